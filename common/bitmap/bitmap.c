@@ -36,20 +36,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <nbdkit-plugin.h>
 
 #include "bitmap.h"
+#include "byte-swapping.h"
+#include "minmax.h"
 #include "rounding.h"
 #include "nextnonzero.h"
 
+/* The range operations treat the bitmap as an array of little endian
+ * 64 bit words, so block ‘blk’ is always at bit ‘blk << bitshift’
+ * counting from the start of the bitmap.  bitmap_resize rounds the
+ * allocation up to a whole number of words and keeps the padding
+ * zeroed, so the last word needs no special case.
+ */
+typedef uint64_t __attribute__((__may_alias__)) bitmap_word;
+#define BITMAP_WORD_BITS 64
+
 int
 bitmap_resize (struct bitmap *bm, uint64_t new_size)
 {
   uint8_t *new_bitmap;
   const size_t old_bm_size = bm->size;
   uint64_t new_bm_size_u64;
-  size_t new_bm_size;
+  size_t new_bm_size, alloc_size;
 
   new_bm_size_u64 = DIV_ROUND_UP (new_size,
                                   bm->blksize * UINT64_C(8) / bm->bpb);
@@ -58,9 +70,10 @@ bitmap_resize (struct bitmap *bm, uint64_t new_size)
     return -1;
   }
   new_bm_size = (size_t) new_bm_size_u64;
+  alloc_size = ROUND_UP (new_bm_size, sizeof (bitmap_word));
 
   if (new_bm_size > 0) {
-    new_bitmap = realloc (bm->bitmap, new_bm_size);
+    new_bitmap = realloc (bm->bitmap, alloc_size);
     if (new_bitmap == NULL) {
       nbdkit_error ("realloc: %m");
       return -1;
@@ -72,8 +85,14 @@ bitmap_resize (struct bitmap *bm, uint64_t new_size)
   }
   bm->bitmap = new_bitmap;
   bm->size = new_bm_size;
-  if (old_bm_size < new_bm_size)
-    memset (&bm->bitmap[old_bm_size], 0, new_bm_size-old_bm_size);
+  /* Zero the newly allocated bytes and the padding, which after
+   * shrinking may still hold bits from the old size.
+   */
+  if (MIN (old_bm_size, new_bm_size) < alloc_size) {
+    const size_t keep = MIN (old_bm_size, new_bm_size);
+
+    memset (&bm->bitmap[keep], 0, alloc_size-keep);
+  }
 
   nbdkit_debug ("bitmap resized to %zu bytes", new_bm_size);
 
@@ -113,3 +132,183 @@ bitmap_next (const struct bitmap *bm, uint64_t blk)
   /* Should never be reached. */
   abort ();
 }
+
+static inline uint64_t
+load_word (const struct bitmap *bm, uint64_t i)
+{
+  return le64toh (((const bitmap_word *) bm->bitmap)[i]);
+}
+
+static inline void
+store_word (const struct bitmap *bm, uint64_t i, uint64_t w)
+{
+  ((bitmap_word *) bm->bitmap)[i] = htole64 (w);
+}
+
+/* Return a word with every entry set to ‘v’. */
+static inline uint64_t
+pattern (const struct bitmap *bm, unsigned v)
+{
+  return v * (UINT64_MAX / ((UINT64_C(1) << bm->bpb) - 1));
+}
+
+/* Return a word with the lowest bit of each entry set if that entry
+ * is non-zero in ‘x’.
+ */
+static inline uint64_t
+fold (const struct bitmap *bm, uint64_t x)
+{
+  switch (bm->bpb) {
+  case 8: x |= x >> 4; /* fallthrough */
+  case 4: x |= x >> 2; /* fallthrough */
+  case 2: x |= x >> 1;
+  }
+  return x & pattern (bm, 1);
+}
+
+/* Return a mask of bits lo <= bit < hi, where lo < hi <= 64. */
+static inline uint64_t
+bit_range (unsigned lo, unsigned hi)
+{
+  uint64_t m = hi == BITMAP_WORD_BITS ? UINT64_MAX : (UINT64_C(1) << hi) - 1;
+  return m & (UINT64_MAX << lo);
+}
+
+/* Clip the ‘n’ blocks starting at ‘blk’ to the end of the bitmap,
+ * returning the block after the last one.
+ */
+static inline uint64_t
+range_end (const struct bitmap *bm, uint64_t blk, uint64_t n)
+{
+  const uint64_t limit = bm->size * bm->ibpb;
+
+  if (blk >= limit)
+    return blk;
+  return blk + MIN (n, limit - blk);
+}
+
+static inline void
+set_range (const struct bitmap *bm, uint64_t blk, uint64_t n, unsigned v,
+           bool atomic)
+{
+  const uint64_t end = range_end (bm, blk, n);
+  const uint64_t bits = pattern (bm, v);
+  const uint64_t b0 = blk << bm->bitshift, b1 = end << bm->bitshift;
+  uint64_t i, base, mask;
+
+  for (i = b0 / BITMAP_WORD_BITS, base = i * BITMAP_WORD_BITS;
+       base < b1;
+       ++i, base += BITMAP_WORD_BITS) {
+    mask = bit_range (b0 > base ? b0 - base : 0,
+                      MIN (b1 - base, BITMAP_WORD_BITS));
+
+    if (!atomic)
+      store_word (bm, i, (load_word (bm, i) & ~mask) | (bits & mask));
+    else {
+      bitmap_word *p = &((bitmap_word *) bm->bitmap)[i];
+      const uint64_t le_mask = htole64 (mask);
+      const uint64_t le_bits = htole64 (bits & mask);
+      uint64_t old = __atomic_load_n (p, __ATOMIC_RELAXED);
+
+      while (!__atomic_compare_exchange_n (p, &old,
+                                           (old & ~le_mask) | le_bits,
+                                           true, __ATOMIC_ACQ_REL,
+                                           __ATOMIC_RELAXED))
+        ;
+    }
+  }
+}
+
+void
+bitmap_set_range (const struct bitmap *bm,
+                  uint64_t blk, uint64_t n, unsigned v)
+{
+  set_range (bm, blk, n, v, false);
+}
+
+void
+bitmap_set_range_atomic (const struct bitmap *bm,
+                         uint64_t blk, uint64_t n, unsigned v)
+{
+  set_range (bm, blk, n, v, true);
+}
+
+/* Return the first block in [blk, end) which has value ‘v’ (if
+ * ‘equal’ is true) or which has some other value (if ‘equal’ is
+ * false).  Returns ‘end’ if there is no such block.
+ */
+static uint64_t
+scan (const struct bitmap *bm, uint64_t blk, uint64_t end, unsigned v,
+      bool equal)
+{
+  const uint64_t bits = pattern (bm, v), lows = pattern (bm, 1);
+  const uint64_t b0 = blk << bm->bitshift, b1 = end << bm->bitshift;
+  uint64_t i, base, m, diff;
+
+  if (blk >= end)
+    return end;
+
+  i = b0 / BITMAP_WORD_BITS;
+  base = i * BITMAP_WORD_BITS;
+  m = lows & (UINT64_MAX << (b0 - base)); /* Ignore blocks before blk. */
+  for (;;) {
+    diff = fold (bm, load_word (bm, i) ^ bits);
+    m &= equal ? ~diff : diff;
+    if (m) {
+      blk = (base + __builtin_ctzll (m)) >> bm->bitshift;
+      return MIN (blk, end);
+    }
+
+    ++i;
+    base += BITMAP_WORD_BITS;
+    if (base >= b1)
+      return end;
+    m = lows;
+  }
+}
+
+int64_t
+bitmap_next_value (const struct bitmap *bm, uint64_t blk, unsigned v)
+{
+  const uint64_t limit = bm->size * bm->ibpb;
+  int64_t next;
+
+  if (blk >= limit)
+    return -1;
+
+  /* Skip long runs of zeroes using next_non_zero. */
+  if (v != 0) {
+    next = bitmap_next (bm, blk);
+    if (next == -1)
+      return -1;
+    blk = next;
+  }
+
+  blk = scan (bm, blk, limit, v, true);
+  return blk < limit ? (int64_t) blk : -1;
+}
+
+uint64_t
+bitmap_run_length (const struct bitmap *bm,
+                   uint64_t blk, uint64_t max, unsigned v)
+{
+  return scan (bm, blk, range_end (bm, blk, max), v, false) - blk;
+}
+
+uint64_t
+bitmap_count (const struct bitmap *bm, uint64_t blk, uint64_t n)
+{
+  const uint64_t end = range_end (bm, blk, n);
+  const uint64_t b0 = blk << bm->bitshift, b1 = end << bm->bitshift;
+  uint64_t i, base, mask, count = 0;
+
+  for (i = b0 / BITMAP_WORD_BITS, base = i * BITMAP_WORD_BITS;
+       base < b1;
+       ++i, base += BITMAP_WORD_BITS) {
+    mask = bit_range (b0 > base ? b0 - base : 0,
+                      MIN (b1 - base, BITMAP_WORD_BITS));
+    count += __builtin_popcountll (fold (bm, load_word (bm, i)) & mask);
+  }
+
+  return count;
+}
@@ -60,7 +60,8 @@ struct bitmap {
   */
   uint8_t bitshift, ibpb;
 
-  uint8_t *bitmap;              /* The bitmap. */
+  uint8_t *bitmap;              /* The bitmap (padded with zeroes to a
+                                   multiple of 8 bytes). */
   size_t size;                  /* Size of bitmap in bytes. */
 };
 
@@ -180,4 +181,53 @@ bitmap_set (const struct bitmap *bm, uint64_t offset, unsigned v)
 extern int64_t bitmap_next (const struct bitmap *bm, uint64_t blk)
   __attribute__((__nonnull__ (1)));
 
+/* Range operations.  These work on a whole 64 bit word of the bitmap
+ * at a time, so they are much faster than looping over
+ * bitmap_get_blk or bitmap_set_blk when a request covers many
+ * blocks.  Blocks which are out of range are ignored.
+ */
+
+/* Set the bit(s) of the ‘n’ blocks starting at ‘blk’ to ‘v’. */
+extern void bitmap_set_range (const struct bitmap *bm,
+                              uint64_t blk, uint64_t n, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
+/* As above, but each word is updated atomically, so this may be
+ * called concurrently with other bitmap_set_range_atomic calls on
+ * different blocks of the same bitmap without holding a lock.
+ */
+extern void bitmap_set_range_atomic (const struct bitmap *bm,
+                                     uint64_t blk, uint64_t n, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
+/* Set the bit(s) of the ‘n’ blocks starting at ‘blk’ to zero. */
+static inline void __attribute__((__nonnull__ (1)))
+bitmap_clear_range (const struct bitmap *bm, uint64_t blk, uint64_t n)
+{
+  bitmap_set_range (bm, blk, n, 0);
+}
+
+/* Find the next block with value ‘v’ in the bitmap, starting at
+ * ‘blk’.  Returns -1 if there is no such block before the end of the
+ * bitmap.
+ */
+extern int64_t bitmap_next_value (const struct bitmap *bm,
+                                  uint64_t blk, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
+/* Return the number of consecutive blocks starting at ‘blk’ which
+ * have value ‘v’, looking at no more than ‘max’ blocks.  Together
+ * with bitmap_next_value this finds the next run of a value.
+ */
+extern uint64_t bitmap_run_length (const struct bitmap *bm,
+                                   uint64_t blk, uint64_t max, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
+/* Count the blocks with a non-zero value among the ‘n’ blocks
+ * starting at ‘blk’.
+ */
+extern uint64_t bitmap_count (const struct bitmap *bm,
+                              uint64_t blk, uint64_t n)
+  __attribute__((__nonnull__ (1)));
+
 #endif /* NBDKIT_BITMAP_H */
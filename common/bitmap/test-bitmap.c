@@ -45,6 +45,7 @@
 #include <nbdkit-plugin.h>
 
 #include "bitmap.h"
+#include "random.h"
 
 static void
 test (int bpb, int blksize)
@@ -119,6 +120,87 @@ test (int bpb, int blksize)
   bitmap_free (&bm);
 }
 
+/* Check the range operations against a simple array of values. */
+static void
+test_ranges (int bpb, int blksize)
+{
+  struct bitmap bm;
+  const uint64_t nr_blocks = 1000;
+  unsigned ref[1000];
+  struct random_state rs;
+  uint64_t blk, n, i, count, len;
+  int64_t next;
+  unsigned v;
+  int iter;
+
+  printf ("ranges: bpb = %d, blksize = %d\n", bpb, blksize);
+  fflush (stdout);
+
+  xsrandom (bpb * blksize, &rs);
+  bitmap_init (&bm, blksize, bpb);
+  if (bitmap_resize (&bm, nr_blocks * blksize) == -1)
+    exit (EXIT_FAILURE);
+  memset (ref, 0, sizeof ref);
+
+  for (iter = 0; iter < 2000; ++iter) {
+    /* Set a random range, sometimes running off the end. */
+    blk = xrandom (&rs) % nr_blocks;
+    n = xrandom (&rs) % (iter & 1 ? 8 : 300);
+    v = xrandom (&rs) & ((1 << bpb) - 1);
+    if (iter & 2)
+      bitmap_set_range (&bm, blk, n, v);
+    else
+      bitmap_set_range_atomic (&bm, blk, n, v);
+    for (i = blk; i < blk + n && i < nr_blocks; ++i)
+      ref[i] = v;
+
+    /* Check a random range. */
+    blk = xrandom (&rs) % nr_blocks;
+    n = xrandom (&rs) % 300;
+    v = xrandom (&rs) & ((1 << bpb) - 1);
+
+    for (i = blk, count = 0; i < blk + n && i < nr_blocks; ++i) {
+      assert (bitmap_get_blk (&bm, i, 0) == ref[i]);
+      if (ref[i] != 0)
+        count++;
+    }
+    assert (bitmap_count (&bm, blk, n) == count);
+
+    for (i = blk; i < nr_blocks && ref[i] != v; ++i)
+      ;
+    next = bitmap_next_value (&bm, blk, v);
+    assert (next == (i < nr_blocks ? (int64_t) i : -1));
+
+    for (i = blk, len = 0; i < blk + n && i < nr_blocks && ref[i] == v; ++i)
+      len++;
+    assert (bitmap_run_length (&bm, blk, n, v) == len);
+  }
+
+  /* Out of range requests are ignored. */
+  bitmap_set_range (&bm, nr_blocks, 10, 1);
+  assert (bitmap_count (&bm, nr_blocks, 10) == 0);
+  assert (bitmap_run_length (&bm, nr_blocks, 10, 0) == 0);
+  assert (bitmap_next_value (&bm, nr_blocks, 0) == -1);
+
+  /* Shrinking the bitmap must clear the padding in the last word, and
+   * growing it again must not bring back stale entries.  Only the
+   * entries sharing the last byte with block 9 survive.
+   */
+  bitmap_set_range (&bm, 0, nr_blocks, 1);
+  if (bitmap_resize (&bm, 10 * blksize) == -1)
+    exit (EXIT_FAILURE);
+  len = 8 / bpb;
+  len = (10 + len - 1) / len * len;
+  assert (bitmap_count (&bm, 0, nr_blocks) == len);
+  assert (bitmap_next_value (&bm, len, 1) == -1);
+  if (bitmap_resize (&bm, nr_blocks * blksize) == -1)
+    exit (EXIT_FAILURE);
+  assert (bitmap_count (&bm, 0, nr_blocks) == len);
+  assert (bitmap_next_value (&bm, len, 1) == -1);
+
+  bitmap_free (&bm);
+}
+
 int
 main (void)
 {
@@ -130,6 +212,9 @@ main (void)
   for (bpb = 1; bpb <= 8; bpb <<= 1)
     for (i = 0; i < sizeof blksizes / sizeof blksizes[0]; ++i)
       test (bpb, blksizes[i]);
+  for (bpb = 1; bpb <= 8; bpb <<= 1)
+    for (i = 0; i < sizeof blksizes / sizeof blksizes[0]; ++i)
+      test_ranges (bpb, blksizes[i]);
 
   exit (EXIT_SUCCESS);
 }
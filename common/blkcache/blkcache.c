@@ -0,0 +1,431 @@
+/* nbdkit
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+
+#include "blkcache.h"
+
+/* A cache of uncompressed blocks, used by the xz and zstd filters.
+ *
+ * The cache is shared by all connections.  It is an LRU list of
+ * blocks (most recently used first), limited both by the number of
+ * blocks and by the total size of uncompressed data.  Blocks which
+ * are being uncompressed are in the list too, so that a second
+ * request for the same block waits for the first to finish instead
+ * of uncompressing it again.  Blocks which are referenced by a
+ * caller are never evicted.
+ *
+ * The number of blocks is small (it is limited by maxdepth), so
+ * lookups are a linear search.
+ */
+struct blkcache {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* Signalled when a block is filled. */
+  size_t maxdepth;
+  uint64_t maxsize;
+  size_t depth;                 /* Number of blocks in the list. */
+  uint64_t used;                /* Total size of filled blocks in list. */
+  struct block *first, *last;
+  blkcache_stats stats;
+
+  /* Background uncompression threads and their queue of jobs. */
+  pthread_mutex_t jobs_lock;
+  pthread_cond_t jobs_cond;
+  struct job *jobs_first, *jobs_last;
+  pthread_t *threads;
+  unsigned nr_threads;
+  bool quit;
+};
+
+struct job {
+  struct job *next;
+  struct block *b;
+  blkcache_decode_fn decode;
+  blkcache_free_fn free;
+  void *opaque;
+};
+
+enum block_state { BLOCK_LOADING, BLOCK_READY, BLOCK_FAILED };
+
+struct block {
+  struct block *prev, *next;
+  uint64_t start;
+  uint64_t size;
+  char *data;
+  enum block_state state;
+  unsigned refs;
+};
+
+blkcache *
+new_blkcache (size_t maxdepth, uint64_t maxsize)
+{
+  blkcache *c;
+
+  c = calloc (1, sizeof *c);
+  if (!c) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  pthread_mutex_init (&c->lock, NULL);
+  pthread_cond_init (&c->cond, NULL);
+  pthread_mutex_init (&c->jobs_lock, NULL);
+  pthread_cond_init (&c->jobs_cond, NULL);
+  c->maxdepth = maxdepth;
+  c->maxsize = maxsize;
+
+  return c;
+}
+
+static void
+free_block (struct block *b)
+{
+  free (b->data);
+  free (b);
+}
+
+void
+free_blkcache (blkcache *c)
+{
+  struct block *b, *next;
+  struct job *job;
+  unsigned i;
+
+  pthread_mutex_lock (&c->jobs_lock);
+  c->quit = true;
+  pthread_cond_broadcast (&c->jobs_cond);
+  pthread_mutex_unlock (&c->jobs_lock);
+  for (i = 0; i < c->nr_threads; ++i)
+    pthread_join (c->threads[i], NULL);
+  free (c->threads);
+
+  while ((job = c->jobs_first) != NULL) {
+    c->jobs_first = job->next;
+    fail_block (c, job->b);
+    put_block (c, job->b);
+    job->free (job->opaque);
+    free (job);
+  }
+
+  for (b = c->first; b != NULL; b = next) {
+    next = b->next;
+    free_block (b);
+  }
+  pthread_cond_destroy (&c->jobs_cond);
+  pthread_mutex_destroy (&c->jobs_lock);
+  pthread_cond_destroy (&c->cond);
+  pthread_mutex_destroy (&c->lock);
+  free (c);
+}
+
+static void
+unlink_block (blkcache *c, struct block *b)
+{
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    c->first = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  else
+    c->last = b->prev;
+  b->prev = b->next = NULL;
+}
+
+static void
+link_block_first (blkcache *c, struct block *b)
+{
+  b->prev = NULL;
+  b->next = c->first;
+  if (c->first)
+    c->first->prev = b;
+  else
+    c->last = b;
+  c->first = b;
+}
+
+/* Eject least recently used blocks until the cache is within its
+ * limits, skipping blocks which are in use.  Called with the lock
+ * held.
+ */
+static void
+evict_blocks (blkcache *c)
+{
+  struct block *b, *prev;
+
+  for (b = c->last; b != NULL && (c->depth > c->maxdepth ||
+                                  c->used > c->maxsize); b = prev) {
+    prev = b->prev;
+    if (b->refs == 0 && b->state == BLOCK_READY) {
+      unlink_block (c, b);
+      c->depth--;
+      c->used -= b->size;
+      free_block (b);
+    }
+  }
+}
+
+static struct block *
+find_block (blkcache *c, uint64_t start)
+{
+  struct block *b;
+
+  for (b = c->first; b != NULL; b = b->next)
+    if (b->start == start)
+      return b;
+  return NULL;
+}
+
+/* Add a new loading block.  Called with the lock held. */
+static struct block *
+new_block (blkcache *c, uint64_t start, uint64_t size)
+{
+  struct block *b;
+
+  b = calloc (1, sizeof *b);
+  if (b == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  b->start = start;
+  b->size = size;
+  b->state = BLOCK_LOADING;
+  b->refs = 1;
+  link_block_first (c, b);
+  c->depth++;
+  evict_blocks (c);
+  return b;
+}
+
+struct block *
+get_block (blkcache *c, uint64_t start, uint64_t size, bool *reserved)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  struct block *b;
+
+  *reserved = false;
+
+  for (;;) {
+    b = find_block (c, start);
+    if (b == NULL) {
+      c->stats.misses++;
+      b = new_block (c, start, size);
+      if (b)
+        *reserved = true;
+      return b;
+    }
+
+    /* This block is now most recently used, so put it at the start. */
+    unlink_block (c, b);
+    link_block_first (c, b);
+    b->refs++;
+
+    while (b->state == BLOCK_LOADING)
+      pthread_cond_wait (&c->cond, &c->lock);
+
+    if (b->state == BLOCK_READY) {
+      c->stats.hits++;
+      return b;
+    }
+
+    /* Whoever was loading the block failed, and it has been removed
+     * from the cache.  Drop our reference and try again (which will
+     * probably reserve the block so the caller can report the
+     * error).
+     */
+    if (--b->refs == 0)
+      free_block (b);
+  }
+}
+
+struct block *
+reserve_block (blkcache *c, uint64_t start, uint64_t size)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (find_block (c, start) != NULL)
+    return NULL;
+
+  c->stats.prefetches++;
+  return new_block (c, start, size);
+}
+
+const char *
+block_data (struct block *b)
+{
+  return b->data;
+}
+
+void
+fill_block (blkcache *c, struct block *b, char *data)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  b->data = data;
+  b->state = BLOCK_READY;
+  c->used += b->size;
+  pthread_cond_broadcast (&c->cond);
+}
+
+void
+fail_block (blkcache *c, struct block *b)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  b->state = BLOCK_FAILED;
+  unlink_block (c, b);
+  c->depth--;
+  pthread_cond_broadcast (&c->cond);
+}
+
+void
+put_block (blkcache *c, struct block *b)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (--b->refs == 0) {
+    if (b->state == BLOCK_FAILED)
+      free_block (b);
+    else
+      evict_blocks (c);
+  }
+}
+
+void
+blkcache_get_stats (blkcache *c, blkcache_stats *ret)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  memcpy (ret, &c->stats, sizeof (c->stats));
+}
+
+static void *
+worker (void *vp)
+{
+  blkcache *c = vp;
+  struct job *job;
+  char *data;
+
+  for (;;) {
+    pthread_mutex_lock (&c->jobs_lock);
+    while (!c->quit && c->jobs_first == NULL)
+      pthread_cond_wait (&c->jobs_cond, &c->jobs_lock);
+    if (c->quit) {
+      pthread_mutex_unlock (&c->jobs_lock);
+      return NULL;
+    }
+    job = c->jobs_first;
+    c->jobs_first = job->next;
+    if (c->jobs_first == NULL)
+      c->jobs_last = NULL;
+    pthread_mutex_unlock (&c->jobs_lock);
+
+    data = job->decode (job->opaque);
+    if (data)
+      fill_block (c, job->b, data);
+    else
+      fail_block (c, job->b);
+    put_block (c, job->b);
+    job->free (job->opaque);
+    free (job);
+  }
+}
+
+int
+blkcache_start_threads (blkcache *c, unsigned nr_threads)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->jobs_lock);
+  int err;
+
+  if (c->threads != NULL)
+    return 0;
+
+  c->threads = calloc (nr_threads, sizeof (pthread_t));
+  if (c->threads == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  for (; c->nr_threads < nr_threads; ++c->nr_threads) {
+    err = pthread_create (&c->threads[c->nr_threads], NULL, worker, c);
+    if (err != 0) {
+      errno = err;
+      nbdkit_error ("pthread_create: %m");
+      return c->nr_threads > 0 ? 0 : -1;
+    }
+  }
+  nbdkit_debug ("started %u uncompression threads", c->nr_threads);
+  return 0;
+}
+
+int
+blkcache_queue (blkcache *c, struct block *b,
+                blkcache_decode_fn decode, blkcache_free_fn free_fn,
+                void *opaque)
+{
+  struct job *job;
+
+  job = malloc (sizeof *job);
+  if (job == NULL) {
+    nbdkit_error ("malloc: %m");
+    fail_block (c, b);
+    put_block (c, b);
+    free_fn (opaque);
+    return -1;
+  }
+  job->next = NULL;
+  job->b = b;
+  job->decode = decode;
+  job->free = free_fn;
+  job->opaque = opaque;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->jobs_lock);
+  if (c->jobs_last)
+    c->jobs_last->next = job;
+  else
+    c->jobs_first = job;
+  c->jobs_last = job;
+  pthread_cond_signal (&c->jobs_cond);
+  return 0;
+}
@@ -0,0 +1,101 @@
+/* nbdkit
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_BLKCACHE_H
+#define NBDKIT_BLKCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct blkcache blkcache;
+
+typedef struct blkcache_stats {
+  size_t hits;
+  size_t misses;
+  size_t prefetches;
+} blkcache_stats;
+
+extern blkcache *new_blkcache (size_t maxdepth, uint64_t maxsize);
+extern void free_blkcache (blkcache *) __attribute__((__nonnull__ (1)));
+
+/* Find the block starting at 'start' in the cache, waiting if another
+ * thread is uncompressing it.  If the block is not in the cache then
+ * a new empty block is added and *reserved is set to true, in which
+ * case the caller must call fill_block or fail_block.  In either case
+ * the caller must call put_block when it has finished with the block.
+ * Returns NULL on error.
+ */
+extern struct block *get_block (blkcache *, uint64_t start, uint64_t size,
+                                bool *reserved)
+  __attribute__((__nonnull__ (1, 4)));
+
+/* If the block starting at 'start' is not in the cache, add a new
+ * empty block as for get_block.  Otherwise returns NULL.  This is
+ * used for prefetching.
+ */
+extern struct block *reserve_block (blkcache *, uint64_t start, uint64_t size)
+  __attribute__((__nonnull__ (1)));
+
+extern const char *block_data (struct block *) __attribute__((__nonnull__ (1)));
+extern void fill_block (blkcache *, struct block *, char *data)
+  __attribute__((__nonnull__ (1, 2, 3)));
+extern void fail_block (blkcache *, struct block *)
+  __attribute__((__nonnull__ (1, 2)));
+extern void put_block (blkcache *, struct block *)
+  __attribute__((__nonnull__ (1, 2)));
+
+extern void blkcache_get_stats (blkcache *, blkcache_stats *ret)
+  __attribute__((__nonnull__ (1, 2)));
+
+/* Blocks can be uncompressed by a pool of background threads.  The
+ * threads must be started after nbdkit has forked, so this is usually
+ * called from the filter's .open method.  Calling it again does
+ * nothing.
+ */
+extern int blkcache_start_threads (blkcache *, unsigned nr_threads)
+  __attribute__((__nonnull__ (1)));
+
+typedef char *(*blkcache_decode_fn) (void *opaque);
+typedef void (*blkcache_free_fn) (void *opaque);
+
+/* Queue a block returned by reserve_block (or get_block with
+ * *reserved set) to be filled by a background thread.  The thread
+ * calls decode (opaque) which returns the uncompressed data (which
+ * must be block size bytes) or NULL on error, then free (opaque).
+ * This takes over the caller's reference to the block.
+ */
+extern int blkcache_queue (blkcache *, struct block *,
+                           blkcache_decode_fn decode, blkcache_free_fn free,
+                           void *opaque)
+  __attribute__((__nonnull__ (1, 2, 3, 4)));
+
+#endif /* NBDKIT_BLKCACHE_H */
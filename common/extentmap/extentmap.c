@@ -0,0 +1,318 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include <nbdkit-plugin.h>
+
+#include "minmax.h"
+#include "extentmap.h"
+
+void
+extentmap_init (struct extentmap *map, size_t max_entries)
+{
+  map->entries = NULL;
+  map->nr_entries = map->nr_alloc = 0;
+  map->max_entries = max_entries;
+  map->clock = 0;
+}
+
+void
+extentmap_free (struct extentmap *map)
+{
+  free (map->entries);
+  map->entries = NULL;
+  map->nr_entries = map->nr_alloc = 0;
+}
+
+void
+extentmap_clear (struct extentmap *map)
+{
+  map->nr_entries = 0;
+}
+
+static inline uint64_t
+entry_end (const struct extentmap_entry *e)
+{
+  return e->offset + e->length;
+}
+
+/* Return the index of the first entry which ends after 'offset', or
+ * nr_entries if there is none.
+ */
+static size_t
+first_entry_ending_after (const struct extentmap *map, uint64_t offset)
+{
+  size_t lo = 0, hi = map->nr_entries, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (entry_end (&map->entries[mid]) <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Return the index of the first entry which starts at or after
+ * 'offset', or nr_entries if there is none.
+ */
+static size_t
+first_entry_starting_from (const struct extentmap *map, uint64_t offset)
+{
+  size_t lo = 0, hi = map->nr_entries, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (map->entries[mid].offset < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Replace entries [i, j) with the n entries in 'new'. */
+static int
+splice (struct extentmap *map, size_t i, size_t j,
+        const struct extentmap_entry *new, size_t n)
+{
+  const size_t nr = map->nr_entries - (j - i) + n;
+
+  assert (i <= j && j <= map->nr_entries);
+
+  if (nr > map->nr_alloc) {
+    size_t nr_alloc = map->nr_alloc ? map->nr_alloc * 2 : 16;
+    struct extentmap_entry *entries;
+
+    while (nr_alloc < nr)
+      nr_alloc *= 2;
+    entries = realloc (map->entries, nr_alloc * sizeof *entries);
+    if (entries == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    map->entries = entries;
+    map->nr_alloc = nr_alloc;
+  }
+
+  memmove (&map->entries[i + n], &map->entries[j],
+           (map->nr_entries - j) * sizeof map->entries[0]);
+  memcpy (&map->entries[i], new, n * sizeof map->entries[0]);
+  map->nr_entries = nr;
+  return 0;
+}
+
+/* Can two adjacent entries be merged into one? */
+static inline bool
+can_merge (const struct extentmap_entry *e1, const struct extentmap_entry *e2)
+{
+  return entry_end (e1) == e2->offset && e1->type == e2->type;
+}
+
+static inline void
+merge (struct extentmap_entry *e1, const struct extentmap_entry *e2)
+{
+  e1->length += e2->length;
+  e1->last_used = MAX (e1->last_used, e2->last_used);
+}
+
+/* Common code for insert and invalidate.  Replace whatever is known
+ * about the range of 'e' with 'e' itself, or if 'e' is NULL with
+ * nothing.
+ */
+static int
+replace_range (struct extentmap *map, uint64_t offset, uint64_t length,
+               const struct extentmap_entry *e)
+{
+  const uint64_t end = offset + length;
+  struct extentmap_entry new[3];
+  size_t i, j, k, n = 0;
+
+  /* Entries [i, j) overlap the range. */
+  i = first_entry_ending_after (map, offset);
+  j = first_entry_starting_from (map, end);
+
+  /* Keep the parts of the first and last entries which lie outside
+   * the range.
+   */
+  if (i < j && map->entries[i].offset < offset) {
+    new[n] = map->entries[i];
+    new[n].length = offset - new[n].offset;
+    n++;
+  }
+  if (e)
+    new[n++] = *e;
+  if (i < j && entry_end (&map->entries[j-1]) > end) {
+    new[n] = map->entries[j-1];
+    new[n].length = entry_end (&new[n]) - end;
+    new[n].offset = end;
+    n++;
+  }
+
+  /* Merge adjacent entries of the same type, including the neighbours
+   * just outside [i, j).
+   */
+  if (n > 0 && i > 0 && can_merge (&map->entries[i-1], &new[0])) {
+    i--;
+    new[0].length += new[0].offset - map->entries[i].offset;
+    new[0].offset = map->entries[i].offset;
+    new[0].last_used = MAX (new[0].last_used, map->entries[i].last_used);
+  }
+  if (n > 0 && j < map->nr_entries &&
+      can_merge (&new[n-1], &map->entries[j])) {
+    merge (&new[n-1], &map->entries[j]);
+    j++;
+  }
+  for (k = 1; k < n; ) {
+    if (can_merge (&new[k-1], &new[k])) {
+      merge (&new[k-1], &new[k]);
+      memmove (&new[k], &new[k+1], (n - k - 1) * sizeof new[0]);
+      n--;
+    }
+    else
+      k++;
+  }
+
+  return splice (map, i, j, new, n);
+}
+
+static int
+compare_uint64 (const void *p1, const void *p2)
+{
+  const uint64_t u1 = *(const uint64_t *) p1;
+  const uint64_t u2 = *(const uint64_t *) p2;
+
+  return u1 < u2 ? -1 : u1 > u2 ? 1 : 0;
+}
+
+/* Evict the least recently used entries.  We evict down to 3/4 of
+ * the limit so that the cost of sorting is spread over many
+ * insertions.
+ */
+static void
+evict (struct extentmap *map)
+{
+  const size_t keep = map->max_entries - map->max_entries / 4;
+  uint64_t *lru, threshold;
+  size_t i, j, nr_above = 0, nr_equal = 0;
+
+  assert (map->nr_entries > keep);
+
+  lru = malloc (map->nr_entries * sizeof *lru);
+  if (lru == NULL) {
+    /* Dropping everything is always safe. */
+    extentmap_clear (map);
+    return;
+  }
+  for (i = 0; i < map->nr_entries; ++i)
+    lru[i] = map->entries[i].last_used;
+  qsort (lru, map->nr_entries, sizeof *lru, compare_uint64);
+  threshold = lru[map->nr_entries - keep];
+  free (lru);
+
+  /* Keep the entries used more recently than threshold, and as many
+   * entries used exactly at threshold as there is room for.
+   */
+  for (i = 0; i < map->nr_entries; ++i)
+    if (map->entries[i].last_used > threshold)
+      nr_above++;
+  assert (nr_above < keep);
+  for (i = j = 0; i < map->nr_entries; ++i) {
+    const uint64_t last_used = map->entries[i].last_used;
+
+    if (last_used > threshold ||
+        (last_used == threshold && nr_equal++ < keep - nr_above))
+      map->entries[j++] = map->entries[i];
+  }
+  map->nr_entries = j;
+  assert (map->nr_entries <= keep);
+}
+
+int
+extentmap_insert (struct extentmap *map,
+                  uint64_t offset, uint64_t length, uint32_t type)
+{
+  struct extentmap_entry e;
+
+  if (length == 0)
+    return 0;
+
+  e.offset = offset;
+  e.length = length;
+  e.type = type;
+  e.last_used = ++map->clock;
+
+  if (replace_range (map, offset, length, &e) == -1)
+    return -1;
+
+  if (map->max_entries > 0 && map->nr_entries > map->max_entries)
+    evict (map);
+  return 0;
+}
+
+void
+extentmap_invalidate (struct extentmap *map, uint64_t offset, uint64_t length)
+{
+  if (length == 0)
+    return;
+
+  if (replace_range (map, offset, length, NULL) == -1)
+    extentmap_clear (map);
+
+  /* Splitting an entry can take the map over the limit. */
+  if (map->max_entries > 0 && map->nr_entries > map->max_entries)
+    evict (map);
+}
+
+bool
+extentmap_lookup (struct extentmap *map, uint64_t offset,
+                  struct extentmap_entry *e)
+{
+  const size_t i = first_entry_ending_after (map, offset);
+
+  if (i >= map->nr_entries || map->entries[i].offset > offset)
+    return false;
+
+  map->entries[i].last_used = ++map->clock;
+  *e = map->entries[i];
+  return true;
+}
@@ -0,0 +1,123 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef NBDKIT_EXTENTMAP_H
+#define NBDKIT_EXTENTMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* This library implements a cache of extent information (the result
+ * of .extents calls).  It maps non-overlapping ranges of the disk to
+ * an extent type (a combination of NBDKIT_EXTENT_HOLE and
+ * NBDKIT_EXTENT_ZERO).  Ranges of the disk which are not in the map
+ * are unknown.
+ *
+ * The ranges are stored in an array ordered by offset.  Because the
+ * ranges never overlap, this gives the same O(log n) lookups as an
+ * interval tree.  Adjacent ranges of the same type are merged.
+ * Results of many .extents calls can be added, and any part of the
+ * map can be invalidated (for example when it is written to).
+ *
+ * The map can optionally be limited to a maximum number of entries.
+ * When the limit is exceeded, the least recently used entries are
+ * evicted.
+ *
+ * The implementation is not protected by locks, callers must provide
+ * their own locking.
+ */
+
+struct extentmap_entry {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t type;
+  uint64_t last_used;           /* Used internally for eviction. */
+};
+
+struct extentmap {
+  struct extentmap_entry *entries; /* Ordered by offset. */
+  size_t nr_entries;
+  size_t nr_alloc;
+  size_t max_entries;           /* 0 = unlimited */
+  uint64_t clock;               /* Counter used for LRU eviction. */
+};
+
+/* Initialize an empty map.  'max_entries' limits the size of the map
+ * (0 means no limit).
+ */
+extern void extentmap_init (struct extentmap *map, size_t max_entries)
+  __attribute__((__nonnull__ (1)));
+
+/* Free the map. */
+extern void extentmap_free (struct extentmap *map)
+  __attribute__((__nonnull__ (1)));
+
+/* Forget everything in the map. */
+extern void extentmap_clear (struct extentmap *map)
+  __attribute__((__nonnull__ (1)));
+
+/* Return the number of entries in the map. */
+static inline size_t __attribute__((__nonnull__ (1)))
+extentmap_count (const struct extentmap *map)
+{
+  return map->nr_entries;
+}
+
+/* Record that the range [offset, offset+length) has the given type,
+ * replacing anything previously known about the range.  This can
+ * allocate, and can evict other entries if the map is full.  On
+ * error it calls nbdkit_error and returns -1; the map is still
+ * consistent but does not contain the new range.
+ */
+extern int extentmap_insert (struct extentmap *map,
+                             uint64_t offset, uint64_t length, uint32_t type)
+  __attribute__((__nonnull__ (1)));
+
+/* Forget anything known about the range [offset, offset+length).
+ * This never fails (if memory cannot be allocated to split an entry,
+ * the whole map is cleared instead).
+ */
+extern void extentmap_invalidate (struct extentmap *map,
+                                  uint64_t offset, uint64_t length)
+  __attribute__((__nonnull__ (1)));
+
+/* Look up the entry containing 'offset'.  If found, copy it into *e
+ * and return true.  If nothing is known about 'offset', return false.
+ * This counts as a use of the entry for the purposes of eviction.
+ */
+extern bool extentmap_lookup (struct extentmap *map, uint64_t offset,
+                              struct extentmap_entry *e)
+  __attribute__((__nonnull__ (1, 3)));
+
+#endif /* NBDKIT_EXTENTMAP_H */
@@ -0,0 +1,160 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Unit tests of the extentmap code. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <nbdkit-plugin.h>
+
+#include "extentmap.h"
+
+/* The map is compared against a simple model which stores the type
+ * of each byte of a small disk (-1 = unknown).
+ */
+#define DISK_SIZE 1000
+
+static int model[DISK_SIZE];
+
+static void
+check (struct extentmap *map, bool lru)
+{
+  struct extentmap_entry e;
+  size_t i;
+  uint64_t prev_end = 0;
+  uint32_t prev_type = -1;
+
+  /* Entries must be ordered, non-overlapping and merged. */
+  for (i = 0; i < map->nr_entries; ++i) {
+    const struct extentmap_entry *p = &map->entries[i];
+
+    assert (p->length > 0);
+    assert (p->offset >= prev_end);
+    if (p->offset == prev_end)
+      assert (p->type != prev_type);
+    prev_end = p->offset + p->length;
+    prev_type = p->type;
+  }
+
+  /* If entries may have been evicted, anything the map knows must
+   * still be correct, but it may know less than the model.
+   */
+  for (i = 0; i < DISK_SIZE; ++i) {
+    if (extentmap_lookup (map, i, &e)) {
+      assert (e.offset <= i && i < e.offset + e.length);
+      assert (model[i] == (int) e.type);
+    }
+    else if (!lru)
+      assert (model[i] == -1);
+  }
+}
+
+static void
+test (size_t max_entries)
+{
+  struct extentmap map;
+  unsigned iter;
+  uint64_t offset, length, j;
+  uint32_t type;
+
+  printf ("max_entries = %zu\n", max_entries);
+  fflush (stdout);
+
+  srandom (1);
+  for (j = 0; j < DISK_SIZE; ++j)
+    model[j] = -1;
+  extentmap_init (&map, max_entries);
+
+  for (iter = 0; iter < 5000; ++iter) {
+    offset = random () % DISK_SIZE;
+    length = random () % (DISK_SIZE - offset) + 1;
+    if (random () % 3 == 0) {
+      extentmap_invalidate (&map, offset, length);
+      for (j = offset; j < offset + length; ++j)
+        model[j] = -1;
+    }
+    else {
+      type = random () % 4;
+      if (extentmap_insert (&map, offset, length, type) == -1)
+        exit (EXIT_FAILURE);
+      for (j = offset; j < offset + length; ++j)
+        model[j] = type;
+    }
+
+    if (max_entries > 0)
+      assert (extentmap_count (&map) <= max_entries);
+    check (&map, max_entries > 0);
+  }
+
+  extentmap_clear (&map);
+  assert (extentmap_count (&map) == 0);
+  extentmap_free (&map);
+}
+
+int
+main (void)
+{
+  test (0);
+  test (1);
+  test (4);
+  test (20);
+  exit (EXIT_SUCCESS);
+}
+
+/* The extentmap code uses nbdkit_error, normally provided by the main
+ * server program.  So we have to provide it here.
+ */
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
@@ -0,0 +1,134 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Microbenchmark for the implementations in nextnonzero.h.  This is
+ * built by "make check" but not run automatically.  Run it by hand:
+ *
+ *   ./common/include/bench-nextnonzero
+ *
+ * It prints the speed of each implementation scanning all-zero
+ * buffers of several sizes.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "nextnonzero.h"
+#include "tvdiff.h"
+
+typedef const char *(*next_non_zero_fn) (const char *buffer, size_t size);
+
+static const struct {
+  const char *name;
+  next_non_zero_fn fn;
+} impls[] = {
+  { "bytes",         next_non_zero_bytes },
+  { "generic",       next_non_zero_generic },
+#ifdef HAVE_X86_64_SIMD_DISPATCH
+  { "sse2",          next_non_zero_sse2 },
+  { "avx2",          next_non_zero_avx2 },
+  { "avx512",        next_non_zero_avx512 },
+#endif
+  { "next_non_zero", next_non_zero },
+};
+
+static const size_t sizes[] = { 512, 4096, 65536, 1048576 };
+
+/* Scan about this many bytes for each test. */
+#define BYTES_PER_TEST (UINT64_C(1) << 31)
+
+static int
+cpu_supports (const char *name)
+{
+#ifdef HAVE_X86_64_SIMD_DISPATCH
+  if (strcmp (name, "avx2") == 0)
+    return __builtin_cpu_supports ("avx2");
+  if (strcmp (name, "avx512") == 0)
+    return __builtin_cpu_supports ("avx512f") &&
+      __builtin_cpu_supports ("avx512bw");
+#endif
+  return 1;
+}
+
+int
+main (void)
+{
+  char *buf;
+  size_t i, j;
+  uint64_t n, iterations;
+  struct timeval start, end;
+  int64_t usec;
+  volatile const char *r;
+
+  /* Start the buffer one byte after an aligned address, so the
+   * implementations have to deal with an unaligned head and tail.
+   */
+  buf = calloc (sizes[sizeof sizes / sizeof sizes[0] - 1] + 64, 1);
+  if (buf == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+
+  printf ("%-16s", "size");
+  for (j = 0; j < sizeof sizes / sizeof sizes[0]; ++j)
+    printf ("%12zu", sizes[j]);
+  printf ("   (GB/s)\n");
+
+  for (i = 0; i < sizeof impls / sizeof impls[0]; ++i) {
+    if (!cpu_supports (impls[i].name))
+      continue;
+    printf ("%-16s", impls[i].name);
+    for (j = 0; j < sizeof sizes / sizeof sizes[0]; ++j) {
+      iterations = BYTES_PER_TEST / sizes[j];
+      gettimeofday (&start, NULL);
+      for (n = 0; n < iterations; ++n) {
+        r = impls[i].fn (&buf[1], sizes[j]);
+        if (r != NULL)
+          abort ();
+      }
+      gettimeofday (&end, NULL);
+      usec = tvdiff_usec (&start, &end);
+      printf ("%12.2f",
+              usec > 0 ? (double) iterations * sizes[j] / usec / 1000 : 0);
+    }
+    printf ("\n");
+  }
+
+  free (buf);
+  exit (EXIT_SUCCESS);
+}
@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2019 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -33,31 +33,21 @@
 #ifndef NBDKIT_ISZERO_H
 #define NBDKIT_ISZERO_H
 
-#include <string.h>
 #include <stdbool.h>
 
+#include "nextnonzero.h"
+
 /* Return true iff the buffer is all zero bytes.
  *
- * The clever approach here was suggested by Eric Blake.  See:
- * https://www.redhat.com/archives/libguestfs/2017-April/msg00171.html
- * https://rusty.ozlabs.org/?p=560
- *
- * See also:
- * https://gcc.gnu.org/bugzilla/show_bug.cgi?id=69908
+ * This used to compare the buffer with itself shifted by 16 bytes
+ * using memcmp (a trick suggested by Eric Blake, see
+ * https://rusty.ozlabs.org/?p=560), but that reads the buffer twice.
+ * The vectorized search in nextnonzero.h reads it only once.
  */
 static inline bool __attribute__((__nonnull__ (1)))
 is_zero (const char *buffer, size_t size)
 {
-  size_t i;
-  const size_t limit = size < 16 ? size : 16;
-
-  for (i = 0; i < limit; ++i)
-    if (buffer[i])
-      return false;
-  if (size != limit)
-    return ! memcmp (buffer, buffer + 16, size - 16);
-
-  return true;
+  return next_non_zero (buffer, size) == NULL;
 }
 
 #endif /* NBDKIT_ISZERO_H */
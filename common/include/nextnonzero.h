@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2019 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -33,19 +33,37 @@
 #ifndef NBDKIT_NEXTNONZERO_H
 #define NBDKIT_NEXTNONZERO_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_X86_64_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
+
 /* Given a byte buffer, return a pointer to the first non-zero byte,
  * or return NULL if we reach the end of the buffer.
  *
- * XXX: Even with -O3 -mavx2, gcc 8.2.1 does a terrible job with this
- * loop, compiling it completely naively.  QEMU has an AVX2
- * implementation of a similar loop.
+ * gcc does a terrible job of vectorizing the obvious loop (see
+ * https://gcc.gnu.org/bugzilla/show_bug.cgi?id=69908), so on x86-64
+ * there are hand written versions using SSE2, AVX2 and AVX-512,
+ * picked at run time according to what the CPU supports.  Elsewhere
+ * a portable version tests a machine word at a time.
+ *
+ * None of the versions read outside the buffer.  The vector versions
+ * handle a tail which is not a whole vector by testing the last
+ * vector in the buffer, which overlaps bytes already known to be
+ * zero.
  *
- * See also:
- * https://sourceware.org/bugzilla/show_bug.cgi?id=19920
- * https://gcc.gnu.org/bugzilla/show_bug.cgi?id=69908
+ * The functions for each instruction set are exposed so that they
+ * can be tested and benchmarked, but callers should only use
+ * next_non_zero.
+ */
+
+/* Byte at a time, used for short buffers and unaligned heads and
+ * tails.
  */
 static inline const char * __attribute__((__nonnull__ (1)))
-next_non_zero (const char *buffer, size_t size)
+next_non_zero_bytes (const char *buffer, size_t size)
 {
   size_t i;
 
@@ -55,4 +73,164 @@ next_non_zero (const char *buffer, size_t size)
   return NULL;
 }
 
+/* Word at a time. */
+typedef uint64_t __attribute__((__may_alias__)) next_non_zero_word;
+
+static inline const char * __attribute__((__nonnull__ (1)))
+next_non_zero_generic (const char *buffer, size_t size)
+{
+  const char *end = buffer + size;
+  const next_non_zero_word *w;
+
+  while (buffer < end && ((uintptr_t) buffer & (sizeof *w - 1)) != 0) {
+    if (*buffer != 0)
+      return buffer;
+    buffer++;
+  }
+
+  w = (const next_non_zero_word *) buffer;
+  while ((const char *) (w + 4) <= end) {
+    if ((w[0] | w[1] | w[2] | w[3]) != 0)
+      break;
+    w += 4;
+  }
+  while ((const char *) (w + 1) <= end) {
+    if (*w != 0)
+      break;
+    w++;
+  }
+
+  return next_non_zero_bytes ((const char *) w, end - (const char *) w);
+}
+
+#ifdef HAVE_X86_64_SIMD_DISPATCH
+
+/* SSE2 (present on all x86-64 CPUs).  size must be >= 16. */
+static inline const char * __attribute__((__nonnull__ (1)))
+next_non_zero_sse2 (const char *buffer, size_t size)
+{
+  const char *p = buffer, *end = buffer + size;
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i v;
+  unsigned mask;
+
+  /* Test 64 bytes at a time until we find a non-zero byte. */
+  for (; p + 64 <= end; p += 64) {
+    v = _mm_or_si128 (_mm_or_si128 (_mm_loadu_si128 ((const __m128i *) p),
+                                    _mm_loadu_si128 ((const __m128i *) (p+16))),
+                      _mm_or_si128 (_mm_loadu_si128 ((const __m128i *) (p+32)),
+                                    _mm_loadu_si128 ((const __m128i *) (p+48))));
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) != 0xffff)
+      break;
+  }
+
+  for (;; p += 16) {
+    if (p + 16 > end) {
+      if (p == end)
+        return NULL;
+      p = end - 16;
+    }
+    v = _mm_loadu_si128 ((const __m128i *) p);
+    mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) ^ 0xffff;
+    if (mask != 0)
+      return p + __builtin_ctz (mask);
+    if (p + 16 == end)
+      return NULL;
+  }
+}
+
+/* AVX2.  size must be >= 32. */
+__attribute__((__target__ ("avx2")))
+static inline const char * __attribute__((__nonnull__ (1)))
+next_non_zero_avx2 (const char *buffer, size_t size)
+{
+  const char *p = buffer, *end = buffer + size;
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i v;
+  uint32_t mask;
+
+  /* Test 128 bytes at a time until we find a non-zero byte. */
+  for (; p + 128 <= end; p += 128) {
+    v = _mm256_or_si256 (
+      _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *) p),
+                       _mm256_loadu_si256 ((const __m256i *) (p+32))),
+      _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *) (p+64)),
+                       _mm256_loadu_si256 ((const __m256i *) (p+96))));
+    if (!_mm256_testz_si256 (v, v))
+      break;
+  }
+
+  for (;; p += 32) {
+    if (p + 32 > end) {
+      if (p == end)
+        return NULL;
+      p = end - 32;
+    }
+    v = _mm256_loadu_si256 ((const __m256i *) p);
+    mask = ~(uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, zero));
+    if (mask != 0)
+      return p + __builtin_ctz (mask);
+    if (p + 32 == end)
+      return NULL;
+  }
+}
+
+/* AVX-512 (AVX512F and AVX512BW).  size must be >= 64. */
+__attribute__((__target__ ("avx512f,avx512bw")))
+static inline const char * __attribute__((__nonnull__ (1)))
+next_non_zero_avx512 (const char *buffer, size_t size)
+{
+  const char *p = buffer, *end = buffer + size;
+  __m512i v;
+  uint64_t mask;
+
+  /* Test 256 bytes at a time until we find a non-zero byte. */
+  for (; p + 256 <= end; p += 256) {
+    v = _mm512_or_si512 (_mm512_or_si512 (_mm512_loadu_si512 (p),
+                                          _mm512_loadu_si512 (p+64)),
+                         _mm512_or_si512 (_mm512_loadu_si512 (p+128),
+                                          _mm512_loadu_si512 (p+192)));
+    if (_mm512_test_epi64_mask (v, v) != 0)
+      break;
+  }
+
+  for (;; p += 64) {
+    if (p + 64 > end) {
+      if (p == end)
+        return NULL;
+      p = end - 64;
+    }
+    v = _mm512_loadu_si512 (p);
+    mask = _mm512_test_epi8_mask (v, v);
+    if (mask != 0)
+      return p + __builtin_ctzll (mask);
+    if (p + 64 == end)
+      return NULL;
+  }
+}
+
+#endif /* HAVE_X86_64_SIMD_DISPATCH */
+
+static inline const char * __attribute__((__nonnull__ (1)))
+next_non_zero (const char *buffer, size_t size)
+{
+#ifdef HAVE_X86_64_SIMD_DISPATCH
+  /* For short buffers the cost of checking the CPU features is not
+   * worth it.
+   */
+  if (size >= 256) {
+    if (__builtin_cpu_supports ("avx512f") &&
+        __builtin_cpu_supports ("avx512bw"))
+      return next_non_zero_avx512 (buffer, size);
+    if (__builtin_cpu_supports ("avx2"))
+      return next_non_zero_avx2 (buffer, size);
+  }
+  if (size >= 16)
+    return next_non_zero_sse2 (buffer, size);
+  return next_non_zero_bytes (buffer, size);
+#else
+  return next_non_zero_generic (buffer, size);
+#endif
+}
+
 #endif /* NBDKIT_NEXTNONZERO_H */
@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2019 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -60,6 +60,18 @@ main (void)
       assert (is_zero (&buf[j], 256-j-i));
   }
 
+  /* A single non-zero byte anywhere in the buffer, including the
+   * unaligned head and tail.
+   */
+  for (j = 0; j <= 16; ++j) {
+    for (i = j; i < 256; ++i) {
+      buf[i] = 1;
+      assert (!is_zero (&buf[j], 256-j));
+      assert (is_zero (&buf[j], i-j));
+      buf[i] = 0;
+    }
+  }
+
   free (buf);
   exit (EXIT_SUCCESS);
 }
@@ -35,28 +35,129 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #include "nextnonzero.h"
 
-char buf[256];
+typedef const char *(*next_non_zero_fn) (const char *buffer, size_t size);
 
-int
-main (void)
+/* The implementations to test, and the smallest buffer each one
+ * accepts.
+ */
+static const struct {
+  const char *name;
+  next_non_zero_fn fn;
+  size_t min_size;
+} impls[] = {
+  { "bytes",         next_non_zero_bytes,   0 },
+  { "generic",       next_non_zero_generic, 0 },
+#ifdef HAVE_X86_64_SIMD_DISPATCH
+  { "sse2",          next_non_zero_sse2,    16 },
+  { "avx2",          next_non_zero_avx2,    32 },
+  { "avx512",        next_non_zero_avx512,  64 },
+#endif
+  { "next_non_zero", next_non_zero,         0 },
+};
+
+static bool
+cpu_supports (const char *name)
 {
-  size_t i, j;
+#ifdef HAVE_X86_64_SIMD_DISPATCH
+  if (strcmp (name, "avx2") == 0)
+    return __builtin_cpu_supports ("avx2");
+  if (strcmp (name, "avx512") == 0)
+    return __builtin_cpu_supports ("avx512f") &&
+      __builtin_cpu_supports ("avx512bw");
+#endif
+  return true;
+}
+
+char buf[1024];
+
+static void
+test_impl (next_non_zero_fn fn, size_t min_size, char *page, size_t page_size)
+{
+  size_t i, j, k;
   char *p;
 
-  for (j = 0; j <= 64; ++j) {
-    for (i = 0; i <= 64; ++i) {
+  /* Every alignment of the start and every length, with the non-zero
+   * byte (if any) at every position.  The bytes either side of the
+   * range are non-zero and must be ignored.
+   */
+  for (i = 0; i <= 64; ++i) {
+    for (j = min_size; j <= 300; ++j) {
+      memset (buf, 0, sizeof buf);
+      if (i > 0)
+        buf[i-1] = 1;
+      buf[i+j] = 1;
+      assert (fn (&buf[i], j) == NULL);
+
+      for (k = 0; k < j; ++k) {
+        buf[i+k] = (k & 0x7f) + 1;
+        assert (fn (&buf[i], j) == &buf[i+k]);
+        buf[i+k] = 0;
+      }
+    }
+  }
+
+  /* Long buffers, with the non-zero byte near the start, in the
+   * middle and near the end.
+   */
+  for (j = 512; j <= sizeof buf - 64; j += 61) {
+    for (k = 0; k < j; k += k < 8 || k > j - 300 ? 1 : 97) {
       memset (buf, 0, sizeof buf);
+      buf[7+k] = -1;
+      assert (fn (&buf[7], j) == &buf[7+k]);
+    }
+  }
+
+  /* Buffers which end just before an unreadable page, to check that
+   * we never read past the end.
+   */
+  for (j = min_size; j <= 1024; ++j) {
+    p = page + page_size - j;
+    memset (p, 0, j);
+    assert (fn (p, j) == NULL);
+    if (j > 0) {
+      p[j-1] = 1;
+      assert (fn (p, j) == &p[j-1]);
+      p[j-1] = 0;
+    }
+  }
+}
+
+int
+main (void)
+{
+  size_t i;
+  long page_size = sysconf (_SC_PAGESIZE);
+  char *page;
+
+  /* Two pages, the second one unreadable. */
+  page = mmap (NULL, 2 * page_size, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    perror ("mmap");
+    exit (EXIT_FAILURE);
+  }
+  if (mprotect (page + page_size, page_size, PROT_NONE) == -1) {
+    perror ("mprotect");
+    exit (EXIT_FAILURE);
+  }
 
-      p = &buf[sizeof buf - j - 1];
-      *p = i+1;
-      assert (next_non_zero (&buf[i], sizeof buf - i) == p);
+  for (i = 0; i < sizeof impls / sizeof impls[0]; ++i) {
+    if (!cpu_supports (impls[i].name)) {
+      printf ("%s: not supported by this CPU, skipped\n", impls[i].name);
+      continue;
     }
+    printf ("%s\n", impls[i].name);
+    test_impl (impls[i].fn, impls[i].min_size, page, page_size);
   }
 
+  munmap (page, 2 * page_size);
   exit (EXIT_SUCCESS);
 }
@@ -33,11 +33,13 @@
 #ifndef NBDKIT_TVDIFF_H
 #define NBDKIT_TVDIFF_H
 
-/* Compute struct timeval differences. */
+/* Compute struct timeval and struct timespec differences. */
 
 #include <config.h>
 
+#include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 
 /* Return the number of µs (microseconds) in y - x. */
 static inline int64_t
@@ -61,4 +63,15 @@ subtract_timeval (const struct timeval *x, const struct timeval *y,
   z->tv_usec = usec % 1000000;
 }
 
+/* Return the number of µs (microseconds) in y - x. */
+static inline int64_t
+tsdiff_usec (const struct timespec *x, const struct timespec *y)
+{
+  int64_t usec;
+
+  usec = (y->tv_sec - x->tv_sec) * 1000000;
+  usec += (y->tv_nsec - x->tv_nsec) / 1000;
+  return usec;
+}
+
 #endif /* NBDKIT_TVDIFF_H */
@@ -40,6 +40,8 @@
 #include <nbdkit-plugin.h>
 
 #include "isaligned.h"
+#include "minmax.h"
+#include "rounding.h"
 #include "regions.h"
 
 void
@@ -47,36 +49,122 @@ init_regions (struct regions *regions)
 {
   regions->regions = NULL;
   regions->nr_regions = 0;
+  regions->chunks = NULL;
+  regions->nr_chunks = 0;
 }
 
 void
 free_regions (struct regions *regions)
 {
+  size_t i;
+
   /* We don't need to free the data since that is not owned by the
    * regions structure.
    */
   free (regions->regions);
+  for (i = 0; i < regions->nr_chunks; ++i)
+    free (regions->chunks[i].pages);
+  free (regions->chunks);
 }
 
-/* Find the region corresponding to the given offset.  Use region->end
- * to find the end of the region.
+/* Return the index of the region containing the start of the page
+ * containing offset.
  */
-static int
-compare_offset (const void *offsetp, const void *regionp)
+static inline size_t
+page_lookup (const struct regions *regions, uint64_t offset)
 {
-  const uint64_t offset = *(uint64_t *)offsetp;
-  const struct region *region = (struct region *)regionp;
+  const struct regions_chunk *chunk =
+    &regions->chunks[offset >> REGIONS_CHUNK_BITS];
+  size_t page;
 
-  if (offset < region->start) return -1;
-  if (offset > region->end) return 1;
-  return 0;
+  if (chunk->pages == NULL)
+    return chunk->first;
+  page = (offset >> REGIONS_PAGE_BITS) & (REGIONS_PAGES_PER_CHUNK-1);
+  return chunk->first + chunk->pages[page];
 }
 
+/* Find the region corresponding to the given offset.  Use region->end
+ * to find the end of the region.
+ */
 const struct region *
 find_region (const struct regions *regions, uint64_t offset)
 {
-  return bsearch (&offset, regions->regions, regions->nr_regions,
-                  sizeof (struct region), compare_offset);
+  const uint64_t page_size = UINT64_C(1) << REGIONS_PAGE_BITS;
+  uint64_t next_page;
+  size_t lo, hi, mid;
+
+  if (regions->nr_regions == 0 ||
+      offset > regions->regions[regions->nr_regions-1].end)
+    return NULL;
+
+  /* The region is between the regions containing the start of this
+   * page and the start of the next page.
+   */
+  lo = page_lookup (regions, offset);
+  next_page = ROUND_DOWN (offset, page_size) + page_size;
+  if (next_page <= regions->regions[regions->nr_regions-1].end)
+    hi = page_lookup (regions, next_page);
+  else
+    hi = regions->nr_regions-1;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (regions->regions[mid].end < offset)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return &regions->regions[lo];
+}
+
+/* Update the index after appending region number n. */
+static int
+index_region (struct regions *regions, size_t n, const struct region *region)
+{
+  const uint64_t page_size = UINT64_C(1) << REGIONS_PAGE_BITS;
+  uint64_t c, p, first_page, last_page;
+  struct regions_chunk *chunk;
+
+  for (c = region->start >> REGIONS_CHUNK_BITS;
+       c <= region->end >> REGIONS_CHUNK_BITS; ++c) {
+    if (c << REGIONS_CHUNK_BITS >= region->start) {
+      /* This region contains the start of a new chunk. */
+      assert (c == regions->nr_chunks);
+      chunk = realloc (regions->chunks,
+                       (c+1) * sizeof (struct regions_chunk));
+      if (chunk == NULL) {
+        nbdkit_error ("realloc: %m");
+        return -1;
+      }
+      regions->chunks = chunk;
+      regions->chunks[c].first = n;
+      regions->chunks[c].pages = NULL;
+      regions->nr_chunks++;
+      continue;
+    }
+
+    /* This region starts inside an existing chunk.  Until now the
+     * chunk (so far) was all in one region, so the new page table
+     * starts out pointing to that region.
+     */
+    chunk = &regions->chunks[c];
+    if (chunk->pages == NULL) {
+      chunk->pages = calloc (REGIONS_PAGES_PER_CHUNK, sizeof (uint32_t));
+      if (chunk->pages == NULL) {
+        nbdkit_error ("calloc: %m");
+        return -1;
+      }
+    }
+
+    /* Update the pages which start inside this region. */
+    first_page = ROUND_UP (region->start, page_size) >> REGIONS_PAGE_BITS;
+    last_page = MIN (region->end >> REGIONS_PAGE_BITS,
+                     ((c+1) << (REGIONS_CHUNK_BITS - REGIONS_PAGE_BITS)) - 1);
+    for (p = first_page; p <= last_page; ++p)
+      chunk->pages[p & (REGIONS_PAGES_PER_CHUNK-1)] = n - chunk->first;
+  }
+
+  return 0;
 }
 
 /* This is the low level function for constructing the list of
@@ -105,6 +193,8 @@ append_one_region (struct regions *regions, struct region region)
     return -1;
   }
   regions->regions = p;
+  if (index_region (regions, regions->nr_regions, &region) == -1)
+    return -1;
   regions->regions[regions->nr_regions] = region;
   regions->nr_regions++;
 
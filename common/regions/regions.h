@@ -70,10 +70,30 @@ struct region {
   const char *description;
 };
 
+/* Index used to look up regions by offset.  The disk is divided into
+ * 1M pages, grouped into 1G chunks.  For each chunk we store the
+ * region containing the start of the chunk.  Only chunks which
+ * contain the start of a region need a page table, giving the region
+ * containing the start of each page.  Looking up an offset then only
+ * has to search the regions which start inside a single page.
+ */
+#define REGIONS_PAGE_BITS 20
+#define REGIONS_CHUNK_BITS 30
+#define REGIONS_PAGES_PER_CHUNK \
+  (1 << (REGIONS_CHUNK_BITS - REGIONS_PAGE_BITS))
+
+struct regions_chunk {
+  size_t first;                /* region containing start of chunk */
+  uint32_t *pages;             /* NULL, or region index - first per page */
+};
+
 /* Array of regions. */
 struct regions {
   struct region *regions;
   size_t nr_regions;
+
+  struct regions_chunk *chunks;
+  size_t nr_chunks;
 };
 
 extern void init_regions (struct regions *regions)
@@ -105,6 +125,32 @@ extern const struct region *find_region (const struct regions *regions,
                                          uint64_t offset)
   __attribute__((__nonnull__ (1)));
 
+/* Return the region containing offset, given a region containing an
+ * earlier offset.  This is used by loops which read or write across
+ * several regions to avoid looking up each region:
+ *
+ *   const struct region *region = find_region (regions, offset);
+ *   while (count > 0) {
+ *     region = next_region (regions, region, offset);
+ *     ...
+ *   }
+ *
+ * If the offset is outside the disk image this returns NULL.
+ */
+static inline const struct region * __attribute__((__nonnull__ (1, 2)))
+next_region (const struct regions *regions, const struct region *region,
+             uint64_t offset)
+{
+  const struct region *end = &regions->regions[regions->nr_regions];
+
+  while (offset > region->end) {
+    region++;
+    if (region == end)
+      return NULL;
+  }
+  return region;
+}
+
 /* Append one region of a given length, plus up to two optional
  * padding regions.
  *
@@ -0,0 +1,169 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests of the regions code. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <nbdkit-plugin.h>
+
+#include "random.h"
+#include "regions.h"
+
+/* Slow lookup to compare against. */
+static const struct region *
+linear_find_region (const struct regions *regions, uint64_t offset)
+{
+  size_t i;
+
+  for (i = 0; i < regions->nr_regions; ++i) {
+    if (offset >= regions->regions[i].start &&
+        offset <= regions->regions[i].end)
+      return &regions->regions[i];
+  }
+  return NULL;
+}
+
+static void
+check_offset (struct regions *regions, uint64_t offset)
+{
+  const struct region *r = find_region (regions, offset);
+
+  assert (r == linear_find_region (regions, offset));
+}
+
+static void
+check_regions (struct regions *regions, struct random_state *rs)
+{
+  const struct region *r;
+  uint64_t size = virtual_size (regions);
+  uint64_t offset;
+  size_t i;
+
+  /* Every region boundary. */
+  for (i = 0; i < nr_regions (regions); ++i) {
+    r = get_region (regions, i);
+    check_offset (regions, r->start);
+    check_offset (regions, r->end);
+    if (r->start > 0)
+      check_offset (regions, r->start - 1);
+  }
+
+  /* Random offsets and page boundaries. */
+  for (i = 0; i < 10000; ++i) {
+    offset = xrandom (rs) % size;
+    check_offset (regions, offset);
+    offset &= ~((UINT64_C(1) << REGIONS_PAGE_BITS) - 1);
+    check_offset (regions, offset);
+  }
+
+  /* Outside the disk. */
+  assert (find_region (regions, size) == NULL);
+  assert (find_region (regions, UINT64_MAX) == NULL);
+
+  /* Walking through the regions with next_region. */
+  r = find_region (regions, 0);
+  for (offset = 0; offset < size; offset += (xrandom (rs) % 65536) + 1) {
+    r = next_region (regions, r, offset);
+    assert (r == linear_find_region (regions, offset));
+  }
+  assert (next_region (regions, r, size) == NULL);
+}
+
+int
+main (void)
+{
+  struct random_state rs;
+  struct regions regions;
+  uint64_t len;
+  size_t i;
+
+  xsrandom (1, &rs);
+
+  /* Many small regions, like a floppy with lots of small files. */
+  init_regions (&regions);
+  for (i = 0; i < 20000; ++i) {
+    len = (xrandom (&rs) % 8192) + 1;
+    if (append_region_len (&regions, "small", len, 0, 0, region_zero) == -1)
+      exit (EXIT_FAILURE);
+  }
+  check_regions (&regions, &rs);
+  free_regions (&regions);
+
+  /* A mixture of tiny, aligned and very large regions, like a
+   * partitioned disk.
+   */
+  init_regions (&regions);
+  for (i = 0; i < 200; ++i) {
+    switch (xrandom (&rs) % 4) {
+    case 0: len = 1; break;
+    case 1: len = (xrandom (&rs) % 4096) + 1; break;
+    case 2: len = (xrandom (&rs) % (UINT64_C(1) << 30)) + 1; break;
+    default: len = (xrandom (&rs) % (UINT64_C(1) << 36)) + 1; break;
+    }
+    if (append_region_len (&regions, "region", len,
+                           (i & 1) ? 512 : 0, (i & 2) ? 1048576 : 0,
+                           region_file, i) == -1)
+      exit (EXIT_FAILURE);
+  }
+  check_regions (&regions, &rs);
+  free_regions (&regions);
+
+  exit (EXIT_SUCCESS);
+}
+
+/* The regions code uses nbdkit_error, normally provided by the main
+ * server program.  So we have to provide it here.
+ */
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
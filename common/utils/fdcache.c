@@ -0,0 +1,171 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "fdcache.h"
+
+/* When a file is read sequentially, ask the kernel to read ahead this
+ * much.
+ */
+#define READAHEAD_SIZE (2 * 1024 * 1024)
+
+/* Find file i in the cache.  The caller must hold the lock. */
+static struct fdcache_entry *
+find_entry (struct fdcache *c, size_t i)
+{
+  size_t j;
+
+  for (j = 0; j < c->len; ++j) {
+    if (c->entries[j].i == i)
+      return &c->entries[j];
+  }
+  return NULL;
+}
+
+/* Take a reference to entry e for a read of len bytes at offset.  The
+ * caller must hold the lock.
+ */
+static int
+use_entry (struct fdcache *c, struct fdcache_entry *e,
+           uint64_t offset, size_t len, int *fd)
+{
+  e->refs++;
+  e->last_used = ++c->tick;
+  *fd = e->fd;
+
+#if HAVE_POSIX_FADVISE
+  /* If this read follows on from the previous one, read ahead.  The
+   * hint is only repeated once the reader is halfway through the
+   * previous window.
+   */
+  if (offset == e->next_offset &&
+      offset + len + READAHEAD_SIZE/2 > e->readahead_end) {
+    e->readahead_end = offset + len + READAHEAD_SIZE;
+    posix_fadvise (e->fd, offset + len, READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+  }
+#endif
+  e->next_offset = offset + len;
+
+  return e - c->entries;
+}
+
+int
+fdcache_get (struct fdcache *c, size_t i, const char *path,
+             uint64_t offset, size_t len, int *fd)
+{
+  struct fdcache_entry *e = NULL;
+  size_t j;
+  int newfd;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+    e = find_entry (c, i);
+    if (e)
+      return use_entry (c, e, offset, len, fd);
+  }
+
+  /* Not in the cache.  Open the file without holding the lock, since
+   * open can be slow (for example on network filesystems) and would
+   * otherwise stall reads of every other file.
+   */
+  newfd = open (path, O_RDONLY|O_CLOEXEC);
+  if (newfd == -1) {
+    nbdkit_error ("open: %s: %m", path);
+    return -2;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  /* Another thread may have added the same file in the meantime. */
+  e = find_entry (c, i);
+  if (e) {
+    close (newfd);
+    return use_entry (c, e, offset, len, fd);
+  }
+
+  /* Find a free slot or evict the least recently used entry which is
+   * not in use.
+   */
+  if (c->len < FDCACHE_SIZE)
+    e = &c->entries[c->len++];
+  else {
+    for (j = 0; j < c->len; ++j) {
+      if (c->entries[j].refs == 0 &&
+          (e == NULL || c->entries[j].last_used < e->last_used))
+        e = &c->entries[j];
+    }
+    if (e == NULL) {
+      *fd = newfd;
+      return -1;
+    }
+    close (e->fd);
+  }
+  e->i = i;
+  e->fd = newfd;
+  e->refs = 0;
+  e->next_offset = e->readahead_end = 0;
+
+  return use_entry (c, e, offset, len, fd);
+}
+
+void
+fdcache_put (struct fdcache *c, int slot, int fd)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (slot >= 0)
+    c->entries[slot].refs--;
+  else
+    close (fd);
+}
+
+void
+fdcache_close (struct fdcache *c)
+{
+  size_t j;
+
+  for (j = 0; j < c->len; ++j)
+    close (c->entries[j].fd);
+  c->len = 0;
+}
@@ -0,0 +1,90 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_FDCACHE_H
+#define NBDKIT_FDCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+/* Cache of open host files, used by plugins which serve many files
+ * (for example through region_file regions) so that reads do not
+ * have to open and close the file each time.  The cache is shared by
+ * all connections.  When it is full the least recently used file
+ * which is not being read is closed.
+ *
+ * Files are identified by a caller-chosen index, usually an index
+ * into the plugin's own table of files.
+ *
+ * The cache also notices when a file is being read sequentially and
+ * asks the kernel to read ahead.
+ */
+#define FDCACHE_SIZE 64
+
+struct fdcache_entry {
+  size_t i;                     /* File index. */
+  int fd;
+  unsigned refs;                /* Number of threads using fd. */
+  uint64_t last_used;
+  uint64_t next_offset;         /* Offset following the last read. */
+  uint64_t readahead_end;       /* End of the last readahead hint. */
+};
+
+struct fdcache {
+  pthread_mutex_t lock;
+  struct fdcache_entry entries[FDCACHE_SIZE];
+  size_t len;
+  uint64_t tick;
+};
+
+#define FDCACHE_INIT { .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/* Get a file descriptor for reading file i (opening path if it is not
+ * in the cache), and note that len bytes will be read at offset.
+ * Returns the slot in the cache, or -1 if the cache is full of files
+ * being read, in which case *fd is a temporary file descriptor.
+ * Returns -2 on error.  In the first two cases the caller must call
+ * fdcache_put when it has finished with *fd.
+ */
+extern int fdcache_get (struct fdcache *c, size_t i, const char *path,
+                        uint64_t offset, size_t len, int *fd)
+  __attribute__((__nonnull__ (1, 3, 6)));
+extern void fdcache_put (struct fdcache *c, int slot, int fd)
+  __attribute__((__nonnull__ (1)));
+
+/* Close all cached files. */
+extern void fdcache_close (struct fdcache *c)
+  __attribute__((__nonnull__ (1)));
+
+#endif /* NBDKIT_FDCACHE_H */
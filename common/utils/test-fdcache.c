@@ -0,0 +1,251 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests of the cache of open files. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "fdcache.h"
+
+#define NR_FILES (FDCACHE_SIZE + 8)
+#define NR_THREADS 8
+
+static char dir[] = "/tmp/fdcacheXXXXXX";
+static char paths[NR_FILES][64];
+static char fifo[64];
+static struct fdcache cache = FDCACHE_INIT;
+
+/* Check that fd is the file with index i, which contains i as text. */
+static void
+check_fd (int fd, size_t i)
+{
+  char buf[32], exp[32];
+  ssize_t r;
+
+  snprintf (exp, sizeof exp, "%zu", i);
+  r = pread (fd, buf, sizeof buf - 1, 0);
+  assert (r >= 0);
+  buf[r] = '\0';
+  if (strcmp (buf, exp) != 0) {
+    fprintf (stderr, "test-fdcache: file %zu: expected \"%s\", got \"%s\"\n",
+             i, exp, buf);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static bool
+fd_is_open (int fd)
+{
+  return fcntl (fd, F_GETFD) != -1;
+}
+
+static void *
+reader (void *arg)
+{
+  unsigned seed = (uintptr_t) arg;
+  size_t n, i;
+  int slot, fd;
+
+  for (n = 0; n < 10000; ++n) {
+    i = rand_r (&seed) % NR_FILES;
+    slot = fdcache_get (&cache, i, paths[i], 0, 1, &fd);
+    assert (slot != -2);
+    check_fd (fd, i);
+    fdcache_put (&cache, slot, fd);
+  }
+  return NULL;
+}
+
+static void *
+open_fifo (void *arg)
+{
+  int *slot = arg;
+  int fd;
+
+  /* This blocks in open until the main thread opens the fifo for
+   * writing.
+   */
+  *slot = fdcache_get (&cache, NR_FILES, fifo, 0, 1, &fd);
+  assert (*slot >= 0);
+  fdcache_put (&cache, *slot, fd);
+  return NULL;
+}
+
+int
+main (void)
+{
+  pthread_t threads[NR_THREADS], fifo_thread;
+  int slots[NR_FILES], fds[NR_FILES];
+  int slot, fd, fifo_slot, wfd;
+  size_t i;
+  FILE *fp;
+
+  /* Fail rather than hang if a lock is held across open. */
+  alarm (60);
+
+  if (mkdtemp (dir) == NULL) {
+    perror ("mkdtemp");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_FILES; ++i) {
+    snprintf (paths[i], sizeof paths[i], "%s/%zu", dir, i);
+    fp = fopen (paths[i], "w");
+    assert (fp);
+    fprintf (fp, "%zu", i);
+    if (fclose (fp) == EOF)
+      assert (false);
+  }
+  snprintf (fifo, sizeof fifo, "%s/fifo", dir);
+  if (mkfifo (fifo, 0600) == -1) {
+    perror ("mkfifo");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Getting the same file twice returns the same slot and fd. */
+  slots[0] = fdcache_get (&cache, 0, paths[0], 0, 1, &fds[0]);
+  assert (slots[0] >= 0);
+  slot = fdcache_get (&cache, 0, paths[0], 1, 1, &fd);
+  assert (slot == slots[0]);
+  assert (fd == fds[0]);
+  assert (cache.entries[slot].refs == 2);
+  check_fd (fd, 0);
+  fdcache_put (&cache, slot, fd);
+  assert (cache.entries[slot].refs == 1);
+
+  /* Fill the cache with files which are all in use. */
+  for (i = 1; i < FDCACHE_SIZE; ++i) {
+    slots[i] = fdcache_get (&cache, i, paths[i], 0, 1, &fds[i]);
+    assert (slots[i] >= 0);
+    check_fd (fds[i], i);
+  }
+  assert (cache.len == FDCACHE_SIZE);
+
+  /* Nothing can be evicted, so we get a temporary file descriptor
+   * which is closed by fdcache_put.
+   */
+  i = FDCACHE_SIZE;
+  slot = fdcache_get (&cache, i, paths[i], 0, 1, &fd);
+  assert (slot == -1);
+  check_fd (fd, i);
+  fdcache_put (&cache, slot, fd);
+  assert (!fd_is_open (fd));
+
+  /* Once files are released the least recently used one is evicted. */
+  fdcache_put (&cache, slots[3], fds[3]);
+  fdcache_put (&cache, slots[5], fds[5]);
+  slot = fdcache_get (&cache, i, paths[i], 0, 1, &fd);
+  assert (slot == slots[3]);
+  check_fd (fd, i);
+  fdcache_put (&cache, slot, fd);
+  for (i = 0; i < FDCACHE_SIZE; ++i) {
+    if (i != 3 && i != 5)
+      fdcache_put (&cache, slots[i], fds[i]);
+  }
+
+  /* Opening a missing file fails. */
+  slot = fdcache_get (&cache, NR_FILES + 1, "/nonexistent", 0, 1, &fd);
+  assert (slot == -2);
+
+  /* While one thread is blocked opening a file, other threads can
+   * still use the cache.
+   */
+  if (pthread_create (&fifo_thread, NULL, open_fifo, &fifo_slot) != 0) {
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  sleep (1);
+  for (i = 0; i < NR_FILES; ++i) {
+    slot = fdcache_get (&cache, i, paths[i], 0, 1, &fd);
+    assert (slot != -2);
+    check_fd (fd, i);
+    fdcache_put (&cache, slot, fd);
+  }
+  wfd = open (fifo, O_WRONLY|O_CLOEXEC);
+  assert (wfd >= 0);
+  pthread_join (fifo_thread, NULL);
+  close (wfd);
+
+  /* Many threads reading random files. */
+  for (i = 0; i < NR_THREADS; ++i) {
+    if (pthread_create (&threads[i], NULL, reader,
+                        (void *) (uintptr_t) (i + 1)) != 0) {
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_THREADS; ++i)
+    pthread_join (threads[i], NULL);
+  for (i = 0; i < cache.len; ++i)
+    assert (cache.entries[i].refs == 0);
+
+  fdcache_close (&cache);
+  for (i = 0; i < NR_FILES; ++i)
+    unlink (paths[i]);
+  unlink (fifo);
+  rmdir (dir);
+  exit (EXIT_SUCCESS);
+}
+
+/* The fdcache code uses nbdkit_error, normally provided by the main
+ * server program.  So we have to provide it here.
+ */
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
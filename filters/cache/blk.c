@@ -30,8 +30,8 @@
  * SUCH DAMAGE.
  */
 
-/* These are the block operations.  They always read or write a single
- * whole block of size ‘blksize’.
+/* These are the block operations.  They always read or write whole
+ * blocks of size ‘blksize’.
  */
 
 #include <config.h>
@@ -88,6 +88,12 @@ enum bm_entry {
   BLOCK_DIRTY = 3,
 };
 
+/* Read hits and misses, published as metrics gauges.  They are
+ * registered once in blk_init and read by the server only when the
+ * metrics are fetched, so they are updated atomically.
+ */
+static uint64_t read_hits, read_misses;
+
 int
 blk_init (void)
 {
@@ -147,6 +153,13 @@ blk_init (void)
 
   lru_init ();
 
+  nbdkit_register_gauge ("cache_read_hits",
+                         "Blocks read which were found in the cache.",
+                         &read_hits);
+  nbdkit_register_gauge ("cache_read_misses",
+                         "Blocks read which were not in the cache.",
+                         &read_misses);
+
   return 0;
 }
 
@@ -179,50 +192,82 @@ blk_set_size (uint64_t new_size)
 }
 
 int
-blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
-          uint64_t blknum, uint8_t *block, int *err)
+blk_read_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   uint64_t blknum, uint64_t nrblocks,
+                   uint8_t *block, int *err)
 {
-  off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
-
-  reclaim (fd, &bm);
+  while (nrblocks > 0) {
+    off_t offset = blknum * blksize;
+    enum bm_entry state;
+    uint64_t n, i;
 
-  nbdkit_debug ("cache: blk_read block %" PRIu64 " (offset %" PRIu64 ") is %s",
-                blknum, (uint64_t) offset,
-                state == BLOCK_NOT_CACHED ? "not cached" :
-                state == BLOCK_CLEAN ? "clean" :
-                state == BLOCK_DIRTY ? "dirty" :
-                "unknown");
+    reclaim (fd, &bm);
 
-  if (state == BLOCK_NOT_CACHED) { /* Read underlying plugin. */
-    if (next_ops->pread (nxdata, block, blksize, offset, 0, err) == -1)
-      return -1;
-
-    /* If cache-on-read, copy the block to the cache. */
-    if (cache_on_read) {
-      nbdkit_debug ("cache: cache-on-read block %" PRIu64
-                    " (offset %" PRIu64 ")",
-                    blknum, (uint64_t) offset);
+    /* Find the run of blocks with the same state, so that each run
+     * turns into a single request.
+     */
+    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+    n = bitmap_run_length (&bm, blknum, nrblocks, state);
+    if (n == 0)                 /* Beyond the end of the bitmap. */
+      n = nrblocks;
+
+    nbdkit_debug ("cache: blk_read_multiple block %" PRIu64
+                  " (offset %" PRIu64 ") count %" PRIu64 " is %s",
+                  blknum, (uint64_t) offset, n,
+                  state == BLOCK_NOT_CACHED ? "not cached" :
+                  state == BLOCK_CLEAN ? "clean" :
+                  state == BLOCK_DIRTY ? "dirty" :
+                  "unknown");
+
+    if (state == BLOCK_NOT_CACHED) { /* Read underlying plugin. */
+      __atomic_add_fetch (&read_misses, n, __ATOMIC_RELAXED);
+      if (next_ops->pread (nxdata, block, n * blksize, offset, 0, err) == -1)
+        return -1;
 
-      if (pwrite (fd, block, blksize, offset) == -1) {
+      /* If cache-on-read, copy the blocks to the cache. */
+      if (cache_on_read) {
+        nbdkit_debug ("cache: cache-on-read block %" PRIu64
+                      " (offset %" PRIu64 ") count %" PRIu64,
+                      blknum, (uint64_t) offset, n);
+
+        if (pwrite (fd, block, n * blksize, offset) == -1) {
+          *err = errno;
+          nbdkit_error ("pwrite: %m");
+          return -1;
+        }
+        bitmap_set_range (&bm, blknum, n, BLOCK_CLEAN);
+        lru_set_recently_accessed_range (blknum, n);
+
+        /* The cache grew by n blocks, so keep reclaiming at the same
+         * rate as if they had been read one at a time.
+         */
+        for (i = 1; i < n; ++i)
+          reclaim (fd, &bm);
+      }
+    }
+    else {                      /* Read cache. */
+      __atomic_add_fetch (&read_hits, n, __ATOMIC_RELAXED);
+      if (pread (fd, block, n * blksize, offset) == -1) {
         *err = errno;
-        nbdkit_error ("pwrite: %m");
+        nbdkit_error ("pread: %m");
         return -1;
       }
-      bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
-      lru_set_recently_accessed (blknum);
+      lru_set_recently_accessed_range (blknum, n);
     }
-    return 0;
-  }
-  else {                        /* Read cache. */
-    if (pread (fd, block, blksize, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
-      return -1;
-    }
-    lru_set_recently_accessed (blknum);
-    return 0;
+
+    blknum += n;
+    nrblocks -= n;
+    block += n * blksize;
   }
+
+  return 0;
+}
+
+int
+blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
+          uint64_t blknum, uint8_t *block, int *err)
+{
+  return blk_read_multiple (next_ops, nxdata, blknum, 1, block, err);
 }
 
 int
@@ -272,73 +317,99 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 }
 
 int
-blk_writethrough (struct nbdkit_next_ops *next_ops, void *nxdata,
-                  uint64_t blknum, const uint8_t *block, uint32_t flags,
-                  int *err)
+blk_writethrough_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                           uint64_t blknum, uint64_t nrblocks,
+                           const uint8_t *block, uint32_t flags, int *err)
 {
   off_t offset = blknum * blksize;
+  uint64_t i;
 
-  reclaim (fd, &bm);
+  /* Keep reclaiming at the same rate as if the blocks had been
+   * written one at a time.
+   */
+  for (i = 0; i < nrblocks; ++i)
+    reclaim (fd, &bm);
 
-  nbdkit_debug ("cache: writethrough block %" PRIu64 " (offset %" PRIu64 ")",
-                blknum, (uint64_t) offset);
+  nbdkit_debug ("cache: writethrough block %" PRIu64 " (offset %" PRIu64 ")"
+                " count %" PRIu64,
+                blknum, (uint64_t) offset, nrblocks);
 
-  if (pwrite (fd, block, blksize, offset) == -1) {
+  if (pwrite (fd, block, nrblocks * blksize, offset) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
     return -1;
   }
 
-  if (next_ops->pwrite (nxdata, block, blksize, offset, flags, err) == -1)
+  if (next_ops->pwrite (nxdata, block, nrblocks * blksize, offset,
+                        flags, err) == -1)
     return -1;
 
-  bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
-  lru_set_recently_accessed (blknum);
+  bitmap_set_range (&bm, blknum, nrblocks, BLOCK_CLEAN);
+  lru_set_recently_accessed_range (blknum, nrblocks);
 
   return 0;
 }
 
 int
-blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
-           uint64_t blknum, const uint8_t *block, uint32_t flags,
-           int *err)
+blk_writethrough (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  uint64_t blknum, const uint8_t *block, uint32_t flags,
+                  int *err)
+{
+  return blk_writethrough_multiple (next_ops, nxdata, blknum, 1, block,
+                                    flags, err);
+}
+
+int
+blk_write_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                    uint64_t blknum, uint64_t nrblocks,
+                    const uint8_t *block, uint32_t flags, int *err)
 {
   off_t offset;
+  uint64_t i;
 
   if (cache_mode == CACHE_MODE_WRITETHROUGH ||
       (cache_mode == CACHE_MODE_WRITEBACK && (flags & NBDKIT_FLAG_FUA)))
-    return blk_writethrough (next_ops, nxdata, blknum, block, flags, err);
+    return blk_writethrough_multiple (next_ops, nxdata, blknum, nrblocks,
+                                      block, flags, err);
 
   offset = blknum * blksize;
 
-  reclaim (fd, &bm);
+  for (i = 0; i < nrblocks; ++i)
+    reclaim (fd, &bm);
 
-  nbdkit_debug ("cache: writeback block %" PRIu64 " (offset %" PRIu64 ")",
-                blknum, (uint64_t) offset);
+  nbdkit_debug ("cache: writeback block %" PRIu64 " (offset %" PRIu64 ")"
+                " count %" PRIu64,
+                blknum, (uint64_t) offset, nrblocks);
 
-  if (pwrite (fd, block, blksize, offset) == -1) {
+  if (pwrite (fd, block, nrblocks * blksize, offset) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
     return -1;
   }
-  bitmap_set_blk (&bm, blknum, BLOCK_DIRTY);
-  lru_set_recently_accessed (blknum);
+  bitmap_set_range (&bm, blknum, nrblocks, BLOCK_DIRTY);
+  lru_set_recently_accessed_range (blknum, nrblocks);
 
   return 0;
 }
 
+int
+blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+           uint64_t blknum, const uint8_t *block, uint32_t flags,
+           int *err)
+{
+  return blk_write_multiple (next_ops, nxdata, blknum, 1, block, flags, err);
+}
+
 int
 for_each_dirty_block (block_callback f, void *vp)
 {
-  uint64_t blknum;
-  enum bm_entry state;
+  int64_t blknum;
 
-  bitmap_for (&bm, blknum) {
-    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
-    if (state == BLOCK_DIRTY) {
-      if (f (blknum, vp) == -1)
-        return -1;
-    }
+  for (blknum = bitmap_next_value (&bm, 0, BLOCK_DIRTY);
+       blknum != -1;
+       blknum = bitmap_next_value (&bm, blknum+1, BLOCK_DIRTY)) {
+    if (f (blknum, vp) == -1)
+      return -1;
   }
 
   return 0;
@@ -55,6 +55,14 @@ extern int blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
                      uint64_t blknum, uint8_t *block, int *err)
   __attribute__((__nonnull__ (1, 4, 5)));
 
+/* As above, but read multiple consecutive blocks.  Runs of blocks
+ * which are not cached are read from the plugin in one request.
+ */
+extern int blk_read_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                              uint64_t blknum, uint64_t nrblocks,
+                              uint8_t *block, int *err)
+  __attribute__((__nonnull__ (1, 5, 6)));
+
 /* If a single block is not cached, copy it from the plugin. */
 extern int blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
                       uint64_t blknum, uint8_t *block, int *err)
@@ -66,6 +74,16 @@ extern int blk_writethrough (struct nbdkit_next_ops *next_ops, void *nxdata,
                              uint32_t flags, int *err)
   __attribute__((__nonnull__ (1, 4, 6)));
 
+/* As above, but write multiple consecutive blocks with one request to
+ * the plugin.
+ */
+extern int blk_writethrough_multiple (struct nbdkit_next_ops *next_ops,
+                                      void *nxdata,
+                                      uint64_t blknum, uint64_t nrblocks,
+                                      const uint8_t *block,
+                                      uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 5, 7)));
+
 /* Write a whole block.
  *
  * If the cache is in writethrough mode, or the FUA flag is set, then
@@ -79,6 +97,13 @@ extern int blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
                       uint32_t flags, int *err)
   __attribute__((__nonnull__ (1, 4, 6)));
 
+/* As above, but write multiple consecutive blocks. */
+extern int blk_write_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                               uint64_t blknum, uint64_t nrblocks,
+                               const uint8_t *block,
+                               uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 5, 7)));
+
 /* Iterates over each dirty block in the cache. */
 typedef int (*block_callback) (uint64_t blknum, void *vp);
 extern int for_each_dirty_block (block_callback f, void *vp)
@@ -67,6 +67,9 @@
  */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Largest buffer of zeroes used by cache_zero for each write. */
+#define MAX_ZERO_BUFFER (1024 * 1024)
+
 unsigned blksize;
 enum cache_mode cache_mode = CACHE_MODE_WRITEBACK;
 int64_t max_size = -1;
@@ -263,7 +266,7 @@ cache_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
              uint32_t flags, int *err)
 {
   CLEANUP_FREE uint8_t *block = NULL;
-  uint64_t blknum, blkoffs;
+  uint64_t blknum, blkoffs, nrblocks;
   int r;
 
   assert (!flags);
@@ -298,22 +301,17 @@ cache_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
 
   /* Aligned body */
-  /* XXX This breaks up large read requests into smaller ones, which
-   * is a problem for plugins which have a large, fixed per-request
-   * overhead (hello, curl).  We should try to keep large requests
-   * together as much as possible, but that requires us to be much
-   * smarter here.
-   */
-  while (count >= blksize) {
+  nrblocks = count / blksize;
+  if (nrblocks > 0) {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_read (next_ops, nxdata, blknum, buf, err);
+    r = blk_read_multiple (next_ops, nxdata, blknum, nrblocks, buf, err);
     if (r == -1)
       return -1;
 
-    buf += blksize;
-    count -= blksize;
-    offset += blksize;
-    blknum++;
+    buf += nrblocks * blksize;
+    count -= nrblocks * blksize;
+    offset += nrblocks * blksize;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
@@ -337,7 +335,7 @@ cache_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
               uint32_t flags, int *err)
 {
   CLEANUP_FREE uint8_t *block = NULL;
-  uint64_t blknum, blkoffs;
+  uint64_t blknum, blkoffs, nrblocks;
   int r;
   bool need_flush = false;
 
@@ -383,16 +381,18 @@ cache_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
 
   /* Aligned body */
-  while (count >= blksize) {
+  nrblocks = count / blksize;
+  if (nrblocks > 0) {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_write (next_ops, nxdata, blknum, buf, flags, err);
+    r = blk_write_multiple (next_ops, nxdata, blknum, nrblocks, buf,
+                            flags, err);
     if (r == -1)
       return -1;
 
-    buf += blksize;
-    count -= blksize;
-    offset += blksize;
-    blknum++;
+    buf += nrblocks * blksize;
+    count -= nrblocks * blksize;
+    offset += nrblocks * blksize;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
@@ -420,7 +420,8 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
             int *err)
 {
   CLEANUP_FREE uint8_t *block = NULL;
-  uint64_t blknum, blkoffs;
+  CLEANUP_FREE uint8_t *zeroes = NULL;
+  uint64_t blknum, blkoffs, nrblocks, chunk = 0;
   int r;
   bool need_flush = false;
 
@@ -432,11 +433,13 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     return -1;
   }
 
-  block = malloc (blksize);
-  if (block == NULL) {
-    *err = errno;
-    nbdkit_error ("malloc: %m");
-    return -1;
+  if (!IS_ALIGNED (count | offset, blksize)) {
+    block = malloc (blksize);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
   }
 
   flags &= ~NBDKIT_FLAG_MAY_TRIM;
@@ -456,6 +459,7 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     /* Do a read-modify-write operation on the current block.
      * Hold the lock over the whole operation.
      */
+    assert (block);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
@@ -470,27 +474,41 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     blknum++;
   }
 
-  /* Aligned body */
-  if (count >= blksize)
-    memset (block, 0, blksize);
-  while (count >=blksize) {
-    /* Intentional that we do not use next_ops->zero */
+  /* Aligned body.  Intentional that we do not use next_ops->zero.
+   * Instead write a buffer of zeroes, several blocks at a time.
+   */
+  nrblocks = count / blksize;
+  if (nrblocks > 0) {
+    chunk = MAX (1, MAX_ZERO_BUFFER / blksize);
+    chunk = MIN (chunk, nrblocks);
+    zeroes = calloc (chunk, blksize);
+    if (zeroes == NULL) {
+      *err = errno;
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+  }
+  while (nrblocks > 0) {
+    chunk = MIN (chunk, nrblocks);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    r = blk_write_multiple (next_ops, nxdata, blknum, chunk, zeroes,
+                            flags, err);
     if (r == -1)
       return -1;
 
-    count -= blksize;
-    offset += blksize;
-    blknum++;
+    nrblocks -= chunk;
+    count -= chunk * blksize;
+    offset += chunk * blksize;
+    blknum += chunk;
   }
 
   /* Unaligned tail */
   if (count) {
+    assert (block);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
-      memset (&block[count], 0, blksize - count);
+      memset (block, 0, count);
       r = blk_write (next_ops, nxdata, blknum, block, flags, err);
     }
     if (r == -1)
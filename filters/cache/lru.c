@@ -117,6 +117,23 @@ lru_set_size (uint64_t new_size)
   return 0;
 }
 
+/* If we've reached N/2 then we need to swap over the bitmaps. */
+static void
+lru_maybe_swap (void)
+{
+  if (c0 >= N/2) {
+    struct bitmap tmp;
+
+    tmp = bm[0];
+    bm[0] = bm[1];
+    bm[1] = tmp;
+    c1 = c0;
+
+    bitmap_clear (&bm[0]);
+    c0 = 0;
+  }
+}
+
 void
 lru_set_recently_accessed (uint64_t blknum)
 {
@@ -129,18 +146,20 @@ lru_set_recently_accessed (uint64_t blknum)
   bitmap_set_blk (&bm[0], blknum, true);
   c0++;
 
-  /* If we've reached N/2 then we need to swap over the bitmaps. */
-  if (c0 >= N/2) {
-    struct bitmap tmp;
+  lru_maybe_swap ();
+}
 
-    tmp = bm[0];
-    bm[0] = bm[1];
-    bm[1] = tmp;
-    c1 = c0;
+void
+lru_set_recently_accessed_range (uint64_t blknum, uint64_t n)
+{
+  uint64_t before;
 
-    bitmap_clear (&bm[0]);
-    c0 = 0;
-  }
+  /* Only count the blocks which were not already set. */
+  before = bitmap_count (&bm[0], blknum, n);
+  bitmap_set_range (&bm[0], blknum, n, true);
+  c0 += bitmap_count (&bm[0], blknum, n) - before;
+
+  lru_maybe_swap ();
 }
 
 bool
@@ -47,6 +47,9 @@ extern int lru_set_size (uint64_t new_size);
 /* Mark a block as recently accessed in the LRU structure. */
 extern void lru_set_recently_accessed (uint64_t blknum);
 
+/* Mark the ‘n’ blocks starting at ‘blknum’ as recently accessed. */
+extern void lru_set_recently_accessed_range (uint64_t blknum, uint64_t n);
+
 /* Check if a block has been recently accessed. */
 extern bool lru_has_been_recently_accessed (uint64_t blknum);
 
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -44,71 +45,115 @@
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "extentmap.h"
+
+/* Default maximum memory used by the cache. */
+#define DEFAULT_MAX_SIZE (8 * 1024 * 1024)
 
 /* This lock protects the global state. */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Cached extents from the last extents () call and its start and end for the
- * sake of simplicity.
+/* Cached extents, merged from all extents () calls. */
+static struct extentmap cache;
+
+/* Incremented on every invalidation.  An extents () call which races
+ * with a write only adds its results to the cache if the generation
+ * did not change while it was calling the plugin.
  */
-struct nbdkit_extents *cache_extents;
-static uint64_t cache_start;
-static uint64_t cache_end;
+static uint64_t generation;
+
+static int64_t max_size = DEFAULT_MAX_SIZE;
 
 static void
 cacheextents_unload (void)
 {
-  nbdkit_extents_free (cache_extents);
+  extentmap_free (&cache);
 }
 
 static int
-cacheextents_add (struct nbdkit_extents *extents, int *err)
+cacheextents_config (nbdkit_next_config *next, void *nxdata,
+                     const char *key, const char *value)
 {
-  size_t i = 0;
+  if (strcmp (key, "cacheextents-max-size") == 0) {
+    int64_t r;
 
-  for (i = 0; i < nbdkit_extents_count (cache_extents); i++) {
-    struct nbdkit_extent ex = nbdkit_get_extent (cache_extents, i);
-    if (nbdkit_add_extent (extents, ex.offset, ex.length, ex.type) == -1) {
-      *err = errno;
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < (int64_t) sizeof (struct extentmap_entry)) {
+      nbdkit_error ("cacheextents-max-size is too small");
       return -1;
     }
+    max_size = r;
+    return 0;
   }
+  else
+    return next (nxdata, key, value);
+}
 
-  return 0;
+#define cacheextents_config_help \
+  "cacheextents-max-size=SIZE Set maximum memory used by the cache."
+
+static int
+cacheextents_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  extentmap_init (&cache, max_size / sizeof (struct extentmap_entry));
+  return next (nxdata);
 }
 
+/* Answer from the cache if we know at least the extent containing
+ * offset.  Returns 1 on a hit, 0 on a miss (setting *gen), -1 on
+ * error.
+ */
 static int
-cacheextents_fill (struct nbdkit_extents *extents, int *err)
+cacheextents_lookup (uint32_t count, uint64_t offset, uint32_t flags,
+                     struct nbdkit_extents *extents, uint64_t *gen, int *err)
 {
-  size_t i = 0;
-  size_t count = nbdkit_extents_count (extents);
-  struct nbdkit_extent first = nbdkit_get_extent (extents, 0);
-  struct nbdkit_extent last = nbdkit_get_extent (extents, count - 1);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  const uint64_t end = offset + count;
+  struct extentmap_entry e;
+  uint64_t pos = offset;
 
-  nbdkit_extents_free (cache_extents);
-  cache_start = first.offset;
-  cache_end = last.offset + last.length;
-  cache_extents = nbdkit_extents_new (cache_start, cache_end);
+  while (pos < end && extentmap_lookup (&cache, pos, &e)) {
+    if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+      *err = errno;
+      return -1;
+    }
+    pos = e.offset + e.length;
+    if (flags & NBDKIT_FLAG_REQ_ONE)
+      break;
+  }
 
-  if (!cache_extents)
-    return -1;
+  if (pos > offset) {
+    nbdkit_debug ("cacheextents: returning from cache");
+    return 1;
+  }
+
+  *gen = generation;
+  return 0;
+}
 
-  for (i = 0; i < count; i++) {
+static void
+cacheextents_fill (uint64_t gen, struct nbdkit_extents *extents)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  size_t i;
+
+  if (gen != generation)
+    return;
+
+  for (i = 0; i < nbdkit_extents_count (extents); i++) {
     struct nbdkit_extent ex = nbdkit_get_extent (extents, i);
+
     nbdkit_debug ("cacheextents: updating cache with:"
                   " offset=%" PRIu64
                   " length=%" PRIu64
                   " type=%x",
                   ex.offset, ex.length, ex.type);
-    if (nbdkit_add_extent (cache_extents, ex.offset, ex.length, ex.type) == -1) {
-      *err = errno;
-      nbdkit_extents_free (cache_extents);
-      cache_extents = NULL;
-      return -1;
-    }
+    /* Not fatal, this extent just won't be cached. */
+    if (extentmap_insert (&cache, ex.offset, ex.length, ex.type) == -1)
+      return;
   }
-
-  return 0;
 }
 
 static int
@@ -117,19 +162,12 @@ cacheextents_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                       struct nbdkit_extents *extents,
                       int *err)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  uint64_t gen;
+  int r;
 
-  nbdkit_debug ("cacheextents:"
-                " cache_start=%" PRIu64
-                " cache_end=%" PRIu64
-                " cache_extents=%p",
-                cache_start, cache_end, cache_extents);
-
-  if (cache_extents &&
-      offset >= cache_start && offset < cache_end) {
-    nbdkit_debug ("cacheextents: returning from cache");
-    return cacheextents_add (extents, err);
-  }
+  r = cacheextents_lookup (count, offset, flags, extents, &gen, err);
+  if (r != 0)
+    return r == 1 ? 0 : -1;
 
   nbdkit_debug ("cacheextents: cache miss");
   /* Clear REQ_ONE to ask the plugin for as much information as it is
@@ -140,21 +178,20 @@ cacheextents_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (next_ops->extents (nxdata, count, offset, flags, extents, err) == -1)
     return -1;
 
-  return cacheextents_fill (extents, err);
+  cacheextents_fill (gen, extents);
+  return 0;
 }
 
-/* Any changes to the data needs to clean the cache.
- *
- * Similar to the readahead filter this could be more intelligent, but
- * there would be very little benefit.
+/* Any changes to the data need to invalidate the overlapping part of
+ * the cache.  This is done after the change, even if it failed, since
+ * part of the range may have been modified anyway.
  */
-
 static void
-kill_cacheextents (void)
+invalidate_cacheextents (uint32_t count, uint64_t offset)
 {
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  nbdkit_extents_free (cache_extents);
-  cache_extents = NULL;
+  generation++;
+  extentmap_invalidate (&cache, offset, count);
 }
 
 static int
@@ -163,8 +200,11 @@ cacheextents_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
                      const void *buf, uint32_t count, uint64_t offset,
                      uint32_t flags, int *err)
 {
-  kill_cacheextents ();
-  return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  int r;
+
+  r = next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  invalidate_cacheextents (count, offset);
+  return r;
 }
 
 static int
@@ -173,8 +213,11 @@ cacheextents_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
                    uint32_t count, uint64_t offset, uint32_t flags,
                    int *err)
 {
-  kill_cacheextents ();
-  return next_ops->trim (nxdata, count, offset, flags, err);
+  int r;
+
+  r = next_ops->trim (nxdata, count, offset, flags, err);
+  invalidate_cacheextents (count, offset);
+  return r;
 }
 
 static int
@@ -183,14 +226,20 @@ cacheextents_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
                    uint32_t count, uint64_t offset, uint32_t flags,
                    int *err)
 {
-  kill_cacheextents ();
-  return next_ops->zero (nxdata, count, offset, flags, err);
+  int r;
+
+  r = next_ops->zero (nxdata, count, offset, flags, err);
+  invalidate_cacheextents (count, offset);
+  return r;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "cacheextents",
   .longname          = "nbdkit cacheextents filter",
   .unload            = cacheextents_unload,
+  .config            = cacheextents_config,
+  .config_help       = cacheextents_config_help,
+  .config_complete   = cacheextents_config_complete,
   .pwrite            = cacheextents_pwrite,
   .trim              = cacheextents_trim,
   .zero              = cacheextents_zero,
@@ -54,6 +54,11 @@
  * When writing a block we unconditionally write the data to the
  * temporary file, setting the bit in the bitmap.
  *
+ * If cow-compress or cow-dedup is set the temporary file is used as
+ * a log of (possibly compressed and shared) blocks instead, see
+ * store.c.  The bitmap is still used to find out if a block is
+ * allocated.
+ *
  * We allow the client to request FUA, and emulate it with a flush
  * (arguably, since the write overlay is temporary, we could ignore
  * FUA altogether).
@@ -81,6 +86,7 @@
 
 #include "bitmap.h"
 #include "blk.h"
+#include "store.h"
 
 #ifndef HAVE_FDATASYNC
 #define fdatasync fsync
@@ -133,7 +139,7 @@ blk_init (void)
   }
 
   unlink (template);
-  return 0;
+  return store_init (fd);
 }
 
 void
@@ -152,6 +158,10 @@ blk_set_size (uint64_t new_size)
   if (bitmap_resize (&bm, new_size) == -1)
     return -1;
 
+  /* The compressed log grows as blocks are written. */
+  if (store_in_use ())
+    return store_set_size (new_size / BLKSIZE);
+
   if (ftruncate (fd, new_size) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
@@ -174,30 +184,62 @@ blk_set_allocated (uint64_t blknum)
   bitmap_set_blk (&bm, blknum, true);
 }
 
-/* These are the block operations.  They always read or write a single
- * whole block of size ‘blksize’.
+/* These are the block operations.  They always read or write whole
+ * blocks of size ‘blksize’.
  */
 int
-blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
-          uint64_t blknum, uint8_t *block, int *err)
+blk_read_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   uint64_t blknum, uint64_t nrblocks,
+                   uint8_t *block, int *err)
 {
-  off_t offset = blknum * BLKSIZE;
-  bool allocated = blk_is_allocated (blknum);
-
-  nbdkit_debug ("cow: blk_read block %" PRIu64 " (offset %" PRIu64 ") is %s",
-                blknum, (uint64_t) offset,
-                !allocated ? "a hole" : "allocated");
-
-  if (!allocated)               /* Read underlying plugin. */
-    return next_ops->pread (nxdata, block, BLKSIZE, offset, 0, err);
-  else {                        /* Read overlay. */
-    if (pread (fd, block, BLKSIZE, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
-      return -1;
+  while (nrblocks > 0) {
+    off_t offset = blknum * BLKSIZE;
+    bool allocated = blk_is_allocated (blknum);
+    uint64_t n, i;
+
+    /* Find the run of blocks with the same state, so that each run
+     * turns into a single request.
+     */
+    n = bitmap_run_length (&bm, blknum, nrblocks, allocated);
+    if (n == 0)                 /* Beyond the end of the bitmap. */
+      n = nrblocks;
+
+    nbdkit_debug ("cow: blk_read_multiple block %" PRIu64
+                  " (offset %" PRIu64 ") count %" PRIu64 " is %s",
+                  blknum, (uint64_t) offset, n,
+                  !allocated ? "a hole" : "allocated");
+
+    if (!allocated) {           /* Read underlying plugin. */
+      if (next_ops->pread (nxdata, block, n * BLKSIZE, offset, 0, err) == -1)
+        return -1;
     }
-    return 0;
+    else if (store_in_use ()) {
+      for (i = 0; i < n; ++i) {
+        if (store_read (blknum + i, block + i * BLKSIZE, err) == -1)
+          return -1;
+      }
+    }
+    else {                      /* Read overlay. */
+      if (pread (fd, block, n * BLKSIZE, offset) == -1) {
+        *err = errno;
+        nbdkit_error ("pread: %m");
+        return -1;
+      }
+    }
+
+    blknum += n;
+    nrblocks -= n;
+    block += n * BLKSIZE;
   }
+
+  return 0;
+}
+
+int
+blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
+          uint64_t blknum, uint8_t *block, int *err)
+{
+  return blk_read_multiple (next_ops, nxdata, blknum, 1, block, err);
 }
 
 int
@@ -212,6 +254,8 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
                 !allocated ? "a hole" : "allocated");
 
   if (allocated) {
+    if (store_in_use ())
+      return 0;
 #if HAVE_POSIX_FADVISE
     int r = posix_fadvise (fd, offset, BLKSIZE, POSIX_FADV_WILLNEED);
     if (r) {
@@ -229,7 +273,11 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (next_ops->pread (nxdata, block, BLKSIZE, offset, 0, err) == -1)
     return -1;
   if (mode == BLK_CACHE_COW) {
-    if (pwrite (fd, block, BLKSIZE, offset) == -1) {
+    if (store_in_use ()) {
+      if (store_write (blknum, block, err) == -1)
+        return -1;
+    }
+    else if (pwrite (fd, block, BLKSIZE, offset) == -1) {
       *err = errno;
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -240,23 +288,38 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 }
 
 int
-blk_write (uint64_t blknum, const uint8_t *block, int *err)
+blk_write_multiple (uint64_t blknum, uint64_t nrblocks,
+                    const uint8_t *block, int *err)
 {
   off_t offset = blknum * BLKSIZE;
+  uint64_t i;
 
-  nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")",
-                blknum, (uint64_t) offset);
+  nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")"
+                " count %" PRIu64,
+                blknum, (uint64_t) offset, nrblocks);
 
-  if (pwrite (fd, block, BLKSIZE, offset) == -1) {
+  if (store_in_use ()) {
+    for (i = 0; i < nrblocks; ++i) {
+      if (store_write (blknum + i, block + i * BLKSIZE, err) == -1)
+        return -1;
+    }
+  }
+  else if (pwrite (fd, block, nrblocks * BLKSIZE, offset) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
     return -1;
   }
-  blk_set_allocated (blknum);
+  bitmap_set_range (&bm, blknum, nrblocks, true);
 
   return 0;
 }
 
+int
+blk_write (uint64_t blknum, const uint8_t *block, int *err)
+{
+  return blk_write_multiple (blknum, 1, block, err);
+}
+
 int
 blk_flush (void)
 {
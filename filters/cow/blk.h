@@ -59,6 +59,15 @@ extern int blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
                      uint64_t blknum, uint8_t *block, int *err)
   __attribute__((__nonnull__ (1, 4, 5)));
 
+/* Read multiple blocks from the overlay or plugin.  Consecutive
+ * blocks which are all holes are read from the plugin in one
+ * request.
+ */
+extern int blk_read_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                              uint64_t blknum, uint64_t nrblocks,
+                              uint8_t *block, int *err)
+  __attribute__((__nonnull__ (1, 5, 6)));
+
 /* Cache mode for blocks not already in overlay */
 enum cache_mode {
   BLK_CACHE_IGNORE,      /* Do nothing */
@@ -77,6 +86,11 @@ extern int blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 extern int blk_write (uint64_t blknum, const uint8_t *block, int *err)
   __attribute__((__nonnull__ (2, 3)));
 
+/* Write multiple consecutive blocks. */
+extern int blk_write_multiple (uint64_t blknum, uint64_t nrblocks,
+                               const uint8_t *block, int *err)
+  __attribute__((__nonnull__ (3, 4)));
+
 /* Flush the overlay to disk. */
 extern int blk_flush (void);
 
@@ -47,6 +47,7 @@
 #include "cleanup.h"
 
 #include "blk.h"
+#include "store.h"
 #include "isaligned.h"
 #include "minmax.h"
 #include "rounding.h"
@@ -56,6 +57,9 @@
  */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Largest buffer of zeroes used by cow_zero for each write. */
+#define MAX_ZERO_BUFFER (1024 * 1024)
+
 bool cow_on_cache;
 
 static void
@@ -68,6 +72,7 @@ cow_load (void)
 static void
 cow_unload (void)
 {
+  store_free ();
   blk_free ();
 }
 
@@ -84,13 +89,65 @@ cow_config (nbdkit_next_config *next, void *nxdata,
     cow_on_cache = r;
     return 0;
   }
+  else if (strcmp (key, "cow-dedup") == 0) {
+    int r;
+
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    cow_dedup = r;
+    return 0;
+  }
+  else if (strcmp (key, "cow-store") == 0) {
+    cow_store = value;
+    return 0;
+  }
+  else if (strcmp (key, "cow-compress") == 0) {
+    if (strcmp (value, "none") == 0)
+      cow_compress = COW_COMPRESS_NONE;
+    else if (strcmp (value, "zlib") == 0) {
+#ifdef HAVE_ZLIB
+      cow_compress = COW_COMPRESS_ZLIB;
+#else
+      nbdkit_error ("cow-compress=zlib: "
+                    "nbdkit was compiled without zlib support");
+      return -1;
+#endif
+    }
+    else if (strcmp (value, "zstd") == 0) {
+#ifdef HAVE_LIBZSTD
+      cow_compress = COW_COMPRESS_ZSTD;
+#else
+      nbdkit_error ("cow-compress=zstd: "
+                    "nbdkit was compiled without zstd support");
+      return -1;
+#endif
+    }
+    else {
+      nbdkit_error ("unknown cow-compress method: %s", value);
+      return -1;
+    }
+    return 0;
+  }
   else {
     return next (nxdata, key, value);
   }
 }
 
 #define cow_config_help \
-  "cow-on-cache=<BOOL>  Set to true to treat client cache requests as writes.\n"
+  "cow-on-cache=<BOOL>  Set to true to treat client cache requests as writes.\n" \
+  "cow-compress=zlib|zstd Compress blocks in the overlay (default: none).\n" \
+  "cow-dedup=<BOOL>     Store identical blocks in the overlay once.\n" \
+  "cow-store=<PATH>     Share identical blocks with other nbdkit instances.\n"
+
+static int
+cow_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (store_open_shared () == -1)
+    return -1;
+
+  return next (nxdata);
+}
 
 static void *
 cow_open (nbdkit_next_open *next, void *nxdata, int readonly)
@@ -99,6 +156,10 @@ cow_open (nbdkit_next_open *next, void *nxdata, int readonly)
   if (next (nxdata, 1) == -1)
     return NULL;
 
+  /* Start the compaction thread (once) after nbdkit has forked. */
+  if (store_in_use () && store_start_compaction () == -1)
+    return NULL;
+
   return NBDKIT_HANDLE_NOT_NEEDED;
 }
 
@@ -205,7 +266,7 @@ cow_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
            uint32_t flags, int *err)
 {
   CLEANUP_FREE uint8_t *block = NULL;
-  uint64_t blknum, blkoffs;
+  uint64_t blknum, blkoffs, nrblocks;
   int r;
 
   if (!IS_ALIGNED (count | offset, BLKSIZE)) {
@@ -239,22 +300,17 @@ cow_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
 
   /* Aligned body */
-  /* XXX This breaks up large read requests into smaller ones, which
-   * is a problem for plugins which have a large, fixed per-request
-   * overhead (hello, curl).  We should try to keep large requests
-   * together as much as possible, but that requires us to be much
-   * smarter here.
-   */
-  while (count >= BLKSIZE) {
+  nrblocks = count / BLKSIZE;
+  if (nrblocks > 0) {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_read (next_ops, nxdata, blknum, buf, err);
+    r = blk_read_multiple (next_ops, nxdata, blknum, nrblocks, buf, err);
     if (r == -1)
       return -1;
 
-    buf += BLKSIZE;
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    buf += nrblocks * BLKSIZE;
+    count -= nrblocks * BLKSIZE;
+    offset += nrblocks * BLKSIZE;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
@@ -278,7 +334,7 @@ cow_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
             uint32_t flags, int *err)
 {
   CLEANUP_FREE uint8_t *block = NULL;
-  uint64_t blknum, blkoffs;
+  uint64_t blknum, blkoffs, nrblocks;
   int r;
 
   if (!IS_ALIGNED (count | offset, BLKSIZE)) {
@@ -317,16 +373,17 @@ cow_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
 
   /* Aligned body */
-  while (count >= BLKSIZE) {
+  nrblocks = count / BLKSIZE;
+  if (nrblocks > 0) {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_write (blknum, buf, err);
+    r = blk_write_multiple (blknum, nrblocks, buf, err);
     if (r == -1)
       return -1;
 
-    buf += BLKSIZE;
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    buf += nrblocks * BLKSIZE;
+    count -= nrblocks * BLKSIZE;
+    offset += nrblocks * BLKSIZE;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
@@ -354,7 +411,8 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
           int *err)
 {
   CLEANUP_FREE uint8_t *block = NULL;
-  uint64_t blknum, blkoffs;
+  CLEANUP_FREE uint8_t *zeroes = NULL;
+  uint64_t blknum, blkoffs, nrblocks, chunk = 0;
   int r;
 
   /* We are purposefully avoiding next_ops->zero, so a zero request is
@@ -365,11 +423,13 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     return -1;
   }
 
-  block = malloc (BLKSIZE);
-  if (block == NULL) {
-    *err = errno;
-    nbdkit_error ("malloc: %m");
-    return -1;
+  if (!IS_ALIGNED (count | offset, BLKSIZE)) {
+    block = malloc (BLKSIZE);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
   }
 
   blknum = offset / BLKSIZE;  /* block number */
@@ -382,6 +442,7 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     /* Do a read-modify-write operation on the current block.
      * Hold the lock over the whole operation.
      */
+    assert (block);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
@@ -396,29 +457,42 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     blknum++;
   }
 
-  /* Aligned body */
-  if (count >= BLKSIZE)
-    memset (block, 0, BLKSIZE);
-  while (count >= BLKSIZE) {
+  /* Aligned body.  Write a buffer of zeroes, several blocks at a
+   * time.
+   */
+  nrblocks = count / BLKSIZE;
+  if (nrblocks > 0) {
+    chunk = MIN (nrblocks, MAX_ZERO_BUFFER / BLKSIZE);
+    zeroes = calloc (chunk, BLKSIZE);
+    if (zeroes == NULL) {
+      *err = errno;
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+  }
+  while (nrblocks > 0) {
     /* XXX There is the possibility of optimizing this: since this loop is
-     * writing a whole, aligned block, we should use FALLOC_FL_ZERO_RANGE.
+     * writing whole, aligned blocks, we should use FALLOC_FL_ZERO_RANGE.
      */
+    chunk = MIN (chunk, nrblocks);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_write (blknum, block, err);
+    r = blk_write_multiple (blknum, chunk, zeroes, err);
     if (r == -1)
       return -1;
 
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    nrblocks -= chunk;
+    count -= chunk * BLKSIZE;
+    offset += chunk * BLKSIZE;
+    blknum += chunk;
   }
 
   /* Unaligned tail */
   if (count) {
+    assert (block);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
-      memset (&block[count], 0, BLKSIZE - count);
+      memset (block, 0, count);
       r = blk_write (blknum, block, err);
     }
     if (r == -1)
@@ -510,6 +584,7 @@ static struct nbdkit_filter filter = {
   .unload            = cow_unload,
   .open              = cow_open,
   .config            = cow_config,
+  .config_complete   = cow_config_complete,
   .config_help       = cow_config_help,
   .prepare           = cow_prepare,
   .get_size          = cow_get_size,
@@ -0,0 +1,407 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Chunk store shared between nbdkit instances, used for cow-store.
+ *
+ * Several cow filters, usually overlays on clones of the same base
+ * image, open the same store file.  Each block written is hashed and
+ * stored once in the file with a reference count, so a block which
+ * another instance has already stored only costs a reference.  Each
+ * nbdkit instance keeps its own in-memory map from its blocks to
+ * chunk numbers (see store.c), so the instances still see separate
+ * overlays.
+ *
+ * The file contains a header, a hash table of chunk chains, then
+ * groups of chunks.  Each group is a table of GROUP_CHUNKS entries
+ * followed by the data of those chunks, so the file grows one group
+ * at a time without moving anything.  All links are stored as chunk
+ * number + 1 so that a new, sparse file is an empty store.  The
+ * header, hash table and chunk tables are mapped shared, and updated
+ * with an fcntl lock on the file held.  Chunk data is only written
+ * while the chunk is unreferenced, so it can be read without the
+ * lock by an instance holding a reference.
+ *
+ * The store is only valid while nbdkit instances are using it.
+ * References held by an instance which is killed are never dropped,
+ * so the file should be deleted once all instances have exited.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+
+#if defined (__linux__) && !defined (FALLOC_FL_PUNCH_HOLE)
+#include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
+#endif
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+
+#include "blk.h"
+#include "store.h"
+#include "sharedstore.h"
+
+#define MAGIC "NBDKCOW1"
+#define HEADER_SIZE 4096
+#define NR_BUCKETS (UINT32_C(1) << 20)
+#define DATA_START (HEADER_SIZE + NR_BUCKETS * sizeof (uint32_t))
+#define GROUP_CHUNKS 4096
+#define TABLE_SIZE (GROUP_CHUNKS * sizeof (struct entry))
+#define GROUP_SIZE (TABLE_SIZE + (uint64_t) GROUP_CHUNKS * BLKSIZE)
+#define MAX_GROUPS ((UINT32_MAX - 1) / GROUP_CHUNKS)
+
+struct header {
+  char magic[8];
+  uint32_t blksize;
+  uint32_t nr_buckets;
+  uint32_t nr_groups;
+  uint32_t nr_chunks;           /* Chunks ever allocated. */
+  uint32_t free_chunk;          /* Free list, chunk number + 1. */
+  uint32_t live_chunks;
+};
+
+struct entry {
+  uint64_t hash;
+  uint32_t refs;                /* 0 if the chunk is free. */
+  uint32_t next;                /* Hash chain or free list. */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int fd = -1;
+static struct header *hdr;
+static uint32_t *buckets;
+static struct entry **tables;   /* Chunk tables of the mapped groups. */
+static uint32_t nr_mapped;
+static uint8_t *scratch;        /* For comparing candidate chunks. */
+
+static int
+lock_file (void)
+{
+  struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+                      .l_start = 0, .l_len = 1 };
+
+  while (fcntl (fd, F_SETLKW, &fl) == -1) {
+    if (errno != EINTR) {
+      nbdkit_error ("cow-store: fcntl: F_SETLKW: %m");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void
+unlock_file (void)
+{
+  struct flock fl = { .l_type = F_UNLCK, .l_whence = SEEK_SET,
+                      .l_start = 0, .l_len = 1 };
+
+  if (fcntl (fd, F_SETLK, &fl) == -1)
+    nbdkit_debug ("cow-store: fcntl: F_UNLCK: %m");
+}
+
+static inline uint64_t
+group_offset (uint32_t g)
+{
+  return DATA_START + g * GROUP_SIZE;
+}
+
+static inline uint64_t
+data_offset (uint32_t c)
+{
+  return group_offset (c / GROUP_CHUNKS) + TABLE_SIZE +
+    (uint64_t) (c % GROUP_CHUNKS) * BLKSIZE;
+}
+
+static inline struct entry *
+entry (uint32_t c)
+{
+  return &tables[c / GROUP_CHUNKS][c % GROUP_CHUNKS];
+}
+
+/* Map the chunk tables of groups added by any instance since we last
+ * looked.  Called with the file locked.
+ */
+static int
+map_groups (void)
+{
+  struct entry **new_tables;
+  void *p;
+
+  if (nr_mapped == hdr->nr_groups)
+    return 0;
+
+  new_tables = realloc (tables, hdr->nr_groups * sizeof (struct entry *));
+  if (new_tables == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  tables = new_tables;
+
+  while (nr_mapped < hdr->nr_groups) {
+    p = mmap (NULL, TABLE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+              fd, group_offset (nr_mapped));
+    if (p == MAP_FAILED) {
+      nbdkit_error ("cow-store: mmap: %m");
+      return -1;
+    }
+    tables[nr_mapped++] = p;
+  }
+  return 0;
+}
+
+int
+sharedstore_open (const char *path)
+{
+  struct stat statbuf;
+  void *p;
+  int r = -1;
+
+  fd = open (path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", path);
+    return -1;
+  }
+  scratch = malloc (BLKSIZE);
+  if (scratch == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  if (lock_file () == -1)
+    return -1;
+
+  /* The first instance to lock a new file initializes it. */
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", path);
+    goto out;
+  }
+  if (statbuf.st_size == 0) {
+    struct header h = { .magic = MAGIC, .blksize = BLKSIZE,
+                        .nr_buckets = NR_BUCKETS };
+
+    if (ftruncate (fd, DATA_START) == -1 ||
+        pwrite (fd, &h, sizeof h, 0) != sizeof h) {
+      nbdkit_error ("cow-store: %s: could not initialize store: %m", path);
+      goto out;
+    }
+  }
+
+  p = mmap (NULL, DATA_START, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    nbdkit_error ("cow-store: mmap: %s: %m", path);
+    goto out;
+  }
+  hdr = p;
+  buckets = (uint32_t *) ((char *) p + HEADER_SIZE);
+  if (memcmp (hdr->magic, MAGIC, sizeof hdr->magic) != 0 ||
+      hdr->blksize != BLKSIZE || hdr->nr_buckets != NR_BUCKETS) {
+    nbdkit_error ("cow-store: %s: not a cow-store file", path);
+    goto out;
+  }
+  if (map_groups () == -1)
+    goto out;
+
+  nbdkit_debug ("cow-store: %s: %" PRIu32 " chunks in use",
+                path, hdr->live_chunks);
+  r = 0;
+ out:
+  unlock_file ();
+  return r;
+}
+
+void
+sharedstore_close (void)
+{
+  uint32_t g;
+
+  for (g = 0; g < nr_mapped; ++g)
+    munmap (tables[g], TABLE_SIZE);
+  free (tables);
+  if (hdr)
+    munmap (hdr, DATA_START);
+  if (fd >= 0)
+    close (fd);
+  free (scratch);
+}
+
+/* Allocate a free chunk, growing the file if there is none.  Called
+ * with the file locked.
+ */
+static int
+alloc_chunk (uint32_t *c)
+{
+  if (hdr->free_chunk) {
+    *c = hdr->free_chunk - 1;
+    hdr->free_chunk = entry (*c)->next;
+    return 0;
+  }
+
+  if (hdr->nr_chunks == hdr->nr_groups * GROUP_CHUNKS) {
+    if (hdr->nr_groups == MAX_GROUPS) {
+      nbdkit_error ("cow-store: the store is full");
+      return -1;
+    }
+    if (ftruncate (fd, group_offset (hdr->nr_groups + 1)) == -1) {
+      nbdkit_error ("cow-store: ftruncate: %m");
+      return -1;
+    }
+    hdr->nr_groups++;
+    if (map_groups () == -1)
+      return -1;
+  }
+  *c = hdr->nr_chunks++;
+  return 0;
+}
+
+int
+sharedstore_put (const uint8_t *block, uint32_t *c_rtn, bool *deduped,
+                 int *err)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  const uint64_t hash = hash_block (block);
+  uint32_t *bucket = &buckets[hash & (NR_BUCKETS-1)];
+  uint32_t c;
+  int r = -1;
+
+  *err = EIO;
+  if (lock_file () == -1)
+    return -1;
+  if (map_groups () == -1)
+    goto out;
+
+  /* Possible matches are read back and compared, since the hash is
+   * not cryptographic.
+   */
+  for (c = *bucket; c != 0; c = entry (c-1)->next) {
+    if (entry (c-1)->hash != hash)
+      continue;
+    if (pread (fd, scratch, BLKSIZE, data_offset (c-1)) != BLKSIZE) {
+      nbdkit_error ("cow-store: pread: %m");
+      goto out;
+    }
+    if (memcmp (block, scratch, BLKSIZE) == 0) {
+      entry (c-1)->refs++;
+      *c_rtn = c-1;
+      *deduped = true;
+      r = 0;
+      goto out;
+    }
+  }
+
+  if (alloc_chunk (&c) == -1) {
+    *err = ENOSPC;
+    goto out;
+  }
+  if (pwrite (fd, block, BLKSIZE, data_offset (c)) != BLKSIZE) {
+    *err = errno ? errno : EIO;
+    nbdkit_error ("cow-store: pwrite: %m");
+    entry (c)->next = hdr->free_chunk;
+    hdr->free_chunk = c+1;
+    goto out;
+  }
+  entry (c)->hash = hash;
+  entry (c)->refs = 1;
+  entry (c)->next = *bucket;
+  *bucket = c+1;
+  hdr->live_chunks++;
+  *c_rtn = c;
+  *deduped = false;
+  r = 0;
+ out:
+  unlock_file ();
+  return r;
+}
+
+int
+sharedstore_get (uint32_t c, uint8_t *block, int *err)
+{
+  ssize_t r;
+
+  r = pread (fd, block, BLKSIZE, data_offset (c));
+  if (r != BLKSIZE) {
+    if (r >= 0)
+      errno = EIO;
+    *err = errno;
+    nbdkit_error ("cow-store: pread: %m");
+    return -1;
+  }
+  return 0;
+}
+
+void
+sharedstore_unref (uint32_t c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct entry *e;
+  uint32_t *p;
+
+  if (lock_file () == -1)
+    return;
+  if (map_groups () == -1)
+    goto out;
+
+  e = entry (c);
+  if (--e->refs > 0)
+    goto out;
+
+  /* Unlink the chunk from its hash chain and free it. */
+  for (p = &buckets[e->hash & (NR_BUCKETS-1)]; *p != c+1;
+       p = &entry (*p-1)->next)
+    ;
+  *p = e->next;
+  e->next = hdr->free_chunk;
+  hdr->free_chunk = c+1;
+  hdr->live_chunks--;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  /* Give the space back to the host filesystem. */
+  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                 data_offset (c), BLKSIZE) == -1)
+    nbdkit_debug ("cow-store: fallocate: %m");
+#endif
+ out:
+  unlock_file ();
+}
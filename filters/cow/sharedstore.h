@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2013 Red Hat Inc.
+ * Copyright (C) 2019 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -30,24 +30,37 @@
  * SUCH DAMAGE.
  */
 
-#ifndef NBDKIT_BLKCACHE_H
-#define NBDKIT_BLKCACHE_H
+#ifndef NBDKIT_SHAREDSTORE_H
+#define NBDKIT_SHAREDSTORE_H
 
-typedef struct blkcache blkcache;
+#include <stdint.h>
+#include <stdbool.h>
 
-typedef struct blkcache_stats {
-  size_t hits;
-  size_t misses;
-} blkcache_stats;
+/* Chunk store shared between nbdkit instances, used for cow-store.
+ * See sharedstore.c.  Chunks are numbered from 0.
+ */
+
+/* Open or create the store file.  Called from .config_complete. */
+extern int sharedstore_open (const char *path);
 
-extern blkcache *new_blkcache (size_t maxdepth);
-extern void free_blkcache (blkcache *) __attribute__((__nonnull__ (1)));
-extern char *get_block (blkcache *, uint64_t offset,
-                        uint64_t *start, uint64_t *size)
-  __attribute__((__nonnull__ (1, 3, 4)));
-extern int put_block (blkcache *, uint64_t start, uint64_t size, char *data)
-  __attribute__((__nonnull__ (1, 4)));
-extern void blkcache_get_stats (blkcache *, blkcache_stats *ret)
-  __attribute__((__nonnull__ (1, 2)));
+/* Close the store.  The caller must have dropped its references. */
+extern void sharedstore_close (void);
+
+/* Store a block, or find an existing chunk with the same contents,
+ * and take a reference to it.  *deduped is set if an existing chunk
+ * was used.
+ */
+extern int sharedstore_put (const uint8_t *block, uint32_t *c,
+                            bool *deduped, int *err)
+  __attribute__((__nonnull__ (1, 2, 3, 4)));
+
+/* Read a chunk that the caller holds a reference to. */
+extern int sharedstore_get (uint32_t c, uint8_t *block, int *err)
+  __attribute__((__nonnull__ (2, 3)));
+
+/* Drop a reference.  The chunk is freed when the last reference from
+ * any nbdkit instance goes away.
+ */
+extern void sharedstore_unref (uint32_t c);
 
-#endif /* NBDKIT_XZFILE_H */
+#endif /* NBDKIT_SHAREDSTORE_H */
@@ -0,0 +1,872 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Log structured overlay store, used when cow-compress or cow-dedup
+ * is set.  With cow-store the chunks are kept in a store shared with
+ * other nbdkit instances instead (see sharedstore.c), and only the
+ * block map below is used.
+ *
+ * Block contents ("chunks") are compressed and appended to a log in
+ * the temporary file.  The log is divided into fixed size segments.
+ * An in-memory block map points each block at the chunk holding its
+ * latest contents, and the chunk table records where each chunk is
+ * stored in the log and how many blocks refer to it.  Each segment
+ * keeps a summary of the chunks which were written to it.
+ *
+ * With cow-dedup, chunks are also entered in a hash table keyed on a
+ * hash of their uncompressed contents.  A write of a block which is
+ * already stored only adds a reference to the existing chunk.
+ * Because the hash is not cryptographic, a candidate chunk is read
+ * back and compared before it is shared.
+ *
+ * When the last reference to a chunk goes away it becomes garbage.
+ * When there is enough garbage, a background thread compacts the log
+ * by copying the live chunks out of the emptiest segments to the end
+ * of the log, then punching a hole in the old segment so the space is
+ * returned to the host filesystem and the segment can be reused.
+ *
+ * Blocks which are all zero are recorded in the map only.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined (__linux__) && !defined (FALLOC_FL_PUNCH_HOLE)
+#include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "iszero.h"
+
+#include "blk.h"
+#include "store.h"
+#include "sharedstore.h"
+
+/* Size of each segment of the log. */
+#define SEGSIZE (1024 * 1024)
+
+/* The block map is a two level table.  Each second level table
+ * covers 1024 blocks and is only allocated when one of its blocks is
+ * written.  Entries are the chunk number + 1, 0 for a block which
+ * has not been written, or ZERO_ENTRY.
+ */
+#define L2_BITS 10
+#define L2_SIZE (UINT64_C(1) << L2_BITS)
+#define ZERO_ENTRY UINT32_MAX
+
+/* End of a hash chain or of the chunk free list. */
+#define NO_CHUNK UINT32_MAX
+
+/* A chunk of length BLKSIZE is stored uncompressed. */
+struct chunk {
+  uint64_t offset;              /* Offset in the log. */
+  uint64_t hash;                /* Only set with cow-dedup. */
+  uint32_t len;                 /* Length in the log. */
+  uint32_t refs;                /* 0 if the chunk is free. */
+  uint32_t next;                /* Hash chain, or free list. */
+};
+
+struct segment {
+  uint32_t used;                /* Bytes appended to this segment. */
+  uint32_t live;                /* Bytes of chunks still referenced. */
+  bool free;
+  uint32_t *chunks;             /* Chunks written to this segment. */
+  size_t nr_chunks, alloc_chunks;
+};
+
+enum cow_compress cow_compress = COW_COMPRESS_NONE;
+bool cow_dedup;
+const char *cow_store;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int fd = -1;
+
+static uint32_t **map;
+static size_t map_len;          /* Number of second level tables. */
+
+static struct chunk *chunks;
+static uint32_t nr_chunks, alloc_chunks;
+static uint32_t free_chunk = NO_CHUNK;
+
+/* Hash table of chunks for cow-dedup.  The number of buckets is a
+ * power of 2 and is doubled when there are more live chunks than
+ * buckets.
+ */
+static uint32_t *buckets;
+static size_t nr_buckets;
+static size_t nr_hashed;
+
+static struct segment *segs;
+static size_t nr_segs;
+static size_t open_seg = SIZE_MAX;
+static uint64_t total_used, total_live;
+static uint64_t bytes_written, bytes_compressed, bytes_deduped;
+
+static pthread_t compact_thread;
+static bool compact_started, compact_quit;
+
+/* Buffers for a compressed record and for comparing chunks.  They
+ * are only used with the lock held.
+ */
+static uint8_t *rec_buf, *other_buf;
+
+int
+store_init (int fd_)
+{
+  fd = fd_;
+  rec_buf = malloc (BLKSIZE);
+  other_buf = malloc (BLKSIZE);
+  if (rec_buf == NULL || other_buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  return 0;
+}
+
+int
+store_open_shared (void)
+{
+  if (cow_store == NULL)
+    return 0;
+  if (cow_compress != COW_COMPRESS_NONE || cow_dedup) {
+    nbdkit_error ("cow-store cannot be used with cow-compress or cow-dedup");
+    return -1;
+  }
+  return sharedstore_open (cow_store);
+}
+
+void
+store_free (void)
+{
+  size_t i;
+
+  if (compact_started) {
+    pthread_mutex_lock (&lock);
+    compact_quit = true;
+    pthread_cond_signal (&compact_cond);
+    pthread_mutex_unlock (&lock);
+    pthread_join (compact_thread, NULL);
+  }
+
+  /* Drop this instance's references to the shared store. */
+  if (cow_store) {
+    for (i = 0; i < map_len; ++i) {
+      size_t j;
+
+      if (map[i] == NULL)
+        continue;
+      for (j = 0; j < L2_SIZE; ++j) {
+        if (map[i][j] != 0 && map[i][j] != ZERO_ENTRY)
+          sharedstore_unref (map[i][j] - 1);
+      }
+    }
+    sharedstore_close ();
+  }
+
+  if (bytes_written > 0)
+    nbdkit_debug ("cow: stored %" PRIu64 " bytes written as %" PRIu64 ", "
+                  "%" PRIu64 " bytes deduplicated, "
+                  "log has %" PRIu64 " live bytes in %" PRIu64 " bytes",
+                  bytes_written, bytes_compressed, bytes_deduped,
+                  total_live, total_used);
+
+  for (i = 0; i < map_len; ++i)
+    free (map[i]);
+  free (map);
+  free (chunks);
+  free (buckets);
+  for (i = 0; i < nr_segs; ++i)
+    free (segs[i].chunks);
+  free (segs);
+  free (rec_buf);
+  free (other_buf);
+}
+
+static uint32_t
+get_entry (uint64_t blknum)
+{
+  uint64_t i = blknum >> L2_BITS;
+
+  if (i >= map_len || map[i] == NULL)
+    return 0;
+  return map[i][blknum & (L2_SIZE-1)];
+}
+
+static int
+set_entry (uint64_t blknum, uint32_t e)
+{
+  uint64_t i = blknum >> L2_BITS;
+
+  if (i >= map_len) {
+    nbdkit_error ("cow: block %" PRIu64 " is beyond the end of the map",
+                  blknum);
+    return -1;
+  }
+  if (map[i] == NULL) {
+    map[i] = calloc (L2_SIZE, sizeof (uint32_t));
+    if (map[i] == NULL) {
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+  }
+  map[i][blknum & (L2_SIZE-1)] = e;
+  return 0;
+}
+
+/* A 64 bit hash of a block, using the xxHash64 round function over
+ * four lanes.  It only has to be fast and well distributed, since
+ * matches are always verified.
+ */
+#define PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+
+static inline uint64_t
+rotl64 (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t
+hash_block (const uint8_t *block)
+{
+  uint64_t h[4] = { PRIME64_1 + PRIME64_2, PRIME64_2, 0, -PRIME64_1 };
+  uint64_t w, r;
+  size_t i, j;
+
+  for (i = 0; i < BLKSIZE; i += 32) {
+    for (j = 0; j < 4; ++j) {
+      memcpy (&w, &block[i + j*8], 8);
+      h[j] = rotl64 (h[j] + w * PRIME64_2, 31) * PRIME64_1;
+    }
+  }
+
+  r = rotl64 (h[0], 1) + rotl64 (h[1], 7) + rotl64 (h[2], 12) +
+    rotl64 (h[3], 18);
+  r ^= r >> 33;
+  r *= PRIME64_2;
+  r ^= r >> 29;
+  return r;
+}
+
+static void
+hash_insert (uint32_t c)
+{
+  size_t b = chunks[c].hash & (nr_buckets-1);
+
+  chunks[c].next = buckets[b];
+  buckets[b] = c;
+  nr_hashed++;
+}
+
+static void
+hash_remove (uint32_t c)
+{
+  uint32_t *p = &buckets[chunks[c].hash & (nr_buckets-1)];
+
+  while (*p != c)
+    p = &chunks[*p].next;
+  *p = chunks[c].next;
+  nr_hashed--;
+}
+
+/* Make sure there is room in the hash table for one more chunk. */
+static int
+hash_reserve (void)
+{
+  uint32_t *old = buckets;
+  size_t old_nr = nr_buckets, n, i;
+  uint32_t c, next;
+
+  if (nr_hashed < nr_buckets)
+    return 0;
+
+  n = nr_buckets ? nr_buckets * 2 : 1024;
+  buckets = malloc (n * sizeof (uint32_t));
+  if (buckets == NULL) {
+    nbdkit_error ("malloc: %m");
+    buckets = old;
+    return -1;
+  }
+  for (i = 0; i < n; ++i)
+    buckets[i] = NO_CHUNK;
+  nr_buckets = n;
+  nr_hashed = 0;
+
+  for (i = 0; i < old_nr; ++i) {
+    for (c = old[i]; c != NO_CHUNK; c = next) {
+      next = chunks[c].next;
+      hash_insert (c);
+    }
+  }
+  free (old);
+  return 0;
+}
+
+static int
+alloc_chunk (uint32_t *c)
+{
+  struct chunk *new_chunks;
+  uint32_t n;
+
+  if (free_chunk != NO_CHUNK) {
+    *c = free_chunk;
+    free_chunk = chunks[*c].next;
+    return 0;
+  }
+
+  if (nr_chunks == alloc_chunks) {
+    n = alloc_chunks ? alloc_chunks * 2 : 1024;
+    if (n >= NO_CHUNK) {
+      nbdkit_error ("cow: too many chunks in the overlay");
+      return -1;
+    }
+    new_chunks = realloc (chunks, n * sizeof (struct chunk));
+    if (new_chunks == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    chunks = new_chunks;
+    alloc_chunks = n;
+  }
+  *c = nr_chunks++;
+  return 0;
+}
+
+/* Drop a reference to the chunk in map entry e. */
+static void
+unref_entry (uint32_t e)
+{
+  struct chunk *ch;
+
+  if (e == 0 || e == ZERO_ENTRY)
+    return;
+  if (cow_store) {
+    sharedstore_unref (e-1);
+    return;
+  }
+  ch = &chunks[e-1];
+  if (--ch->refs > 0)
+    return;
+
+  segs[ch->offset / SEGSIZE].live -= ch->len;
+  total_live -= ch->len;
+  if (cow_dedup)
+    hash_remove (e-1);
+  ch->next = free_chunk;
+  free_chunk = e-1;
+}
+
+int
+store_set_size (uint64_t nr_blocks)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  size_t new_len = (nr_blocks + L2_SIZE - 1) >> L2_BITS;
+  uint32_t **new_map;
+  size_t i, j;
+
+  /* Drop blocks beyond the new end. */
+  for (i = 0; i < map_len; ++i) {
+    if (map[i] == NULL)
+      continue;
+    for (j = 0; j < L2_SIZE; ++j) {
+      if ((i << L2_BITS) + j >= nr_blocks) {
+        unref_entry (map[i][j]);
+        map[i][j] = 0;
+      }
+    }
+    if (i >= new_len) {
+      free (map[i]);
+      map[i] = NULL;
+    }
+  }
+
+  if (new_len != map_len) {
+    new_map = realloc (map, new_len * sizeof (uint32_t *));
+    if (new_map == NULL && new_len > 0) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    map = new_map;
+    for (i = map_len; i < new_len; ++i)
+      map[i] = NULL;
+    map_len = new_len;
+  }
+
+  return 0;
+}
+
+/* Compress a block into out (which is BLKSIZE bytes).  Returns the
+ * length, which is BLKSIZE if the block did not compress and was
+ * copied.
+ */
+static uint32_t
+compress_block (const uint8_t *block, uint8_t *out)
+{
+  switch (cow_compress) {
+#ifdef HAVE_ZLIB
+  case COW_COMPRESS_ZLIB: {
+    uLongf len = BLKSIZE - 1;
+
+    if (compress2 (out, &len, block, BLKSIZE, Z_BEST_SPEED) == Z_OK)
+      return len;
+    break;
+  }
+#endif
+#ifdef HAVE_LIBZSTD
+  case COW_COMPRESS_ZSTD: {
+    size_t len = ZSTD_compress (out, BLKSIZE - 1, block, BLKSIZE, 1);
+
+    if (!ZSTD_isError (len))
+      return len;
+    break;
+  }
+#endif
+  default:
+    break;
+  }
+
+  memcpy (out, block, BLKSIZE);
+  return BLKSIZE;
+}
+
+static int
+decompress_block (const uint8_t *in, uint32_t len, uint8_t *block)
+{
+  if (len == BLKSIZE) {
+    memcpy (block, in, BLKSIZE);
+    return 0;
+  }
+
+  switch (cow_compress) {
+#ifdef HAVE_ZLIB
+  case COW_COMPRESS_ZLIB: {
+    uLongf out_len = BLKSIZE;
+
+    if (uncompress (block, &out_len, in, len) == Z_OK && out_len == BLKSIZE)
+      return 0;
+    break;
+  }
+#endif
+#ifdef HAVE_LIBZSTD
+  case COW_COMPRESS_ZSTD: {
+    size_t out_len = ZSTD_decompress (block, BLKSIZE, in, len);
+
+    if (!ZSTD_isError (out_len) && out_len == BLKSIZE)
+      return 0;
+    break;
+  }
+#endif
+  default:
+    break;
+  }
+
+  nbdkit_error ("cow: could not uncompress block from overlay");
+  return -1;
+}
+
+/* Read and uncompress a chunk. */
+static int
+read_chunk (uint32_t c, uint8_t *block, int *err)
+{
+  uint32_t len = chunks[c].len;
+  ssize_t r;
+
+  r = pread (fd, rec_buf, len, chunks[c].offset);
+  if (r != len) {
+    if (r >= 0)
+      errno = EIO;
+    *err = errno;
+    nbdkit_error ("pread: %m");
+    return -1;
+  }
+  if (decompress_block (rec_buf, len, block) == -1) {
+    *err = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* Start a new segment, reusing a free one if possible. */
+static int
+new_segment (void)
+{
+  struct segment *new_segs;
+  size_t i;
+
+  for (i = 0; i < nr_segs; ++i) {
+    if (segs[i].free) {
+      segs[i].free = false;
+      open_seg = i;
+      return 0;
+    }
+  }
+
+  new_segs = realloc (segs, (nr_segs+1) * sizeof (struct segment));
+  if (new_segs == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  segs = new_segs;
+  memset (&segs[nr_segs], 0, sizeof (struct segment));
+  open_seg = nr_segs++;
+  return 0;
+}
+
+/* Append a record to the log, and point chunk c at it. */
+static int
+append_record (uint32_t c, const uint8_t *rec, uint32_t len, int *err)
+{
+  struct segment *seg;
+  uint64_t offset;
+  uint32_t *p;
+
+  if (open_seg == SIZE_MAX || segs[open_seg].used + len > SEGSIZE) {
+    if (new_segment () == -1) {
+      *err = ENOMEM;
+      return -1;
+    }
+  }
+  seg = &segs[open_seg];
+
+  if (seg->nr_chunks == seg->alloc_chunks) {
+    size_t n = seg->alloc_chunks ? seg->alloc_chunks * 2 : 64;
+
+    p = realloc (seg->chunks, n * sizeof (uint32_t));
+    if (p == NULL) {
+      *err = errno;
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    seg->chunks = p;
+    seg->alloc_chunks = n;
+  }
+
+  offset = (uint64_t) open_seg * SEGSIZE + seg->used;
+  if (pwrite (fd, rec, len, offset) != len) {
+    *err = errno;
+    nbdkit_error ("pwrite: %m");
+    return -1;
+  }
+
+  chunks[c].offset = offset;
+  chunks[c].len = len;
+  seg->chunks[seg->nr_chunks++] = c;
+  seg->used += len;
+  seg->live += len;
+  total_used += len;
+  total_live += len;
+  return 0;
+}
+
+/* Look for a stored chunk with the same contents as block. */
+static int
+find_duplicate (const uint8_t *block, uint64_t hash, uint32_t *c_rtn,
+                int *err)
+{
+  uint32_t c;
+
+  for (c = buckets[hash & (nr_buckets-1)]; c != NO_CHUNK;
+       c = chunks[c].next) {
+    if (chunks[c].hash != hash)
+      continue;
+    if (read_chunk (c, other_buf, err) == -1)
+      return -1;
+    if (memcmp (block, other_buf, BLKSIZE) == 0) {
+      *c_rtn = c;
+      return 0;
+    }
+  }
+
+  *c_rtn = NO_CHUNK;
+  return 0;
+}
+
+/* Is there enough garbage to make compaction worthwhile? */
+static bool
+need_compaction (void)
+{
+  uint64_t garbage = total_used - total_live;
+
+  return garbage >= 4 * SEGSIZE && garbage >= total_used / 4;
+}
+
+int
+store_read (uint64_t blknum, uint8_t *block, int *err)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  uint32_t e = get_entry (blknum);
+
+  if (e == ZERO_ENTRY) {
+    memset (block, 0, BLKSIZE);
+    return 0;
+  }
+  if (e == 0) {
+    *err = EIO;
+    nbdkit_error ("cow: block %" PRIu64 " is not in the overlay", blknum);
+    return -1;
+  }
+
+  if (cow_store)
+    return sharedstore_get (e-1, block, err);
+  return read_chunk (e-1, block, err);
+}
+
+int
+store_write (uint64_t blknum, const uint8_t *block, int *err)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  uint32_t old = get_entry (blknum);
+  uint64_t hash = 0;
+  uint32_t c, len;
+  bool deduped;
+
+  /* Make sure the second level table is allocated, so that the
+   * calls to set_entry below cannot fail.
+   */
+  if (set_entry (blknum, old) == -1) {
+    *err = ENOMEM;
+    return -1;
+  }
+
+  bytes_written += BLKSIZE;
+
+  if (is_zero ((const char *) block, BLKSIZE)) {
+    set_entry (blknum, ZERO_ENTRY);
+    unref_entry (old);
+    return 0;
+  }
+
+  if (cow_store) {
+    /* Take the new reference before dropping the old one, in case
+     * the block is being rewritten with the same contents.
+     */
+    if (sharedstore_put (block, &c, &deduped, err) == -1)
+      return -1;
+    set_entry (blknum, c+1);
+    unref_entry (old);
+    if (deduped)
+      bytes_deduped += BLKSIZE;
+    else
+      bytes_compressed += BLKSIZE;
+    return 0;
+  }
+
+  if (cow_dedup) {
+    if (hash_reserve () == -1) {
+      *err = ENOMEM;
+      return -1;
+    }
+    hash = hash_block (block);
+    if (find_duplicate (block, hash, &c, err) == -1)
+      return -1;
+    if (c != NO_CHUNK) {
+      /* Take the new reference before dropping the old one, in case
+       * the block is being rewritten with the same contents.
+       */
+      set_entry (blknum, c+1);
+      chunks[c].refs++;
+      unref_entry (old);
+      bytes_deduped += BLKSIZE;
+      return 0;
+    }
+  }
+
+  if (alloc_chunk (&c) == -1) {
+    *err = ENOMEM;
+    return -1;
+  }
+  len = compress_block (block, rec_buf);
+  if (append_record (c, rec_buf, len, err) == -1) {
+    chunks[c].next = free_chunk;
+    free_chunk = c;
+    return -1;
+  }
+  set_entry (blknum, c+1);
+  chunks[c].refs = 1;
+  chunks[c].hash = hash;
+  if (cow_dedup)
+    hash_insert (c);
+  bytes_compressed += len;
+
+  unref_entry (old);
+  if (compact_started && need_compaction ())
+    pthread_cond_signal (&compact_cond);
+  return 0;
+}
+
+/* Choose the segment with the least live data, which isn't the one
+ * currently being appended to.  Returns SIZE_MAX if no segment would
+ * free much space.
+ */
+static size_t
+pick_victim (void)
+{
+  size_t i, victim = SIZE_MAX;
+
+  for (i = 0; i < nr_segs; ++i) {
+    if (segs[i].free || i == open_seg || segs[i].used == 0)
+      continue;
+    if (victim == SIZE_MAX || segs[i].live < segs[victim].live)
+      victim = i;
+  }
+  if (victim != SIZE_MAX && segs[victim].live > SEGSIZE / 2)
+    return SIZE_MAX;
+  return victim;
+}
+
+/* Move the live chunks out of a segment and free it.  Called with
+ * the lock held.  Since blocks refer to chunks, only the chunk table
+ * has to be updated, not the block map.
+ */
+static int
+compact_segment (size_t victim, uint8_t *buf)
+{
+  struct segment *seg = &segs[victim];
+  uint64_t start = (uint64_t) victim * SEGSIZE;
+  size_t i;
+  int err;
+
+  if (seg->live > 0) {
+    if (pread (fd, buf, seg->used, start) != seg->used) {
+      nbdkit_error ("cow: compaction: pread: %m");
+      return -1;
+    }
+
+    for (i = 0; i < seg->nr_chunks; ++i) {
+      uint32_t c = seg->chunks[i];
+      uint64_t offset = chunks[c].offset;
+      uint32_t len = chunks[c].len;
+
+      /* Skip chunks which were freed, or freed and reused elsewhere. */
+      if (chunks[c].refs == 0 || offset < start || offset >= start + SEGSIZE)
+        continue;
+
+      if (append_record (c, &buf[offset - start], len, &err) == -1)
+        return -1;
+      /* append_record may have reallocated segs. */
+      segs[victim].live -= len;
+      total_live -= len;
+    }
+  }
+
+  seg = &segs[victim];
+  total_used -= seg->used;
+  seg->used = seg->live = 0;
+  free (seg->chunks);
+  seg->chunks = NULL;
+  seg->nr_chunks = seg->alloc_chunks = 0;
+  seg->free = true;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  /* Give the space back to the host filesystem. */
+  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                 start, SEGSIZE) == -1)
+    nbdkit_debug ("cow: compaction: fallocate: %m");
+#endif
+  return 0;
+}
+
+static void *
+compact_thread_fn (void *vp)
+{
+  uint8_t *buf;
+  size_t victim;
+
+  buf = malloc (SEGSIZE);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    while (!compact_quit &&
+           (!need_compaction () || (victim = pick_victim ()) == SIZE_MAX))
+      pthread_cond_wait (&compact_cond, &lock);
+    if (compact_quit)
+      break;
+
+    if (compact_segment (victim, buf) == -1) {
+      nbdkit_error ("cow: compaction of the overlay stopped");
+      break;
+    }
+
+    /* Let requests in between segments. */
+    pthread_mutex_unlock (&lock);
+    pthread_mutex_lock (&lock);
+  }
+  pthread_mutex_unlock (&lock);
+
+  free (buf);
+  return NULL;
+}
+
+int
+store_start_compaction (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  int err;
+
+  /* The shared store frees chunks as soon as they are unused. */
+  if (compact_started || cow_store)
+    return 0;
+
+  err = pthread_create (&compact_thread, NULL, compact_thread_fn, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  compact_started = true;
+  return 0;
+}
@@ -0,0 +1,103 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_STORE_H
+#define NBDKIT_STORE_H
+
+#include <stdint.h>
+
+#include <stdbool.h>
+
+/* Compression used for the overlay, set by the cow-compress
+ * parameter.
+ */
+enum cow_compress {
+  COW_COMPRESS_NONE,
+  COW_COMPRESS_ZLIB,
+  COW_COMPRESS_ZSTD,
+};
+extern enum cow_compress cow_compress;
+
+/* Share identical blocks in the overlay, set by cow-dedup. */
+extern bool cow_dedup;
+
+/* Path of the chunk store shared with other nbdkit instances, set by
+ * cow-store, or NULL.
+ */
+extern const char *cow_store;
+
+/* If neither compression nor deduplication is used the overlay is a
+ * sparse file indexed by block number (see blk.c) and the other
+ * store_* functions are not used.
+ */
+static inline bool
+store_in_use (void)
+{
+  return cow_compress != COW_COMPRESS_NONE || cow_dedup || cow_store;
+}
+
+/* Use the temporary file fd for the compressed store. */
+extern int store_init (int fd);
+
+/* Open the shared store if cow-store was set.  Called from
+ * .config_complete.
+ */
+extern int store_open_shared (void);
+
+/* Stop compaction and free the block map and chunk table. */
+extern void store_free (void);
+
+/* Start the background compaction thread.  This must be called after
+ * nbdkit has forked.  Calling it again does nothing.
+ */
+extern int store_start_compaction (void);
+
+/*----------------------------------------------------------------------
+ * The functions below are called with the lock in cow.c held.
+ */
+
+/* Resize the block map. */
+extern int store_set_size (uint64_t nr_blocks);
+
+/* Read or write a single block in the store.  Reading a block which
+ * was never written is an error, blk.c uses the bitmap to avoid it.
+ */
+extern int store_read (uint64_t blknum, uint8_t *block, int *err)
+  __attribute__((__nonnull__ (2, 3)));
+extern int store_write (uint64_t blknum, const uint8_t *block, int *err)
+  __attribute__((__nonnull__ (2, 3)));
+
+/* A fast 64 bit hash of a block, used to find identical blocks. */
+extern uint64_t hash_block (const uint8_t *block)
+  __attribute__((__nonnull__ (1)));
+
+#endif /* NBDKIT_STORE_H */
@@ -150,6 +150,9 @@ rate_config_complete (nbdkit_next_config_complete *next, void *nxdata)
   /* Initialize the global buckets. */
   bucket_init (&read_bucket, rate, BUCKET_CAPACITY);
   bucket_init (&write_bucket, rate, BUCKET_CAPACITY);
+  if (rate > 0)
+    nbdkit_set_gauge ("rate_bits_per_second",
+                      "Current total bandwidth limit.", rate);
 
   return next (nxdata);
 }
@@ -237,9 +240,13 @@ maybe_adjust (const char *file, struct bucket *bucket, pthread_mutex_t *lock)
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (lock);
   old_rate = bucket_adjust_rate (bucket, new_rate);
 
-  if (old_rate != new_rate)
+  if (old_rate != new_rate) {
     nbdkit_debug ("rate adjusted from %" PRIu64 " to %" PRIi64,
                   old_rate, new_rate);
+    if (file == rate_file)
+      nbdkit_set_gauge ("rate_bits_per_second",
+                        "Current total bandwidth limit.", new_rate);
+  }
 }
 
 static inline int
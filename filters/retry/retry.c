@@ -49,6 +49,8 @@ static unsigned initial_delay = 2;
 static bool exponential_backoff = true;
 static bool force_readonly = false;
 
+static uint64_t total_retries;  /* published as a metrics gauge */
+
 /* Currently next_ops->reopen is not safe if another thread makes a
  * request on the same connection (but on other connections it's OK).
  * To work around this for now we limit the thread model here, but
@@ -190,6 +192,10 @@ do_retry (struct retry_handle *h,
     return false;
   }
 
+  nbdkit_set_gauge ("retry_retries",
+                    "Number of times a request has been retried.",
+                    __atomic_add_fetch (&total_retries, 1, __ATOMIC_RELAXED));
+
   /* Update *data in case we are called again. */
   data->retry++;
   if (exponential_backoff)
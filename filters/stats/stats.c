@@ -38,7 +38,8 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
-#include <sys/time.h>
+#include <errno.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -47,21 +48,195 @@
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "minmax.h"
 #include "tvdiff.h"
 
 static char *filename;
 static bool append;
+static unsigned interval;       /* statsinterval, 0 = only at exit */
 static FILE *fp;
-static struct timeval start_t;
+static struct timespec start_t; /* CLOCK_MONOTONIC */
+
+/* Operation latencies are recorded in a log-linear (HDR-style)
+ * histogram of microseconds.  Each power of 2 is divided into
+ * 1 << SUB_BITS linear sub-buckets, so the relative error of any
+ * percentile is bounded by 1/16 regardless of magnitude, while values
+ * below 16us are recorded exactly.  Anything longer than
+ * 2^(MAX_EXP+1) us (about 38 hours) lands in the last bucket.
+ */
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_EXP 36
+#define NR_BUCKETS ((MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS)
+
+enum op { OP_READ, OP_WRITE, OP_TRIM, OP_ZERO, OP_EXTENTS, OP_CACHE, NR_OPS };
+
+static const char *op_names[NR_OPS] = {
+  [OP_READ] = "read", [OP_WRITE] = "write", [OP_TRIM] = "trim",
+  [OP_ZERO] = "zero", [OP_EXTENTS] = "extents", [OP_CACHE] = "cache",
+};
+
+struct opstats {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t max_usecs;
+  uint64_t hist[NR_BUCKETS];
+};
 
-/* This lock protects all the stats. */
+/* Each thread which handles requests has its own set of counters.
+ * They are only ever written by the owning thread, so the fast path
+ * takes no locks: stores are relaxed atomics which let a concurrent
+ * reader (the exit or periodic snapshot) see untorn values, and the
+ * reader simply sums all threads.
+ */
+struct threadstats {
+  struct threadstats *next;
+  struct opstats op[NR_OPS];
+};
+
+static pthread_key_t stats_key;
+
+/* This lock protects the list of per-thread counters (not the
+ * counters themselves) and the totals inherited from threads which
+ * have exited.
+ */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static uint64_t pread_ops, pread_bytes;
-static uint64_t pwrite_ops, pwrite_bytes;
-static uint64_t trim_ops, trim_bytes;
-static uint64_t zero_ops, zero_bytes;
-static uint64_t extents_ops, extents_bytes;
-static uint64_t cache_ops, cache_bytes;
+static struct threadstats *threads;
+static struct threadstats retired;
+
+/* Background thread writing periodic snapshots. */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond; /* Uses CLOCK_MONOTONIC. */
+static bool snapshot_started, snapshot_quit;
+static pthread_t snapshot_thread;
+
+static inline unsigned
+bucket_of (uint64_t usecs)
+{
+  unsigned e;
+
+  if (usecs < SUB_BUCKETS)
+    return usecs;
+  e = 63 - __builtin_clzll (usecs);
+  if (e > MAX_EXP)
+    return NR_BUCKETS - 1;
+  return (e - SUB_BITS + 1) * SUB_BUCKETS +
+    ((usecs >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Largest value which maps to bucket b. */
+static inline uint64_t
+bucket_max (unsigned b)
+{
+  unsigned e, sub;
+
+  if (b < SUB_BUCKETS)
+    return b;
+  e = b / SUB_BUCKETS + SUB_BITS - 1;
+  sub = b % SUB_BUCKETS;
+  return (((uint64_t) SUB_BUCKETS + sub + 1) << (e - SUB_BITS)) - 1;
+}
+
+static void
+add_opstats (struct opstats *to, const struct opstats *from)
+{
+  size_t i;
+  uint64_t v;
+
+  to->ops += __atomic_load_n (&from->ops, __ATOMIC_RELAXED);
+  to->bytes += __atomic_load_n (&from->bytes, __ATOMIC_RELAXED);
+  v = __atomic_load_n (&from->max_usecs, __ATOMIC_RELAXED);
+  if (v > to->max_usecs)
+    to->max_usecs = v;
+  for (i = 0; i < NR_BUCKETS; ++i)
+    to->hist[i] += __atomic_load_n (&from->hist[i], __ATOMIC_RELAXED);
+}
+
+/* Called when a thread exits: fold its counters into the retired
+ * totals so they are not lost.
+ */
+static void
+free_threadstats (void *vp)
+{
+  struct threadstats *ts = vp, **pp;
+  size_t i;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (pp = &threads; *pp; pp = &(*pp)->next) {
+    if (*pp == ts) {
+      *pp = ts->next;
+      break;
+    }
+  }
+  for (i = 0; i < NR_OPS; ++i)
+    add_opstats (&retired.op[i], &ts->op[i]);
+  free (ts);
+}
+
+static struct threadstats *
+get_threadstats (void)
+{
+  struct threadstats *ts;
+
+  ts = pthread_getspecific (stats_key);
+  if (ts)
+    return ts;
+
+  ts = calloc (1, sizeof *ts);
+  if (ts == NULL) {
+    nbdkit_debug ("stats: calloc: %m");
+    return NULL;
+  }
+  pthread_setspecific (stats_key, ts);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  ts->next = threads;
+  threads = ts;
+  return ts;
+}
+
+static void
+record (enum op op, uint64_t bytes, const struct timespec *start)
+{
+  struct timespec end;
+  struct threadstats *ts;
+  struct opstats *s;
+  int64_t usecs;
+  unsigned b;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  usecs = tsdiff_usec (start, &end);
+
+  ts = get_threadstats ();
+  if (ts == NULL)
+    return;
+  s = &ts->op[op];
+  b = bucket_of (usecs);
+
+  __atomic_store_n (&s->ops, s->ops + 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&s->bytes, s->bytes + bytes, __ATOMIC_RELAXED);
+  __atomic_store_n (&s->hist[b], s->hist[b] + 1, __ATOMIC_RELAXED);
+  if ((uint64_t) usecs > s->max_usecs)
+    __atomic_store_n (&s->max_usecs, usecs, __ATOMIC_RELAXED);
+}
+
+/* Latency below which the fraction q of operations completed. */
+static uint64_t
+percentile (const struct opstats *s, double q)
+{
+  uint64_t target, sum = 0;
+  unsigned b;
+
+  target = (uint64_t) (q * s->ops);
+  if (target < q * s->ops || target == 0)
+    target++;
+  for (b = 0; b < NR_BUCKETS; ++b) {
+    sum += s->hist[b];
+    if (sum >= target)
+      return MIN (bucket_max (b), s->max_usecs);
+  }
+  return s->max_usecs;
+}
 
 static inline double
 calc_bps (uint64_t bytes, int64_t usecs)
@@ -69,49 +244,129 @@ calc_bps (uint64_t bytes, int64_t usecs)
   return 8.0 * bytes / usecs * 1000000.;
 }
 
-static inline void
+static void
 print_stats (int64_t usecs)
 {
+  struct threadstats *totals;
+  const struct threadstats *ts;
+  size_t i;
+
+  totals = malloc (sizeof *totals);
+  if (totals == NULL) {
+    nbdkit_debug ("stats: malloc: %m");
+    return;
+  }
+
+  pthread_mutex_lock (&lock);
+  memcpy (totals, &retired, sizeof *totals);
+  for (ts = threads; ts; ts = ts->next)
+    for (i = 0; i < NR_OPS; ++i)
+      add_opstats (&totals->op[i], &ts->op[i]);
+  pthread_mutex_unlock (&lock);
+
   fprintf (fp, "elapsed time: %g s\n", usecs / 1000000.);
 
-  if (pread_ops > 0)
-    fprintf (fp, "read: %" PRIu64 " ops, %" PRIu64 " bytes, %g bits/s\n",
-             pread_ops, pread_bytes, calc_bps (pread_bytes, usecs));
-  if (pwrite_ops > 0)
-    fprintf (fp, "write: %" PRIu64 " ops, %" PRIu64 " bytes, %g bits/s\n",
-             pwrite_ops, pwrite_bytes, calc_bps (pwrite_bytes, usecs));
-  if (trim_ops > 0)
-    fprintf (fp, "trim: %" PRIu64 " ops, %" PRIu64 " bytes, %g bits/s\n",
-             trim_ops, trim_bytes, calc_bps (trim_bytes, usecs));
-  if (zero_ops > 0)
-    fprintf (fp, "zero: %" PRIu64 " ops, %" PRIu64 " bytes, %g bits/s\n",
-             zero_ops, zero_bytes, calc_bps (zero_bytes, usecs));
-  if (extents_ops > 0)
-    fprintf (fp, "extents: %" PRIu64 " ops, %" PRIu64 " bytes, %g bits/s\n",
-             extents_ops, extents_bytes, calc_bps (extents_bytes, usecs));
-  if (cache_ops > 0)
-    fprintf (fp, "cache: %" PRIu64 " ops, %" PRIu64 " bytes, %g bits/s\n",
-             cache_ops, cache_bytes, calc_bps (cache_bytes, usecs));
+  for (i = 0; i < NR_OPS; ++i) {
+    const struct opstats *s = &totals->op[i];
+
+    if (s->ops == 0)
+      continue;
+    fprintf (fp, "%s: %" PRIu64 " ops, %" PRIu64 " bytes, %g bits/s\n",
+             op_names[i], s->ops, s->bytes, calc_bps (s->bytes, usecs));
+    fprintf (fp, "  latency: "
+             "p50 %" PRIu64 " us, p99 %" PRIu64 " us, "
+             "p999 %" PRIu64 " us, max %" PRIu64 " us\n",
+             percentile (s, 0.5), percentile (s, 0.99),
+             percentile (s, 0.999), s->max_usecs);
+  }
 
   fflush (fp);
+  free (totals);
+}
+
+static void *
+snapshot_loop (void *vp)
+{
+  struct timespec deadline;
+  struct timespec now;
+  int64_t usecs;
+
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+
+  pthread_mutex_lock (&snapshot_lock);
+  while (!snapshot_quit) {
+    deadline.tv_sec += interval;
+    while (!snapshot_quit &&
+           pthread_cond_timedwait (&snapshot_cond, &snapshot_lock,
+                                   &deadline) != ETIMEDOUT)
+      ;
+    if (snapshot_quit)
+      break;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    usecs = tsdiff_usec (&start_t, &now);
+    if (usecs > 0) {
+      print_stats (usecs);
+      fputc ('\n', fp);
+    }
+  }
+  pthread_mutex_unlock (&snapshot_lock);
+
+  return NULL;
+}
+
+static void
+stats_load (void)
+{
+  pthread_condattr_t attr;
+  int err;
+
+  err = pthread_key_create (&stats_key, free_threadstats);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_key_create: %m");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Snapshots are timed with the same clock as the statistics. */
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&snapshot_cond, &attr);
+  pthread_condattr_destroy (&attr);
 }
 
 static void
 stats_unload (void)
 {
-  struct timeval now;
+  struct timespec now;
   int64_t usecs;
+  struct threadstats *ts;
+
+  if (snapshot_started) {
+    pthread_mutex_lock (&snapshot_lock);
+    snapshot_quit = true;
+    pthread_cond_signal (&snapshot_cond);
+    pthread_mutex_unlock (&snapshot_lock);
+    pthread_join (snapshot_thread, NULL);
+  }
 
-  gettimeofday (&now, NULL);
-  usecs = tvdiff_usec (&start_t, &now);
-  if (fp && usecs > 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  usecs = tsdiff_usec (&start_t, &now);
+  if (fp && usecs > 0)
     print_stats (usecs);
-  }
 
   if (fp)
     fclose (fp);
   free (filename);
+
+  /* Any threads still registered will never run the destructor once
+   * the key is deleted, so free their counters here.
+   */
+  pthread_key_delete (stats_key);
+  while ((ts = threads) != NULL) {
+    threads = ts->next;
+    free (ts);
+  }
 }
 
 static int
@@ -134,6 +389,11 @@ stats_config (nbdkit_next_config *next, void *nxdata,
     append = r;
     return 0;
   }
+  else if (strcmp (key, "statsinterval") == 0) {
+    if (nbdkit_parse_unsigned ("statsinterval", value, &interval) == -1)
+      return -1;
+    return 0;
+  }
 
   return next (nxdata, key, value);
 }
@@ -167,14 +427,43 @@ stats_config_complete (nbdkit_next_config_complete *next, void *nxdata)
     return -1;
   }
 
-  gettimeofday (&start_t, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start_t);
 
   return next (nxdata);
 }
 
 #define stats_config_help \
-  "statsfile=<FILE>    (required) The file to place the log in.\n" \
-  "statsappend=<BOOL>  True to append to the log (default false).\n"
+  "statsfile=<FILE>      (required) The file to place the log in.\n" \
+  "statsappend=<BOOL>    True to append to the log (default false).\n" \
+  "statsinterval=<SECS>  Also write the stats every SECS seconds.\n"
+
+/* The snapshot thread cannot be started from .config_complete because
+ * nbdkit may fork into the background afterwards, so start it when
+ * the first client connects.
+ */
+static void *
+stats_open (nbdkit_next_open *next, void *nxdata, int readonly)
+{
+  int err;
+
+  if (next (nxdata, readonly) == -1)
+    return NULL;
+
+  if (interval > 0) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&snapshot_lock);
+    if (!snapshot_started) {
+      err = pthread_create (&snapshot_thread, NULL, snapshot_loop, NULL);
+      if (err) {
+        errno = err;
+        nbdkit_error ("pthread_create: %m");
+        return NULL;
+      }
+      snapshot_started = true;
+    }
+  }
+
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
 
 /* Read. */
 static int
@@ -182,14 +471,13 @@ stats_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
              void *handle, void *buf, uint32_t count, uint64_t offset,
              uint32_t flags, int *err)
 {
+  struct timespec start;
   int r;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next_ops->pread (nxdata, buf, count, offset, flags, err);
-  if (r == 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    pread_ops++;
-    pread_bytes += count;
-  }
+  if (r == 0)
+    record (OP_READ, count, &start);
   return r;
 }
 
@@ -200,14 +488,13 @@ stats_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
               const void *buf, uint32_t count, uint64_t offset,
               uint32_t flags, int *err)
 {
+  struct timespec start;
   int r;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next_ops->pwrite (nxdata, buf, count, offset, flags, err);
-  if (r == 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    pwrite_ops++;
-    pwrite_bytes += count;
-  }
+  if (r == 0)
+    record (OP_WRITE, count, &start);
   return r;
 }
 
@@ -218,14 +505,13 @@ stats_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
             uint32_t count, uint64_t offset, uint32_t flags,
             int *err)
 {
+  struct timespec start;
   int r;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next_ops->trim (nxdata, count, offset, flags, err);
-  if (r == 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    trim_ops++;
-    trim_bytes += count;
-  }
+  if (r == 0)
+    record (OP_TRIM, count, &start);
   return r;
 }
 
@@ -236,14 +522,13 @@ stats_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
             uint32_t count, uint64_t offset, uint32_t flags,
             int *err)
 {
+  struct timespec start;
   int r;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next_ops->zero (nxdata, count, offset, flags, err);
-  if (r == 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    zero_ops++;
-    zero_bytes += count;
-  }
+  if (r == 0)
+    record (OP_ZERO, count, &start);
   return r;
 }
 
@@ -254,18 +539,17 @@ stats_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                uint32_t count, uint64_t offset, uint32_t flags,
                struct nbdkit_extents *extents, int *err)
 {
+  struct timespec start;
   int r;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next_ops->extents (nxdata, count, offset, flags, extents, err);
-  if (r == 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    extents_ops++;
-    /* XXX There's a case for trying to determine how long the extents
-     * will be that are returned to the client, given the flags and
-     * the complex rules in the protocol.
-     */
-    extents_bytes += count;
-  }
+  /* XXX There's a case for trying to determine how long the extents
+   * will be that are returned to the client, given the flags and
+   * the complex rules in the protocol.
+   */
+  if (r == 0)
+    record (OP_EXTENTS, count, &start);
   return r;
 }
 
@@ -276,24 +560,25 @@ stats_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
              uint32_t count, uint64_t offset, uint32_t flags,
              int *err)
 {
+  struct timespec start;
   int r;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next_ops->cache (nxdata, count, offset, flags, err);
-  if (r == 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    cache_ops++;
-    cache_bytes += count;
-  }
+  if (r == 0)
+    record (OP_CACHE, count, &start);
   return r;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "stats",
   .longname          = "nbdkit stats filter",
+  .load              = stats_load,
   .unload            = stats_unload,
   .config            = stats_config,
   .config_complete   = stats_config_complete,
   .config_help       = stats_config_help,
+  .open              = stats_open,
   .pread             = stats_pread,
   .pwrite            = stats_pwrite,
   .trim              = stats_trim,
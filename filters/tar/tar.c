@@ -0,0 +1,343 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* The tar filter serves a single member of a tar file.  The headers
+ * are scanned once, on the first connection, to build an index of
+ * where the member's data is stored.  After that requests are simply
+ * translated into requests to the underlying plugin, so the filter
+ * does not limit the thread model.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+
+#include "tarfile.h"
+
+static const char *entry;       /* tar-entry parameter. */
+static uint64_t limit;          /* tar-limit parameter, 0 = no limit. */
+
+/* The index is built by the first connection. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool indexed;
+static struct tarfile tar;
+
+static void
+tar_unload (void)
+{
+  tarfile_free (&tar);
+}
+
+static int
+tar_config (nbdkit_next_config *next, void *nxdata,
+            const char *key, const char *value)
+{
+  if (strcmp (key, "tar-entry") == 0) {
+    entry = value;
+    return 0;
+  }
+  else if (strcmp (key, "tar-limit") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    limit = r;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+static int
+tar_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (entry == NULL) {
+    nbdkit_error ("the tar-entry parameter is required");
+    return -1;
+  }
+  return next (nxdata);
+}
+
+#define tar_config_help \
+  "tar-entry=<PATH>    (required) The member of the tar file to serve.\n" \
+  "tar-limit=<SIZE>              Only look in the first SIZE bytes."
+
+/* Build the index the first time a connection is prepared. */
+static int
+tar_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
+             void *handle, int readonly)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  int64_t size;
+
+  /* The plugin's size must be fetched on every connection before the
+   * first request is passed through.
+   */
+  size = next_ops->get_size (nxdata);
+  if (size == -1)
+    return -1;
+
+  if (indexed) {
+    if (tar.nr_pieces > 0) {
+      const struct tarfile_piece *last = &tar.pieces[tar.nr_pieces-1];
+
+      if (last->tar_offset + last->length > size) {
+        nbdkit_error ("tar: the tar file has been truncated");
+        return -1;
+      }
+    }
+    return 0;
+  }
+  if (tarfile_find (next_ops, nxdata, entry, limit, &tar) == -1)
+    return -1;
+  indexed = true;
+  return 0;
+}
+
+static int64_t
+tar_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle)
+{
+  return tar.size;
+}
+
+/* Writes to sparse members would have to change the layout of the
+ * tar file, so they are served read-only.
+ */
+static int
+tar_can_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle)
+{
+  if (tar.sparse)
+    return 0;
+  return next_ops->can_write (nxdata);
+}
+
+static int
+tar_can_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+                 void *handle)
+{
+  if (tar.sparse)
+    return 1;
+  return next_ops->can_extents (nxdata);
+}
+
+/* Offset of the member's data for members which are not sparse. */
+static inline uint64_t
+data_offset (void)
+{
+  return tar.nr_pieces > 0 ? tar.pieces[0].tar_offset : 0;
+}
+
+/* Read data. */
+static int
+tar_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, void *buf, uint32_t count, uint64_t offs,
+           uint32_t flags, int *err)
+{
+  uint8_t *p = buf;
+  size_t i;
+
+  if (!tar.sparse)
+    return next_ops->pread (nxdata, buf, count, offs + data_offset (),
+                            flags, err);
+
+  i = tarfile_find_piece (&tar, offs);
+  while (count > 0) {
+    const struct tarfile_piece *piece = i < tar.nr_pieces ?
+      &tar.pieces[i] : NULL;
+    uint32_t n;
+
+    if (piece == NULL || offs < piece->offset) {
+      /* In a hole. */
+      n = piece ? MIN (count, piece->offset - offs) : count;
+      memset (p, 0, n);
+    }
+    else {
+      n = MIN (count, piece->offset + piece->length - offs);
+      if (next_ops->pread (nxdata, p, n,
+                           piece->tar_offset + offs - piece->offset,
+                           flags, err) == -1)
+        return -1;
+      i++;
+    }
+    p += n;
+    offs += n;
+    count -= n;
+  }
+  return 0;
+}
+
+/* Write data. */
+static int
+tar_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle,
+            const void *buf, uint32_t count, uint64_t offs, uint32_t flags,
+            int *err)
+{
+  return next_ops->pwrite (nxdata, buf, count, offs + data_offset (),
+                           flags, err);
+}
+
+/* Trim data. */
+static int
+tar_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+          void *handle, uint32_t count, uint64_t offs, uint32_t flags,
+          int *err)
+{
+  return next_ops->trim (nxdata, count, offs + data_offset (), flags, err);
+}
+
+/* Zero data. */
+static int
+tar_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+          void *handle, uint32_t count, uint64_t offs, uint32_t flags,
+          int *err)
+{
+  return next_ops->zero (nxdata, count, offs + data_offset (), flags, err);
+}
+
+/* Extents.  For sparse members these come from the sparse map. */
+static int
+tar_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+             void *handle, uint32_t count, uint64_t offs, uint32_t flags,
+             struct nbdkit_extents *extents, int *err)
+{
+  size_t i;
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents2 = NULL;
+  struct nbdkit_extent e;
+  uint64_t offset = data_offset (), end = offs + count;
+
+  if (tar.sparse) {
+    for (i = tarfile_find_piece (&tar, offs);
+         offs < end && i <= tar.nr_pieces; ++i) {
+      uint64_t hole_end = i < tar.nr_pieces ? tar.pieces[i].offset : tar.size;
+
+      if (offs < hole_end) {
+        if (nbdkit_add_extent (extents, offs, hole_end - offs,
+                               NBDKIT_EXTENT_HOLE|NBDKIT_EXTENT_ZERO) == -1) {
+          *err = errno;
+          return -1;
+        }
+        offs = hole_end;
+      }
+      if (i < tar.nr_pieces) {
+        if (nbdkit_add_extent (extents, offs,
+                               tar.pieces[i].offset + tar.pieces[i].length -
+                               offs, 0) == -1) {
+          *err = errno;
+          return -1;
+        }
+        offs = tar.pieces[i].offset + tar.pieces[i].length;
+      }
+    }
+    return 0;
+  }
+
+  extents2 = nbdkit_extents_new (offs + offset, offset + tar.size);
+  if (extents2 == NULL) {
+    *err = errno;
+    return -1;
+  }
+  if (next_ops->extents (nxdata, count, offs + offset,
+                         flags, extents2, err) == -1)
+    return -1;
+
+  for (i = 0; i < nbdkit_extents_count (extents2); ++i) {
+    e = nbdkit_get_extent (extents2, i);
+    e.offset -= offset;
+    if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Cache data. */
+static int
+tar_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, uint32_t count, uint64_t offs, uint32_t flags,
+           int *err)
+{
+  uint64_t end = offs + count;
+  size_t i;
+
+  if (!tar.sparse)
+    return next_ops->cache (nxdata, count, offs + data_offset (),
+                            flags, err);
+
+  for (i = tarfile_find_piece (&tar, offs);
+       i < tar.nr_pieces && tar.pieces[i].offset < end; ++i) {
+    const struct tarfile_piece *piece = &tar.pieces[i];
+    uint64_t start = MAX (offs, piece->offset);
+    uint64_t n = MIN (end, piece->offset + piece->length) - start;
+
+    if (next_ops->cache (nxdata, n, piece->tar_offset + start - piece->offset,
+                         flags, err) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "tar",
+  .longname          = "nbdkit tar filter",
+  .unload            = tar_unload,
+  .config            = tar_config,
+  .config_complete   = tar_config_complete,
+  .config_help       = tar_config_help,
+  .prepare           = tar_prepare,
+  .get_size          = tar_get_size,
+  .can_write         = tar_can_write,
+  .can_extents       = tar_can_extents,
+  .pread             = tar_pread,
+  .pwrite            = tar_pwrite,
+  .trim              = tar_trim,
+  .zero              = tar_zero,
+  .extents           = tar_extents,
+  .cache             = tar_cache,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
@@ -0,0 +1,738 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parsing of tar files.
+ *
+ * This understands POSIX ustar and pax, and GNU tar archives,
+ * including GNU long names and sparse members in both the old GNU
+ * format and the pax formats 0.0, 0.1 and 1.0.  See "Basic Tar
+ * Format" and "Storing Sparse Files" in the GNU tar manual.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <nbdkit-filter.h>
+
+#include "iszero.h"
+#include "rounding.h"
+
+#include "tarfile.h"
+
+#define BLOCKSIZE 512
+
+/* Offsets of fields in the header. */
+#define NAME_OFFSET             0   /* 100 bytes */
+#define SIZE_OFFSET           124   /* 12 bytes */
+#define CHKSUM_OFFSET         148   /* 8 bytes */
+#define TYPEFLAG_OFFSET       156
+#define MAGIC_OFFSET          257   /* 6 bytes */
+#define PREFIX_OFFSET         345   /* 155 bytes */
+
+/* Old GNU sparse headers.  Each entry is an offset and a length of
+ * 12 bytes each.  There are 4 entries in the header, and 21 in each
+ * extension block which follows it.
+ */
+#define GNU_SPARSE_OFFSET     386
+#define GNU_ISEXTENDED_OFFSET 482
+#define GNU_REALSIZE_OFFSET   483   /* 12 bytes */
+#define GNU_EXT_ISEXTENDED_OFFSET 504
+#define GNU_SPARSE_ENTRY_SIZE  24
+
+/* Largest pax extended header or GNU long name that we will read. */
+#define MAX_EXTENDED_HEADER (1024 * 1024)
+
+/* Largest number of entries in a sparse map. */
+#define MAX_SPARSE_ENTRIES (16 * 1024 * 1024)
+
+/* A region of a sparse member which is stored in the tar file. */
+struct span {
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct spans {
+  struct span *ptr;
+  size_t len, alloc;
+};
+
+/* Information from extended headers which applies to the next
+ * member.
+ */
+struct pending {
+  char *name;                   /* GNU long name or pax path. */
+  char *sparse_name;            /* GNU.sparse.name */
+  int64_t size;                 /* pax size, or -1 */
+  int64_t realsize;             /* GNU.sparse.realsize or .size, or -1 */
+  int sparse_major;             /* GNU.sparse.major, or -1 */
+  bool have_map;                /* Sparse map for format 0.0 or 0.1. */
+  struct spans map;
+};
+
+static int
+append_span (struct spans *spans, uint64_t offset, uint64_t length)
+{
+  struct span *p;
+  size_t n;
+
+  if (spans->len == spans->alloc) {
+    if (spans->alloc >= MAX_SPARSE_ENTRIES) {
+      nbdkit_error ("tar: sparse map has too many entries");
+      return -1;
+    }
+    n = spans->alloc ? spans->alloc * 2 : 16;
+    p = realloc (spans->ptr, n * sizeof (struct span));
+    if (p == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    spans->ptr = p;
+    spans->alloc = n;
+  }
+  spans->ptr[spans->len].offset = offset;
+  spans->ptr[spans->len].length = length;
+  spans->len++;
+  return 0;
+}
+
+static void
+reset_pending (struct pending *pending)
+{
+  free (pending->name);
+  free (pending->sparse_name);
+  free (pending->map.ptr);
+  memset (pending, 0, sizeof *pending);
+  pending->size = -1;
+  pending->realsize = -1;
+  pending->sparse_major = -1;
+}
+
+/* Parse a numeric header field.  This is octal, optionally
+ * surrounded by spaces and terminated by NUL, or for large values
+ * the GNU base-256 encoding where the top bit of the first byte is
+ * set.
+ */
+static int
+parse_number (const char *field, size_t len, uint64_t *r)
+{
+  const unsigned char *p = (const unsigned char *) field;
+  uint64_t v = 0;
+  size_t i = 0;
+
+  if (p[0] & 0x80) {
+    if (p[0] & 0x40)            /* Negative. */
+      return -1;
+    v = p[0] & 0x3f;
+    for (i = 1; i < len; ++i) {
+      if (v > UINT64_MAX >> 8)
+        return -1;
+      v = v << 8 | p[i];
+    }
+    *r = v;
+    return 0;
+  }
+
+  while (i < len && p[i] == ' ')
+    i++;
+  for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i) {
+    if (v > UINT64_MAX >> 3)
+      return -1;
+    v = v << 3 | (p[i] - '0');
+  }
+  for (; i < len && p[i] != '\0'; ++i) {
+    if (p[i] != ' ')
+      return -1;
+  }
+  *r = v;
+  return 0;
+}
+
+/* Parse a decimal number from a pax header or sparse map.  Returns
+ * the number of characters used, or 0 if there was no number.
+ */
+static size_t
+parse_decimal (const char *s, size_t len, uint64_t *r)
+{
+  uint64_t v = 0;
+  size_t i;
+
+  for (i = 0; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+    if (v > (UINT64_MAX - 9) / 10)
+      return 0;
+    v = v * 10 + (s[i] - '0');
+  }
+  *r = v;
+  return i;
+}
+
+static bool
+checksum_ok (const unsigned char *header)
+{
+  uint64_t expected;
+  unsigned sum = 0;
+  int ssum = 0;
+  size_t i;
+
+  if (parse_number ((const char *) &header[CHKSUM_OFFSET], 8,
+                    &expected) == -1)
+    return false;
+
+  for (i = 0; i < BLOCKSIZE; ++i) {
+    unsigned char c = i >= CHKSUM_OFFSET && i < CHKSUM_OFFSET+8 ?
+      ' ' : header[i];
+    sum += c;
+    ssum += (signed char) c;
+  }
+
+  /* Some old tar programs used a signed sum. */
+  return expected == sum || expected == (uint64_t) ssum;
+}
+
+static int
+read_block (struct nbdkit_next_ops *next_ops, void *nxdata,
+            uint64_t offset, unsigned char *block)
+{
+  int err;
+
+  return next_ops->pread (nxdata, block, BLOCKSIZE, offset, 0, &err);
+}
+
+/* Read the data of an extended header or long name, adding a
+ * trailing NUL.
+ */
+static char *
+read_data (struct nbdkit_next_ops *next_ops, void *nxdata,
+           uint64_t offset, uint64_t size)
+{
+  char *data;
+  int err;
+
+  if (size > MAX_EXTENDED_HEADER) {
+    nbdkit_error ("tar: extended header at offset %" PRIu64 " is too large",
+                  offset);
+    return NULL;
+  }
+  data = malloc (size + 1);
+  if (data == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  if (size > 0 &&
+      next_ops->pread (nxdata, data, size, offset, 0, &err) == -1) {
+    free (data);
+    return NULL;
+  }
+  data[size] = '\0';
+  return data;
+}
+
+static char *
+strndup_value (const char *value, size_t len)
+{
+  char *r = strndup (value, len);
+
+  if (r == NULL)
+    nbdkit_error ("strndup: %m");
+  return r;
+}
+
+/* Parse the records of a pax extended header, each of the form
+ * "LEN KEY=VALUE\n".
+ */
+static int
+parse_pax (const char *data, size_t size, struct pending *pending)
+{
+  const char *p = data, *end = data + size;
+
+  while (p < end && *p != '\0') {
+    const char *rec = p, *key, *eq, *value;
+    uint64_t reclen, v;
+    size_t n, vlen;
+
+    n = parse_decimal (p, end - p, &reclen);
+    if (n == 0 || n >= (size_t) (end - rec) || rec[n] != ' ' ||
+        reclen <= n+1 || reclen > (uint64_t) (end - rec) ||
+        rec[reclen-1] != '\n')
+      goto bad;
+    key = &rec[n+1];
+    eq = memchr (key, '=', &rec[reclen-1] - key);
+    if (eq == NULL)
+      goto bad;
+    value = eq+1;
+    vlen = &rec[reclen-1] - value;
+    p = &rec[reclen];
+
+#define KEY_IS(str) \
+    ((size_t) (eq - key) == strlen (str) && strncmp (key, str, eq - key) == 0)
+
+    if (KEY_IS ("path")) {
+      free (pending->name);
+      pending->name = strndup_value (value, vlen);
+      if (pending->name == NULL)
+        return -1;
+    }
+    else if (KEY_IS ("GNU.sparse.name")) {
+      free (pending->sparse_name);
+      pending->sparse_name = strndup_value (value, vlen);
+      if (pending->sparse_name == NULL)
+        return -1;
+    }
+    else if (KEY_IS ("size")) {
+      if (parse_decimal (value, vlen, &v) != vlen || v > INT64_MAX)
+        goto bad;
+      pending->size = v;
+    }
+    else if (KEY_IS ("GNU.sparse.realsize") || KEY_IS ("GNU.sparse.size")) {
+      if (parse_decimal (value, vlen, &v) != vlen || v > INT64_MAX)
+        goto bad;
+      pending->realsize = v;
+    }
+    else if (KEY_IS ("GNU.sparse.major")) {
+      if (parse_decimal (value, vlen, &v) != vlen || v > 1)
+        goto bad;
+      pending->sparse_major = v;
+    }
+    else if (KEY_IS ("GNU.sparse.offset")) {
+      /* Format 0.0: repeated offset and numbytes records. */
+      if (parse_decimal (value, vlen, &v) != vlen)
+        goto bad;
+      if (append_span (&pending->map, v, 0) == -1)
+        return -1;
+      pending->have_map = true;
+    }
+    else if (KEY_IS ("GNU.sparse.numbytes")) {
+      if (parse_decimal (value, vlen, &v) != vlen || pending->map.len == 0)
+        goto bad;
+      pending->map.ptr[pending->map.len-1].length = v;
+    }
+    else if (KEY_IS ("GNU.sparse.map")) {
+      /* Format 0.1: "offset,length,offset,length,..." */
+      uint64_t offset, length;
+
+      while (vlen > 0) {
+        n = parse_decimal (value, vlen, &offset);
+        if (n == 0 || n == vlen || value[n] != ',')
+          goto bad;
+        value += n+1; vlen -= n+1;
+        n = parse_decimal (value, vlen, &length);
+        if (n == 0 || (n < vlen && value[n] != ','))
+          goto bad;
+        if (n < vlen) n++;
+        value += n; vlen -= n;
+        if (append_span (&pending->map, offset, length) == -1)
+          return -1;
+      }
+      pending->have_map = true;
+    }
+#undef KEY_IS
+  }
+  return 0;
+
+ bad:
+  nbdkit_error ("tar: could not parse pax extended header");
+  return -1;
+}
+
+/* Read the old GNU sparse map from the header and any extension
+ * blocks.  *pos is updated to point after the extension blocks.
+ */
+static int
+read_gnu_sparse_map (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     const unsigned char *header, uint64_t *pos,
+                     struct spans *spans)
+{
+  unsigned char ext[BLOCKSIZE];
+  const unsigned char *entries = &header[GNU_SPARSE_OFFSET];
+  size_t nr_entries = 4;
+  bool extended = header[GNU_ISEXTENDED_OFFSET];
+  uint64_t offset, length;
+  size_t i;
+
+  for (;;) {
+    for (i = 0; i < nr_entries; ++i) {
+      const char *e = (const char *) &entries[i * GNU_SPARSE_ENTRY_SIZE];
+
+      if (e[0] == '\0')
+        break;
+      if (parse_number (e, 12, &offset) == -1 ||
+          parse_number (e+12, 12, &length) == -1) {
+        nbdkit_error ("tar: could not parse GNU sparse header");
+        return -1;
+      }
+      if (append_span (spans, offset, length) == -1)
+        return -1;
+    }
+
+    if (!extended)
+      return 0;
+
+    if (read_block (next_ops, nxdata, *pos, ext) == -1)
+      return -1;
+    *pos += BLOCKSIZE;
+    entries = ext;
+    nr_entries = 21;
+    extended = ext[GNU_EXT_ISEXTENDED_OFFSET];
+  }
+}
+
+/* Read the sparse map stored at the start of the data of a pax
+ * format 1.0 sparse member.  This is a list of decimal numbers, each
+ * followed by a newline: the number of entries, then the offset and
+ * length of each, padded to a whole block.  *pos is updated to point
+ * to the data following the map.
+ */
+struct map_reader {
+  struct nbdkit_next_ops *next_ops;
+  void *nxdata;
+  uint64_t pos, end;
+  char block[BLOCKSIZE];
+  size_t i;
+};
+
+static int
+map_reader_next (struct map_reader *r, uint64_t *v)
+{
+  size_t digits = 0;
+
+  *v = 0;
+  for (;;) {
+    char c;
+
+    if (r->i == BLOCKSIZE) {
+      if (r->pos + BLOCKSIZE > r->end ||
+          read_block (r->next_ops, r->nxdata, r->pos,
+                      (unsigned char *) r->block) == -1)
+        goto bad;
+      r->pos += BLOCKSIZE;
+      r->i = 0;
+    }
+    c = r->block[r->i++];
+    if (c == '\n' && digits > 0)
+      return 0;
+    if (c < '0' || c > '9' || *v > (UINT64_MAX - 9) / 10)
+      goto bad;
+    *v = *v * 10 + (c - '0');
+    digits++;
+  }
+
+ bad:
+  nbdkit_error ("tar: could not parse sparse map");
+  return -1;
+}
+
+static int
+read_pax_sparse_map (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     uint64_t *pos, uint64_t end, struct spans *spans)
+{
+  struct map_reader r = {
+    .next_ops = next_ops, .nxdata = nxdata,
+    .pos = *pos, .end = end, .i = BLOCKSIZE
+  };
+  uint64_t nr, offset, length, i;
+
+  if (map_reader_next (&r, &nr) == -1)
+    return -1;
+  if (nr > MAX_SPARSE_ENTRIES) {
+    nbdkit_error ("tar: sparse map has too many entries");
+    return -1;
+  }
+  for (i = 0; i < nr; ++i) {
+    if (map_reader_next (&r, &offset) == -1 ||
+        map_reader_next (&r, &length) == -1)
+      return -1;
+    if (append_span (spans, offset, length) == -1)
+      return -1;
+  }
+
+  *pos = r.pos;
+  return 0;
+}
+
+/* Build the pieces of a sparse member from its map.  The stored
+ * regions follow each other in the tar file starting at 'data'.
+ */
+static int
+build_sparse_pieces (struct tarfile *t, const struct spans *spans,
+                     uint64_t data, uint64_t stored)
+{
+  uint64_t tar_offset = data, end = 0;
+  size_t i;
+
+  t->pieces = malloc (spans->len * sizeof (struct tarfile_piece));
+  if (t->pieces == NULL && spans->len > 0) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  for (i = 0; i < spans->len; ++i) {
+    const struct span *s = &spans->ptr[i];
+
+    if (s->length == 0)
+      continue;
+    if (s->offset < end || s->offset > t->size ||
+        s->length > t->size - s->offset ||
+        s->length > stored - (tar_offset - data)) {
+      nbdkit_error ("tar: sparse map is inconsistent");
+      return -1;
+    }
+    t->pieces[t->nr_pieces].offset = s->offset;
+    t->pieces[t->nr_pieces].length = s->length;
+    t->pieces[t->nr_pieces].tar_offset = tar_offset;
+    t->nr_pieces++;
+    tar_offset += s->length;
+    end = s->offset + s->length;
+  }
+  return 0;
+}
+
+/* Member names are compared ignoring any leading "./". */
+static const char *
+skip_dot_slash (const char *name)
+{
+  while (name[0] == '.' && name[1] == '/') {
+    name += 2;
+    while (*name == '/')
+      name++;
+  }
+  return name;
+}
+
+void
+tarfile_free (struct tarfile *t)
+{
+  free (t->pieces);
+  memset (t, 0, sizeof *t);
+}
+
+int
+tarfile_find (struct nbdkit_next_ops *next_ops, void *nxdata,
+              const char *entry, uint64_t limit, struct tarfile *t)
+{
+  unsigned char header[BLOCKSIZE];
+  char hname[155 + 1 + 100 + 1]; /* ustar prefix "/" name NUL */
+  struct pending pending = { .size = -1, .realsize = -1,
+                             .sparse_major = -1 };
+  struct spans spans = { 0 };
+  int64_t tar_size;
+  uint64_t pos = 0, hsize, data, stored;
+  bool found = false;
+  char *extdata;
+  const char *name;
+  int r = -1;
+
+  memset (t, 0, sizeof *t);
+  entry = skip_dot_slash (entry);
+
+  tar_size = next_ops->get_size (nxdata);
+  if (tar_size == -1)
+    return -1;
+  if (limit == 0 || limit > tar_size)
+    limit = tar_size;
+
+  while (pos + BLOCKSIZE <= limit) {
+    if (read_block (next_ops, nxdata, pos, header) == -1)
+      goto out;
+
+    /* End of archive. */
+    if (is_zero ((const char *) header, BLOCKSIZE))
+      break;
+
+    if (!checksum_ok (header) ||
+        parse_number ((const char *) &header[SIZE_OFFSET], 12,
+                      &hsize) == -1) {
+      nbdkit_error ("tar: not a tar file, "
+                    "or the header at offset %" PRIu64 " is corrupt", pos);
+      goto out;
+    }
+    data = pos + BLOCKSIZE;
+
+    switch (header[TYPEFLAG_OFFSET]) {
+    case 'L':                   /* GNU long name. */
+      extdata = read_data (next_ops, nxdata, data, hsize);
+      if (extdata == NULL)
+        goto out;
+      free (pending.name);
+      pending.name = extdata;
+      pos = data + ROUND_UP (hsize, BLOCKSIZE);
+      continue;
+
+    case 'x':                   /* pax extended header. */
+      extdata = read_data (next_ops, nxdata, data, hsize);
+      if (extdata == NULL)
+        goto out;
+      if (parse_pax (extdata, hsize, &pending) == -1) {
+        free (extdata);
+        goto out;
+      }
+      free (extdata);
+      pos = data + ROUND_UP (hsize, BLOCKSIZE);
+      continue;
+
+    case 'K':                   /* GNU long link name. */
+    case 'g':                   /* pax global header. */
+      pos = data + ROUND_UP (hsize, BLOCKSIZE);
+      continue;
+    }
+
+    /* Work out the name of this member. */
+    if (pending.sparse_name)
+      name = pending.sparse_name;
+    else if (pending.name)
+      name = pending.name;
+    else {
+      const char *hn = (const char *) &header[NAME_OFFSET];
+      const char *prefix = (const char *) &header[PREFIX_OFFSET];
+
+      /* Only POSIX ustar headers have a prefix field. */
+      if (memcmp (&header[MAGIC_OFFSET], "ustar\0", 6) == 0 &&
+          prefix[0] != '\0')
+        snprintf (hname, sizeof hname, "%.155s/%.100s", prefix, hn);
+      else
+        snprintf (hname, sizeof hname, "%.100s", hn);
+      name = hname;
+    }
+
+    stored = pending.size >= 0 ? pending.size : hsize;
+
+    spans.len = 0;
+    if (header[TYPEFLAG_OFFSET] == 'S' &&
+        read_gnu_sparse_map (next_ops, nxdata, header, &data, &spans) == -1)
+      goto out;
+
+    if (strcmp (skip_dot_slash (name), entry) == 0) {
+      switch (header[TYPEFLAG_OFFSET]) {
+      case '0': case '\0': case '7':  /* Regular file. */
+      case 'S':                       /* Old GNU sparse file. */
+        break;
+      default:
+        nbdkit_error ("tar: %s is not a regular file", entry);
+        goto out;
+      }
+
+      tarfile_free (t);
+      found = true;
+
+      if (header[TYPEFLAG_OFFSET] == 'S') {
+        if (parse_number ((const char *) &header[GNU_REALSIZE_OFFSET], 12,
+                          &t->size) == -1) {
+          nbdkit_error ("tar: could not parse GNU sparse header");
+          goto out;
+        }
+        t->sparse = true;
+        if (build_sparse_pieces (t, &spans, data, stored) == -1)
+          goto out;
+      }
+      else if (pending.sparse_major == 1 || pending.have_map) {
+        uint64_t map_start = data;
+
+        if (pending.realsize == -1) {
+          nbdkit_error ("tar: sparse member %s has no size", entry);
+          goto out;
+        }
+        t->size = pending.realsize;
+        t->sparse = true;
+        if (pending.sparse_major == 1) {
+          if (read_pax_sparse_map (next_ops, nxdata, &data,
+                                   map_start + stored, &spans) == -1)
+            goto out;
+          if (build_sparse_pieces (t, &spans, data,
+                                   stored - (data - map_start)) == -1)
+            goto out;
+        }
+        else if (build_sparse_pieces (t, &pending.map, data, stored) == -1)
+          goto out;
+        data = map_start;
+      }
+      else {
+        t->size = stored;
+        t->pieces = malloc (sizeof (struct tarfile_piece));
+        if (t->pieces == NULL) {
+          nbdkit_error ("malloc: %m");
+          goto out;
+        }
+        t->pieces[0].offset = 0;
+        t->pieces[0].length = stored;
+        t->pieces[0].tar_offset = data;
+        t->nr_pieces = 1;
+      }
+
+      if (data + stored > (uint64_t) tar_size) {
+        nbdkit_error ("tar: %s is truncated", entry);
+        goto out;
+      }
+    }
+
+    pos = data + ROUND_UP (stored, BLOCKSIZE);
+    reset_pending (&pending);
+  }
+
+  if (!found) {
+    nbdkit_error ("tar: %s was not found in the tar file", entry);
+    goto out;
+  }
+
+  nbdkit_debug ("tar: %s: size %" PRIu64 ", %s, %zu piece(s)",
+                entry, t->size, t->sparse ? "sparse" : "not sparse",
+                t->nr_pieces);
+  r = 0;
+
+ out:
+  if (r == -1)
+    tarfile_free (t);
+  reset_pending (&pending);
+  free (spans.ptr);
+  return r;
+}
+
+size_t
+tarfile_find_piece (const struct tarfile *t, uint64_t offset)
+{
+  size_t lo = 0, hi = t->nr_pieces;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const struct tarfile_piece *p = &t->pieces[mid];
+
+    if (p->offset + p->length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
@@ -0,0 +1,79 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parsing of tar files. */
+
+#ifndef NBDKIT_TARFILE_H
+#define NBDKIT_TARFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nbdkit-filter.h>
+
+/* A contiguous run of the member's data stored in the tar file.  For
+ * ordinary members there is a single piece covering the whole
+ * member.  For sparse members the gaps between pieces read as zeroes.
+ */
+struct tarfile_piece {
+  uint64_t offset;              /* Offset within the member. */
+  uint64_t length;
+  uint64_t tar_offset;          /* Offset within the tar file. */
+};
+
+struct tarfile {
+  uint64_t size;                /* Size of the member. */
+  bool sparse;
+  struct tarfile_piece *pieces; /* Sorted by offset. */
+  size_t nr_pieces;
+};
+
+/* Scan the headers of the tar file and build the index of the member
+ * called 'entry'.  If the member appears more than once the last copy
+ * is used, as tar would do when extracting.  If 'limit' is not zero
+ * then only the first 'limit' bytes of the tar file are scanned.
+ *
+ * Returns 0 on success, or -1 on error (after calling nbdkit_error).
+ */
+extern int tarfile_find (struct nbdkit_next_ops *next_ops, void *nxdata,
+                         const char *entry, uint64_t limit,
+                         struct tarfile *t);
+
+/* Free the index. */
+extern void tarfile_free (struct tarfile *t);
+
+/* Find the index of the piece containing or following 'offset'.
+ * Returns t->nr_pieces if there is none.
+ */
+extern size_t tarfile_find_piece (const struct tarfile *t, uint64_t offset);
+
+#endif /* NBDKIT_TARFILE_H */
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
@@ -49,7 +50,28 @@
 #include "blkcache.h"
 
 static uint64_t maxblock = 512 * 1024 * 1024;
-static uint32_t maxdepth = 8;
+static uint32_t maxdepth = 64;
+static uint64_t maxsize = 1024 * 1024 * 1024;
+static unsigned nr_threads = 0;         /* 0 = number of CPUs */
+static int64_t prefetch = -1;           /* -1 = same as nr_threads */
+
+/* Blocks are only uncompressed in the background if their compressed
+ * size is at most this, since the whole compressed block has to be
+ * held in memory until a background thread gets to it.  Larger
+ * blocks are uncompressed by the request thread when they are needed,
+ * reading the compressed data a megabyte at a time.
+ */
+#define MAX_BACKGROUND_BLOCK (32 * 1024 * 1024)
+
+/* The block cache is shared by all connections. */
+static blkcache *cache;
+
+static void
+xz_unload (void)
+{
+  if (cache)
+    free_blkcache (cache);
+}
 
 static int
 xz_config (nbdkit_next_config *next, void *nxdata,
@@ -71,20 +93,65 @@ xz_config (nbdkit_next_config *next, void *nxdata,
     }
     return 0;
   }
+  else if (strcmp (key, "xz-cache-size") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxsize = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "xz-threads") == 0) {
+    if (nbdkit_parse_unsigned ("xz-threads", value, &nr_threads) == -1)
+      return -1;
+    if (nr_threads == 0 || nr_threads > 256) {
+      nbdkit_error ("'xz-threads' parameter must be between 1 and 256");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "xz-prefetch") == 0) {
+    unsigned r;
+
+    if (nbdkit_parse_unsigned ("xz-prefetch", value, &r) == -1)
+      return -1;
+    prefetch = r;
+    return 0;
+  }
   else
     return next (nxdata, key, value);
 }
 
+static int
+xz_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (nr_threads == 0) {
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+    nr_threads = n >= 1 ? (n <= 256 ? n : 256) : 1;
+  }
+  if (prefetch == -1)
+    prefetch = nr_threads;
+
+  cache = new_blkcache (maxdepth, maxsize);
+  if (cache == NULL)
+    return -1;
+
+  return next (nxdata);
+}
+
 #define xz_config_help \
   "xz-max-block=<SIZE> (optional) Maximum block size allowed (default: 512M)\n"\
-  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 4)\n"
+  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 64)\n" \
+  "xz-cache-size=<SIZE> (optional) Maximum size of cache (default: 1G)\n" \
+  "xz-threads=<N>      (optional) Uncompression threads (default: nr CPUs)\n" \
+  "xz-prefetch=<N>     (optional) Blocks to prefetch (default: xz-threads)\n"
 
 /* The per-connection handle. */
 struct xz_handle {
   xzfile *xz;
 
-  /* Block cache. */
-  blkcache *c;
+  /* End of the previous read, used to detect sequential access. */
+  uint64_t next_offset;
 };
 
 /* Create the per-connection handle. */
@@ -97,20 +164,21 @@ xz_open (nbdkit_next_open *next, void *nxdata, int readonly)
   if (next (nxdata, 1) == -1)
     return NULL;
 
+  /* Start the uncompression threads on the first connection, since
+   * nbdkit may fork after the filter is loaded.
+   */
+  if (blkcache_start_threads (cache, nr_threads) == -1)
+    return NULL;
+
   h = malloc (sizeof *h);
   if (h == NULL) {
     nbdkit_error ("malloc: %m");
     return NULL;
   }
 
-  h->c = new_blkcache (maxdepth);
-  if (!h->c) {
-    free (h);
-    return NULL;
-  }
-
   /* Initialized in xz_prepare. */
   h->xz = NULL;
+  h->next_offset = UINT64_MAX;
 
   return h;
 }
@@ -122,14 +190,11 @@ xz_close (void *handle)
   struct xz_handle *h = handle;
   blkcache_stats stats;
 
-  if (h->c) {
-    blkcache_get_stats (h->c, &stats);
-
-    nbdkit_debug ("cache: hits = %zu, misses = %zu", stats.hits, stats.misses);
-  }
+  blkcache_get_stats (cache, &stats);
+  nbdkit_debug ("cache: hits = %zu, misses = %zu, prefetches = %zu",
+                stats.hits, stats.misses, stats.prefetches);
 
   xzfile_close (h->xz);
-  free_blkcache (h->c);
   free (h);
 }
 
@@ -201,6 +266,52 @@ xz_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   return NBDKIT_CACHE_EMULATE;
 }
 
+static char *
+decode_xzblock (void *xb)
+{
+  return xzfile_decode_block (xb);
+}
+
+static void
+free_xzblock (void *xb)
+{
+  xzfile_free_compressed_block (xb);
+}
+
+/* If the block containing offset is not in the cache, read its
+ * compressed data and queue it for a background thread to uncompress.
+ * Only the uncompression happens in the background: the compressed
+ * data is read here, in the request thread, because the underlying
+ * plugin can only be called from there.  Errors are ignored, since
+ * the block will be read again if it is needed.
+ */
+static void
+start_block (struct xz_handle *h, struct nbdkit_next_ops *next_ops,
+             void *nxdata, uint64_t offset)
+{
+  uint64_t start, size;
+  struct block *b;
+  xzblock *xb;
+  int err;
+
+  if (xzfile_locate_block (h->xz, offset, &start, &size) == -1)
+    return;
+  if (xzfile_compressed_block_size (h->xz, offset) > MAX_BACKGROUND_BLOCK)
+    return;
+  b = reserve_block (cache, start, size);
+  if (b == NULL)
+    return;
+
+  xb = xzfile_read_compressed_block (h->xz, next_ops, nxdata, 0, &err, start);
+  if (xb == NULL) {
+    fail_block (cache, b);
+    put_block (cache, b);
+    return;
+  }
+
+  blkcache_queue (cache, b, decode_xzblock, free_xzblock, xb);
+}
+
 /* Read data from the file. */
 static int
 xz_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
@@ -208,48 +319,103 @@ xz_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
           uint32_t flags, int *err)
 {
   struct xz_handle *h = handle;
+  uint64_t exportsize = xzfile_get_size (h->xz);
+  uint64_t start, size, end, o;
+  struct block *b;
+  bool reserved, sequential;
   char *data;
-  uint64_t start, size;
+  int64_t i;
   uint32_t n;
 
-  /* Find the block in the cache. */
-  data = get_block (h->c, offset, &start, &size);
-  if (!data) {
-    /* Not in the cache.  We need to read the block from the xz file. */
-    data = xzfile_read_block (h->xz, next_ops, nxdata, flags, err,
-                              offset, &start, &size);
-    if (data == NULL)
+  sequential =
+    __atomic_exchange_n (&h->next_offset, offset + count,
+                         __ATOMIC_RELAXED) == offset;
+
+  /* Start uncompressing the other blocks covered by a large request
+   * in the background while this thread uncompresses the first one.
+   */
+  if (xzfile_locate_block (h->xz, offset, &start, &size) == -1) {
+    *err = EIO;
+    return -1;
+  }
+  end = offset + count;
+  for (o = start + size; o < end; ) {
+    if (xzfile_locate_block (h->xz, o, &start, &size) == -1)
+      break;
+    start_block (h, next_ops, nxdata, o);
+    o = start + size;
+  }
+
+  while (count > 0) {
+    if (xzfile_locate_block (h->xz, offset, &start, &size) == -1) {
+      *err = EIO;
       return -1;
-    put_block (h->c, start, size, data);
+    }
+
+    /* Find the block in the cache. */
+    b = get_block (cache, start, size, &reserved);
+    if (b == NULL) {
+      *err = ENOMEM;
+      return -1;
+    }
+    if (reserved) {
+      /* Not in the cache.  We need to read the block from the xz
+       * file and uncompress it in this thread.
+       */
+      *err = EIO;
+      data = xzfile_read_block (h->xz, next_ops, nxdata, flags, err,
+                                start, &start, &size);
+      if (data == NULL) {
+        fail_block (cache, b);
+        put_block (cache, b);
+        return -1;
+      }
+      fill_block (cache, b, data);
+    }
+
+    /* It's possible if the blocks are really small or oddly aligned
+     * or if the requests are large that we need to read the following
+     * block to satisfy the request.
+     */
+    n = count;
+    if (start + size - offset < n)
+      n = start + size - offset;
+
+    memcpy (buf, &block_data (b)[offset-start], n);
+    put_block (cache, b);
+    buf += n;
+    count -= n;
+    offset += n;
   }
 
-  /* It's possible if the blocks are really small or oddly aligned or
-   * if the requests are large that we need to read the following
-   * block to satisfy the request.
+  /* If the client is reading sequentially, start uncompressing the
+   * blocks following the request.  This is done after the requested
+   * data has been uncompressed so that it is not delayed, but reading
+   * the compressed data of these blocks still delays the reply.
    */
-  n = count;
-  if (start + size - offset < n)
-    n = start + size - offset;
-
-  memcpy (buf, &data[offset-start], n);
-  buf += n;
-  count -= n;
-  offset += n;
-  if (count > 0)
-    return xz_pread (next_ops, nxdata, h, buf, count, offset, flags, err);
+  if (sequential) {
+    for (i = 0; i < prefetch && o < exportsize; ++i) {
+      if (xzfile_locate_block (h->xz, o, &start, &size) == -1)
+        break;
+      start_block (h, next_ops, nxdata, o);
+      o = start + size;
+    }
+  }
 
   return 0;
 }
 
 static int xz_thread_model (void)
 {
-  return NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS;
+  return NBDKIT_THREAD_MODEL_PARALLEL;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "xz",
   .longname          = "nbdkit XZ filter",
+  .unload            = xz_unload,
   .config            = xz_config,
+  .config_complete   = xz_config_complete,
   .config_help       = xz_config_help,
   .thread_model      = xz_thread_model,
   .open              = xz_open,
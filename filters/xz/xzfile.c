@@ -41,6 +41,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 
@@ -347,6 +348,37 @@ xzfile_get_size (xzfile *xz)
   return lzma_index_uncompressed_size (xz->idx);
 }
 
+/* A block of compressed data which has been read from the xz file.
+ * This contains everything needed to decode the block, so decoding
+ * does not need to access the underlying plugin and can be done in
+ * any thread.
+ */
+struct xzblock {
+  uint64_t start;               /* Uncompressed offset of block. */
+  uint64_t size;                /* Uncompressed size of block. */
+  lzma_check check;
+  lzma_vli unpadded_size;
+  uint8_t *in;                  /* Block header, data, padding, check. */
+  size_t in_size;
+};
+
+int
+xzfile_locate_block (xzfile *xz, uint64_t offset,
+                     uint64_t *start_rtn, uint64_t *size_rtn)
+{
+  lzma_index_iter iter;
+
+  lzma_index_iter_init (&iter, xz->idx);
+  if (lzma_index_iter_locate (&iter, offset)) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
+    return -1;
+  }
+
+  *start_rtn = iter.block.uncompressed_file_offset;
+  *size_rtn = iter.block.uncompressed_size;
+  return 0;
+}
+
 char *
 xzfile_read_block (xzfile *xz,
                    struct nbdkit_next_ops *next_ops,
@@ -372,6 +404,7 @@ xzfile_read_block (xzfile *xz,
   size = next_ops->get_size (nxdata);
   if (size == -1) {
     nbdkit_error ("xz: get_size: %m");
+    *err = EIO;
     return NULL;
   }
 
@@ -379,6 +412,7 @@ xzfile_read_block (xzfile *xz,
   lzma_index_iter_init (&iter, xz->idx);
   if (lzma_index_iter_locate (&iter, offset)) {
     nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
+    *err = EIO;
     return NULL;
   }
 
@@ -500,3 +534,171 @@ xzfile_read_block (xzfile *xz,
 
   return NULL;
 }
+
+uint64_t
+xzfile_compressed_block_size (xzfile *xz, uint64_t offset)
+{
+  lzma_index_iter iter;
+
+  lzma_index_iter_init (&iter, xz->idx);
+  if (lzma_index_iter_locate (&iter, offset))
+    return 0;
+  return iter.block.total_size;
+}
+
+xzblock *
+xzfile_read_compressed_block (xzfile *xz,
+                              struct nbdkit_next_ops *next_ops,
+                              void *nxdata, uint32_t flags, int *err,
+                              uint64_t offset)
+{
+  int64_t size;
+  lzma_index_iter iter;
+  xzblock *b;
+  const size_t bufsize = 1024 * 1024;
+  uint64_t offs;
+  size_t pos, n;
+
+  /* Read the total size of the underlying disk, so we don't
+   * read over the end.
+   */
+  size = next_ops->get_size (nxdata);
+  if (size == -1) {
+    nbdkit_error ("xz: get_size: %m");
+    *err = EIO;
+    return NULL;
+  }
+
+  /* Locate the block containing the uncompressed offset. */
+  lzma_index_iter_init (&iter, xz->idx);
+  if (lzma_index_iter_locate (&iter, offset)) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
+    *err = EIO;
+    return NULL;
+  }
+
+  nbdkit_debug ("seek: block number %d at file offset %" PRIu64,
+                (int) iter.block.number_in_file,
+                (uint64_t) iter.block.compressed_file_offset);
+
+  offs = iter.block.compressed_file_offset;
+  if (iter.block.total_size > SIZE_MAX ||
+      offs + iter.block.total_size > size) {
+    nbdkit_error ("xz: read: block extends beyond the end of the file");
+    *err = EIO;
+    return NULL;
+  }
+
+  b = malloc (sizeof *b);
+  if (b == NULL) {
+    nbdkit_error ("malloc: %m");
+    *err = errno;
+    return NULL;
+  }
+  b->start = iter.block.uncompressed_file_offset;
+  b->size = iter.block.uncompressed_size;
+  b->check = iter.stream.flags->check;
+  b->unpadded_size = iter.block.unpadded_size;
+  b->in_size = iter.block.total_size;
+  b->in = malloc (b->in_size);
+  if (b->in == NULL) {
+    nbdkit_error ("malloc: %m");
+    *err = errno;
+    free (b);
+    return NULL;
+  }
+
+  for (pos = 0; pos < b->in_size; pos += n) {
+    n = b->in_size - pos;
+    if (n > bufsize)
+      n = bufsize;
+    if (next_ops->pread (nxdata, &b->in[pos], n, offs + pos, 0, err) == -1) {
+      nbdkit_error ("xz: read: could not read block of compressed data: "
+                    "error %d", *err);
+      xzfile_free_compressed_block (b);
+      return NULL;
+    }
+  }
+
+  return b;
+}
+
+void
+xzfile_free_compressed_block (xzblock *b)
+{
+  if (b) {
+    free (b->in);
+    free (b);
+  }
+}
+
+char *
+xzfile_decode_block (xzblock *b)
+{
+  lzma_block block;
+  lzma_filter filters[LZMA_FILTERS_MAX + 1];
+  lzma_ret r;
+  size_t in_pos, out_pos;
+  char *data = NULL;
+  size_t i;
+
+  if (b->in[0] == '\0') {
+    nbdkit_error ("xz: read: unexpected invalid block in file, header[0] = 0");
+    return NULL;
+  }
+
+  block.version = 0;
+  block.check = b->check;
+  block.filters = filters;
+  block.header_size = lzma_block_header_size_decode (b->in[0]);
+  if (block.header_size > b->in_size) {
+    nbdkit_error ("xz: read: block header is larger than the block");
+    return NULL;
+  }
+
+  r = lzma_block_header_decode (&block, NULL, b->in);
+  if (r != LZMA_OK) {
+    nbdkit_error ("invalid block header (error %d)", r);
+    return NULL;
+  }
+
+  /* What this actually does is it checks that the block header
+   * matches the index.
+   */
+  r = lzma_block_compressed_size (&block, b->unpadded_size);
+  if (r != LZMA_OK) {
+    nbdkit_error ("cannot calculate compressed size (error %d)", r);
+    goto err;
+  }
+
+  data = malloc (b->size);
+  if (data == NULL) {
+    nbdkit_error ("malloc (%" PRIu64 " bytes): %m\n"
+                  "NOTE: If this error occurs, you need to recompress your "
+                  "xz files with a smaller block size.  "
+                  "Use: 'xz --block-size=16777216 ...'.",
+                  b->size);
+    goto err;
+  }
+
+  in_pos = block.header_size;
+  out_pos = 0;
+  r = lzma_block_buffer_decode (&block, NULL,
+                                b->in, &in_pos, b->in_size,
+                                (uint8_t *) data, &out_pos, b->size);
+  if (r != LZMA_OK || out_pos != b->size) {
+    nbdkit_error ("could not parse block data (error %d)", r);
+    goto err;
+  }
+
+  for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+    free (filters[i].options);
+
+  return data;
+
+ err:
+  for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+    free (filters[i].options);
+  free (data);
+  return NULL;
+}
@@ -51,12 +51,21 @@ extern uint64_t xzfile_max_uncompressed_block_size (xzfile *);
 /* Get the total uncompressed size of the file. */
 extern uint64_t xzfile_get_size (xzfile *);
 
-/* Read the xz file block that contains the byte at 'offset' in the
- * uncompressed file.
+/* Find the xz file block that contains the byte at 'offset' in the
+ * uncompressed file.  The start offset & size of the block relative
+ * to the uncompressed file are returned in *start and *size.
+ */
+extern int xzfile_locate_block (xzfile *xz, uint64_t offset,
+                                uint64_t *start, uint64_t *size);
+
+/* Read and uncompress the xz file block that contains the byte at
+ * 'offset' in the uncompressed file.  The compressed data is read and
+ * uncompressed a megabyte at a time, so only the uncompressed block
+ * has to be held in memory.
  *
  * The uncompressed block of data, which probably begins before the
- * requested byte and ends after it, is returned.  The caller must
- * free it.  NULL is returned if there was an error.
+ * requested byte, is returned.  The caller must free it.  NULL is
+ * returned if there was an error.
  *
  * The start offset & size of the block relative to the uncompressed
  * file are returned in *start and *size.
@@ -67,4 +76,36 @@ extern char *xzfile_read_block (xzfile *xz,
                                 uint64_t offset,
                                 uint64_t *start, uint64_t *size);
 
+/* Return the compressed size of the block containing 'offset', or 0
+ * if the offset is not in the file.
+ */
+extern uint64_t xzfile_compressed_block_size (xzfile *xz, uint64_t offset);
+
+/* A compressed block read from the xz file.  The whole compressed
+ * block is held in memory so that it can be uncompressed in another
+ * thread, which cannot call into the underlying plugin.
+ */
+typedef struct xzblock xzblock;
+
+/* Read the compressed xz file block that contains the byte at
+ * 'offset' in the uncompressed file.  NULL is returned if there was
+ * an error.  The caller must free the block using
+ * xzfile_free_compressed_block.
+ */
+extern xzblock *xzfile_read_compressed_block (xzfile *xz,
+                                              struct nbdkit_next_ops *next_ops,
+                                              void *nxdata, uint32_t flags,
+                                              int *err, uint64_t offset);
+
+extern void xzfile_free_compressed_block (xzblock *);
+
+/* Uncompress a block which has been read by
+ * xzfile_read_compressed_block.  This does not access the underlying
+ * plugin, and is safe to call from any thread.
+ *
+ * The uncompressed block of data is returned.  The caller must free
+ * it.  NULL is returned if there was an error.
+ */
+extern char *xzfile_decode_block (xzblock *);
+
 #endif /* NBDKIT_XZFILE_H */
@@ -0,0 +1,472 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <nbdkit-filter.h>
+
+#include "iszero.h"
+
+#include "zstdfile.h"
+#include "blkcache.h"
+
+static uint64_t maxframe = 512 * 1024 * 1024;
+static uint32_t maxdepth = 64;
+static uint64_t maxsize = 1024 * 1024 * 1024;
+static unsigned nr_threads = 0;         /* 0 = number of CPUs */
+static int64_t prefetch = -1;           /* -1 = same as nr_threads */
+
+/* Frames are only uncompressed in the background if their compressed
+ * size is at most this, as for MAX_BACKGROUND_BLOCK in the xz filter.
+ */
+#define MAX_BACKGROUND_FRAME (32 * 1024 * 1024)
+
+/* The frame cache is shared by all connections. */
+static blkcache *cache;
+
+static void
+zstd_unload (void)
+{
+  if (cache)
+    free_blkcache (cache);
+}
+
+static int
+zstd_config (nbdkit_next_config *next, void *nxdata,
+             const char *key, const char *value)
+{
+  if (strcmp (key, "zstd-max-frame") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxframe = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "zstd-max-depth") == 0) {
+    if (nbdkit_parse_uint32_t ("zstd-max-depth", value, &maxdepth) == -1)
+      return -1;
+    if (maxdepth == 0) {
+      nbdkit_error ("'zstd-max-depth' parameter must be >= 1");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "zstd-cache-size") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxsize = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "zstd-threads") == 0) {
+    if (nbdkit_parse_unsigned ("zstd-threads", value, &nr_threads) == -1)
+      return -1;
+    if (nr_threads == 0 || nr_threads > 256) {
+      nbdkit_error ("'zstd-threads' parameter must be between 1 and 256");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "zstd-prefetch") == 0) {
+    unsigned r;
+
+    if (nbdkit_parse_unsigned ("zstd-prefetch", value, &r) == -1)
+      return -1;
+    prefetch = r;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+static int
+zstd_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (nr_threads == 0) {
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+    nr_threads = n >= 1 ? (n <= 256 ? n : 256) : 1;
+  }
+  if (prefetch == -1)
+    prefetch = nr_threads;
+
+  cache = new_blkcache (maxdepth, maxsize);
+  if (cache == NULL)
+    return -1;
+
+  return next (nxdata);
+}
+
+#define zstd_config_help \
+  "zstd-max-frame=<SIZE>  (optional) Maximum frame size allowed (default: 512M)\n"\
+  "zstd-max-depth=<N>     (optional) Maximum frames in cache (default: 64)\n" \
+  "zstd-cache-size=<SIZE> (optional) Maximum size of cache (default: 1G)\n" \
+  "zstd-threads=<N>       (optional) Uncompression threads (default: nr CPUs)\n" \
+  "zstd-prefetch=<N>      (optional) Frames to prefetch (default: zstd-threads)\n"
+
+/* The per-connection handle. */
+struct zstd_handle {
+  zstdfile *zstd;
+
+  /* End of the previous read, used to detect sequential access. */
+  uint64_t next_offset;
+};
+
+/* Create the per-connection handle. */
+static void *
+zstd_open (nbdkit_next_open *next, void *nxdata, int readonly)
+{
+  struct zstd_handle *h;
+
+  /* Always pass readonly=1 to the underlying plugin. */
+  if (next (nxdata, 1) == -1)
+    return NULL;
+
+  /* Start the uncompression threads on the first connection, since
+   * nbdkit may fork after the filter is loaded.
+   */
+  if (blkcache_start_threads (cache, nr_threads) == -1)
+    return NULL;
+
+  h = malloc (sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  /* Initialized in zstd_prepare. */
+  h->zstd = NULL;
+  h->next_offset = UINT64_MAX;
+
+  return h;
+}
+
+/* Free up the per-connection handle. */
+static void
+zstd_close (void *handle)
+{
+  struct zstd_handle *h = handle;
+  blkcache_stats stats;
+
+  blkcache_get_stats (cache, &stats);
+  nbdkit_debug ("cache: hits = %zu, misses = %zu, prefetches = %zu",
+                stats.hits, stats.misses, stats.prefetches);
+
+  zstdfile_close (h->zstd);
+  free (h);
+}
+
+static int
+zstd_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
+              int readonly)
+{
+  struct zstd_handle *h = handle;
+
+  h->zstd = zstdfile_open (next_ops, nxdata);
+  if (!h->zstd)
+    return -1;
+
+  if (maxframe < zstdfile_max_uncompressed_frame_size (h->zstd)) {
+    nbdkit_error ("zstd file largest frame is bigger than maxframe\n"
+                  "Either recompress the zstd file with smaller frames "
+                  "(see nbdkit-zstd-filter(1))\n"
+                  "or make maxframe parameter bigger.\n"
+                  "maxframe = %" PRIu64 " (bytes)\n"
+                  "largest frame in zstd file = %" PRIu64 " (bytes)",
+                  maxframe,
+                  zstdfile_max_uncompressed_frame_size (h->zstd));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Get the file size. */
+static int64_t
+zstd_get_size (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  struct zstd_handle *h = handle;
+
+  return zstdfile_get_size (h->zstd);
+}
+
+/* Writes are not supported, see the same function in the xz filter. */
+static int
+zstd_can_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle)
+{
+  return 0;
+}
+
+/* Frames which are entirely zero are reported as holes. */
+static int
+zstd_can_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle)
+{
+  return 1;
+}
+
+/* Cache */
+static int
+zstd_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle)
+{
+  /* As for the xz filter, rely on nbdkit calling .pread for caching. */
+  return NBDKIT_CACHE_EMULATE;
+}
+
+static char *
+decode_zstdframe (void *zf)
+{
+  return zstdfile_decode_frame (zf);
+}
+
+static void
+free_zstdframe (void *zf)
+{
+  zstdfile_free_compressed_frame (zf);
+}
+
+/* If the frame containing offset is not in the cache, read its
+ * compressed data and queue it for a background thread to uncompress.
+ * The compressed data is read here, in the request thread, because
+ * the underlying plugin can only be called from there.  Errors are
+ * ignored, since the frame will be read again if it is needed.
+ */
+static void
+start_frame (struct zstd_handle *h, struct nbdkit_next_ops *next_ops,
+             void *nxdata, uint64_t offset)
+{
+  uint64_t start, size;
+  struct block *b;
+  zstdframe *zf;
+  int err;
+
+  if (zstdfile_locate_frame (h->zstd, offset, &start, &size) == -1)
+    return;
+  if (zstdfile_compressed_frame_size (h->zstd, offset) > MAX_BACKGROUND_FRAME)
+    return;
+  b = reserve_block (cache, start, size);
+  if (b == NULL)
+    return;
+
+  zf = zstdfile_read_compressed_frame (h->zstd, next_ops, nxdata, 0, &err,
+                                       start);
+  if (zf == NULL) {
+    fail_block (cache, b);
+    put_block (cache, b);
+    return;
+  }
+
+  blkcache_queue (cache, b, decode_zstdframe, free_zstdframe, zf);
+}
+
+/* Get the frame containing offset from the cache.  If it is not in
+ * the cache, read and uncompress it in this thread.  The caller must
+ * call put_block when it has finished with the frame.
+ */
+static struct block *
+get_frame (struct zstd_handle *h, struct nbdkit_next_ops *next_ops,
+           void *nxdata, uint32_t flags, uint64_t offset,
+           uint64_t *start, uint64_t *size, int *err)
+{
+  struct block *b;
+  bool reserved;
+  char *data;
+
+  if (zstdfile_locate_frame (h->zstd, offset, start, size) == -1) {
+    *err = EIO;
+    return NULL;
+  }
+
+  b = get_block (cache, *start, *size, &reserved);
+  if (b == NULL) {
+    *err = ENOMEM;
+    return NULL;
+  }
+  if (reserved) {
+    data = zstdfile_read_frame (h->zstd, next_ops, nxdata, flags, err,
+                                offset, start, size);
+    if (data == NULL) {
+      fail_block (cache, b);
+      put_block (cache, b);
+      return NULL;
+    }
+    fill_block (cache, b, data);
+  }
+  return b;
+}
+
+/* Read data from the file. */
+static int
+zstd_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags, int *err)
+{
+  struct zstd_handle *h = handle;
+  uint64_t exportsize = zstdfile_get_size (h->zstd);
+  uint64_t start, size, end, o;
+  struct block *b;
+  bool sequential;
+  int64_t i;
+  uint32_t n;
+
+  sequential =
+    __atomic_exchange_n (&h->next_offset, offset + count,
+                         __ATOMIC_RELAXED) == offset;
+
+  /* Start uncompressing the other frames covered by a large request
+   * in the background while this thread uncompresses the first one.
+   */
+  if (zstdfile_locate_frame (h->zstd, offset, &start, &size) == -1) {
+    *err = EIO;
+    return -1;
+  }
+  end = offset + count;
+  for (o = start + size; o < end; ) {
+    if (zstdfile_locate_frame (h->zstd, o, &start, &size) == -1)
+      break;
+    start_frame (h, next_ops, nxdata, o);
+    o = start + size;
+  }
+
+  while (count > 0) {
+    b = get_frame (h, next_ops, nxdata, flags, offset, &start, &size, err);
+    if (b == NULL)
+      return -1;
+
+    /* The request may span several frames. */
+    n = count;
+    if (start + size - offset < n)
+      n = start + size - offset;
+
+    memcpy (buf, &block_data (b)[offset-start], n);
+    put_block (cache, b);
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  /* If the client is reading sequentially, start uncompressing the
+   * frames following the request.  This is done after the requested
+   * data has been copied so that it is not delayed by uncompression,
+   * but reading the compressed data of these frames still delays the
+   * reply.
+   */
+  if (sequential) {
+    for (i = 0; i < prefetch && o < exportsize; ++i) {
+      if (zstdfile_locate_frame (h->zstd, o, &start, &size) == -1)
+        break;
+      start_frame (h, next_ops, nxdata, o);
+      o = start + size;
+    }
+  }
+
+  return 0;
+}
+
+/* Extents. */
+static int
+zstd_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+              struct nbdkit_extents *extents, int *err)
+{
+  struct zstd_handle *h = handle;
+  uint64_t end = offset + count;
+  uint64_t start, size;
+  struct block *b;
+  int zero;
+
+  while (offset < end) {
+    if (zstdfile_locate_frame (h->zstd, offset, &start, &size) == -1) {
+      *err = EIO;
+      return -1;
+    }
+    zero = zstdfile_is_zero_frame (h->zstd, offset);
+    if (zero == -1) {
+      /* Check the frame through the cache, so that it does not have
+       * to be uncompressed again when the client reads it.
+       */
+      b = get_frame (h, next_ops, nxdata, 0, offset, &start, &size, err);
+      if (b == NULL)
+        return -1;
+      zero = is_zero (block_data (b), size);
+      put_block (cache, b);
+      zstdfile_set_zero_frame (h->zstd, offset, zero);
+    }
+    if (nbdkit_add_extent (extents, start, size,
+                           zero ? NBDKIT_EXTENT_HOLE|NBDKIT_EXTENT_ZERO : 0)
+        == -1) {
+      *err = errno;
+      return -1;
+    }
+    offset = start + size;
+  }
+
+  return 0;
+}
+
+static int zstd_thread_model (void)
+{
+  return NBDKIT_THREAD_MODEL_PARALLEL;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "zstd",
+  .longname          = "nbdkit zstd filter",
+  .unload            = zstd_unload,
+  .config            = zstd_config,
+  .config_complete   = zstd_config_complete,
+  .config_help       = zstd_config_help,
+  .thread_model      = zstd_thread_model,
+  .open              = zstd_open,
+  .close             = zstd_close,
+  .prepare           = zstd_prepare,
+  .get_size          = zstd_get_size,
+  .can_write         = zstd_can_write,
+  .can_extents       = zstd_can_extents,
+  .can_cache         = zstd_can_cache,
+  .pread             = zstd_pread,
+  .extents           = zstd_extents,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
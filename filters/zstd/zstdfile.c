@@ -0,0 +1,700 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parsing of zstd files and their seek tables. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <nbdkit-filter.h>
+
+#include <zstd.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+
+#include "zstdfile.h"
+
+/* The seek table is stored in a skippable frame at the end of the
+ * file, see contrib/seekable_format/zstd_seekable_compression_format.md
+ * in the zstd sources.
+ */
+#define SEEK_TABLE_MAGIC          0x184D2A5E
+#define SEEKABLE_MAGIC            0x8F92EAB1
+#define SEEK_TABLE_FOOTER_SIZE    9
+#define SEEK_TABLE_CHECKSUM_FLAG  0x80
+
+/* Largest possible frame header. */
+#define FRAME_HEADER_SIZE_MAX     18
+
+/* Frames which compress to no more than this are checked to see if
+ * they are all zeroes (for extents).  Larger frames are assumed to
+ * contain data.
+ */
+#define ZERO_CHECK_MAX            4096
+
+struct frame {
+  uint64_t start;               /* Uncompressed offset. */
+  uint64_t size;                /* Uncompressed size. */
+  uint64_t offset;              /* Offset of frame in zstd file. */
+  uint64_t compressed_size;
+  int zero;                     /* -1 = unknown, 0 = data, 1 = zero */
+};
+
+struct zstdfile {
+  struct frame *frames;
+  size_t nr_frames;
+  uint64_t size;
+  uint64_t max_uncompressed_frame_size;
+};
+
+struct zstdframe {
+  uint64_t start;
+  uint64_t size;
+  void *in;
+  size_t in_size;
+};
+
+static int add_frame (zstdfile *zstd, uint64_t offset,
+                      uint64_t compressed_size, uint64_t size);
+static int read_seek_table (zstdfile *zstd,
+                            struct nbdkit_next_ops *next_ops, void *nxdata,
+                            int64_t file_size);
+static int scan_frames (zstdfile *zstd,
+                        struct nbdkit_next_ops *next_ops, void *nxdata,
+                        int64_t file_size);
+
+zstdfile *
+zstdfile_open (struct nbdkit_next_ops *next_ops, void *nxdata)
+{
+  zstdfile *zstd;
+  int64_t file_size;
+  int r;
+
+  zstd = calloc (1, sizeof *zstd);
+  if (zstd == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  file_size = next_ops->get_size (nxdata);
+  if (file_size == -1)
+    goto err;
+
+  r = read_seek_table (zstd, next_ops, nxdata, file_size);
+  if (r == -1)
+    goto err;
+  if (r == 0) {
+    nbdkit_debug ("zstd: no seek table, scanning frames");
+    if (scan_frames (zstd, next_ops, nxdata, file_size) == -1)
+      goto err;
+  }
+
+  if (zstd->nr_frames == 0) {
+    nbdkit_error ("zstd: file does not contain any frames");
+    goto err;
+  }
+
+  nbdkit_debug ("zstd: size %" PRIu64 " bytes (%.1fM)",
+                zstd->size, zstd->size / 1024.0 / 1024.0);
+  nbdkit_debug ("zstd: %zu frames", zstd->nr_frames);
+  nbdkit_debug ("zstd: maximum uncompressed frame size %" PRIu64
+                " bytes (%.1fM)",
+                zstd->max_uncompressed_frame_size,
+                zstd->max_uncompressed_frame_size / 1024.0 / 1024.0);
+
+  return zstd;
+
+ err:
+  zstdfile_close (zstd);
+  return NULL;
+}
+
+void
+zstdfile_close (zstdfile *zstd)
+{
+  if (zstd) {
+    free (zstd->frames);
+    free (zstd);
+  }
+}
+
+uint64_t
+zstdfile_max_uncompressed_frame_size (zstdfile *zstd)
+{
+  return zstd->max_uncompressed_frame_size;
+}
+
+uint64_t
+zstdfile_get_size (zstdfile *zstd)
+{
+  return zstd->size;
+}
+
+static int
+add_frame (zstdfile *zstd, uint64_t offset, uint64_t compressed_size,
+           uint64_t size)
+{
+  struct frame *frames;
+
+  /* Empty frames contribute nothing to the uncompressed file. */
+  if (size == 0)
+    return 0;
+
+  if (compressed_size > SIZE_MAX || size > SIZE_MAX) {
+    nbdkit_error ("zstd: frame at offset %" PRIu64 " is too large", offset);
+    return -1;
+  }
+
+  frames = realloc (zstd->frames, (zstd->nr_frames+1) * sizeof (struct frame));
+  if (frames == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  zstd->frames = frames;
+  frames[zstd->nr_frames].start = zstd->size;
+  frames[zstd->nr_frames].size = size;
+  frames[zstd->nr_frames].offset = offset;
+  frames[zstd->nr_frames].compressed_size = compressed_size;
+  frames[zstd->nr_frames].zero = -1;
+  zstd->nr_frames++;
+
+  zstd->size += size;
+  if (size > zstd->max_uncompressed_frame_size)
+    zstd->max_uncompressed_frame_size = size;
+  return 0;
+}
+
+/* Read the seek table if there is one.  Returns 1 if the index was
+ * built from the seek table, 0 if there is no seek table, or -1 on
+ * error.
+ */
+static int
+read_seek_table (zstdfile *zstd,
+                 struct nbdkit_next_ops *next_ops, void *nxdata,
+                 int64_t file_size)
+{
+  uint8_t footer[SEEK_TABLE_FOOTER_SIZE];
+  uint32_t header[2];
+  uint32_t nr_frames, entry_size, i;
+  uint64_t table_size, offset;
+  uint8_t *table = NULL;
+  int err;
+
+  if (file_size < SEEK_TABLE_FOOTER_SIZE + 8)
+    return 0;
+  if (next_ops->pread (nxdata, footer, sizeof footer,
+                       file_size - sizeof footer, 0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table footer: error %d", err);
+    return -1;
+  }
+  if (footer[5] != (SEEKABLE_MAGIC & 0xff) ||
+      footer[6] != ((SEEKABLE_MAGIC >> 8) & 0xff) ||
+      footer[7] != ((SEEKABLE_MAGIC >> 16) & 0xff) ||
+      footer[8] != (uint8_t) (SEEKABLE_MAGIC >> 24))
+    return 0;
+
+  nr_frames = footer[0] | footer[1] << 8 | footer[2] << 16 |
+    (uint32_t) footer[3] << 24;
+  entry_size = footer[4] & SEEK_TABLE_CHECKSUM_FLAG ? 12 : 8;
+  table_size = (uint64_t) nr_frames * entry_size;
+  if ((footer[4] & 0x7c) != 0 ||
+      table_size + SEEK_TABLE_FOOTER_SIZE + 8 > file_size) {
+    nbdkit_error ("zstd: seek table is corrupt");
+    return -1;
+  }
+
+  if (next_ops->pread (nxdata, header, sizeof header,
+                       file_size - sizeof footer - table_size - 8,
+                       0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table: error %d", err);
+    return -1;
+  }
+  if (le32toh (header[0]) != SEEK_TABLE_MAGIC ||
+      le32toh (header[1]) != table_size + SEEK_TABLE_FOOTER_SIZE) {
+    nbdkit_error ("zstd: seek table is corrupt");
+    return -1;
+  }
+
+  table = malloc (table_size);
+  if (table == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (next_ops->pread (nxdata, table, table_size,
+                       file_size - sizeof footer - table_size,
+                       0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table: error %d", err);
+    free (table);
+    return -1;
+  }
+
+  offset = 0;
+  for (i = 0; i < nr_frames; ++i) {
+    const uint8_t *e = &table[i * entry_size];
+    uint32_t compressed_size, size;
+
+    compressed_size = e[0] | e[1] << 8 | e[2] << 16 | (uint32_t) e[3] << 24;
+    size = e[4] | e[5] << 8 | e[6] << 16 | (uint32_t) e[7] << 24;
+    if (add_frame (zstd, offset, compressed_size, size) == -1) {
+      free (table);
+      return -1;
+    }
+    offset += compressed_size;
+  }
+  free (table);
+
+  if (offset + 8 + table_size + SEEK_TABLE_FOOTER_SIZE != file_size) {
+    nbdkit_error ("zstd: seek table does not match the size of the file");
+    return -1;
+  }
+
+  nbdkit_debug ("zstd: read seek table with %" PRIu32 " entries", nr_frames);
+  return 1;
+}
+
+/* When scanning, the file is read through a 1M buffer since frame
+ * and block headers are small and close together.
+ */
+struct reader {
+  struct nbdkit_next_ops *next_ops;
+  void *nxdata;
+  int64_t file_size;
+  uint8_t buf[1024 * 1024];
+  uint64_t buf_offset;
+  size_t buf_len;
+};
+
+static int
+read_bytes (struct reader *r, uint64_t offset, void *dst, size_t len)
+{
+  int err;
+
+  if (offset + len > r->file_size) {
+    nbdkit_error ("zstd: unexpected end of file");
+    return -1;
+  }
+
+  if (offset < r->buf_offset || offset + len > r->buf_offset + r->buf_len) {
+    r->buf_offset = offset;
+    r->buf_len = sizeof r->buf;
+    if (r->buf_offset + r->buf_len > r->file_size)
+      r->buf_len = r->file_size - r->buf_offset;
+    if (r->next_ops->pread (r->nxdata, r->buf, r->buf_len, r->buf_offset,
+                            0, &err) == -1) {
+      nbdkit_error ("zstd: read: error %d", err);
+      r->buf_len = 0;
+      return -1;
+    }
+  }
+
+  memcpy (dst, &r->buf[offset - r->buf_offset], len);
+  return 0;
+}
+
+/* Find the frames by reading each frame header and walking over the
+ * block headers in the frame.  This means reading the whole file, so
+ * it is slow for large files on remote servers.
+ */
+static int
+scan_frames (zstdfile *zstd,
+             struct nbdkit_next_ops *next_ops, void *nxdata,
+             int64_t file_size)
+{
+  struct reader *r;
+  uint64_t offset = 0, frame_offset, size;
+  uint8_t hdr[FRAME_HEADER_SIZE_MAX];
+  uint32_t magic, skip;
+  uint8_t b[3];
+  unsigned fcs_flag, did_flag, header_size;
+  bool checksum, last;
+  unsigned long long content_size;
+  static const unsigned did_size[4] = { 0, 1, 2, 4 };
+  static const unsigned fcs_size[4] = { 0, 2, 4, 8 };
+  int ret = -1;
+
+  r = malloc (sizeof *r);
+  if (r == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  r->next_ops = next_ops;
+  r->nxdata = nxdata;
+  r->file_size = file_size;
+  r->buf_offset = r->buf_len = 0;
+
+  while (offset < file_size) {
+    frame_offset = offset;
+    if (read_bytes (r, offset, &magic, 4) == -1)
+      goto out;
+    magic = le32toh (magic);
+
+    if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START) {
+      if (read_bytes (r, offset + 4, &skip, 4) == -1)
+        goto out;
+      offset += 8 + (uint64_t) le32toh (skip);
+      continue;
+    }
+    if (magic != ZSTD_MAGICNUMBER) {
+      nbdkit_error ("zstd: not a zstd file, or corrupt frame "
+                    "at offset %" PRIu64, offset);
+      goto out;
+    }
+
+    /* Parse the frame header descriptor to find the header size. */
+    if (read_bytes (r, offset + 4, &hdr[4], 1) == -1)
+      goto out;
+    fcs_flag = hdr[4] >> 6;
+    did_flag = hdr[4] & 3;
+    checksum = hdr[4] & 4;
+    header_size = 5 + (hdr[4] & 0x20 ? 0 : 1) + did_size[did_flag] +
+      (fcs_flag == 0 && (hdr[4] & 0x20) ? 1 : fcs_size[fcs_flag]);
+    if (read_bytes (r, offset, hdr, header_size) == -1)
+      goto out;
+    content_size = ZSTD_getFrameContentSize (hdr, header_size);
+    if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+      nbdkit_error ("zstd: corrupt frame header at offset %" PRIu64, offset);
+      goto out;
+    }
+    if (content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+      nbdkit_error ("zstd: frame at offset %" PRIu64 " does not record "
+                    "its uncompressed size, so the file cannot be served "
+                    "(see nbdkit-zstd-filter(1))",
+                    offset);
+      goto out;
+    }
+    offset += header_size;
+
+    /* Walk over the blocks. */
+    do {
+      if (read_bytes (r, offset, b, 3) == -1)
+        goto out;
+      last = b[0] & 1;
+      size = (b[0] | b[1] << 8 | b[2] << 16) >> 3;
+      switch ((b[0] >> 1) & 3) {
+      case 0: /* raw */
+      case 2: /* compressed */
+        offset += 3 + size;
+        break;
+      case 1: /* RLE */
+        offset += 3 + 1;
+        break;
+      default:
+        nbdkit_error ("zstd: corrupt block header at offset %" PRIu64, offset);
+        goto out;
+      }
+    } while (!last);
+    if (checksum)
+      offset += 4;
+    if (offset > file_size) {
+      nbdkit_error ("zstd: unexpected end of file");
+      goto out;
+    }
+
+    if (add_frame (zstd, frame_offset, offset - frame_offset,
+                   content_size) == -1)
+      goto out;
+  }
+
+  ret = 0;
+ out:
+  free (r);
+  return ret;
+}
+
+static struct frame *
+find_frame (zstdfile *zstd, uint64_t offset)
+{
+  size_t lo = 0, hi = zstd->nr_frames;
+
+  if (offset >= zstd->size) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the zstd file", offset);
+    return NULL;
+  }
+
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (zstd->frames[mid].start <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &zstd->frames[lo];
+}
+
+int
+zstdfile_locate_frame (zstdfile *zstd, uint64_t offset,
+                       uint64_t *start_rtn, uint64_t *size_rtn)
+{
+  struct frame *f = find_frame (zstd, offset);
+
+  if (f == NULL)
+    return -1;
+  *start_rtn = f->start;
+  *size_rtn = f->size;
+  return 0;
+}
+
+char *
+zstdfile_read_frame (zstdfile *zstd,
+                     struct nbdkit_next_ops *next_ops,
+                     void *nxdata, uint32_t flags, int *err,
+                     uint64_t offset,
+                     uint64_t *start_rtn, uint64_t *size_rtn)
+{
+  struct frame *f;
+  ZSTD_DStream *ds;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  const size_t bufsize = 1024 * 1024;
+  CLEANUP_FREE unsigned char *buf = NULL;
+  char *data = NULL;
+  uint64_t pos;
+  size_t n, r, in_pos, out_pos;
+
+  f = find_frame (zstd, offset);
+  if (f == NULL) {
+    *err = EIO;
+    return NULL;
+  }
+  *start_rtn = f->start;
+  *size_rtn = f->size;
+
+  ds = ZSTD_createDStream ();
+  if (ds == NULL) {
+    nbdkit_error ("ZSTD_createDStream: %m");
+    *err = ENOMEM;
+    return NULL;
+  }
+  r = ZSTD_initDStream (ds);
+  if (ZSTD_isError (r)) {
+    nbdkit_error ("ZSTD_initDStream: %s", ZSTD_getErrorName (r));
+    *err = EIO;
+    goto err;
+  }
+  r = 1;
+
+  data = malloc (f->size);
+  if (data == NULL) {
+    nbdkit_error ("malloc (%" PRIu64 " bytes): %m\n"
+                  "NOTE: If this error occurs, you need to recompress your "
+                  "zstd files with a smaller frame size.",
+                  f->size);
+    *err = ENOMEM;
+    goto err;
+  }
+
+  buf = malloc (bufsize);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    *err = ENOMEM;
+    goto err;
+  }
+
+  out.dst = data;
+  out.size = f->size;
+  out.pos = 0;
+  for (pos = 0; pos < f->compressed_size && r != 0; pos += n) {
+    n = bufsize;
+    if (f->compressed_size - pos < n)
+      n = f->compressed_size - pos;
+    if (next_ops->pread (nxdata, buf, n, f->offset + pos, 0, err) == -1) {
+      nbdkit_error ("zstd: read: could not read frame: error %d", *err);
+      goto err;
+    }
+
+    in.src = buf;
+    in.size = n;
+    in.pos = 0;
+    while (in.pos < in.size && r != 0) {
+      in_pos = in.pos;
+      out_pos = out.pos;
+      r = ZSTD_decompressStream (ds, &out, &in);
+      if (ZSTD_isError (r)) {
+        nbdkit_error ("zstd: could not uncompress frame: %s",
+                      ZSTD_getErrorName (r));
+        *err = EIO;
+        goto err;
+      }
+      /* No progress means the frame is larger than the index says. */
+      if (in.pos == in_pos && out.pos == out_pos)
+        goto bad_size;
+    }
+  }
+
+  if (r != 0 || out.pos != f->size)
+    goto bad_size;
+
+  ZSTD_freeDStream (ds);
+  return data;
+
+ bad_size:
+  nbdkit_error ("zstd: frame at offset %" PRIu64 " does not uncompress "
+                "to the expected %" PRIu64 " bytes", f->offset, f->size);
+  *err = EIO;
+ err:
+  ZSTD_freeDStream (ds);
+  free (data);
+  return NULL;
+}
+
+uint64_t
+zstdfile_compressed_frame_size (zstdfile *zstd, uint64_t offset)
+{
+  if (offset >= zstd->size)
+    return 0;
+  return find_frame (zstd, offset)->compressed_size;
+}
+
+zstdframe *
+zstdfile_read_compressed_frame (zstdfile *zstd,
+                                struct nbdkit_next_ops *next_ops,
+                                void *nxdata, uint32_t flags, int *err,
+                                uint64_t offset)
+{
+  struct frame *f;
+  zstdframe *zf;
+  const size_t bufsize = 1024 * 1024;
+  size_t pos, n;
+
+  f = find_frame (zstd, offset);
+  if (f == NULL) {
+    *err = EIO;
+    return NULL;
+  }
+
+  zf = malloc (sizeof *zf);
+  if (zf == NULL) {
+    nbdkit_error ("malloc: %m");
+    *err = errno;
+    return NULL;
+  }
+  zf->start = f->start;
+  zf->size = f->size;
+  zf->in_size = f->compressed_size;
+  zf->in = malloc (zf->in_size);
+  if (zf->in == NULL) {
+    nbdkit_error ("malloc: %m");
+    *err = errno;
+    free (zf);
+    return NULL;
+  }
+
+  for (pos = 0; pos < zf->in_size; pos += n) {
+    n = zf->in_size - pos;
+    if (n > bufsize)
+      n = bufsize;
+    if (next_ops->pread (nxdata, zf->in + pos, n, f->offset + pos,
+                         0, err) == -1) {
+      nbdkit_error ("zstd: read: could not read frame: error %d", *err);
+      zstdfile_free_compressed_frame (zf);
+      return NULL;
+    }
+  }
+
+  return zf;
+}
+
+void
+zstdfile_free_compressed_frame (zstdframe *zf)
+{
+  if (zf) {
+    free (zf->in);
+    free (zf);
+  }
+}
+
+char *
+zstdfile_decode_frame (zstdframe *zf)
+{
+  char *data;
+  size_t r;
+
+  data = malloc (zf->size);
+  if (data == NULL) {
+    nbdkit_error ("malloc (%" PRIu64 " bytes): %m\n"
+                  "NOTE: If this error occurs, you need to recompress your "
+                  "zstd files with a smaller frame size.",
+                  zf->size);
+    return NULL;
+  }
+
+  r = ZSTD_decompress (data, zf->size, zf->in, zf->in_size);
+  if (ZSTD_isError (r)) {
+    nbdkit_error ("zstd: could not uncompress frame: %s",
+                  ZSTD_getErrorName (r));
+    free (data);
+    return NULL;
+  }
+  if (r != zf->size) {
+    nbdkit_error ("zstd: frame uncompressed to %zu bytes, "
+                  "expected %" PRIu64, r, zf->size);
+    free (data);
+    return NULL;
+  }
+
+  return data;
+}
+
+int
+zstdfile_is_zero_frame (zstdfile *zstd, uint64_t offset)
+{
+  struct frame *f;
+
+  f = find_frame (zstd, offset);
+  if (f == NULL)
+    return 0;
+
+  /* Only a frame which compresses extremely well can be all zeroes.
+   * Other frames are assumed to contain data.
+   */
+  if (f->compressed_size > ZERO_CHECK_MAX)
+    return 0;
+  return __atomic_load_n (&f->zero, __ATOMIC_RELAXED);
+}
+
+void
+zstdfile_set_zero_frame (zstdfile *zstd, uint64_t offset, bool zero)
+{
+  struct frame *f;
+
+  f = find_frame (zstd, offset);
+  if (f)
+    __atomic_store_n (&f->zero, zero, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,126 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parsing of zstd files and their seek tables. */
+
+#ifndef NBDKIT_ZSTDFILE_H
+#define NBDKIT_ZSTDFILE_H
+
+#include <stdbool.h>
+
+#include <nbdkit-filter.h>
+
+typedef struct zstdfile zstdfile;
+
+/* Open the zstd file and build the index of frames, either from the
+ * seek table or by scanning the frame headers.
+ */
+extern zstdfile *zstdfile_open (struct nbdkit_next_ops *next_ops,
+                                void *nxdata);
+
+/* Close the file and free up all resources. */
+extern void zstdfile_close (zstdfile *);
+
+/* Get (uncompressed) size of the largest frame in the file. */
+extern uint64_t zstdfile_max_uncompressed_frame_size (zstdfile *);
+
+/* Get the total uncompressed size of the file. */
+extern uint64_t zstdfile_get_size (zstdfile *);
+
+/* Find the frame that contains the byte at 'offset' in the
+ * uncompressed file.  The start offset & size of the frame relative
+ * to the uncompressed file are returned in *start and *size.
+ */
+extern int zstdfile_locate_frame (zstdfile *zstd, uint64_t offset,
+                                  uint64_t *start, uint64_t *size);
+
+/* Read and uncompress the frame that contains the byte at 'offset'
+ * in the uncompressed file.  The compressed data is read and
+ * uncompressed a megabyte at a time, so only the uncompressed frame
+ * has to be held in memory.
+ *
+ * The uncompressed frame, which probably begins before the requested
+ * byte, is returned.  The caller must free it.  NULL is returned if
+ * there was an error.
+ *
+ * The start offset & size of the frame relative to the uncompressed
+ * file are returned in *start and *size.
+ */
+extern char *zstdfile_read_frame (zstdfile *zstd,
+                                  struct nbdkit_next_ops *next_ops,
+                                  void *nxdata, uint32_t flags, int *err,
+                                  uint64_t offset,
+                                  uint64_t *start, uint64_t *size);
+
+/* Return the compressed size of the frame containing 'offset', or 0
+ * if the offset is not in the file.
+ */
+extern uint64_t zstdfile_compressed_frame_size (zstdfile *zstd,
+                                                uint64_t offset);
+
+/* A compressed frame read from the zstd file.  The whole compressed
+ * frame is held in memory so that it can be uncompressed in another
+ * thread, which cannot call into the underlying plugin.
+ */
+typedef struct zstdframe zstdframe;
+
+/* Read the compressed frame that contains the byte at 'offset' in the
+ * uncompressed file.  NULL is returned if there was an error.  The
+ * caller must free the frame using zstdfile_free_compressed_frame.
+ */
+extern zstdframe *zstdfile_read_compressed_frame (zstdfile *zstd,
+                                                  struct nbdkit_next_ops *next_ops,
+                                                  void *nxdata, uint32_t flags,
+                                                  int *err, uint64_t offset);
+
+extern void zstdfile_free_compressed_frame (zstdframe *);
+
+/* Uncompress a frame which has been read by
+ * zstdfile_read_compressed_frame.  This does not access the
+ * underlying plugin, and is safe to call from any thread.
+ *
+ * The uncompressed frame is returned.  The caller must free it.
+ * NULL is returned if there was an error.
+ */
+extern char *zstdfile_decode_frame (zstdframe *);
+
+/* Return 1 if the frame containing 'offset' is all zeroes, 0 if not,
+ * or -1 if this is not known yet.  Only frames which compress very
+ * well can be all zeroes.  The caller must uncompress those to check
+ * them, and record the answer with zstdfile_set_zero_frame.
+ */
+extern int zstdfile_is_zero_frame (zstdfile *zstd, uint64_t offset);
+
+extern void zstdfile_set_zero_frame (zstdfile *zstd, uint64_t offset,
+                                     bool zero);
+
+#endif /* NBDKIT_ZSTDFILE_H */
@@ -61,6 +61,11 @@ extern size_t nbdkit_extents_count (const struct nbdkit_extents *);
 extern struct nbdkit_extent nbdkit_get_extent (const struct nbdkit_extents *,
                                                size_t);
 
+extern void nbdkit_set_gauge (const char *name, const char *help,
+                              double value);
+extern void nbdkit_register_gauge (const char *name, const char *help,
+                                   const uint64_t *value);
+
 typedef int nbdkit_next_config (void *nxdata,
                                 const char *key, const char *value);
 typedef int nbdkit_next_config_complete (void *nxdata);
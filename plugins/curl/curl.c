@@ -51,11 +51,17 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <curl/curl.h>
 
 #include <nbdkit-plugin.h>
 
+#include "cleanup.h"
+#include "utils.h"
+
 static const char *url = NULL;
 static const char *user = NULL;
 static char *password = NULL;
@@ -66,6 +72,9 @@ static bool sslverify = true;
 static uint32_t timeout = 0;
 static const char *unix_socket_path = NULL;
 static long protocols = CURLPROTO_ALL;
+static unsigned connections = 4;
+static unsigned metadata_ttl = 0;
+static uint32_t min_fetch = 0;
 
 /* Use '-D curl.verbose=1' to set. */
 int curl_debug_verbose = 0;
@@ -82,12 +91,15 @@ curl_load (void)
   }
 }
 
+static void stop_worker (void);
+
 static void
 curl_unload (void)
 {
   free (password);
   free (proxy_password);
   free (cookie);
+  stop_worker ();
   curl_global_cleanup ();
 }
 
@@ -176,6 +188,25 @@ curl_config (const char *key, const char *value)
   else if (strcmp (key, "user") == 0)
     user = value;
 
+  else if (strcmp (key, "metadata-ttl") == 0 ||
+           strcmp (key, "metadata_ttl") == 0) {
+    if (nbdkit_parse_unsigned ("metadata-ttl", value, &metadata_ttl) == -1)
+      return -1;
+  }
+
+  else if (strcmp (key, "min-fetch") == 0 ||
+           strcmp (key, "min_fetch") == 0) {
+    int64_t size = nbdkit_parse_size (value);
+
+    if (size == -1)
+      return -1;
+    if (size > 64 * 1024 * 1024) {
+      nbdkit_error ("min-fetch must be no larger than 64M");
+      return -1;
+    }
+    min_fetch = size;
+  }
+
   else if (strcmp (key, "password") == 0) {
     free (password);
     if (nbdkit_read_password (value, &password) == -1)
@@ -191,6 +222,15 @@ curl_config (const char *key, const char *value)
       return -1;
   }
 
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
+
   else if (strcmp (key, "cookie") == 0) {
     free (cookie);
     if (nbdkit_read_password (value, &cookie) == -1)
@@ -249,7 +289,10 @@ curl_config_complete (void)
 }
 
 #define curl_config_help \
+  "connections=<N>            Maximum number of parallel HTTP requests.\n" \
   "cookie=<COOKIE>            Set HTTP/HTTPS cookies.\n" \
+  "metadata-ttl=<SECS>        Cache the remote file size (default 0).\n" \
+  "min-fetch=<SIZE>           Minimum size of HTTP range requests.\n" \
   "password=<PASSWORD>        The password for the user account.\n" \
   "protocols=PROTO,PROTO,..   Limit protocols allowed.\n" \
   "proxy-password=<PASSWORD>  The proxy password.\n" \
@@ -260,18 +303,66 @@ curl_config_complete (void)
   "url=<URL>       (required) The disk image URL to serve.\n" \
   "user=<USER>                The user to log in as."
 
-/* The per-connection handle. */
+/* Easy handles are kept in a pool shared by all connections.  A
+ * background worker thread drives every transfer through a single
+ * curl_multi handle, so concurrent NBD requests become concurrent
+ * HTTP requests sharing libcurl's cache of keep-alive (or HTTP/2
+ * multiplexed) connections to the server.
+ */
 struct curl_handle {
   CURL *c;
+  bool in_use;                  /* Taken from the pool by a request. */
   bool accept_range;
-  int64_t exportsize;
   char errbuf[CURL_ERROR_SIZE];
   char *write_buf;
   uint32_t write_count;
   const char *read_buf;
   uint32_t read_count;
+
+  /* Used to hand the transfer to the worker thread and wait for it. */
+  struct curl_handle *next;     /* Next in the submission queue. */
+  bool done;
+  CURLcode result;
+  pthread_cond_t cond;
 };
 
+/* The per-connection handle. */
+struct curl_conn {
+  int64_t exportsize;
+};
+
+/* Protects all of the pool and worker state below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handle_freed = PTHREAD_COND_INITIALIZER;
+static struct curl_handle **pool = NULL;
+static size_t pool_size = 0;
+static struct curl_handle *queue = NULL;
+static bool worker_started = false;
+static bool worker_quit = false;
+static pthread_t worker_thread;
+static int wakeup_fds[2] = { -1, -1 };
+
+/* The result of the last HEAD request, reused by curl_open for
+ * metadata-ttl=SECS.  Also protected by the lock.
+ */
+static int64_t cached_size = -1;
+static struct timespec cached_time;
+
+/* With min-fetch=SIZE, small reads fetch at least SIZE bytes and the
+ * surplus is kept in one of these buffers (one per pool handle, so
+ * each concurrent sequential reader can keep its own).  Also protected
+ * by the lock.
+ */
+struct fetch_buffer {
+  char *data;                   /* NULL if the slot is empty. */
+  uint64_t offset;
+  uint32_t len;
+  uint64_t last_used;
+};
+static struct fetch_buffer *fetch_buffers = NULL;
+static uint64_t fetch_clock = 0;
+static uint64_t write_generation = 0;
+
 /* Translate CURLcode to nbdkit_error. */
 #define display_curl_error(h, r, fs, ...)                       \
   do {                                                          \
@@ -283,19 +374,30 @@ static size_t header_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t write_cb (char *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t read_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 
-/* Create the per-connection handle. */
-static void *
-curl_open (int readonly)
+static void
+free_handle (struct curl_handle *h)
+{
+  if (h->c)
+    curl_easy_cleanup (h->c);
+  pthread_cond_destroy (&h->cond);
+  free (h);
+}
+
+/* Create a new easy handle for the pool, with all of the options
+ * which are common to every request.
+ */
+static struct curl_handle *
+allocate_handle (void)
 {
   struct curl_handle *h;
   CURLcode r;
-  double d;
 
   h = calloc (1, sizeof *h);
   if (h == NULL) {
     nbdkit_error ("calloc: %m");
     return NULL;
   }
+  pthread_cond_init (&h->cond, NULL);
 
   h->c = curl_easy_init ();
   if (h->c == NULL) {
@@ -313,6 +415,11 @@ curl_open (int readonly)
 
   curl_easy_setopt (h->c, CURLOPT_ERRORBUFFER, h->errbuf);
 
+  /* The worker thread uses this to find the handle of a finished
+   * transfer.
+   */
+  curl_easy_setopt (h->c, CURLOPT_PRIVATE, h);
+
   r = CURLE_OK;
   if (unix_socket_path) {
 #if HAVE_CURLOPT_UNIX_SOCKET_PATH
@@ -361,66 +468,366 @@ curl_open (int readonly)
     curl_easy_setopt (h->c, CURLOPT_PROXYPASSWORD, proxy_password);
   if (cookie)
     curl_easy_setopt (h->c, CURLOPT_COOKIE, cookie);
+#ifdef CURLPIPE_MULTIPLEX
+  /* Prefer waiting for a connection which can be multiplexed (HTTP/2)
+   * over opening a new connection.
+   */
+  curl_easy_setopt (h->c, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+  /* Get set up for reading and writing. */
+  curl_easy_setopt (h->c, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt (h->c, CURLOPT_WRITEDATA, h);
+  curl_easy_setopt (h->c, CURLOPT_READFUNCTION, read_cb);
+  curl_easy_setopt (h->c, CURLOPT_READDATA, h);
+
+  return h;
+
+ err:
+  free_handle (h);
+  return NULL;
+}
+
+/* Take a free easy handle from the pool, allocating a new one if
+ * fewer than connections=N exist, otherwise waiting for one to be
+ * returned.
+ */
+static struct curl_handle *
+get_handle (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct curl_handle *h;
+  size_t i;
+
+  for (;;) {
+    for (i = 0; i < pool_size; ++i) {
+      if (!pool[i]->in_use) {
+        pool[i]->in_use = true;
+        return pool[i];
+      }
+    }
+
+    if (pool_size < connections) {
+      h = allocate_handle ();
+      if (h == NULL)
+        return NULL;
+      pool[pool_size++] = h;
+      h->in_use = true;
+      return h;
+    }
+
+    pthread_cond_wait (&handle_freed, &lock);
+  }
+}
+
+static void
+put_handle (struct curl_handle *h)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  h->in_use = false;
+  pthread_cond_signal (&handle_freed);
+}
+
+static void
+wakeup_worker (void)
+{
+  char c = 0;
+
+  if (write (wakeup_fds[1], &c, 1) == -1 && errno != EAGAIN)
+    nbdkit_debug ("curl: write: wakeup pipe: %m");
+}
+
+/* The worker thread owns the multi handle.  It adds submitted easy
+ * handles to it, drives all transfers and wakes the caller of
+ * perform() when its transfer finishes.
+ */
+static void *
+worker (void *multi_vp)
+{
+  CURLM *multi = multi_vp;
+  struct curl_handle *h, *next;
+  CURLMsg *msg;
+  struct curl_waitfd waitfd;
+  int running, n;
+  char buf[64];
+
+  for (;;) {
+    pthread_mutex_lock (&lock);
+    if (worker_quit) {
+      pthread_mutex_unlock (&lock);
+      break;
+    }
+    h = queue;
+    queue = NULL;
+    pthread_mutex_unlock (&lock);
+
+    for (; h != NULL; h = next) {
+      CURLMcode mc;
+
+      next = h->next;
+      mc = curl_multi_add_handle (multi, h->c);
+      if (mc != CURLM_OK) {
+        nbdkit_debug ("curl_multi_add_handle: %s", curl_multi_strerror (mc));
+        pthread_mutex_lock (&lock);
+        h->result = CURLE_FAILED_INIT;
+        h->done = true;
+        pthread_cond_signal (&h->cond);
+        pthread_mutex_unlock (&lock);
+      }
+    }
+
+    curl_multi_perform (multi, &running);
+
+    while ((msg = curl_multi_info_read (multi, &n)) != NULL) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+      curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &h);
+      curl_multi_remove_handle (multi, msg->easy_handle);
+      pthread_mutex_lock (&lock);
+      h->result = msg->data.result;
+      h->done = true;
+      pthread_cond_signal (&h->cond);
+      pthread_mutex_unlock (&lock);
+    }
+
+    waitfd.fd = wakeup_fds[0];
+    waitfd.events = CURL_WAIT_POLLIN;
+    waitfd.revents = 0;
+    curl_multi_wait (multi, &waitfd, 1, 1000, NULL);
+    if (waitfd.revents)
+      while (read (wakeup_fds[0], buf, sizeof buf) > 0)
+        ;
+  }
+
+  curl_multi_cleanup (multi);
+  return NULL;
+}
+
+/* Start the worker thread.  This is deferred until the first client
+ * connects because nbdkit may fork into the background after the
+ * plugin is loaded.
+ */
+static int
+start_worker (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  CURLM *multi;
+  int err;
+
+  if (worker_started)
+    return 0;
+
+  pool = calloc (connections, sizeof *pool);
+  fetch_buffers = calloc (connections, sizeof *fetch_buffers);
+  if (pool == NULL || fetch_buffers == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+
+#ifdef HAVE_PIPE2
+  if (pipe2 (wakeup_fds, O_NONBLOCK|O_CLOEXEC) == -1) {
+    nbdkit_error ("pipe2: %m");
+    return -1;
+  }
+#else
+  /* This plugin doesn't fork, so we don't care about CLOEXEC. */
+  if (pipe (wakeup_fds) == -1) {
+    nbdkit_error ("pipe: %m");
+    return -1;
+  }
+  if (set_nonblock (wakeup_fds[0]) == -1 ||
+      set_nonblock (wakeup_fds[1]) == -1) {
+    close (wakeup_fds[0]);
+    close (wakeup_fds[1]);
+    wakeup_fds[0] = wakeup_fds[1] = -1;
+    return -1;
+  }
+#endif
+
+  multi = curl_multi_init ();
+  if (multi == NULL) {
+    nbdkit_error ("curl_multi_init: failed");
+    return -1;
+  }
+  curl_multi_setopt (multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) connections);
+#ifdef CURLPIPE_MULTIPLEX
+  curl_multi_setopt (multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+  err = pthread_create (&worker_thread, NULL, worker, multi);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    curl_multi_cleanup (multi);
+    return -1;
+  }
+  worker_started = true;
+  return 0;
+}
+
+static void
+stop_worker (void)
+{
+  size_t i;
+
+  if (worker_started) {
+    pthread_mutex_lock (&lock);
+    worker_quit = true;
+    pthread_mutex_unlock (&lock);
+    wakeup_worker ();
+    pthread_join (worker_thread, NULL);
+  }
+
+  for (i = 0; i < pool_size; ++i)
+    free_handle (pool[i]);
+  free (pool);
+  if (fetch_buffers) {
+    for (i = 0; i < connections; ++i)
+      free (fetch_buffers[i].data);
+    free (fetch_buffers);
+  }
+  if (wakeup_fds[0] >= 0) {
+    close (wakeup_fds[0]);
+    close (wakeup_fds[1]);
+  }
+}
+
+/* Run the transfer which has been set up on the easy handle and wait
+ * for it to finish.
+ */
+static CURLcode
+perform (struct curl_handle *h)
+{
+  CURLcode r;
+
+  pthread_mutex_lock (&lock);
+  h->done = false;
+  h->next = queue;
+  queue = h;
+  pthread_mutex_unlock (&lock);
+
+  wakeup_worker ();
+
+  pthread_mutex_lock (&lock);
+  while (!h->done)
+    pthread_cond_wait (&h->cond, &lock);
+  r = h->result;
+  pthread_mutex_unlock (&lock);
+
+  return r;
+}
+
+/* Make a HEAD request to find the size of the remote file and check
+ * that the server supports byte ranges.
+ */
+static int64_t
+head_request (void)
+{
+  struct curl_handle *h;
+  CURLcode r;
+  double d;
+  int64_t size = -1;
+
+  h = get_handle ();
+  if (h == NULL)
+    return -1;
 
   /* Get the file size and also whether the remote HTTP server
    * supports byte ranges.
    */
   h->accept_range = false;
+  curl_easy_setopt (h->c, CURLOPT_HTTPGET, 1);
   curl_easy_setopt (h->c, CURLOPT_NOBODY, 1); /* No Body, not nobody! */
   curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, header_cb);
   curl_easy_setopt (h->c, CURLOPT_HEADERDATA, h);
-  r = curl_easy_perform (h->c);
+  r = perform (h);
+  curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt (h->c, CURLOPT_HEADERDATA, NULL);
   if (r != CURLE_OK) {
     display_curl_error (h, r,
                         "problem doing HEAD request to fetch size of URL [%s]",
                         url);
-    goto err;
+    goto out;
   }
 
   r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
   if (r != CURLE_OK) {
     display_curl_error (h, r, "could not get length of remote file [%s]", url);
-    goto err;
+    goto out;
   }
 
   if (d == -1) {
     nbdkit_error ("could not get length of remote file [%s], "
                   "is the URL correct?", url);
-    goto err;
+    goto out;
   }
 
-  h->exportsize = (size_t) d;
-  nbdkit_debug ("content length: %" PRIi64, h->exportsize);
+  nbdkit_debug ("content length: %" PRIi64, (int64_t) d);
 
   if (strncasecmp (url, "http://", strlen ("http://")) == 0 ||
       strncasecmp (url, "https://", strlen ("https://")) == 0) {
     if (!h->accept_range) {
       nbdkit_error ("server does not support 'range' (byte range) requests");
-      goto err;
+      goto out;
     }
 
     nbdkit_debug ("accept range supported (for HTTP/HTTPS)");
   }
 
-  /* Get set up for reading and writing. */
-  curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, NULL);
-  curl_easy_setopt (h->c, CURLOPT_HEADERDATA, NULL);
-  curl_easy_setopt (h->c, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt (h->c, CURLOPT_WRITEDATA, h);
-  if (!readonly) {
-    curl_easy_setopt (h->c, CURLOPT_READFUNCTION, read_cb);
-    curl_easy_setopt (h->c, CURLOPT_READDATA, h);
+  size = (size_t) d;
+
+ out:
+  put_handle (h);
+  return size;
+}
+
+/* Create the per-connection handle. */
+static void *
+curl_open (int readonly)
+{
+  struct curl_conn *conn;
+  struct timespec now;
+  int64_t size;
+
+  if (start_worker () == -1)
+    return NULL;
+
+  conn = calloc (1, sizeof *conn);
+  if (conn == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
   }
 
-  nbdkit_debug ("returning new handle %p", h);
+  /* Clients such as qemu-img open many short-lived connections, so
+   * reuse the result of a recent HEAD request if there is one.
+   */
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock (&lock);
+  size = -1;
+  if (metadata_ttl > 0 && cached_size >= 0 &&
+      now.tv_sec - cached_time.tv_sec < metadata_ttl)
+    size = cached_size;
+  pthread_mutex_unlock (&lock);
+
+  if (size >= 0)
+    nbdkit_debug ("content length: %" PRIi64 " (cached)", size);
+  else {
+    size = head_request ();
+    if (size == -1) {
+      free (conn);
+      return NULL;
+    }
+    pthread_mutex_lock (&lock);
+    cached_size = size;
+    cached_time = now;
+    pthread_mutex_unlock (&lock);
+  }
+  conn->exportsize = size;
 
-  return h;
+  nbdkit_debug ("returning new handle %p", conn);
 
- err:
-  if (h->c)
-    curl_easy_cleanup (h->c);
-  free (h);
-  return NULL;
+  return conn;
 }
 
 static size_t
@@ -454,31 +861,37 @@ header_cb (void *ptr, size_t size, size_t nmemb, void *opaque)
 static void
 curl_close (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct curl_conn *conn = handle;
 
-  curl_easy_cleanup (h->c);
-  free (h);
+  free (conn);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+/* All requests go through the shared pool, so they may run in
+ * parallel.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 curl_get_size (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct curl_conn *conn = handle;
 
-  return h->exportsize;
+  return conn->exportsize;
 }
 
-/* Read data from the remote server. */
+/* Fetch a range of the remote file with a single HTTP request. */
 static int
-curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+fetch (void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
+  struct curl_handle *h;
   CURLcode r;
   char range[128];
 
+  h = get_handle ();
+  if (h == NULL)
+    return -1;
+
   /* Tell the write_cb where we want the data to be written.  write_cb
    * will update this if the data comes in multiple sections.
    */
@@ -493,9 +906,10 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   curl_easy_setopt (h->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = perform (h);
   if (r != CURLE_OK) {
     display_curl_error (h, r, "pread: curl_easy_perform");
+    put_handle (h);
     return -1;
   }
 
@@ -506,6 +920,117 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   /* As far as I understand the cURL API, this should never happen. */
   assert (h->write_count == 0);
 
+  put_handle (h);
+  return 0;
+}
+
+/* If the read is entirely contained in a buffer left over from an
+ * earlier min-fetch request, copy it and return true.
+ */
+static bool
+read_from_fetch_buffers (void *buf, uint32_t count, uint64_t offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  size_t i;
+
+  for (i = 0; i < connections; ++i) {
+    struct fetch_buffer *fb = &fetch_buffers[i];
+
+    if (fb->data && offset >= fb->offset &&
+        offset + count <= fb->offset + fb->len) {
+      memcpy (buf, fb->data + (offset - fb->offset), count);
+      fb->last_used = ++fetch_clock;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Keep the data from a min-fetch request, replacing the least
+ * recently used buffer.  If a write happened while the data was being
+ * fetched it may be stale, so it is dropped instead.
+ */
+static void
+save_fetch_buffer (char *data, uint32_t len, uint64_t offset,
+                   uint64_t generation)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct fetch_buffer *victim = &fetch_buffers[0];
+  size_t i;
+
+  if (generation != write_generation) {
+    free (data);
+    return;
+  }
+
+  for (i = 1; i < connections; ++i) {
+    if (fetch_buffers[i].last_used < victim->last_used)
+      victim = &fetch_buffers[i];
+  }
+  free (victim->data);
+  victim->data = data;
+  victim->offset = offset;
+  victim->len = len;
+  victim->last_used = ++fetch_clock;
+}
+
+/* Drop any fetch buffers overlapping a write. */
+static void
+invalidate_fetch_buffers (uint32_t count, uint64_t offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  size_t i;
+
+  write_generation++;
+  for (i = 0; i < connections; ++i) {
+    struct fetch_buffer *fb = &fetch_buffers[i];
+
+    if (fb->data && offset < fb->offset + fb->len &&
+        fb->offset < offset + count) {
+      free (fb->data);
+      fb->data = NULL;
+    }
+  }
+}
+
+/* Read data from the remote server. */
+static int
+curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  struct curl_conn *conn = handle;
+  uint64_t generation;
+  uint32_t len;
+  char *data;
+
+  if (count >= min_fetch)
+    return fetch (buf, count, offset);
+
+  /* Small reads are rounded up to min-fetch bytes, and the surplus
+   * is kept to satisfy the following reads.
+   */
+  if (read_from_fetch_buffers (buf, count, offset))
+    return 0;
+
+  len = min_fetch;
+  if (offset + len > conn->exportsize)
+    len = conn->exportsize - offset;
+
+  data = malloc (len);
+  if (data == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  pthread_mutex_lock (&lock);
+  generation = write_generation;
+  pthread_mutex_unlock (&lock);
+
+  if (fetch (data, len, offset) == -1) {
+    free (data);
+    return -1;
+  }
+  memcpy (buf, data, count);
+  save_fetch_buffer (data, len, offset, generation);
   return 0;
 }
 
@@ -536,10 +1061,20 @@ write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 static int
 curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
+  struct curl_handle *h;
   CURLcode r;
   char range[128];
 
+  /* Drop overlapping fetch buffers before the write, so no read
+   * can be satisfied from them while the write is in progress.
+   */
+  if (min_fetch > 0)
+    invalidate_fetch_buffers (count, offset);
+
+  h = get_handle ();
+  if (h == NULL)
+    return -1;
+
   /* Tell the read_cb where we want the data to be read from.  read_cb
    * will update this if the data comes in multiple sections.
    */
@@ -554,9 +1089,18 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   curl_easy_setopt (h->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = perform (h);
+
+  /* A min-fetch read which ran while the upload was in progress may
+   * have saved data from before the write, so invalidate again now
+   * that the write has completed (or failed part way through).
+   */
+  if (min_fetch > 0)
+    invalidate_fetch_buffers (count, offset);
+
   if (r != CURLE_OK) {
     display_curl_error (h, r, "pwrite: curl_easy_perform");
+    put_handle (h);
     return -1;
   }
 
@@ -567,6 +1111,7 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   /* As far as I understand the cURL API, this should never happen. */
   assert (h->read_count == 0);
 
+  put_handle (h);
   return 0;
 }
 
@@ -34,12 +34,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include <nbdkit-plugin.h>
 
+#include "fdcache.h"
 #include "regions.h"
 
 #include "virtual-floppy.h"
@@ -53,6 +56,9 @@ static const char *label = "NBDKITFLOPY";
 /* Virtual floppy. */
 static struct virtual_floppy floppy;
 
+/* Cache of open host files. */
+static struct fdcache fdcache = FDCACHE_INIT;
+
 static void
 floppy_load (void)
 {
@@ -62,6 +68,7 @@ floppy_load (void)
 static void
 floppy_unload (void)
 {
+  fdcache_close (&fdcache);
   free (dir);
   free_virtual_floppy (&floppy);
 }
@@ -140,13 +147,16 @@ floppy_can_cache (void *handle)
 static int
 floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  const struct region *region = find_region (&floppy.regions, offset);
+
   while (count > 0) {
-    const struct region *region = find_region (&floppy.regions, offset);
     size_t i, len;
     const char *host_path;
-    int fd;
+    int fd, slot;
     ssize_t r;
 
+    region = next_region (&floppy.regions, region, offset);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -157,23 +167,21 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
       i = region->u.i;
       assert (i < floppy.nr_files);
       host_path = floppy.files[i].host_path;
-      fd = open (host_path, O_RDONLY|O_CLOEXEC);
-      if (fd == -1) {
-        nbdkit_error ("open: %s: %m", host_path);
+      slot = fdcache_get (&fdcache, i, host_path, offset - region->start, len, &fd);
+      if (slot == -2)
         return -1;
-      }
       r = pread (fd, buf, len, offset - region->start);
       if (r == -1) {
         nbdkit_error ("pread: %s: %m", host_path);
-        close (fd);
+        fdcache_put (&fdcache, slot, fd);
         return -1;
       }
       if (r == 0) {
         nbdkit_error ("pread: %s: unexpected end of file", host_path);
-        close (fd);
+        fdcache_put (&fdcache, slot, fd);
         return -1;
       }
-      close (fd);
+      fdcache_put (&fdcache, slot, fd);
       len = r;
       break;
 
@@ -35,27 +35,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <zlib.h>
 
 #include <nbdkit-plugin.h>
 
-static char *filename = NULL;
+#include "byte-swapping.h"
+#include "cleanup.h"
 
-static void
-gzip_unload (void)
-{
-  free (filename);
-}
+/* Size of the deflate window which must be saved with each
+ * checkpoint.  This is fixed by the deflate format.
+ */
+#define WINSIZE 32768
 
-/* Called for each key=value passed on the command line.  This plugin
- * only accepts file=<filename>, which is required.
+/* Size of the compressed input buffer used by each cursor. */
+#define INBUFSIZE (128 * 1024)
+
+/* Number of inflate cursors shared between all connections.  This
+ * limits how many requests can be decompressing concurrently.
  */
+#define NR_CURSORS 16
+
+static char *filename = NULL;
+static char *indexfile = NULL;
+static uint64_t span = 8 * 1024 * 1024;
+
+/* Called for each key=value passed on the command line. */
 static int
 gzip_config (const char *key, const char *value)
 {
@@ -65,6 +81,22 @@ gzip_config (const char *key, const char *value)
     if (!filename)
       return -1;
   }
+  else if (strcmp (key, "index") == 0) {
+    free (indexfile);
+    indexfile = nbdkit_absolute_path (value);
+    if (!indexfile)
+      return -1;
+  }
+  else if (strcmp (key, "index-span") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < 65536 || r > UINT32_MAX) {
+      nbdkit_error ("index-span must be between 64K and 4G");
+      return -1;
+    }
+    span = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -87,129 +119,771 @@ gzip_config_complete (void)
 }
 
 #define gzip_config_help \
-  "file=<FILENAME>     (required) The filename to serve."
-
-/* Translate a gzerror to nbdkit_error. */
-#define nbdkit_gzerror(gz, fs, ...)                        \
-  do {                                                     \
-    int gzerrnum;                                          \
-    const char *gzerr = gzerror ((gz), &gzerrnum);         \
-    if (gzerrnum == Z_ERRNO) {                             \
-      nbdkit_error ((fs ": %m"), ## __VA_ARGS__);          \
-    } else {                                               \
-      nbdkit_error ((fs ": %s"), ## __VA_ARGS__, gzerr);   \
-    }                                                      \
-  } while (0)
-
-/* The per-connection handle. */
-struct gzip_handle {
-  gzFile gz;
-  uint64_t exportsize;
+  "file=<FILENAME>     (required) The filename to serve.\n" \
+  "index=<FILENAME>               Load and save the seek index here.\n" \
+  "index-span=<SIZE>              Distance between checkpoints (default 8M)."
+
+/* The index is a list of checkpoints, built in the style of zran.c
+ * from the zlib examples.  Each checkpoint records a deflate block
+ * boundary: the uncompressed offset, the offset in the compressed
+ * file of the first complete byte of the block, the number of bits
+ * of the preceding byte which belong to the block, and the 32K of
+ * uncompressed data preceding the checkpoint which the block may
+ * refer back to.  Starting inflate at any checkpoint only requires
+ * priming it with those bits and setting the dictionary.
+ *
+ * The index is built once (when the first client connects) and is
+ * shared between all connections.  If index=FILE was given it is
+ * also saved there so that it does not have to be rebuilt next time
+ * nbdkit serves the same file.
+ */
+struct point {
+  uint64_t out;                 /* Uncompressed offset. */
+  uint64_t in;                  /* Compressed offset. */
+  unsigned bits;                /* Bits of the byte at in-1, or 0. */
 };
 
-/* Create the per-connection handle. */
-static void *
-gzip_open (int readonly)
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool index_built = false;
+static int fd = -1;             /* The compressed file. */
+static bool uncompressed;       /* The file is not gzip, serve as-is. */
+static uint64_t exportsize;
+static struct point *points = NULL;
+static unsigned char *windows = NULL; /* WINSIZE bytes per point. */
+static size_t nr_points = 0;
+
+/* An inflate cursor.  A cursor which has finished a request remembers
+ * where it stopped, so that a client reading sequentially carries on
+ * decompressing from there instead of going back to the preceding
+ * checkpoint each time.
+ */
+struct cursor {
+  bool in_use;
+  bool valid;                   /* strm is positioned at pos. */
+  bool inited;                  /* inflateInit2 has been called. */
+  bool raw;                     /* Raw deflate (no gzip header/trailer). */
+  z_stream strm;
+  uint64_t pos;                 /* Uncompressed offset of strm. */
+  uint64_t in_off;              /* Next compressed offset to read. */
+  uint64_t last_used;
+  unsigned char *inbuf;
+  unsigned char *discard;
+};
+
+static pthread_mutex_t cursors_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cursor_freed = PTHREAD_COND_INITIALIZER;
+static struct cursor cursors[NR_CURSORS];
+static uint64_t cursor_clock = 0;
+
+static void
+free_index (void)
+{
+  free (points);
+  free (windows);
+  points = NULL;
+  windows = NULL;
+  nr_points = 0;
+}
+
+static void
+gzip_unload (void)
 {
-  struct gzip_handle *h;
-  char buf[BUFSIZ];
-  int r;
+  size_t i;
 
-  h = malloc (sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
+  for (i = 0; i < NR_CURSORS; ++i) {
+    if (cursors[i].inited)
+      inflateEnd (&cursors[i].strm);
+    free (cursors[i].inbuf);
+    free (cursors[i].discard);
   }
+  free_index ();
+  if (fd >= 0)
+    close (fd);
+  free (filename);
+  free (indexfile);
+}
+
+static int
+add_point (unsigned bits, uint64_t in, uint64_t out,
+           unsigned left, const unsigned char *window)
+{
+  struct point *new_points;
+  unsigned char *new_windows, *w;
 
-  h->gz = gzopen (filename, "r");
-  if (h->gz == NULL) {
-    nbdkit_error ("gzopen: %s: %m", filename);
-    goto err1;
+  new_points = realloc (points, (nr_points+1) * sizeof (struct point));
+  if (new_points == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  points = new_points;
+  new_windows = realloc (windows, (nr_points+1) * WINSIZE);
+  if (new_windows == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
   }
+  windows = new_windows;
 
-  gzbuffer (h->gz, 128 * 1024);
+  points[nr_points].out = out;
+  points[nr_points].in = in;
+  points[nr_points].bits = bits;
 
-  /* Work out the size of the uncompressed file - expensive!  Note
-   * that seeking to the end of the file is not supported, so instead
-   * we have to read the file and discard it.
+  /* The window is circular, so copy it out in the right order. */
+  w = &windows[nr_points * WINSIZE];
+  if (left)
+    memcpy (w, window + WINSIZE - left, left);
+  if (left < WINSIZE)
+    memcpy (w + left, window, WINSIZE - left);
+
+  nr_points++;
+  return 0;
+}
+
+/* After a gzip member has finished, check whether another member
+ * follows at compressed offset *in_off (in the buffer or the file).
+ * Anything else after the end of the last member is ignored, which
+ * matches what gzip(1) does with trailing zero padding.  Returns 1 if
+ * there is another member, 0 if not, -1 on error.
+ */
+static int
+another_member (z_stream *strm, unsigned char *inbuf, uint64_t *in_off)
+{
+  ssize_t r;
+
+  if (strm->avail_in < 2) {
+    if (strm->avail_in > 0)
+      memmove (inbuf, strm->next_in, strm->avail_in);
+    r = pread (fd, inbuf + strm->avail_in, INBUFSIZE - strm->avail_in,
+               *in_off);
+    if (r == -1) {
+      nbdkit_error ("pread: %s: %m", filename);
+      return -1;
+    }
+    *in_off += r;
+    strm->next_in = inbuf;
+    strm->avail_in += r;
+  }
+
+  return strm->avail_in >= 2 &&
+    strm->next_in[0] == 0x1f && strm->next_in[1] == 0x8b;
+}
+
+/* Decompress the whole file once, recording a checkpoint roughly
+ * every span bytes of uncompressed output.
+ */
+static int
+build_index (void)
+{
+  z_stream strm = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+  CLEANUP_FREE unsigned char *inbuf = NULL;
+  CLEANUP_FREE unsigned char *window = NULL;
+  uint64_t in_off = 0, totin = 0, totout = 0, last = 0;
+  ssize_t r;
+  int ret;
+
+  inbuf = malloc (INBUFSIZE);
+  window = malloc (WINSIZE);
+  if (inbuf == NULL || window == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  /* 15+16 means expect a gzip header.  Only gzip members are
+   * accepted (not zlib streams) because the cursors skip the 8 byte
+   * gzip trailer themselves, see inflate_cursor.
    */
-  h->exportsize = 0;
-  do {
-    r = gzread (h->gz, buf, BUFSIZ);
-    h->exportsize += r;
-  } while (r > 0);
-  if (r == -1) {
-    nbdkit_gzerror (h->gz, "gzread: %s", filename);
-    goto err2;
+  if (inflateInit2 (&strm, 15+16) != Z_OK) {
+    nbdkit_error ("inflateInit2: %s", strm.msg ? strm.msg : "failed");
+    return -1;
+  }
+
+  strm.avail_in = 0;
+  strm.avail_out = 0;
+  for (;;) {
+    if (strm.avail_in == 0) {
+      r = pread (fd, inbuf, INBUFSIZE, in_off);
+      if (r == -1) {
+        nbdkit_error ("pread: %s: %m", filename);
+        goto err;
+      }
+      if (r == 0) {
+        nbdkit_error ("%s: unexpected end of file", filename);
+        goto err;
+      }
+      in_off += r;
+      strm.next_in = inbuf;
+      strm.avail_in = r;
+    }
+
+    if (strm.avail_out == 0) {
+      strm.avail_out = WINSIZE;
+      strm.next_out = window;
+    }
+
+    /* Z_BLOCK makes inflate stop at the end of each deflate block. */
+    totin += strm.avail_in;
+    totout += strm.avail_out;
+    ret = inflate (&strm, Z_BLOCK);
+    totin -= strm.avail_in;
+    totout -= strm.avail_out;
+    if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+      nbdkit_error ("inflate: %s: %s", filename,
+                    strm.msg ? strm.msg : "corrupt input");
+      goto err;
+    }
+
+    if (ret == Z_STREAM_END) {
+      ret = another_member (&strm, inbuf, &in_off);
+      if (ret == -1)
+        goto err;
+      if (ret == 0)
+        break;
+      inflateReset (&strm);
+      continue;
+    }
+
+    /* Bit 7 of data_type means we are at the end of a block, and bit
+     * 6 means it was the last block, which isn't a useful checkpoint.
+     */
+    if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+        (nr_points == 0 || totout - last > span)) {
+      if (add_point (strm.data_type & 7, totin, totout,
+                     strm.avail_out, window) == -1)
+        goto err;
+      last = totout;
+    }
+  }
+
+  if (nr_points == 0) {
+    nbdkit_error ("%s: no deflate blocks found", filename);
+    goto err;
+  }
+  inflateEnd (&strm);
+  exportsize = totout;
+  nbdkit_debug ("gzip: %s: uncompressed size = %" PRIu64 ", "
+                "%zu checkpoints",
+                filename, exportsize, nr_points);
+  return 0;
+
+ err:
+  inflateEnd (&strm);
+  free_index ();
+  return -1;
+}
+
+/* The sidecar index file is a header followed by the checkpoints
+ * (each 24 bytes) followed by their windows.  All numbers are little
+ * endian.  The index is only used if the compressed file has the same
+ * size and modification time as when it was built.
+ */
+static const char index_magic[16] = "NBDKIT-GZINDEX1";
+
+struct index_header {
+  char magic[16];
+  uint64_t file_size;
+  uint64_t file_mtime_sec;
+  uint64_t file_mtime_nsec;
+  uint64_t span;
+  uint64_t exportsize;
+  uint64_t nr_points;
+} __attribute__((__packed__));
+
+struct index_point {
+  uint64_t out;
+  uint64_t in;
+  uint64_t bits;
+} __attribute__((__packed__));
+
+static void
+make_index_header (struct index_header *hdr, const struct stat *statbuf)
+{
+  memset (hdr, 0, sizeof *hdr);
+  memcpy (hdr->magic, index_magic, sizeof hdr->magic);
+  hdr->file_size = htole64 (statbuf->st_size);
+  hdr->file_mtime_sec = htole64 (statbuf->st_mtim.tv_sec);
+  hdr->file_mtime_nsec = htole64 (statbuf->st_mtim.tv_nsec);
+  hdr->span = htole64 (span);
+}
+
+static int
+full_pread (int ifd, void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pread (ifd, buf, count, offset);
+    if (r == -1)
+      return -1;
+    if (r == 0) {
+      errno = EIO;
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+full_write (int ofd, const void *buf, size_t count)
+{
+  while (count > 0) {
+    ssize_t r = write (ofd, buf, count);
+    if (r == -1)
+      return -1;
+    buf += r;
+    count -= r;
+  }
+  return 0;
+}
+
+/* Try to load the sidecar index.  Returns 0 if it was loaded, or -1
+ * if it is missing or stale, in which case the caller builds the
+ * index from scratch.  Any problem here is not an error.
+ */
+static int
+load_index (const struct stat *statbuf)
+{
+  struct index_header hdr, expected;
+  struct index_point *ipoints = NULL;
+  uint64_t n;
+  size_t i;
+  int ifd;
+
+  ifd = open (indexfile, O_RDONLY|O_CLOEXEC);
+  if (ifd == -1)
+    return -1;
+
+  make_index_header (&expected, statbuf);
+  if (full_pread (ifd, &hdr, sizeof hdr, 0) == -1 ||
+      memcmp (hdr.magic, expected.magic, sizeof hdr.magic) != 0 ||
+      hdr.file_size != expected.file_size ||
+      hdr.file_mtime_sec != expected.file_mtime_sec ||
+      hdr.file_mtime_nsec != expected.file_mtime_nsec ||
+      hdr.span != expected.span) {
+    nbdkit_debug ("gzip: %s: ignoring stale or corrupt index", indexfile);
+    goto err;
   }
 
-  nbdkit_debug ("gzip: %s: uncompressed size = %" PRIu64,
-                filename, h->exportsize);
+  n = le64toh (hdr.nr_points);
+  if (n == 0 || n > SIZE_MAX / WINSIZE) {
+    nbdkit_debug ("gzip: %s: ignoring corrupt index", indexfile);
+    goto err;
+  }
 
-  if (gzrewind (h->gz) == -1) {
-    nbdkit_gzerror (h->gz, "gzrewind: unable to rewind file");
-    goto err2;
+  ipoints = malloc (n * sizeof (struct index_point));
+  points = malloc (n * sizeof (struct point));
+  windows = malloc (n * WINSIZE);
+  if (ipoints == NULL || points == NULL || windows == NULL) {
+    nbdkit_debug ("gzip: %s: malloc: %m", indexfile);
+    goto err;
+  }
+  if (full_pread (ifd, ipoints, n * sizeof (struct index_point),
+                  sizeof hdr) == -1 ||
+      full_pread (ifd, windows, n * WINSIZE,
+                  sizeof hdr + n * sizeof (struct index_point)) == -1) {
+    nbdkit_debug ("gzip: %s: read: %m", indexfile);
+    goto err;
+  }
+  for (i = 0; i < n; ++i) {
+    points[i].out = le64toh (ipoints[i].out);
+    points[i].in = le64toh (ipoints[i].in);
+    points[i].bits = le64toh (ipoints[i].bits);
+    if (points[i].bits > 7 ||
+        (points[i].bits > 0 && points[i].in == 0) ||
+        (i > 0 && points[i].out < points[i-1].out)) {
+      nbdkit_debug ("gzip: %s: ignoring corrupt index", indexfile);
+      goto err;
+    }
   }
 
-  return h;
+  nr_points = n;
+  exportsize = le64toh (hdr.exportsize);
+  free (ipoints);
+  close (ifd);
+  nbdkit_debug ("gzip: %s: loaded %zu checkpoints from %s",
+                filename, nr_points, indexfile);
+  return 0;
 
- err2:
-  gzclose (h->gz);
- err1:
-  free (h);
-  return NULL;
+ err:
+  free (ipoints);
+  free_index ();
+  close (ifd);
+  return -1;
 }
 
-/* Free up the per-connection handle. */
+/* Save the index to the sidecar file.  This is written to a temporary
+ * file and renamed so that a concurrent nbdkit never sees a partial
+ * index.  Failure (eg. a read-only directory) is not an error.
+ */
 static void
-gzip_close (void *handle)
+save_index (const struct stat *statbuf)
+{
+  struct index_header hdr;
+  CLEANUP_FREE struct index_point *ipoints = NULL;
+  CLEANUP_FREE char *tmpfile = NULL;
+  size_t i;
+  int ofd;
+
+  if (asprintf (&tmpfile, "%s.XXXXXX", indexfile) == -1) {
+    nbdkit_debug ("gzip: asprintf: %m");
+    return;
+  }
+  ipoints = malloc (nr_points * sizeof (struct index_point));
+  if (ipoints == NULL) {
+    nbdkit_debug ("gzip: malloc: %m");
+    return;
+  }
+
+  make_index_header (&hdr, statbuf);
+  hdr.exportsize = htole64 (exportsize);
+  hdr.nr_points = htole64 (nr_points);
+  for (i = 0; i < nr_points; ++i) {
+    ipoints[i].out = htole64 (points[i].out);
+    ipoints[i].in = htole64 (points[i].in);
+    ipoints[i].bits = htole64 (points[i].bits);
+  }
+
+  ofd = mkstemp (tmpfile);
+  if (ofd == -1) {
+    nbdkit_debug ("gzip: cannot save index: %s: %m", tmpfile);
+    return;
+  }
+  if (full_write (ofd, &hdr, sizeof hdr) == -1 ||
+      full_write (ofd, ipoints, nr_points * sizeof (struct index_point)) == -1 ||
+      full_write (ofd, windows, nr_points * WINSIZE) == -1 ||
+      fchmod (ofd, 0644) == -1) {
+    nbdkit_debug ("gzip: cannot save index: %s: %m", tmpfile);
+    close (ofd);
+    unlink (tmpfile);
+    return;
+  }
+  if (close (ofd) == -1 || rename (tmpfile, indexfile) == -1) {
+    nbdkit_debug ("gzip: cannot save index: %s: %m", indexfile);
+    unlink (tmpfile);
+    return;
+  }
+  nbdkit_debug ("gzip: saved %zu checkpoints to %s", nr_points, indexfile);
+}
+
+/* Open the file and load or build the index, once. */
+static int
+get_index (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&index_lock);
+  struct stat statbuf;
+  unsigned char magic[2];
+
+  if (index_built)
+    return 0;
+
+  if (fd == -1) {
+    fd = open (filename, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+      nbdkit_error ("open: %s: %m", filename);
+      return -1;
+    }
+  }
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", filename);
+    return -1;
+  }
+
+  /* Like gzread, which this plugin used to use, serve a file which
+   * does not start with the gzip magic as it is.
+   */
+  if (statbuf.st_size < 2 ||
+      full_pread (fd, magic, 2, 0) == -1 ||
+      magic[0] != 0x1f || magic[1] != 0x8b) {
+    nbdkit_debug ("gzip: %s: not gzip compressed, serving it uncompressed",
+                  filename);
+    uncompressed = true;
+    exportsize = statbuf.st_size;
+    index_built = true;
+    return 0;
+  }
+
+  if (indexfile == NULL || load_index (&statbuf) == -1) {
+    if (build_index () == -1)
+      return -1;
+    if (indexfile)
+      save_index (&statbuf);
+  }
+
+  index_built = true;
+  return 0;
+}
+
+/* Create the per-connection handle.  The plugin only needs the
+ * global index, so there is no real per-connection state.
+ */
+static void *
+gzip_open (int readonly)
 {
-  struct gzip_handle *h = handle;
+  if (get_index () == -1)
+    return NULL;
 
-  gzclose (h->gz);
-  free (h);
+  return NBDKIT_HANDLE_NOT_NEEDED;
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 gzip_get_size (void *handle)
 {
-  struct gzip_handle *h = handle;
+  return exportsize;
+}
 
-  return h->exportsize;
+/* Find the last checkpoint at or before offset. */
+static size_t
+find_point (uint64_t offset)
+{
+  size_t lo = 0, hi = nr_points;
+
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (points[mid].out <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
 }
 
-/* Read data from the file. */
+/* Take a cursor for reading at offset.  This prefers a free cursor
+ * which has already stopped at or shortly before offset; otherwise it
+ * takes the least recently used cursor, which the caller must
+ * position at a checkpoint.
+ */
+static struct cursor *
+get_cursor (uint64_t offset, uint64_t checkpoint)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cursors_lock);
+  struct cursor *best, *lru;
+  size_t i;
+
+  for (;;) {
+    best = lru = NULL;
+    for (i = 0; i < NR_CURSORS; ++i) {
+      struct cursor *c = &cursors[i];
+
+      if (c->in_use)
+        continue;
+      if (c->valid && c->pos <= offset && c->pos >= checkpoint &&
+          (best == NULL || c->pos > best->pos))
+        best = c;
+      if (lru == NULL || c->last_used < lru->last_used)
+        lru = c;
+    }
+    if (best == NULL)
+      best = lru;
+    if (best) {
+      best->in_use = true;
+      best->last_used = ++cursor_clock;
+      return best;
+    }
+    pthread_cond_wait (&cursor_freed, &cursors_lock);
+  }
+}
+
+static void
+put_cursor (struct cursor *c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cursors_lock);
+
+  c->in_use = false;
+  pthread_cond_signal (&cursor_freed);
+}
+
+/* Position a cursor at checkpoint i. */
 static int
-gzip_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+seek_cursor (struct cursor *c, size_t i)
 {
-  struct gzip_handle *h = handle;
+  const struct point *p = &points[i];
+  int ret;
+
+  c->valid = false;
+
+  /* Allocate each buffer separately so that if one allocation fails
+   * the next seek tries again for the one which is missing.
+   */
+  if (c->inbuf == NULL) {
+    c->inbuf = malloc (INBUFSIZE);
+    if (c->inbuf == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+  if (c->discard == NULL) {
+    c->discard = malloc (WINSIZE);
+    if (c->discard == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
 
-  if (gzseek (h->gz, offset, SEEK_SET) == -1) {
-    nbdkit_gzerror (h->gz, "gzseek");
+  if (!c->inited) {
+    c->strm.zalloc = Z_NULL;
+    c->strm.zfree = Z_NULL;
+    c->strm.opaque = Z_NULL;
+    c->strm.avail_in = 0;
+    c->strm.next_in = Z_NULL;
+    ret = inflateInit2 (&c->strm, -15);
+    if (ret != Z_OK) {
+      nbdkit_error ("inflateInit2: %s",
+                    c->strm.msg ? c->strm.msg : "failed");
+      return -1;
+    }
+    c->inited = true;
+  }
+  else if (inflateReset2 (&c->strm, -15) != Z_OK) {
+    nbdkit_error ("inflateReset2: failed");
     return -1;
   }
+  c->raw = true;
+  c->strm.avail_in = 0;
+  c->in_off = p->in;
 
-  while (count > 0) {
-    int r = gzread (h->gz, buf, count);
-    if (r == -1) {
-      nbdkit_gzerror (h->gz, "gzread");
+  if (p->bits) {
+    unsigned char ch;
+
+    if (full_pread (fd, &ch, 1, p->in - 1) == -1) {
+      nbdkit_error ("pread: %s: %m", filename);
       return -1;
     }
-    if (r == 0) {
-      nbdkit_error ("gzread: unexpected end of file (count=%" PRIu32 ")",
-                    count);
+    inflatePrime (&c->strm, p->bits, ch >> (8 - p->bits));
+  }
+  inflateSetDictionary (&c->strm, &windows[i * WINSIZE], WINSIZE);
+
+  c->pos = p->out;
+  c->valid = true;
+  return 0;
+}
+
+/* Decompress count bytes from the cursor into buf. */
+static int
+inflate_cursor (struct cursor *c, unsigned char *buf, uint64_t count)
+{
+  ssize_t r;
+  int ret;
+
+  while (count > 0) {
+    if (c->strm.avail_in == 0) {
+      r = pread (fd, c->inbuf, INBUFSIZE, c->in_off);
+      if (r == -1) {
+        nbdkit_error ("pread: %s: %m", filename);
+        return -1;
+      }
+      if (r == 0) {
+        nbdkit_error ("%s: unexpected end of file", filename);
+        return -1;
+      }
+      c->in_off += r;
+      c->strm.next_in = c->inbuf;
+      c->strm.avail_in = r;
+    }
+
+    c->strm.next_out = buf;
+    c->strm.avail_out = count > UINT_MAX ? UINT_MAX : count;
+    ret = inflate (&c->strm, Z_NO_FLUSH);
+    if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+      nbdkit_error ("inflate: %s: %s", filename,
+                    c->strm.msg ? c->strm.msg : "corrupt input");
       return -1;
     }
+    r = c->strm.next_out - buf;
     buf += r;
     count -= r;
+    c->pos += r;
+
+    if (ret == Z_STREAM_END) {
+      /* End of a gzip member.  In raw mode we have to skip the 8 byte
+       * trailer ourselves, then parse the next member's header.
+       */
+      if (c->raw) {
+        unsigned skip = 8;
+
+        while (skip > 0) {
+          if (c->strm.avail_in == 0) {
+            r = pread (fd, c->inbuf, INBUFSIZE, c->in_off);
+            if (r == -1) {
+              nbdkit_error ("pread: %s: %m", filename);
+              return -1;
+            }
+            if (r == 0)
+              break;
+            c->in_off += r;
+            c->strm.next_in = c->inbuf;
+            c->strm.avail_in = r;
+          }
+          r = c->strm.avail_in < skip ? c->strm.avail_in : skip;
+          c->strm.next_in += r;
+          c->strm.avail_in -= r;
+          skip -= r;
+        }
+      }
+      ret = another_member (&c->strm, c->inbuf, &c->in_off);
+      if (ret == -1)
+        return -1;
+      if (ret == 0 && count > 0) {
+        nbdkit_error ("%s: unexpected end of file", filename);
+        return -1;
+      }
+      if (inflateReset2 (&c->strm, 15+16) != Z_OK) {
+        nbdkit_error ("inflateReset2: failed");
+        return -1;
+      }
+      c->raw = false;
+    }
   }
 
   return 0;
 }
 
+/* Read data from the file. */
+static int
+gzip_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  size_t i;
+  struct cursor *c;
+  int r = -1;
+
+  if (uncompressed) {
+    if (full_pread (fd, buf, count, offset) == -1) {
+      nbdkit_error ("pread: %s: %m", filename);
+      return -1;
+    }
+    return 0;
+  }
+
+  i = find_point (offset);
+  c = get_cursor (offset, points[i].out);
+
+  if (!c->valid || c->pos > offset || c->pos < points[i].out) {
+    if (seek_cursor (c, i) == -1)
+      goto out;
+  }
+
+  /* Skip forward to offset. */
+  while (c->pos < offset) {
+    uint64_t n = offset - c->pos;
+
+    if (n > WINSIZE)
+      n = WINSIZE;
+    if (inflate_cursor (c, c->discard, n) == -1)
+      goto out;
+  }
+
+  if (inflate_cursor (c, buf, count) == -1)
+    goto out;
+
+  r = 0;
+ out:
+  if (r == -1)
+    c->valid = false;
+  put_cursor (c);
+  return r;
+}
+
 static struct nbdkit_plugin plugin = {
   .name              = "gzip",
   .version           = PACKAGE_VERSION,
@@ -219,7 +893,6 @@ static struct nbdkit_plugin plugin = {
   .config_help       = gzip_config_help,
   .magic_config_key  = "file",
   .open              = gzip_open,
-  .close             = gzip_close,
   .get_size          = gzip_get_size,
   .pread             = gzip_pread,
 };
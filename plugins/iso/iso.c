@@ -34,24 +34,40 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "fdcache.h"
+#include "regions.h"
 #include "utils.h"
 
+#include "virtual-iso.h"
+
 /* List of directories parsed from the command line. */
 static char **dirs = NULL;
 static size_t nr_dirs = 0;
 
+/* By default the ISO is synthesized by the plugin.  If prog or
+ * params is used then an external program is run to create a
+ * temporary ISO instead.
+ */
+static bool external = false;
+
 /* genisoimage or mkisofs program, picked at compile time, but can be
  * overridden at run time.
  */
+#ifdef ISOPROG
 static const char *isoprog = ISOPROG;
+#else
+static const char *isoprog = NULL;
+#endif
 
 /* Extra parameters for isoprog. */
 static const char *params = NULL;
@@ -59,6 +75,12 @@ static const char *params = NULL;
 /* The temporary ISO. */
 static int fd = -1;
 
+/* The synthesized ISO. */
+static struct virtual_iso iso;
+
+/* Cache of open host files. */
+static struct fdcache fdcache = FDCACHE_INIT;
+
 /* Construct the temporary ISO. */
 static int
 make_iso (void)
@@ -119,11 +141,20 @@ make_iso (void)
   return 0;
 }
 
+static void
+iso_load (void)
+{
+  init_virtual_iso (&iso);
+}
+
 static void
 iso_unload (void)
 {
   size_t i;
 
+  fdcache_close (&fdcache);
+  free_virtual_iso (&iso);
+
   for (i = 0; i < nr_dirs; ++i)
     free (dirs[i]);
   free (dirs);
@@ -155,9 +186,11 @@ iso_config (const char *key, const char *value)
   }
   else if (strcmp (key, "params") == 0) {
     params = value;
+    external = true;
   }
   else if (strcmp (key, "prog") == 0) {
     isoprog = value;
+    external = true;
   }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
@@ -176,6 +209,15 @@ iso_config_complete (void)
     return -1;
   }
 
+  if (!external)
+    return create_virtual_iso (dirs, nr_dirs, &iso);
+
+  if (isoprog == NULL) {
+    nbdkit_error ("no genisoimage or mkisofs program was found "
+                  "at compile time, use prog=<ISOPROG>");
+    return -1;
+  }
+
   if (make_iso () == -1)
     return -1;
 
@@ -201,6 +243,9 @@ iso_get_size (void *handle)
 {
   struct stat statbuf;
 
+  if (!external)
+    return virtual_size (&iso.regions);
+
   if (fstat (fd, &statbuf) == -1) {
     nbdkit_error ("fstat: %m");
     return -1;
@@ -223,10 +268,73 @@ iso_can_cache (void *handle)
   return NBDKIT_CACHE_EMULATE;
 }
 
+/* Read data from the synthesized ISO. */
+static int
+pread_virtual_iso (void *buf, uint32_t count, uint64_t offset)
+{
+  const struct region *region = find_region (&iso.regions, offset);
+
+  while (count > 0) {
+    size_t i, len;
+    const char *host_path;
+    int host_fd, slot;
+    ssize_t r;
+
+    region = next_region (&iso.regions, region, offset);
+
+    /* Length to end of region. */
+    len = region->end - offset + 1;
+    if (len > count)
+      len = count;
+
+    switch (region->type) {
+    case region_file:
+      i = region->u.i;
+      assert (i < iso.nr_files);
+      host_path = iso.files[i].host_path;
+      slot = fdcache_get (&fdcache, i, host_path, offset - region->start, len,
+                          &host_fd);
+      if (slot == -2)
+        return -1;
+      r = pread (host_fd, buf, len, offset - region->start);
+      if (r == -1) {
+        nbdkit_error ("pread: %s: %m", host_path);
+        fdcache_put (&fdcache, slot, host_fd);
+        return -1;
+      }
+      if (r == 0) {
+        nbdkit_error ("pread: %s: unexpected end of file", host_path);
+        fdcache_put (&fdcache, slot, host_fd);
+        return -1;
+      }
+      fdcache_put (&fdcache, slot, host_fd);
+      len = r;
+      break;
+
+    case region_data:
+      memcpy (buf, &region->u.data[offset - region->start], len);
+      break;
+
+    case region_zero:
+      memset (buf, 0, len);
+      break;
+    }
+
+    count -= len;
+    buf += len;
+    offset += len;
+  }
+
+  return 0;
+}
+
 /* Read data from the file. */
 static int
 iso_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  if (!external)
+    return pread_virtual_iso (buf, count, offset);
+
   while (count > 0) {
     ssize_t r = pread (fd, buf, count, offset);
     if (r == -1) {
@@ -249,6 +357,7 @@ static struct nbdkit_plugin plugin = {
   .name              = "iso",
   .longname          = "nbdkit iso plugin",
   .version           = PACKAGE_VERSION,
+  .load              = iso_load,
   .unload            = iso_unload,
   .config            = iso_config,
   .config_complete   = iso_config_complete,
@@ -0,0 +1,1463 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Build an ISO 9660 image in memory, without copying the files.
+ *
+ * The volume descriptors, path tables and directories are generated
+ * here and file data is mapped directly to the host files using
+ * common/regions.  POSIX file names, permissions, symbolic links and
+ * device nodes are stored using Rock Ridge extensions (RRIP 1.09 /
+ * SUSP 1.10).  The ISO 9660 identifiers are only used by clients
+ * which do not understand Rock Ridge.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <nbdkit-plugin.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "regions.h"
+#include "rounding.h"
+
+#include "virtual-iso.h"
+
+/* Largest extent which can be described by one directory record.
+ * Larger files are split into several extents (ISO 9660 level 3).
+ */
+#define MAX_EXTENT_SIZE 0xfffff800
+
+/* Like genisoimage, pad the end of the image with 150 sectors of
+ * zeroes.  This avoids read errors at the end of the disk with some
+ * drivers, and libarchive will not recognize very small ISOs.
+ */
+#define PADDING_SECTORS 150
+
+/* Directory record flags. */
+#define FLAG_DIRECTORY   0x02
+#define FLAG_MULTIEXTENT 0x80
+
+/* Size of the fixed part of a directory record. */
+#define RECORD_HEADER_SIZE 33
+
+/* Maximum size of a directory record.  Records must have even
+ * length, so this is 254 rather than 255.
+ */
+#define MAX_RECORD_SIZE 254
+
+/* Size of a SUSP CE (continuation area) entry. */
+#define CE_ENTRY_SIZE 28
+
+/* System use entries for one directory record, before they are split
+ * between the record and continuation areas.
+ */
+struct su {
+  unsigned char buf[8192];
+  size_t len;
+  size_t ends[128];             /* End offset of each entry. */
+  size_t nr;
+};
+
+/* Used while reading host directories. */
+struct host_entry {
+  char *name;
+  char *host_path;
+  struct stat statbuf;
+  size_t seq;                   /* Order in which entries were read. */
+};
+
+/* Used to merge host entries with the same name into directory
+ * entries.
+ */
+struct pending {
+  struct entry e;
+  size_t first, n;              /* Range of host entries. */
+};
+
+static int visit (char **host_dirs, size_t nr_host_dirs, struct virtual_iso *iso);
+static int visit_directory (size_t di, struct virtual_iso *iso);
+static void find_hard_links (struct virtual_iso *iso);
+static int create_path_tables (struct virtual_iso *iso);
+static uint32_t write_directory (size_t di, unsigned char *out, struct virtual_iso *iso);
+static int create_descriptors (struct virtual_iso *iso);
+static int create_regions (struct virtual_iso *iso);
+
+void
+init_virtual_iso (struct virtual_iso *iso)
+{
+  memset (iso, 0, sizeof *iso);
+  init_regions (&iso->regions);
+}
+
+int
+create_virtual_iso (char **host_dirs, size_t nr_host_dirs,
+                    struct virtual_iso *iso)
+{
+  size_t i;
+  uint64_t lba;
+
+  if (visit (host_dirs, nr_host_dirs, iso) == -1)
+    return -1;
+
+  nbdkit_debug ("iso: %zu directories and %zu files",
+                iso->nr_dirs, iso->nr_files);
+
+  find_hard_links (iso);
+
+  if (create_path_tables (iso) == -1)
+    return -1;
+
+  /* The first pass over the directories calculates their sizes and
+   * the size of the continuation areas, but does not write anything.
+   */
+  iso->ce_size = 0;
+  for (i = 0; i < iso->nr_dirs; ++i)
+    iso->dirs[i].size = write_directory (i, NULL, iso);
+  iso->ce_size = ROUND_UP (iso->ce_size, ISO_SECTOR_SIZE);
+
+  /* Now we know how large everything is we can assign sectors. */
+  lba = 18;
+  iso->path_table_l_lba = lba;
+  lba += DIV_ROUND_UP (iso->path_table_size, ISO_SECTOR_SIZE);
+  iso->path_table_m_lba = lba;
+  lba += DIV_ROUND_UP (iso->path_table_size, ISO_SECTOR_SIZE);
+  iso->dir_data_size = 0;
+  for (i = 0; i < iso->nr_dirs; ++i) {
+    iso->dirs[i].lba = lba;
+    lba += iso->dirs[i].size / ISO_SECTOR_SIZE;
+    iso->dir_data_size += iso->dirs[i].size;
+  }
+  /* Some readers (eg. libarchive) read the ISO sequentially and
+   * require continuation areas to follow the directories.
+   */
+  iso->ce_lba = lba;
+  lba += iso->ce_size / ISO_SECTOR_SIZE;
+  for (i = 0; i < iso->nr_files; ++i) {
+    if (iso->files[i].data != i || iso->files[i].statbuf.st_size == 0)
+      continue;
+    if (lba > UINT32_MAX)
+      goto too_big;
+    iso->files[i].lba = lba;
+    lba += DIV_ROUND_UP (iso->files[i].statbuf.st_size, ISO_SECTOR_SIZE);
+  }
+  lba += PADDING_SECTORS;
+  if (lba > UINT32_MAX) {
+  too_big:
+    nbdkit_error ("ISO image is too large for the ISO 9660 format");
+    return -1;
+  }
+  iso->nr_sectors = lba;
+
+  nbdkit_debug ("iso: %" PRIu32 " sectors, "
+                "path tables %" PRIu32 " bytes, "
+                "continuation areas %" PRIu32 " bytes, "
+                "directories %" PRIu64 " bytes",
+                iso->nr_sectors, iso->path_table_size,
+                iso->ce_size, iso->dir_data_size);
+
+  /* The second pass writes the directories and continuation areas. */
+  iso->dir_data = calloc (iso->dir_data_size, 1);
+  iso->ce = calloc (iso->ce_size, 1);
+  if (iso->dir_data == NULL || iso->ce == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  lba = 0;
+  iso->ce_size = 0;
+  for (i = 0; i < iso->nr_dirs; ++i) {
+    write_directory (i, iso->dir_data + lba, iso);
+    lba += iso->dirs[i].size;
+  }
+  iso->ce_size = ROUND_UP (iso->ce_size, ISO_SECTOR_SIZE);
+
+  /* The path tables contain the directory locations, so fill those
+   * in now.
+   */
+  if (create_path_tables (iso) == -1)
+    return -1;
+
+  if (create_descriptors (iso) == -1)
+    return -1;
+
+  if (create_regions (iso) == -1)
+    return -1;
+
+  return 0;
+}
+
+void
+free_virtual_iso (struct virtual_iso *iso)
+{
+  size_t i, j;
+
+  free_regions (&iso->regions);
+
+  for (i = 0; i < iso->nr_files; ++i)
+    free (iso->files[i].host_path);
+  free (iso->files);
+
+  for (i = 0; i < iso->nr_dirs; ++i) {
+    for (j = 0; j < iso->dirs[i].nr_host_paths; ++j)
+      free (iso->dirs[i].host_paths[j]);
+    free (iso->dirs[i].host_paths);
+    for (j = 0; j < iso->dirs[i].nr_entries; ++j) {
+      free (iso->dirs[i].entries[j].name);
+      free (iso->dirs[i].entries[j].link);
+    }
+    free (iso->dirs[i].entries);
+  }
+  free (iso->dirs);
+
+  free (iso->descriptors);
+  free (iso->path_table_l);
+  free (iso->path_table_m);
+  free (iso->ce);
+  free (iso->dir_data);
+}
+
+/* Add a new directory to iso->dirs, taking ownership of host_paths.
+ * Returns the directory index, or -1 on error.
+ */
+static ssize_t
+add_directory (size_t parent, const char *iso_name,
+               const struct stat *statbuf,
+               char **host_paths, size_t nr_host_paths,
+               struct virtual_iso *iso)
+{
+  void *np;
+  size_t di;
+  struct dir *dir;
+
+  di = iso->nr_dirs;
+  np = realloc (iso->dirs, sizeof (struct dir) * (di+1));
+  if (np == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  iso->dirs = np;
+  iso->nr_dirs++;
+
+  dir = &iso->dirs[di];
+  memset (dir, 0, sizeof *dir);
+  dir->parent = parent;
+  strcpy (dir->iso_name, iso_name);
+  dir->statbuf = *statbuf;
+  dir->host_paths = host_paths;
+  dir->nr_host_paths = nr_host_paths;
+  return di;
+}
+
+/* Visit files and directories.
+ *
+ * This constructs the iso->dirs and iso->files lists.  The root
+ * directory is the union of all of the host directories.
+ * Directories are visited in breadth first order, which is the order
+ * they must appear in the path tables.
+ */
+static int
+visit (char **host_dirs, size_t nr_host_dirs, struct virtual_iso *iso)
+{
+  char **host_paths;
+  struct stat statbuf;
+  size_t i;
+
+  if (stat (host_dirs[0], &statbuf) == -1) {
+    nbdkit_error ("stat: %s: %m", host_dirs[0]);
+    return -1;
+  }
+
+  host_paths = calloc (nr_host_dirs, sizeof (char *));
+  if (host_paths == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  for (i = 0; i < nr_host_dirs; ++i) {
+    host_paths[i] = strdup (host_dirs[i]);
+    if (host_paths[i] == NULL) {
+      nbdkit_error ("strdup: %m");
+      goto error;
+    }
+  }
+
+  if (add_directory (0, "", &statbuf, host_paths, nr_host_dirs, iso) == -1)
+    goto error;
+
+  /* Note that visit_directory appends to iso->dirs. */
+  for (i = 0; i < iso->nr_dirs; ++i) {
+    if (visit_directory (i, iso) == -1)
+      return -1;
+  }
+
+  return 0;
+
+ error:
+  for (i = 0; i < nr_host_dirs; ++i)
+    free (host_paths[i]);
+  free (host_paths);
+  return -1;
+}
+
+/* Read the entries of a host directory and append them to *entries. */
+static int
+read_host_directory (const char *host_dir,
+                     struct host_entry **entries, size_t *nr_entries)
+{
+  DIR *DIR;
+  struct dirent *d;
+  struct host_entry *e;
+  void *np;
+
+  DIR = opendir (host_dir);
+  if (DIR == NULL) {
+    nbdkit_error ("opendir: %s: %m", host_dir);
+    return -1;
+  }
+
+  while (errno = 0, (d = readdir (DIR)) != NULL) {
+    if (strcmp (d->d_name, ".") == 0 ||
+        strcmp (d->d_name, "..") == 0)
+      continue;
+
+    np = realloc (*entries, sizeof (struct host_entry) * (*nr_entries + 1));
+    if (np == NULL) {
+      nbdkit_error ("realloc: %m");
+      goto error;
+    }
+    *entries = np;
+    e = &(*entries)[*nr_entries];
+    e->name = strdup (d->d_name);
+    if (e->name == NULL) {
+      nbdkit_error ("strdup: %m");
+      goto error;
+    }
+    if (asprintf (&e->host_path, "%s/%s", host_dir, d->d_name) == -1) {
+      nbdkit_error ("asprintf: %m");
+      free (e->name);
+      goto error;
+    }
+    e->seq = *nr_entries;
+    (*nr_entries)++;
+
+    if (lstat (e->host_path, &e->statbuf) == -1) {
+      nbdkit_error ("stat: %s: %m", e->host_path);
+      goto error;
+    }
+  }
+
+  /* Did readdir fail? */
+  if (errno != 0) {
+    nbdkit_error ("readdir: %s: %m", host_dir);
+    goto error;
+  }
+
+  if (closedir (DIR) == -1) {
+    nbdkit_error ("closedir: %s: %m", host_dir);
+    return -1;
+  }
+  return 0;
+
+ error:
+  closedir (DIR);
+  return -1;
+}
+
+static int
+compare_host_entries (const void *ap, const void *bp)
+{
+  const struct host_entry *a = ap;
+  const struct host_entry *b = bp;
+  int r;
+
+  r = strcmp (a->name, b->name);
+  if (r != 0)
+    return r;
+  /* Keep entries with the same name in command line order. */
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/* Compare strings as if the shorter one was padded with spaces. */
+static int
+compare_padded (const char *a, size_t alen, const char *b, size_t blen)
+{
+  size_t i;
+  unsigned char ca, cb;
+
+  for (i = 0; i < alen || i < blen; ++i) {
+    ca = i < alen ? a[i] : ' ';
+    cb = i < blen ? b[i] : ' ';
+    if (ca != cb)
+      return ca < cb ? -1 : 1;
+  }
+  return 0;
+}
+
+/* ECMA-119 9.3 requires directory records to be sorted by name and
+ * then by extension.
+ */
+static int
+compare_identifiers (const char *a, const char *b)
+{
+  size_t alen = strcspn (a, ".");
+  size_t blen = strcspn (b, ".");
+  int r;
+
+  r = compare_padded (a, alen, b, blen);
+  if (r != 0)
+    return r;
+  a += alen;
+  b += blen;
+  if (*a == '.') a++;
+  if (*b == '.') b++;
+  return compare_padded (a, strlen (a), b, strlen (b));
+}
+
+static int
+compare_pending (const void *ap, const void *bp)
+{
+  const struct pending *a = ap;
+  const struct pending *b = bp;
+
+  return compare_identifiers (a->e.iso_name, b->e.iso_name);
+}
+
+/* Only d-characters (A-Z, 0-9 and _) are allowed in ISO 9660 names. */
+static char
+d_char (char c)
+{
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 'A';
+  if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+    return c;
+  return '_';
+}
+
+/* Make the ISO 9660 identifier from a host name.  Files are
+ * "NAME.EXT" where the name and extension together are at most 30
+ * characters.  Directories are at most 31 characters with no
+ * extension.  If suffix is > 0 then it is appended to the name to
+ * make the identifier unique.
+ */
+static void
+make_iso_name (const char *name, bool is_dir, unsigned suffix, char *out)
+{
+  const char *dot = is_dir ? NULL : strrchr (name, '.');
+  size_t base_len, ext_len, max_base, i, j = 0;
+  char digits[16] = "";
+
+  if (dot == name)              /* eg. ".bashrc" has no extension */
+    dot = NULL;
+  base_len = dot ? (size_t) (dot - name) : strlen (name);
+  ext_len = dot ? strlen (dot+1) : 0;
+  if (ext_len > 8)
+    ext_len = 8;
+  max_base = (is_dir ? 31 : 30) - ext_len;
+  if (suffix > 0)
+    snprintf (digits, sizeof digits, "%u", suffix);
+  max_base -= strlen (digits);
+
+  for (i = 0; i < base_len && j < max_base; ++i)
+    out[j++] = d_char (name[i]);
+  for (i = 0; digits[i]; ++i)
+    out[j++] = digits[i];
+  if (j == 0)
+    out[j++] = '_';
+  if (dot) {
+    out[j++] = '.';
+    for (i = 0; i < ext_len; ++i)
+      out[j++] = d_char (dot[1+i]);
+  }
+  out[j] = '\0';
+}
+
+/* Sorted set of the identifiers used in a directory. */
+struct used_names {
+  char (*names)[32];
+  size_t nr;
+};
+
+/* Return the index where name is, or would be inserted. */
+static size_t
+find_used (const struct used_names *used, const char *name, bool *found)
+{
+  size_t lo = 0, hi = used->nr, mid;
+  int r;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    r = compare_identifiers (name, used->names[mid]);
+    if (r == 0) {
+      *found = true;
+      return mid;
+    }
+    if (r < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  *found = false;
+  return lo;
+}
+
+/* Make the ISO 9660 identifiers in a directory unique.  On entry
+ * the pending array is sorted by identifier, so entries with the
+ * same identifier are adjacent.  The first keeps its identifier and
+ * the others get the lowest numeric suffix which is not used by any
+ * other entry in the directory.
+ */
+static int
+make_unique_names (struct pending *pending, size_t nr_pending)
+{
+  struct used_names used = { .nr = 0 };
+  size_t i, run, pos;
+  unsigned suffix;
+  bool changed = false, found;
+  char name[32];
+
+  if (nr_pending == 0)
+    return 0;
+
+  /* Each entry ends up with exactly one distinct identifier. */
+  used.names = malloc (nr_pending * sizeof used.names[0]);
+  if (used.names == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  for (i = 0; i < nr_pending; ++i) {
+    if (i == 0 ||
+        compare_identifiers (pending[i].e.iso_name,
+                             used.names[used.nr-1]) != 0)
+      strcpy (used.names[used.nr++], pending[i].e.iso_name);
+  }
+
+  for (run = 0, i = 1; i < nr_pending; ++i) {
+    if (compare_identifiers (pending[i].e.iso_name,
+                             pending[run].e.iso_name) != 0) {
+      run = i;
+      continue;
+    }
+
+    for (suffix = 1; ; ++suffix) {
+      make_iso_name (pending[i].e.name, S_ISDIR (pending[i].e.statbuf.st_mode),
+                     suffix, name);
+      pos = find_used (&used, name, &found);
+      if (!found)
+        break;
+    }
+    memmove (&used.names[pos+1], &used.names[pos],
+             (used.nr - pos) * sizeof used.names[0]);
+    strcpy (used.names[pos], name);
+    used.nr++;
+    strcpy (pending[i].e.iso_name, name);
+    changed = true;
+  }
+
+  free (used.names);
+  if (changed)
+    qsort (pending, nr_pending, sizeof (struct pending), compare_pending);
+  return 0;
+}
+
+/* Read all of the host directories which make up directory di, and
+ * construct its entries.  Any subdirectories are appended to
+ * iso->dirs.
+ */
+static int
+visit_directory (size_t di, struct virtual_iso *iso)
+{
+  struct host_entry *host_entries = NULL;
+  size_t nr_host_entries = 0;
+  CLEANUP_FREE struct pending *pending = NULL;
+  size_t nr_pending = 0;
+  struct entry *entries = NULL;
+  size_t nr_entries = 0;
+  char **host_paths;
+  struct host_entry *h;
+  struct pending *p;
+  struct entry *e;
+  struct file *file;
+  ssize_t sdi;
+  void *np;
+  size_t i, j;
+  ssize_t r;
+  int ret = -1;
+
+  for (i = 0; i < iso->dirs[di].nr_host_paths; ++i) {
+    if (read_host_directory (iso->dirs[di].host_paths[i],
+                             &host_entries, &nr_host_entries) == -1)
+      goto out;
+  }
+  qsort (host_entries, nr_host_entries, sizeof (struct host_entry),
+         compare_host_entries);
+
+  /* Merge entries with the same name.  Only directories can be
+   * merged.  Other file types are ignored.
+   */
+  pending = calloc (nr_host_entries, sizeof (struct pending));
+  if (nr_host_entries > 0 && pending == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto out;
+  }
+  for (i = 0; i < nr_host_entries; i = j) {
+    h = &host_entries[i];
+    for (j = i+1; j < nr_host_entries; ++j) {
+      if (strcmp (host_entries[j].name, h->name) != 0)
+        break;
+      if (!S_ISDIR (h->statbuf.st_mode) ||
+          !S_ISDIR (host_entries[j].statbuf.st_mode)) {
+        nbdkit_error ("%s and %s have the same name, "
+                      "but only directories can be merged",
+                      h->host_path, host_entries[j].host_path);
+        goto out;
+      }
+    }
+
+    if (!S_ISDIR (h->statbuf.st_mode) &&
+        !S_ISREG (h->statbuf.st_mode) &&
+        !S_ISLNK (h->statbuf.st_mode) &&
+        !S_ISCHR (h->statbuf.st_mode) &&
+        !S_ISBLK (h->statbuf.st_mode) &&
+        !S_ISFIFO (h->statbuf.st_mode))
+      continue;
+
+    if (strlen (h->name) > 255) {
+      nbdkit_error ("%s: file name is too long", h->host_path);
+      goto out;
+    }
+
+    p = &pending[nr_pending++];
+    p->e.name = h->name;
+    p->e.statbuf = h->statbuf;
+    p->first = i;
+    p->n = j - i;
+    make_iso_name (h->name, S_ISDIR (h->statbuf.st_mode), 0, p->e.iso_name);
+  }
+
+  qsort (pending, nr_pending, sizeof (struct pending), compare_pending);
+  if (make_unique_names (pending, nr_pending) == -1)
+    goto out;
+
+  /* Now create the entries in order.  Because subdirectories are
+   * appended to iso->dirs in this order, the path tables will be
+   * sorted correctly.
+   */
+  entries = calloc (nr_pending, sizeof (struct entry));
+  if (nr_pending > 0 && entries == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto out;
+  }
+  for (i = 0; i < nr_pending; ++i) {
+    p = &pending[i];
+    h = &host_entries[p->first];
+    e = &entries[nr_entries++];
+    *e = p->e;
+    /* The entry takes ownership of the name. */
+    h->name = NULL;
+
+    if (S_ISDIR (e->statbuf.st_mode)) {
+      if (iso->nr_dirs >= 65535) {
+        nbdkit_error ("too many directories for the ISO 9660 format");
+        goto out;
+      }
+      host_paths = calloc (p->n, sizeof (char *));
+      if (host_paths == NULL) {
+        nbdkit_error ("calloc: %m");
+        goto out;
+      }
+      for (j = 0; j < p->n; ++j) {
+        host_paths[j] = h[j].host_path;
+        h[j].host_path = NULL;
+      }
+      sdi = add_directory (di, e->iso_name, &e->statbuf,
+                           host_paths, p->n, iso);
+      if (sdi == -1) {
+        for (j = 0; j < p->n; ++j)
+          free (host_paths[j]);
+        free (host_paths);
+        goto out;
+      }
+      e->i = sdi;
+      iso->dirs[di].nr_subdirs++;
+    }
+    else if (S_ISREG (e->statbuf.st_mode)) {
+      np = realloc (iso->files, sizeof (struct file) * (iso->nr_files + 1));
+      if (np == NULL) {
+        nbdkit_error ("realloc: %m");
+        goto out;
+      }
+      iso->files = np;
+      e->i = iso->nr_files;
+      file = &iso->files[iso->nr_files++];
+      memset (file, 0, sizeof *file);
+      file->host_path = h->host_path;
+      h->host_path = NULL;
+      file->statbuf = e->statbuf;
+      file->data = e->i;
+    }
+    else if (S_ISLNK (e->statbuf.st_mode)) {
+      e->link = malloc (e->statbuf.st_size + 1);
+      if (e->link == NULL) {
+        nbdkit_error ("malloc: %m");
+        goto out;
+      }
+      r = readlink (h->host_path, e->link, e->statbuf.st_size + 1);
+      if (r == -1) {
+        nbdkit_error ("readlink: %s: %m", h->host_path);
+        goto out;
+      }
+      if (r > e->statbuf.st_size) {
+        nbdkit_error ("readlink: %s: symbolic link changed while reading",
+                      h->host_path);
+        goto out;
+      }
+      e->link[r] = '\0';
+    }
+  }
+
+  ret = 0;
+
+ out:
+  if (entries) {
+    iso->dirs[di].entries = entries;
+    iso->dirs[di].nr_entries = nr_entries;
+  }
+  for (i = 0; i < nr_host_entries; ++i) {
+    free (host_entries[i].name);
+    free (host_entries[i].host_path);
+  }
+  free (host_entries);
+  return ret;
+}
+
+/* Used to find hard links. */
+struct file_id {
+  dev_t dev;
+  ino_t ino;
+  size_t i;
+};
+
+static int
+compare_file_ids (const void *ap, const void *bp)
+{
+  const struct file_id *a = ap;
+  const struct file_id *b = bp;
+
+  if (a->dev != b->dev)
+    return a->dev < b->dev ? -1 : 1;
+  if (a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  return a->i < b->i ? -1 : a->i > b->i;
+}
+
+/* Files which are hard linked together on the host share the same
+ * data in the ISO.
+ */
+static void
+find_hard_links (struct virtual_iso *iso)
+{
+  CLEANUP_FREE struct file_id *ids = NULL;
+  size_t i, n = 0;
+
+  ids = malloc (sizeof (struct file_id) * iso->nr_files);
+  if (ids == NULL)
+    return;                     /* Not fatal, just store the data twice. */
+
+  for (i = 0; i < iso->nr_files; ++i) {
+    if (iso->files[i].statbuf.st_nlink > 1) {
+      ids[n].dev = iso->files[i].statbuf.st_dev;
+      ids[n].ino = iso->files[i].statbuf.st_ino;
+      ids[n].i = i;
+      n++;
+    }
+  }
+  qsort (ids, n, sizeof (struct file_id), compare_file_ids);
+
+  for (i = 1; i < n; ++i) {
+    if (ids[i].dev == ids[i-1].dev && ids[i].ino == ids[i-1].ino)
+      iso->files[ids[i].i].data = iso->files[ids[i-1].i].data;
+  }
+}
+
+static void
+put_both16 (unsigned char *p, uint16_t v)
+{
+  uint16_t le = htole16 (v), be = htobe16 (v);
+
+  memcpy (p, &le, 2);
+  memcpy (p+2, &be, 2);
+}
+
+static void
+put_both32 (unsigned char *p, uint32_t v)
+{
+  uint32_t le = htole32 (v), be = htobe32 (v);
+
+  memcpy (p, &le, 4);
+  memcpy (p+4, &be, 4);
+}
+
+/* Write the 7 byte date format used in directory records. */
+static void
+put_record_date (unsigned char *p, time_t t)
+{
+  struct tm tm;
+
+  memset (p, 0, 7);
+  if (gmtime_r (&t, &tm) == NULL)
+    return;
+  if (tm.tm_year < 0 || tm.tm_year > 255)
+    return;
+  p[0] = tm.tm_year;
+  p[1] = tm.tm_mon + 1;
+  p[2] = tm.tm_mday;
+  p[3] = tm.tm_hour;
+  p[4] = tm.tm_min;
+  p[5] = tm.tm_sec;
+  /* p[6] = 0, offset from GMT. */
+}
+
+/* Write the 17 byte date format used in the volume descriptor. */
+static void
+put_volume_date (unsigned char *p, time_t t)
+{
+  struct tm tm;
+  char buf[64];
+
+  memset (p, '0', 16);
+  p[16] = 0;
+  if (t == 0 || gmtime_r (&t, &tm) == NULL)
+    return;
+  snprintf (buf, sizeof buf, "%04d%02d%02d%02d%02d%02d00",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+  memcpy (p, buf, 16);
+}
+
+/* Copy a string into a fixed size field, padding with spaces. */
+static void
+put_string (unsigned char *p, size_t len, const char *s)
+{
+  size_t n = strlen (s);
+
+  assert (n <= len);
+  memcpy (p, s, n);
+  memset (p+n, ' ', len-n);
+}
+
+/* Start a new system use entry with the given signature and length,
+ * and return a pointer to it.
+ */
+static unsigned char *
+su_entry (struct su *su, const char *sig, size_t len)
+{
+  unsigned char *p = &su->buf[su->len];
+
+  assert (len <= 255);
+  assert (su->len + len <= sizeof su->buf);
+  assert (su->nr < sizeof su->ends / sizeof su->ends[0]);
+  memset (p, 0, len);
+  p[0] = sig[0];
+  p[1] = sig[1];
+  p[2] = len;
+  p[3] = 1;                     /* version */
+  su->len += len;
+  su->ends[su->nr++] = su->len;
+  return p;
+}
+
+static void
+su_px (struct su *su, const struct stat *statbuf, uint32_t nlink)
+{
+  unsigned char *p = su_entry (su, "PX", 36);
+
+  put_both32 (p+4, statbuf->st_mode);
+  put_both32 (p+12, nlink);
+  put_both32 (p+20, statbuf->st_uid);
+  put_both32 (p+28, statbuf->st_gid);
+}
+
+static void
+su_tf (struct su *su, const struct stat *statbuf)
+{
+  unsigned char *p = su_entry (su, "TF", 5 + 3*7);
+
+  p[4] = 0x0e;                  /* modify, access, attributes */
+  put_record_date (p+5, statbuf->st_mtime);
+  put_record_date (p+12, statbuf->st_atime);
+  put_record_date (p+19, statbuf->st_ctime);
+}
+
+static void
+su_nm (struct su *su, const char *name)
+{
+  size_t len = strlen (name), n;
+  unsigned char *p;
+
+  /* NM entries hold at most 250 bytes of the name. */
+  while (len > 0) {
+    n = len > 250 ? 250 : len;
+    p = su_entry (su, "NM", 5 + n);
+    p[4] = n < len ? 0x01 : 0;  /* CONTINUE */
+    memcpy (p+5, name, n);
+    name += n;
+    len -= n;
+  }
+}
+
+/* Add one symbolic link component to the current SL entry p,
+ * starting a new SL entry if it is full, and return the current SL
+ * entry.
+ *
+ * Rather than moving a whole component to the next entry, we fill up
+ * the current entry and continue the component in the next one.
+ * Some readers (eg. libarchive) wrongly omit the '/' when a new SL
+ * entry starts with a new component, so this avoids that case
+ * except where components are very short.
+ */
+static unsigned char *
+sl_component (struct su *su, unsigned char *p, uint8_t flags,
+              const char *s, size_t len)
+{
+  size_t space, n;
+
+  do {
+    space = p ? 255 - p[2] : 0;
+    if (space < 2 + (len > 0 ? 1 : 0)) {
+      if (p)
+        p[4] = 0x01;            /* CONTINUE */
+      p = su_entry (su, "SL", 5);
+      space = 255 - 5;
+    }
+    n = len < space - 2 ? len : space - 2;
+
+    assert (su->len + 2 + n <= sizeof su->buf);
+    p[p[2]] = flags | (n < len ? 0x01 : 0);
+    p[p[2]+1] = n;
+    memcpy (&p[p[2]+2], s, n);
+    p[2] += 2 + n;
+    su->len += 2 + n;
+    su->ends[su->nr-1] = su->len;
+
+    s += n;
+    len -= n;
+  } while (len > 0);
+
+  return p;
+}
+
+/* Symbolic links are stored as a list of components in one or more
+ * SL entries.
+ */
+static void
+su_sl (struct su *su, const char *target)
+{
+  unsigned char *p = NULL;
+  size_t len;
+
+  if (*target == '/')
+    p = sl_component (su, p, 0x08, "", 0); /* ROOT */
+
+  for (;;) {
+    while (*target == '/')
+      target++;
+    if (*target == '\0')
+      break;
+
+    len = strcspn (target, "/");
+    if (len == 1 && target[0] == '.')
+      p = sl_component (su, p, 0x02, "", 0); /* CURRENT */
+    else if (len == 2 && target[0] == '.' && target[1] == '.')
+      p = sl_component (su, p, 0x04, "", 0); /* PARENT */
+    else
+      p = sl_component (su, p, 0, target, len);
+    target += len;
+  }
+}
+
+static void
+su_pn (struct su *su, dev_t rdev)
+{
+  unsigned char *p = su_entry (su, "PN", 20);
+
+  put_both32 (p+4, major (rdev));
+  put_both32 (p+12, minor (rdev));
+}
+
+/* The ER entry identifies the extensions in use.  It is stored once,
+ * in the "." entry of the root directory.
+ */
+static void
+su_er (struct su *su)
+{
+  static const char id[] = "RRIP_1991A";
+  static const char des[] =
+    "THE ROCK RIDGE INTERCHANGE PROTOCOL PROVIDES SUPPORT FOR "
+    "POSIX FILE SYSTEM SEMANTICS";
+  static const char src[] =
+    "PLEASE CONTACT DISC PUBLISHER FOR SPECIFICATION SOURCE.  "
+    "SEE PUBLISHER IDENTIFIER IN PRIMARY VOLUME DESCRIPTOR FOR "
+    "CONTACT INFORMATION.";
+  size_t id_len = strlen (id), des_len = strlen (des), src_len = strlen (src);
+  unsigned char *p = su_entry (su, "ER", 8 + id_len + des_len + src_len);
+
+  p[4] = id_len;
+  p[5] = des_len;
+  p[6] = src_len;
+  p[7] = 1;                     /* extension version */
+  memcpy (p+8, id, id_len);
+  memcpy (p+8+id_len, des, des_len);
+  memcpy (p+8+id_len+des_len, src, src_len);
+}
+
+static size_t
+su_entry_start (const struct su *su, size_t i)
+{
+  return i == 0 ? 0 : su->ends[i-1];
+}
+
+/* Return how many system use entries starting at entry i fit in
+ * space bytes, leaving room for a CE entry if they do not all fit.
+ */
+static size_t
+su_fit (const struct su *su, size_t i, size_t space)
+{
+  size_t start = su_entry_start (su, i);
+
+  if (su->len - start <= space)
+    return su->nr;
+  while (i < su->nr && su->ends[i] - start <= space - CE_ENTRY_SIZE)
+    i++;
+  return i;
+}
+
+/* Allocate len bytes of continuation area.  Continuation areas must
+ * not cross a sector boundary.
+ */
+static uint32_t
+alloc_ce (struct virtual_iso *iso, size_t len)
+{
+  uint32_t offset;
+
+  if (iso->ce_size % ISO_SECTOR_SIZE + len > ISO_SECTOR_SIZE)
+    iso->ce_size = ROUND_UP (iso->ce_size, ISO_SECTOR_SIZE);
+  offset = iso->ce_size;
+  iso->ce_size += len;
+  return offset;
+}
+
+/* Place the system use entries in the directory record, spilling
+ * into continuation areas if necessary.  If iso->ce is NULL then
+ * this only calculates the space required.  Returns the new length
+ * of the record.
+ */
+static size_t
+place_su (const struct su *su, unsigned char *rec, size_t rec_len,
+          struct virtual_iso *iso)
+{
+  unsigned char *p = rec + rec_len;
+  unsigned char scratch[CE_ENTRY_SIZE];
+  size_t i = 0, j, start, len;
+  uint32_t offset;
+
+  j = su_fit (su, 0, MAX_RECORD_SIZE - rec_len);
+  len = su_entry_start (su, j);
+  memcpy (p, su->buf, len);
+  p += len;
+  rec_len += len;
+  if (j < su->nr)
+    rec_len += CE_ENTRY_SIZE;
+
+  while (j < su->nr) {
+    i = j;
+    start = su_entry_start (su, i);
+    j = su_fit (su, i, ISO_SECTOR_SIZE);
+    len = su_entry_start (su, j) - start;
+    offset = alloc_ce (iso, len + (j < su->nr ? CE_ENTRY_SIZE : 0));
+
+    /* Write the CE entry pointing to this area, in the record or at
+     * the end of the previous area.
+     */
+    p[0] = 'C';
+    p[1] = 'E';
+    p[2] = CE_ENTRY_SIZE;
+    p[3] = 1;
+    put_both32 (p+4, iso->ce_lba + offset / ISO_SECTOR_SIZE);
+    put_both32 (p+12, offset % ISO_SECTOR_SIZE);
+    put_both32 (p+20, len + (j < su->nr ? CE_ENTRY_SIZE : 0));
+
+    if (iso->ce) {
+      memcpy (&iso->ce[offset], &su->buf[start], len);
+      p = &iso->ce[offset + len];
+    }
+    else
+      p = scratch;
+  }
+
+  return rec_len;
+}
+
+/* Make a directory record.  rec must point to at least 256 bytes.
+ * Returns the length of the record.
+ */
+static size_t
+make_record (unsigned char *rec, const char *ident, size_t ident_len,
+             uint8_t flags, uint32_t lba, uint32_t size,
+             const struct stat *statbuf, const struct su *su,
+             struct virtual_iso *iso)
+{
+  size_t len;
+
+  memset (rec, 0, 256);
+  put_both32 (&rec[2], lba);
+  put_both32 (&rec[10], size);
+  put_record_date (&rec[18], statbuf->st_mtime);
+  rec[25] = flags;
+  put_both16 (&rec[28], 1);     /* volume sequence number */
+  rec[32] = ident_len;
+  memcpy (&rec[33], ident, ident_len);
+
+  /* Pad to even length before the system use area. */
+  len = ROUND_UP (RECORD_HEADER_SIZE + ident_len, 2);
+  if (su)
+    len = place_su (su, rec, len, iso);
+  len = ROUND_UP (len, 2);
+  assert (len <= MAX_RECORD_SIZE);
+  rec[0] = len;
+  return len;
+}
+
+/* Append a record to a directory.  Records must not cross sector
+ * boundaries.  If out is NULL then this only calculates the size.
+ */
+static void
+append_record (unsigned char *out, uint32_t *size,
+               const unsigned char *rec, size_t len)
+{
+  if (*size % ISO_SECTOR_SIZE + len > ISO_SECTOR_SIZE)
+    *size = ROUND_UP (*size, ISO_SECTOR_SIZE);
+  if (out)
+    memcpy (&out[*size], rec, len);
+  *size += len;
+}
+
+/* Write directory di to out, or if out is NULL just calculate the
+ * size of the directory and the continuation areas it needs.
+ * Returns the size of the directory rounded up to whole sectors.
+ */
+static uint32_t
+write_directory (size_t di, unsigned char *out, struct virtual_iso *iso)
+{
+  const struct dir *dir = &iso->dirs[di];
+  const struct dir *parent = &iso->dirs[dir->parent];
+  const struct entry *e;
+  const struct file *data;
+  unsigned char rec[256];
+  char ident[34];
+  struct su su;
+  uint32_t size = 0;
+  uint64_t remaining, extent_size;
+  uint32_t lba;
+  size_t i, len;
+
+  /* "." entry.  In the root directory this also contains the SP
+   * entry (which must come first) and the ER entry.
+   */
+  su.len = su.nr = 0;
+  if (di == 0) {
+    unsigned char *p = su_entry (&su, "SP", 7);
+    p[4] = 0xbe;
+    p[5] = 0xef;
+    p[6] = 0;                   /* bytes skipped */
+  }
+  su_px (&su, &dir->statbuf, 2 + dir->nr_subdirs);
+  su_tf (&su, &dir->statbuf);
+  if (di == 0)
+    su_er (&su);
+  len = make_record (rec, "\0", 1, FLAG_DIRECTORY, dir->lba, dir->size,
+                     &dir->statbuf, &su, iso);
+  append_record (out, &size, rec, len);
+
+  /* ".." entry. */
+  su.len = su.nr = 0;
+  su_px (&su, &parent->statbuf, 2 + parent->nr_subdirs);
+  su_tf (&su, &parent->statbuf);
+  len = make_record (rec, "\1", 1, FLAG_DIRECTORY, parent->lba, parent->size,
+                     &parent->statbuf, &su, iso);
+  append_record (out, &size, rec, len);
+
+  for (i = 0; i < dir->nr_entries; ++i) {
+    e = &dir->entries[i];
+
+    su.len = su.nr = 0;
+    if (S_ISDIR (e->statbuf.st_mode))
+      su_px (&su, &e->statbuf, 2 + iso->dirs[e->i].nr_subdirs);
+    else
+      su_px (&su, &e->statbuf, e->statbuf.st_nlink);
+    su_tf (&su, &e->statbuf);
+    su_nm (&su, e->name);
+    if (S_ISLNK (e->statbuf.st_mode))
+      su_sl (&su, e->link);
+    if (S_ISCHR (e->statbuf.st_mode) || S_ISBLK (e->statbuf.st_mode))
+      su_pn (&su, e->statbuf.st_rdev);
+
+    if (S_ISDIR (e->statbuf.st_mode)) {
+      len = make_record (rec, e->iso_name, strlen (e->iso_name),
+                         FLAG_DIRECTORY,
+                         iso->dirs[e->i].lba, iso->dirs[e->i].size,
+                         &e->statbuf, &su, iso);
+      append_record (out, &size, rec, len);
+    }
+    else if (S_ISREG (e->statbuf.st_mode)) {
+      snprintf (ident, sizeof ident, "%s;1", e->iso_name);
+      data = &iso->files[iso->files[e->i].data];
+      lba = data->lba;
+      remaining = data->statbuf.st_size;
+
+      /* Files larger than 4G are stored as several extents.  Each
+       * record repeats the Rock Ridge entries.
+       */
+      do {
+        extent_size = remaining > MAX_EXTENT_SIZE ? MAX_EXTENT_SIZE : remaining;
+        remaining -= extent_size;
+        len = make_record (rec, ident, strlen (ident),
+                           remaining > 0 ? FLAG_MULTIEXTENT : 0,
+                           lba, extent_size, &e->statbuf, &su, iso);
+        append_record (out, &size, rec, len);
+        lba += extent_size / ISO_SECTOR_SIZE;
+      } while (remaining > 0);
+    }
+    else {
+      snprintf (ident, sizeof ident, "%s;1", e->iso_name);
+      len = make_record (rec, ident, strlen (ident), 0, 0, 0,
+                         &e->statbuf, &su, iso);
+      append_record (out, &size, rec, len);
+    }
+  }
+
+  return ROUND_UP (size, ISO_SECTOR_SIZE);
+}
+
+/* Create the little and big endian path tables (ECMA-119 9.4). */
+static int
+create_path_tables (struct virtual_iso *iso)
+{
+  size_t i, len, ident_len, offset = 0;
+  const char *ident;
+  uint32_t lba_le, lba_be;
+  uint16_t parent_le, parent_be;
+
+  if (iso->path_table_l == NULL) {
+    len = 0;
+    for (i = 0; i < iso->nr_dirs; ++i) {
+      ident_len = i == 0 ? 1 : strlen (iso->dirs[i].iso_name);
+      len += 8 + ROUND_UP (ident_len, 2);
+    }
+    iso->path_table_size = len;
+    iso->path_table_l = calloc (ROUND_UP (len, ISO_SECTOR_SIZE), 1);
+    iso->path_table_m = calloc (ROUND_UP (len, ISO_SECTOR_SIZE), 1);
+    if (iso->path_table_l == NULL || iso->path_table_m == NULL) {
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+  }
+
+  for (i = 0; i < iso->nr_dirs; ++i) {
+    if (i == 0) {
+      ident = "\0";
+      ident_len = 1;
+    }
+    else {
+      ident = iso->dirs[i].iso_name;
+      ident_len = strlen (ident);
+    }
+    /* Directory numbers start at 1. */
+    assert (iso->dirs[i].parent + 1 <= UINT16_MAX);
+    lba_le = htole32 (iso->dirs[i].lba);
+    lba_be = htobe32 (iso->dirs[i].lba);
+    parent_le = htole16 (iso->dirs[i].parent + 1);
+    parent_be = htobe16 (iso->dirs[i].parent + 1);
+
+    iso->path_table_l[offset] = iso->path_table_m[offset] = ident_len;
+    memcpy (&iso->path_table_l[offset+2], &lba_le, 4);
+    memcpy (&iso->path_table_m[offset+2], &lba_be, 4);
+    memcpy (&iso->path_table_l[offset+6], &parent_le, 2);
+    memcpy (&iso->path_table_m[offset+6], &parent_be, 2);
+    memcpy (&iso->path_table_l[offset+8], ident, ident_len);
+    memcpy (&iso->path_table_m[offset+8], ident, ident_len);
+    offset += 8 + ROUND_UP (ident_len, 2);
+  }
+  assert (offset == iso->path_table_size);
+
+  return 0;
+}
+
+/* Create the primary volume descriptor and the volume descriptor set
+ * terminator (ECMA-119 8.4 and 8.3).
+ */
+static int
+create_descriptors (struct virtual_iso *iso)
+{
+  unsigned char *pvd, *term;
+  uint32_t le, be;
+  time_t now = time (NULL);
+
+  iso->descriptors = calloc (2, ISO_SECTOR_SIZE);
+  if (iso->descriptors == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  pvd = iso->descriptors;
+  term = iso->descriptors + ISO_SECTOR_SIZE;
+
+  pvd[0] = 1;
+  memcpy (&pvd[1], "CD001", 5);
+  pvd[6] = 1;
+  put_string (&pvd[8], 32, "");                 /* system identifier */
+  put_string (&pvd[40], 32, "CDROM");           /* volume identifier */
+  put_both32 (&pvd[80], iso->nr_sectors);
+  put_both16 (&pvd[120], 1);                    /* volume set size */
+  put_both16 (&pvd[124], 1);                    /* volume sequence number */
+  put_both16 (&pvd[128], ISO_SECTOR_SIZE);
+  put_both32 (&pvd[132], iso->path_table_size);
+  le = htole32 (iso->path_table_l_lba);
+  memcpy (&pvd[140], &le, 4);
+  be = htobe32 (iso->path_table_m_lba);
+  memcpy (&pvd[148], &be, 4);
+
+  /* Root directory record (without system use entries). */
+  make_record (&pvd[156], "\0", 1, FLAG_DIRECTORY,
+               iso->dirs[0].lba, iso->dirs[0].size,
+               &iso->dirs[0].statbuf, NULL, iso);
+
+  put_string (&pvd[190], 128, "");              /* volume set identifier */
+  put_string (&pvd[318], 128, "");              /* publisher */
+  put_string (&pvd[446], 128, "");              /* data preparer */
+  put_string (&pvd[574], 128, "NBDKIT");        /* application */
+  put_string (&pvd[702], 37, "");               /* copyright file */
+  put_string (&pvd[739], 37, "");               /* abstract file */
+  put_string (&pvd[776], 37, "");               /* bibliographic file */
+  put_volume_date (&pvd[813], now);             /* creation */
+  put_volume_date (&pvd[830], now);             /* modification */
+  put_volume_date (&pvd[847], 0);               /* expiration */
+  put_volume_date (&pvd[864], 0);               /* effective */
+  pvd[881] = 1;                                 /* file structure version */
+
+  term[0] = 255;
+  memcpy (&term[1], "CD001", 5);
+  term[6] = 1;
+
+  return 0;
+}
+
+static int
+create_regions (struct virtual_iso *iso)
+{
+  size_t i;
+  uint64_t offset;
+
+  /* System area. */
+  if (append_region_len (&iso->regions, "system area",
+                         16 * ISO_SECTOR_SIZE, 0, 0, region_zero) == -1)
+    return -1;
+
+  if (append_region_len (&iso->regions, "volume descriptors",
+                         2 * ISO_SECTOR_SIZE, 0, 0,
+                         region_data, iso->descriptors) == -1)
+    return -1;
+
+  if (append_region_len (&iso->regions, "path table (L)",
+                         iso->path_table_size, 0, ISO_SECTOR_SIZE,
+                         region_data, iso->path_table_l) == -1)
+    return -1;
+  if (append_region_len (&iso->regions, "path table (M)",
+                         iso->path_table_size, 0, ISO_SECTOR_SIZE,
+                         region_data, iso->path_table_m) == -1)
+    return -1;
+
+  /* The directories are stored contiguously, in the same order as
+   * iso->dirs.
+   */
+  for (i = 0, offset = 0; i < iso->nr_dirs; ++i) {
+    assert (virtual_size (&iso->regions) ==
+            (uint64_t) iso->dirs[i].lba * ISO_SECTOR_SIZE);
+    if (append_region_len (&iso->regions, "directory",
+                           iso->dirs[i].size, 0, 0,
+                           region_data, &iso->dir_data[offset]) == -1)
+      return -1;
+    offset += iso->dirs[i].size;
+  }
+
+  if (iso->ce_size > 0 &&
+      append_region_len (&iso->regions, "continuation areas",
+                         iso->ce_size, 0, 0,
+                         region_data, iso->ce) == -1)
+    return -1;
+
+  for (i = 0; i < iso->nr_files; ++i) {
+    if (iso->files[i].data != i || iso->files[i].statbuf.st_size == 0)
+      continue;
+    assert (virtual_size (&iso->regions) ==
+            (uint64_t) iso->files[i].lba * ISO_SECTOR_SIZE);
+    if (append_region_len (&iso->regions, iso->files[i].host_path,
+                           iso->files[i].statbuf.st_size,
+                           0, ISO_SECTOR_SIZE,
+                           region_file, i) == -1)
+      return -1;
+  }
+
+  if (append_region_len (&iso->regions, "padding",
+                         PADDING_SECTORS * ISO_SECTOR_SIZE, 0, 0,
+                         region_zero) == -1)
+    return -1;
+
+  assert (virtual_size (&iso->regions) ==
+          (uint64_t) iso->nr_sectors * ISO_SECTOR_SIZE);
+
+  nbdkit_debug ("iso: %zu regions, total disk size %" PRIi64,
+                nr_regions (&iso->regions), virtual_size (&iso->regions));
+
+  return 0;
+}
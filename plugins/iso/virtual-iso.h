@@ -0,0 +1,134 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_VIRTUAL_ISO_H
+#define NBDKIT_VIRTUAL_ISO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "regions.h"
+
+#define ISO_SECTOR_SIZE 2048
+
+/* Regular file.  Hard links to the same host file share the data. */
+struct file {
+  char *host_path;              /* Path of file on the host. */
+  struct stat statbuf;          /* stat(2) information, including size. */
+  size_t data;                  /* File holding the data (index into files). */
+  uint32_t lba;                 /* First sector of the data. */
+};
+
+/* Directory entry. */
+struct entry {
+  char *name;                   /* Name (stored in Rock Ridge NM). */
+  char iso_name[32];            /* ISO 9660 identifier, without ";1". */
+  struct stat statbuf;
+  size_t i;                     /* Index into dirs or files. */
+  char *link;                   /* Symbolic link target. */
+};
+
+struct dir {
+  size_t parent;                /* Parent directory (for root, 0). */
+  char iso_name[32];            /* ISO 9660 identifier (for root, ""). */
+  struct stat statbuf;
+  uint32_t nr_subdirs;
+
+  /* Host directories which are merged to make this directory. */
+  char **host_paths;
+  size_t nr_host_paths;
+
+  /* Entries, sorted by ISO 9660 identifier. */
+  struct entry *entries;
+  size_t nr_entries;
+
+  uint32_t lba;                 /* First sector of the directory. */
+  uint32_t size;                /* Size in bytes (whole sectors). */
+};
+
+struct virtual_iso {
+  /* Virtual disk layout. */
+  struct regions regions;
+
+  /* All regular files found. */
+  struct file *files;
+  size_t nr_files;
+
+  /* Directories.  dirs[0] == root directory. */
+  struct dir *dirs;
+  size_t nr_dirs;
+
+  /* Primary volume descriptor and volume descriptor set terminator. */
+  unsigned char *descriptors;
+
+  /* Little and big endian path tables. */
+  unsigned char *path_table_l;
+  unsigned char *path_table_m;
+  uint32_t path_table_size;
+
+  /* Continuation areas for Rock Ridge entries which do not fit in
+   * the directory records.
+   */
+  unsigned char *ce;
+  uint32_t ce_size;
+
+  /* All directories, stored contiguously. */
+  unsigned char *dir_data;
+  uint64_t dir_data_size;
+
+  /* The disk layout:
+   * sector 0-15:       system area (zeroes)
+   * sector 16:         primary volume descriptor
+   * sector 17:         volume descriptor set terminator
+   * sector 18:         little endian path table
+   * then:              big endian path table
+   * then:              directories
+   * then:              continuation areas
+   * then:              file data
+   * then:              padding (zeroes)
+   */
+  uint32_t path_table_l_lba;
+  uint32_t path_table_m_lba;
+  uint32_t ce_lba;
+  uint32_t nr_sectors;
+};
+
+extern void init_virtual_iso (struct virtual_iso *iso)
+  __attribute__((__nonnull__ (1)));
+extern int create_virtual_iso (char **dirs, size_t nr_dirs,
+                               struct virtual_iso *iso)
+  __attribute__((__nonnull__ (1, 3)));
+extern void free_virtual_iso (struct virtual_iso *iso)
+  __attribute__((__nonnull__ (1)));
+
+#endif /* NBDKIT_VIRTUAL_ISO_H */
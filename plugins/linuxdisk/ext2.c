@@ -0,0 +1,1250 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Create an ext2 filesystem without copying the file data.
+ *
+ * Only the metadata (superblocks, group descriptors, bitmaps, inode
+ * tables, directories, indirect blocks and long symlinks) is
+ * generated, in memory.  The data blocks of each regular file are
+ * laid out contiguously, apart from where they have to skip over the
+ * metadata at the start of a block group, and are mapped straight to
+ * the host file through region_file regions.  So the time taken and
+ * memory used are proportional to the number of inodes, not to the
+ * amount of data, and no copy of the filesystem is made.
+ *
+ * The filesystem is ext2 revision 1 with 4K blocks, 128 byte inodes
+ * and the sparse_super, large_file and filetype features.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <nbdkit-plugin.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "random.h"
+#include "regions.h"
+#include "rounding.h"
+
+#include "virtual-disk.h"
+
+#define BLOCK_SIZE 4096
+#define BLOCKS_PER_GROUP (BLOCK_SIZE * 8)
+#define INODE_SIZE 128
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / 4)
+#define GROUP_DESC_SIZE 32
+
+/* Same default as mke2fs, one inode for every 16K of the filesystem. */
+#define BYTES_PER_INODE 16384
+
+#define ROOT_INO 2
+#define LOST_AND_FOUND_INO 11
+#define FIRST_INO 12            /* first inode used for files */
+
+/* i_blocks counts 512 byte sectors in a 32 bit field. */
+#define MAX_FILE_BLOCKS (UINT32_MAX / (BLOCK_SIZE / 512) - 1024)
+
+/* File entry in the directory tree. */
+struct node {
+  char *name;                   /* name in the parent directory */
+  char *host_path;              /* path of the host file */
+  struct stat statbuf;
+  size_t parent;                /* index of the parent directory */
+  size_t first_child;           /* directories: children are */
+  size_t nr_children;           /*   nodes[first_child...] */
+  size_t owner;                 /* node which owns the inode */
+  uint32_t ino;
+  uint32_t links;               /* owner only: link count */
+  uint64_t nr_data_blocks;      /* owner only: logical blocks */
+};
+
+/* Contiguous run of allocated blocks. */
+struct run {
+  uint64_t block;               /* first block */
+  uint64_t len;                 /* length in bytes */
+  enum region_type type;
+  size_t i;                     /* region_file: index of the extent */
+  const unsigned char *data;    /* region_data: data */
+  const char *description;
+};
+
+/* Bitmap block, shared between groups with identical bitmaps. */
+struct bitmap {
+  uint32_t used;                /* bits [0, used) are set */
+  uint32_t size;                /* bits [size, BLOCKS_PER_GROUP) are set */
+  unsigned char *data;
+};
+
+struct ext2 {
+  struct virtual_disk *disk;
+
+  struct node *nodes;
+  size_t nr_nodes, nodes_alloc;
+
+  /* Geometry. */
+  uint64_t nr_blocks;
+  uint32_t nr_groups;
+  uint32_t inodes_per_group;
+  uint32_t inode_table_blocks;
+  uint32_t gdt_blocks;
+  uint32_t nr_inodes;           /* highest inode number in use */
+
+  /* Block allocator.  Blocks are allocated in increasing order. */
+  uint64_t next_block;
+  struct run *runs;
+  size_t nr_runs, runs_alloc;
+
+  /* Metadata. */
+  unsigned char *inodes;        /* inodes 1..nr_inodes */
+  unsigned char *gdt;
+  struct bitmap *bitmaps;
+  size_t nr_bitmaps;
+
+  /* Used when creating the filesystem regions. */
+  uint64_t pos;
+};
+
+static inline void
+put16 (unsigned char *p, uint16_t v)
+{
+  v = htole16 (v);
+  memcpy (p, &v, 2);
+}
+
+static inline void
+put32 (unsigned char *p, uint32_t v)
+{
+  v = htole32 (v);
+  memcpy (p, &v, 4);
+}
+
+/* Keep a buffer referred to by the regions until the plugin is
+ * unloaded.
+ */
+static int
+keep_buffer (struct virtual_disk *disk, void *buf)
+{
+  void **p;
+
+  p = realloc (disk->buffers, (disk->nr_buffers+1) * sizeof (void *));
+  if (p == NULL) {
+    nbdkit_error ("realloc: %m");
+    free (buf);
+    return -1;
+  }
+  disk->buffers = p;
+  disk->buffers[disk->nr_buffers++] = buf;
+  return 0;
+}
+
+static void *
+alloc_buffer (struct virtual_disk *disk, size_t n, size_t elem_size)
+{
+  void *buf = calloc (n, elem_size);
+
+  if (buf == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  if (keep_buffer (disk, buf) == -1)
+    return NULL;
+  return buf;
+}
+
+/* Add a node for name in the directory parent_path (or the root
+ * directory if parent_path is NULL).
+ */
+static struct node *
+add_node (struct ext2 *fs, const char *name, const char *parent_path,
+          size_t parent)
+{
+  struct node *node;
+
+  if (fs->nr_nodes == fs->nodes_alloc) {
+    size_t n = MAX (fs->nodes_alloc * 2, 64);
+
+    node = realloc (fs->nodes, n * sizeof (struct node));
+    if (node == NULL) {
+      nbdkit_error ("realloc: %m");
+      return NULL;
+    }
+    fs->nodes = node;
+    fs->nodes_alloc = n;
+  }
+
+  node = &fs->nodes[fs->nr_nodes];
+  memset (node, 0, sizeof *node);
+  node->parent = parent;
+  node->owner = fs->nr_nodes;
+  node->name = strdup (name);
+  if (node->name == NULL) {
+    nbdkit_error ("strdup: %m");
+    return NULL;
+  }
+  if (parent_path == NULL)
+    node->host_path = strdup (dir);
+  else if (asprintf (&node->host_path, "%s/%s", parent_path, name) == -1)
+    node->host_path = NULL;
+  if (node->host_path == NULL) {
+    nbdkit_error ("strdup: %m");
+    free (node->name);
+    return NULL;
+  }
+  fs->nr_nodes++;
+
+  if (lstat (node->host_path, &node->statbuf) == -1) {
+    nbdkit_error ("lstat: %s: %m", node->host_path);
+    return NULL;
+  }
+  return node;
+}
+
+/* Read the directory tree.  This is done breadth first so that the
+ * children of each directory are adjacent in the nodes array.
+ */
+static int
+scan_tree (struct ext2 *fs)
+{
+  size_t i;
+
+  if (add_node (fs, "", NULL, 0) == NULL)
+    return -1;
+  if (!S_ISDIR (fs->nodes[0].statbuf.st_mode)) {
+    nbdkit_error ("%s: not a directory", dir);
+    return -1;
+  }
+
+  for (i = 0; i < fs->nr_nodes; ++i) {
+    DIR *dp;
+    struct dirent *d;
+
+    if (!S_ISDIR (fs->nodes[i].statbuf.st_mode))
+      continue;
+
+    dp = opendir (fs->nodes[i].host_path);
+    if (dp == NULL) {
+      nbdkit_error ("opendir: %s: %m", fs->nodes[i].host_path);
+      return -1;
+    }
+    fs->nodes[i].first_child = fs->nr_nodes;
+
+    errno = 0;
+    while ((d = readdir (dp)) != NULL) {
+      if (strcmp (d->d_name, ".") == 0 || strcmp (d->d_name, "..") == 0)
+        continue;
+      /* We always create an empty /lost+found. */
+      if (i == 0 && strcmp (d->d_name, "lost+found") == 0)
+        continue;
+      if (add_node (fs, d->d_name, fs->nodes[i].host_path, i) == NULL) {
+        closedir (dp);
+        return -1;
+      }
+      errno = 0;
+    }
+    if (errno != 0) {
+      nbdkit_error ("readdir: %s: %m", fs->nodes[i].host_path);
+      closedir (dp);
+      return -1;
+    }
+    if (closedir (dp) == -1) {
+      nbdkit_error ("closedir: %s: %m", fs->nodes[i].host_path);
+      return -1;
+    }
+    fs->nodes[i].nr_children = fs->nr_nodes - fs->nodes[i].first_child;
+  }
+
+  return 0;
+}
+
+/* Find hard links.  Each set of nodes referring to the same host
+ * inode shares the inode owned by the first of them.
+ */
+struct link {
+  dev_t dev;
+  ino_t ino;
+  size_t i;
+};
+
+static int
+compare_links (const void *av, const void *bv)
+{
+  const struct link *a = av, *b = bv;
+
+  if (a->dev != b->dev)
+    return a->dev < b->dev ? -1 : 1;
+  if (a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  return a->i < b->i ? -1 : a->i > b->i;
+}
+
+static int
+find_hard_links (struct ext2 *fs)
+{
+  struct link *links;
+  size_t i, n = 0;
+
+  links = malloc (fs->nr_nodes * sizeof (struct link));
+  if (links == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  for (i = 0; i < fs->nr_nodes; ++i) {
+    const struct stat *st = &fs->nodes[i].statbuf;
+
+    if (!S_ISDIR (st->st_mode) && st->st_nlink > 1) {
+      links[n].dev = st->st_dev;
+      links[n].ino = st->st_ino;
+      links[n].i = i;
+      n++;
+    }
+  }
+
+  qsort (links, n, sizeof (struct link), compare_links);
+  for (i = 1; i < n; ++i) {
+    if (links[i].dev == links[i-1].dev && links[i].ino == links[i-1].ino)
+      fs->nodes[links[i].i].owner = fs->nodes[links[i-1].i].owner;
+  }
+
+  free (links);
+  return 0;
+}
+
+static uint8_t
+file_type (mode_t mode)
+{
+  if (S_ISREG (mode)) return 1;
+  if (S_ISDIR (mode)) return 2;
+  if (S_ISCHR (mode)) return 3;
+  if (S_ISBLK (mode)) return 4;
+  if (S_ISFIFO (mode)) return 5;
+  if (S_ISSOCK (mode)) return 6;
+  if (S_ISLNK (mode)) return 7;
+  return 0;
+}
+
+/* Write directory entries.  If buf is NULL this only counts the
+ * blocks needed.
+ */
+struct dir_writer {
+  unsigned char *buf;
+  uint64_t blocks;              /* blocks used so far */
+  size_t used;                  /* bytes used in the current block */
+  unsigned char *last;          /* last entry written */
+};
+
+/* Extend the last entry in the current block to the end of the block. */
+static void
+dir_end_block (struct dir_writer *w)
+{
+  if (w->buf && w->last)
+    put16 (w->last + 4, BLOCK_SIZE - (w->last - w->buf) % BLOCK_SIZE);
+}
+
+static void
+dir_add (struct dir_writer *w, const char *name, uint32_t ino,
+         uint8_t ftype)
+{
+  size_t name_len = strlen (name);
+  size_t rec_len = ROUND_UP (8 + name_len, 4);
+  unsigned char *p;
+
+  if (w->blocks == 0 || w->used + rec_len > BLOCK_SIZE) {
+    dir_end_block (w);
+    w->blocks++;
+    w->used = 0;
+  }
+  if (w->buf) {
+    p = w->buf + (w->blocks-1) * BLOCK_SIZE + w->used;
+    put32 (p, ino);
+    put16 (p+4, rec_len);
+    p[6] = name_len;
+    p[7] = ftype;
+    memcpy (p+8, name, name_len);
+    w->last = p;
+  }
+  w->used += rec_len;
+}
+
+static uint64_t
+write_dir (struct ext2 *fs, size_t i, unsigned char *buf)
+{
+  const struct node *node = &fs->nodes[i];
+  struct dir_writer w = { .buf = buf };
+  size_t j;
+
+  dir_add (&w, ".", node->ino, 2);
+  dir_add (&w, "..", fs->nodes[node->parent].ino, 2);
+  for (j = node->first_child; j < node->first_child + node->nr_children; ++j)
+    dir_add (&w, fs->nodes[j].name, fs->nodes[j].ino,
+             file_type (fs->nodes[j].statbuf.st_mode));
+  if (i == 0)
+    dir_add (&w, "lost+found", LOST_AND_FOUND_INO, 2);
+  dir_end_block (&w);
+  return w.blocks;
+}
+
+/* Number of indirect blocks needed to map n blocks. */
+static uint64_t
+indirect_blocks (uint64_t n)
+{
+  const uint64_t P = POINTERS_PER_BLOCK;
+  uint64_t r;
+
+  if (n <= 12)
+    return 0;
+  n -= 12;
+  r = 1;
+  if (n <= P)
+    return r;
+  n -= P;
+  r += 1 + DIV_ROUND_UP (MIN (n, P*P), P);
+  if (n <= P*P)
+    return r;
+  n -= P*P;
+  r += 1 + DIV_ROUND_UP (n, P*P) + DIV_ROUND_UP (n, P);
+  return r;
+}
+
+/* Assign inode numbers and count the blocks needed by each inode.
+ * Returns the total number of blocks, or -1 on error.
+ */
+static int64_t
+assign_inodes (struct ext2 *fs)
+{
+  uint32_t ino = FIRST_INO;
+  uint64_t total = 1;           /* for /lost+found */
+  size_t i;
+
+  for (i = 0; i < fs->nr_nodes; ++i) {
+    struct node *node = &fs->nodes[i];
+    const struct stat *st = &node->statbuf;
+
+    if (node->owner != i) {
+      node->ino = fs->nodes[node->owner].ino;
+      fs->nodes[node->owner].links++;
+      continue;
+    }
+
+    if (i == 0)
+      node->ino = ROOT_INO;
+    else {
+      if (ino == 0) {
+        nbdkit_error ("too many files for an ext2 filesystem");
+        return -1;
+      }
+      node->ino = ino++;
+    }
+
+    if (S_ISDIR (st->st_mode)) {
+      node->links += 2;
+      if (i > 0)
+        fs->nodes[node->parent].links++;
+      else
+        node->links++;          /* /lost+found */
+      node->nr_data_blocks = write_dir (fs, i, NULL);
+    }
+    else {
+      node->links++;
+      if (S_ISREG (st->st_mode))
+        node->nr_data_blocks = DIV_ROUND_UP (st->st_size, BLOCK_SIZE);
+      else if (S_ISLNK (st->st_mode) && st->st_size >= 60)
+        node->nr_data_blocks = 1;
+    }
+
+    if (node->nr_data_blocks > MAX_FILE_BLOCKS) {
+      nbdkit_error ("%s: file is too large for ext2", node->host_path);
+      return -1;
+    }
+    total += node->nr_data_blocks + indirect_blocks (node->nr_data_blocks);
+  }
+
+  fs->nr_inodes = ino - 1;
+  return total;
+}
+
+static bool
+group_has_super (uint32_t g)
+{
+  uint32_t n;
+
+  if (g <= 1)
+    return true;
+  for (n = 3; n <= 7; n += 2) {
+    uint32_t p = n;
+
+    while (p < g)
+      p *= n;
+    if (p == g)
+      return true;
+  }
+  return false;
+}
+
+static uint64_t
+group_start (const struct ext2 *fs, uint32_t g)
+{
+  return (uint64_t) g * BLOCKS_PER_GROUP;
+}
+
+static uint64_t
+group_end (const struct ext2 *fs, uint32_t g)
+{
+  return MIN (group_start (fs, g) + BLOCKS_PER_GROUP, fs->nr_blocks);
+}
+
+static uint64_t
+group_overhead (const struct ext2 *fs, uint32_t g)
+{
+  return (group_has_super (g) ? 1 + fs->gdt_blocks : 0) +
+    2 + fs->inode_table_blocks;
+}
+
+/* Choose the size and layout of the filesystem given the number of
+ * blocks needed for files and directories.
+ */
+static int
+compute_geometry (struct ext2 *fs, uint64_t nr_data_blocks)
+{
+  bool fixed = size > 0 && !size_add_estimate;
+  uint64_t total, extra = 0, overhead, need;
+  uint32_t g;
+  unsigned tries;
+
+  if (fixed)
+    total = size / BLOCK_SIZE;
+  else {
+    if (size_add_estimate)
+      extra = DIV_ROUND_UP (size, BLOCK_SIZE);
+    total = MAX (nr_data_blocks + extra, 1024*1024 / BLOCK_SIZE);
+  }
+
+  for (tries = 0; tries < 100; ++tries) {
+    uint64_t ipg;
+
+    fs->nr_blocks = total;
+    fs->nr_groups = DIV_ROUND_UP (total, BLOCKS_PER_GROUP);
+    if (fs->nr_groups == 0) {
+      nbdkit_error ("size parameter is too small");
+      return -1;
+    }
+    ipg = MAX (DIV_ROUND_UP (fs->nr_inodes, fs->nr_groups),
+               total * BLOCK_SIZE / BYTES_PER_INODE / fs->nr_groups);
+    ipg = ROUND_UP (ipg, INODES_PER_BLOCK);
+    if (ipg > BLOCK_SIZE * 8) {
+      /* Tiny files: add groups to hold the inodes. */
+      if (fixed) {
+        nbdkit_error ("size parameter is too small for the number of files");
+        return -1;
+      }
+      total = (uint64_t) DIV_ROUND_UP (fs->nr_inodes, BLOCK_SIZE * 8) *
+        BLOCKS_PER_GROUP;
+      continue;
+    }
+    fs->inodes_per_group = ipg;
+    fs->inode_table_blocks = ipg / INODES_PER_BLOCK;
+    fs->gdt_blocks =
+      DIV_ROUND_UP (fs->nr_groups * GROUP_DESC_SIZE, BLOCK_SIZE);
+
+    /* The last group must have room for its metadata and some data. */
+    g = fs->nr_groups - 1;
+    if (total - group_start (fs, g) < group_overhead (fs, g) + 16) {
+      if (fixed && g > 0)
+        total = group_start (fs, g);
+      else
+        total = group_start (fs, g) + group_overhead (fs, g) + 16;
+      continue;
+    }
+
+    overhead = 0;
+    for (g = 0; g < fs->nr_groups; ++g)
+      overhead += group_overhead (fs, g);
+    need = nr_data_blocks + overhead;
+
+    if (fixed) {
+      if (need > total) {
+        nbdkit_error ("size parameter is too small, "
+                      "the filesystem needs at least %" PRIu64 " bytes",
+                      need * BLOCK_SIZE);
+        return -1;
+      }
+      break;
+    }
+    if (need + extra <= total)
+      break;
+    total = need + extra;
+  }
+  if (tries == 100) {
+    nbdkit_error ("could not choose a size for the filesystem");
+    return -1;
+  }
+
+  if (fs->nr_blocks > UINT32_MAX ||
+      (uint64_t) fs->nr_groups * fs->inodes_per_group > UINT32_MAX) {
+    nbdkit_error ("filesystem is too large for ext2");
+    return -1;
+  }
+
+  nbdkit_debug ("ext2: %" PRIu64 " blocks, %" PRIu32 " groups, "
+                "%" PRIu32 " inodes per group, %" PRIu32 " inodes used",
+                fs->nr_blocks, fs->nr_groups,
+                fs->inodes_per_group, fs->nr_inodes);
+  return 0;
+}
+
+/* Allocate up to n blocks, returning the first block in *start and
+ * the number allocated in *len.  A run never crosses the metadata at
+ * the start of a group.
+ */
+static int
+alloc_run (struct ext2 *fs, uint64_t n, uint64_t *start, uint64_t *len)
+{
+  for (;;) {
+    uint32_t g = fs->next_block / BLOCKS_PER_GROUP;
+    uint64_t data_start, end;
+
+    if (g >= fs->nr_groups) {
+      nbdkit_error ("filesystem is too small");
+      return -1;
+    }
+    data_start = group_start (fs, g) + group_overhead (fs, g);
+    if (fs->next_block < data_start)
+      fs->next_block = data_start;
+    end = group_end (fs, g);
+    if (fs->next_block < end) {
+      *start = fs->next_block;
+      *len = MIN (n, end - fs->next_block);
+      fs->next_block += *len;
+      return 0;
+    }
+    fs->next_block = group_start (fs, g+1);
+  }
+}
+
+static int
+add_run (struct ext2 *fs, uint64_t block, uint64_t len,
+         enum region_type rtype, size_t i, const unsigned char *data,
+         const char *description)
+{
+  struct run *run;
+
+  if (fs->nr_runs == fs->runs_alloc) {
+    size_t n = MAX (fs->runs_alloc * 2, 64);
+
+    run = realloc (fs->runs, n * sizeof (struct run));
+    if (run == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    fs->runs = run;
+    fs->runs_alloc = n;
+  }
+
+  run = &fs->runs[fs->nr_runs++];
+  run->block = block;
+  run->len = len;
+  run->type = rtype;
+  run->i = i;
+  run->data = data;
+  run->description = description;
+  return 0;
+}
+
+/* Allocate n blocks of metadata.  The physical block numbers are
+ * returned in phys[] (if not NULL).  Returns the buffer holding the
+ * contents.
+ */
+static unsigned char *
+alloc_metadata (struct ext2 *fs, uint64_t n, uint32_t *phys,
+                const char *description)
+{
+  unsigned char *buf;
+  uint64_t j, k, start, len;
+
+  buf = alloc_buffer (fs->disk, n, BLOCK_SIZE);
+  if (buf == NULL)
+    return NULL;
+
+  for (j = 0; j < n; j += len) {
+    if (alloc_run (fs, n - j, &start, &len) == -1 ||
+        add_run (fs, start, len * BLOCK_SIZE, region_data, 0,
+                 buf + j * BLOCK_SIZE, description) == -1)
+      return NULL;
+    if (phys)
+      for (k = 0; k < len; ++k)
+        phys[j+k] = start + k;
+  }
+  return buf;
+}
+
+/* Used to fill in the block pointers (i_block and indirect blocks) of
+ * an inode in logical block order.
+ */
+struct block_map {
+  unsigned char *i_block;
+  unsigned char *ind_buf;       /* all indirect blocks */
+  uint32_t *ind_phys;
+  uint64_t next_ind;            /* next unused indirect block */
+  unsigned char *ind, *dind, *tind; /* current indirect blocks */
+  uint64_t l;                   /* next logical block */
+};
+
+static unsigned char *
+take_indirect (struct block_map *m, unsigned char *ptr)
+{
+  put32 (ptr, m->ind_phys[m->next_ind]);
+  return m->ind_buf + m->next_ind++ * BLOCK_SIZE;
+}
+
+static void
+map_block (struct block_map *m, uint32_t phys)
+{
+  const uint64_t P = POINTERS_PER_BLOCK;
+  uint64_t l = m->l++;
+
+  if (l < 12) {
+    put32 (&m->i_block[l*4], phys);
+    return;
+  }
+  l -= 12;
+  if (l < P) {
+    if (l == 0)
+      m->ind = take_indirect (m, &m->i_block[12*4]);
+    put32 (&m->ind[l*4], phys);
+    return;
+  }
+  l -= P;
+  if (l < P*P) {
+    if (l == 0)
+      m->dind = take_indirect (m, &m->i_block[13*4]);
+    if (l % P == 0)
+      m->ind = take_indirect (m, &m->dind[l/P*4]);
+    put32 (&m->ind[l%P*4], phys);
+    return;
+  }
+  l -= P*P;
+  if (l == 0)
+    m->tind = take_indirect (m, &m->i_block[14*4]);
+  if (l % (P*P) == 0)
+    m->dind = take_indirect (m, &m->tind[l/(P*P)*4]);
+  if (l % P == 0)
+    m->ind = take_indirect (m, &m->dind[l/P%P*4]);
+  put32 (&m->ind[l%P*4], phys);
+}
+
+/* Add a host file, returning its index in disk->files. */
+static int64_t
+add_file (struct virtual_disk *disk, char *host_path)
+{
+  char **files;
+
+  files = realloc (disk->files, (disk->nr_files+1) * sizeof (char *));
+  if (files == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  disk->files = files;
+  disk->files[disk->nr_files] = host_path;
+  return disk->nr_files++;
+}
+
+static int64_t
+add_extent (struct virtual_disk *disk, size_t file, uint64_t offset)
+{
+  struct extent *extents;
+
+  extents = realloc (disk->extents,
+                     (disk->nr_extents+1) * sizeof (struct extent));
+  if (extents == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  disk->extents = extents;
+  disk->extents[disk->nr_extents].file = file;
+  disk->extents[disk->nr_extents].offset = offset;
+  return disk->nr_extents++;
+}
+
+/* Allocate the blocks of an inode and fill in the block pointers.
+ * If file >= 0 the data comes from that host file, otherwise it is
+ * metadata and the buffer holding it is returned in *data.
+ */
+static int
+alloc_inode_blocks (struct ext2 *fs, unsigned char *inode,
+                    uint64_t nr_blocks, uint64_t file_size, int64_t file,
+                    unsigned char **data, const char *description)
+{
+  struct block_map m = { .i_block = inode + 40 };
+  uint64_t nr_ind = indirect_blocks (nr_blocks);
+  CLEANUP_FREE uint32_t *ind_phys = NULL;
+  CLEANUP_FREE uint32_t *phys = NULL;
+  uint64_t j, k, start, len;
+
+  if (nr_ind > 0) {
+    ind_phys = malloc (nr_ind * sizeof (uint32_t));
+    if (ind_phys == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    m.ind_phys = ind_phys;
+    m.ind_buf = alloc_metadata (fs, nr_ind, ind_phys, "indirect blocks");
+    if (m.ind_buf == NULL)
+      return -1;
+  }
+
+  if (file >= 0) {
+    for (j = 0; j < nr_blocks; j += len) {
+      int64_t i;
+
+      if (alloc_run (fs, nr_blocks - j, &start, &len) == -1)
+        return -1;
+      i = add_extent (fs->disk, file, j * BLOCK_SIZE);
+      if (i == -1 ||
+          add_run (fs, start,
+                   MIN (len * BLOCK_SIZE, file_size - j * BLOCK_SIZE),
+                   region_file, i, NULL, description) == -1)
+        return -1;
+      for (k = 0; k < len; ++k)
+        map_block (&m, start + k);
+    }
+  }
+  else {
+    phys = malloc (nr_blocks * sizeof (uint32_t));
+    if (phys == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    *data = alloc_metadata (fs, nr_blocks, phys, description);
+    if (*data == NULL)
+      return -1;
+    for (j = 0; j < nr_blocks; ++j)
+      map_block (&m, phys[j]);
+  }
+
+  assert (m.next_ind == nr_ind);
+  put32 (inode + 28, (nr_blocks + nr_ind) * (BLOCK_SIZE / 512));
+  return 0;
+}
+
+static unsigned char *
+get_inode (struct ext2 *fs, uint32_t ino)
+{
+  return fs->inodes + (ino-1) * INODE_SIZE;
+}
+
+static void
+set_inode_attrs (unsigned char *inode, const struct stat *st,
+                 uint32_t links)
+{
+  put16 (inode + 0, st->st_mode);
+  put16 (inode + 2, st->st_uid);
+  put32 (inode + 8, st->st_atime);
+  put32 (inode + 12, st->st_ctime);
+  put32 (inode + 16, st->st_mtime);
+  put16 (inode + 24, st->st_gid);
+  put16 (inode + 26, links);
+  put16 (inode + 120, st->st_uid >> 16);
+  put16 (inode + 122, st->st_gid >> 16);
+}
+
+static int
+create_inode (struct ext2 *fs, size_t i)
+{
+  struct node *node = &fs->nodes[i];
+  const struct stat *st = &node->statbuf;
+  unsigned char *inode = get_inode (fs, node->ino);
+  unsigned char *data;
+  uint64_t isize = 0;
+  int64_t file;
+  char *target;
+  ssize_t r;
+
+  set_inode_attrs (inode, st, node->links);
+
+  if (S_ISDIR (st->st_mode)) {
+    if (alloc_inode_blocks (fs, inode, node->nr_data_blocks, 0, -1, &data,
+                            "directory") == -1)
+      return -1;
+    write_dir (fs, i, data);
+    isize = node->nr_data_blocks * BLOCK_SIZE;
+  }
+  else if (S_ISREG (st->st_mode)) {
+    isize = st->st_size;
+    if (isize > 0) {
+      file = add_file (fs->disk, node->host_path);
+      if (file == -1)
+        return -1;
+      node->host_path = NULL;   /* now owned by disk->files */
+      if (alloc_inode_blocks (fs, inode, node->nr_data_blocks, isize, file,
+                              NULL, fs->disk->files[file]) == -1)
+        return -1;
+    }
+  }
+  else if (S_ISLNK (st->st_mode)) {
+    isize = st->st_size;
+    target = malloc (isize + 1);
+    if (target == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    r = readlink (node->host_path, target, isize + 1);
+    if (r == -1) {
+      nbdkit_error ("readlink: %s: %m", node->host_path);
+      free (target);
+      return -1;
+    }
+    if (r != isize) {
+      nbdkit_error ("readlink: %s: symlink changed", node->host_path);
+      free (target);
+      return -1;
+    }
+    if (node->nr_data_blocks == 0)
+      /* Fast symlink stored in i_block. */
+      memcpy (inode + 40, target, isize);
+    else {
+      if (alloc_inode_blocks (fs, inode, 1, 0, -1, &data, "symlink") == -1) {
+        free (target);
+        return -1;
+      }
+      memcpy (data, target, isize);
+    }
+    free (target);
+  }
+  else if (S_ISCHR (st->st_mode) || S_ISBLK (st->st_mode)) {
+    unsigned maj = major (st->st_rdev), min = minor (st->st_rdev);
+
+    if (maj < 256 && min < 256)
+      put32 (inode + 40, (maj << 8) | min);
+    else
+      put32 (inode + 44, (min & 0xff) | (maj << 8) | ((min & ~0xff) << 12));
+  }
+
+  put32 (inode + 4, isize);
+  if (S_ISREG (st->st_mode))
+    put32 (inode + 108, isize >> 32);
+  return 0;
+}
+
+static int
+create_lost_and_found (struct ext2 *fs)
+{
+  unsigned char *inode = get_inode (fs, LOST_AND_FOUND_INO);
+  struct stat st = { .st_mode = S_IFDIR | 0700 };
+  struct dir_writer w = { .buf = NULL };
+
+  st.st_atime = st.st_ctime = st.st_mtime = time (NULL);
+  set_inode_attrs (inode, &st, 2);
+  put32 (inode + 4, BLOCK_SIZE);
+  if (alloc_inode_blocks (fs, inode, 1, 0, -1, &w.buf, "lost+found") == -1)
+    return -1;
+  dir_add (&w, ".", LOST_AND_FOUND_INO, 2);
+  dir_add (&w, "..", ROOT_INO, 2);
+  dir_end_block (&w);
+  return 0;
+}
+
+/* Return a bitmap block with bits [0, used) and [nr_bits, end) set. */
+static const unsigned char *
+get_bitmap (struct ext2 *fs, uint32_t used, uint32_t nr_bits)
+{
+  struct bitmap *bitmaps;
+  unsigned char *data;
+  size_t i;
+
+  for (i = 0; i < fs->nr_bitmaps; ++i)
+    if (fs->bitmaps[i].used == used && fs->bitmaps[i].size == nr_bits)
+      return fs->bitmaps[i].data;
+
+  data = alloc_buffer (fs->disk, 1, BLOCK_SIZE);
+  if (data == NULL)
+    return NULL;
+  for (i = 0; i < BLOCK_SIZE * 8; ++i)
+    if (i < used || i >= nr_bits)
+      data[i/8] |= 1 << (i%8);
+
+  bitmaps = realloc (fs->bitmaps, (fs->nr_bitmaps+1) * sizeof (struct bitmap));
+  if (bitmaps == NULL) {
+    nbdkit_error ("realloc: %m");
+    return NULL;
+  }
+  fs->bitmaps = bitmaps;
+  fs->bitmaps[fs->nr_bitmaps].used = used;
+  fs->bitmaps[fs->nr_bitmaps].size = nr_bits;
+  fs->bitmaps[fs->nr_bitmaps].data = data;
+  fs->nr_bitmaps++;
+  return data;
+}
+
+/* Append a region to disk->fs_regions at byte offset pos, adding
+ * zero padding before it if necessary.
+ */
+static int
+emit (struct ext2 *fs, uint64_t pos, uint64_t len, enum region_type rtype,
+      size_t i, const unsigned char *data, const char *description)
+{
+  struct regions *regions = &fs->disk->fs_regions;
+  int r;
+
+  assert (pos >= fs->pos);
+  if (pos > fs->pos &&
+      append_region_len (regions, "free space", pos - fs->pos, 0, 0,
+                         region_zero) == -1)
+    return -1;
+  if (rtype == region_file)
+    r = append_region_len (regions, description, len, 0, 0, region_file, i);
+  else
+    r = append_region_len (regions, description, len, 0, 0,
+                           region_data, data);
+  if (r == -1)
+    return -1;
+  fs->pos = pos + len;
+  return 0;
+}
+
+/* Fill in the group descriptors, superblocks and bitmaps, and create
+ * the regions making up the filesystem.
+ */
+static int
+create_regions (struct ext2 *fs)
+{
+  const uint32_t ipg = fs->inodes_per_group;
+  uint64_t free_blocks = 0, free_inodes = 0;
+  unsigned char *sb;
+  size_t nr_supers = 0, r = 0, j;
+  uint32_t g, *dirs;
+  uint64_t used_blocks;
+  uint32_t used_inodes;
+  time_t now = time (NULL);
+  size_t i;
+
+  /* Count directories in each group. */
+  dirs = calloc (fs->nr_groups, sizeof (uint32_t));
+  if (dirs == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  dirs[(LOST_AND_FOUND_INO-1) / ipg]++;
+  for (i = 0; i < fs->nr_nodes; ++i)
+    if (fs->nodes[i].owner == i && S_ISDIR (fs->nodes[i].statbuf.st_mode))
+      dirs[(fs->nodes[i].ino-1) / ipg]++;
+
+  /* Group descriptors. */
+  for (g = 0; g < fs->nr_groups; ++g) {
+    unsigned char *desc = fs->gdt + g * GROUP_DESC_SIZE;
+    uint64_t start = group_start (fs, g), end = group_end (fs, g);
+    uint64_t meta = start + (group_has_super (g) ? 1 + fs->gdt_blocks : 0);
+
+    used_blocks = MIN (MAX (fs->next_block, start + group_overhead (fs, g)),
+                       end) - start;
+    used_inodes = fs->nr_inodes > g * ipg ?
+      MIN (fs->nr_inodes - g * ipg, ipg) : 0;
+    put32 (desc + 0, meta);
+    put32 (desc + 4, meta + 1);
+    put32 (desc + 8, meta + 2);
+    put16 (desc + 12, end - start - used_blocks);
+    put16 (desc + 14, ipg - used_inodes);
+    put16 (desc + 16, dirs[g]);
+    free_blocks += end - start - used_blocks;
+    free_inodes += ipg - used_inodes;
+    if (group_has_super (g))
+      nr_supers++;
+  }
+  free (dirs);
+
+  /* Superblocks.  The copies differ only in s_block_group_nr. */
+  sb = alloc_buffer (fs->disk, nr_supers, 1024);
+  if (sb == NULL)
+    return -1;
+  put32 (sb + 0, fs->nr_groups * ipg);
+  put32 (sb + 4, fs->nr_blocks);
+  put32 (sb + 12, free_blocks);
+  put32 (sb + 16, free_inodes);
+  put32 (sb + 20, 0);           /* s_first_data_block */
+  put32 (sb + 24, 2);           /* s_log_block_size (4K) */
+  put32 (sb + 28, 2);           /* s_log_frag_size */
+  put32 (sb + 32, BLOCKS_PER_GROUP);
+  put32 (sb + 36, BLOCKS_PER_GROUP);
+  put32 (sb + 40, ipg);
+  put32 (sb + 48, now);         /* s_wtime */
+  put16 (sb + 54, 0xffff);      /* s_max_mnt_count */
+  put16 (sb + 56, 0xef53);      /* s_magic */
+  put16 (sb + 58, 1);           /* s_state = clean */
+  put16 (sb + 60, 1);           /* s_errors = continue */
+  put32 (sb + 64, now);         /* s_lastcheck */
+  put32 (sb + 76, 1);           /* s_rev_level */
+  put32 (sb + 84, LOST_AND_FOUND_INO); /* s_first_ino */
+  put16 (sb + 88, INODE_SIZE);
+  put32 (sb + 96, 0x0002);      /* incompat: filetype */
+  put32 (sb + 100, 0x0003);     /* ro_compat: sparse_super, large_file */
+  for (j = 0; j < 16; ++j)
+    sb[104+j] = xrandom (&random_state) & 0xff;
+  if (label) {
+    if (strlen (label) > 16)
+      nbdkit_debug ("ext2: label will be truncated to 16 characters");
+    strncpy ((char *) sb + 120, label, 16);
+  }
+  put32 (sb + 264, now);        /* s_mkfs_time */
+  for (j = 1; j < nr_supers; ++j)
+    memcpy (sb + j * 1024, sb, 1024);
+
+  /* Create the regions, group by group. */
+  j = 0;
+  for (g = 0; g < fs->nr_groups; ++g) {
+    uint64_t start = group_start (fs, g), end = group_end (fs, g);
+    uint64_t meta = start;
+    const unsigned char *bitmap;
+
+    if (group_has_super (g)) {
+      put16 (sb + j * 1024 + 90, g); /* s_block_group_nr */
+      if (emit (fs, start * BLOCK_SIZE + (g == 0 ? 1024 : 0), 1024,
+                region_data, 0, sb + j * 1024, "superblock") == -1 ||
+          emit (fs, (start + 1) * BLOCK_SIZE,
+                fs->nr_groups * GROUP_DESC_SIZE,
+                region_data, 0, fs->gdt, "group descriptors") == -1)
+        return -1;
+      j++;
+      meta += 1 + fs->gdt_blocks;
+    }
+
+    used_blocks = MIN (MAX (fs->next_block, start + group_overhead (fs, g)),
+                       end) - start;
+    bitmap = get_bitmap (fs, used_blocks, end - start);
+    if (bitmap == NULL ||
+        emit (fs, meta * BLOCK_SIZE, BLOCK_SIZE, region_data, 0, bitmap,
+              "block bitmap") == -1)
+      return -1;
+
+    used_inodes = fs->nr_inodes > g * ipg ?
+      MIN (fs->nr_inodes - g * ipg, ipg) : 0;
+    bitmap = get_bitmap (fs, used_inodes, ipg);
+    if (bitmap == NULL ||
+        emit (fs, (meta + 1) * BLOCK_SIZE, BLOCK_SIZE, region_data, 0, bitmap,
+              "inode bitmap") == -1)
+      return -1;
+
+    if (used_inodes > 0 &&
+        emit (fs, (meta + 2) * BLOCK_SIZE, used_inodes * INODE_SIZE,
+              region_data, 0, get_inode (fs, g * ipg + 1),
+              "inode table") == -1)
+      return -1;
+
+    for (; r < fs->nr_runs && fs->runs[r].block < end; ++r) {
+      const struct run *run = &fs->runs[r];
+
+      if (emit (fs, run->block * BLOCK_SIZE, run->len, run->type,
+                run->i, run->data, run->description) == -1)
+        return -1;
+    }
+  }
+  assert (r == fs->nr_runs);
+
+  /* Free space at the end of the filesystem. */
+  if (fs->pos < fs->nr_blocks * BLOCK_SIZE &&
+      append_region_len (&fs->disk->fs_regions, "free space",
+                         fs->nr_blocks * BLOCK_SIZE - fs->pos, 0, 0,
+                         region_zero) == -1)
+    return -1;
+
+  return 0;
+}
+
+static void
+free_ext2 (struct ext2 *fs)
+{
+  size_t i;
+
+  for (i = 0; i < fs->nr_nodes; ++i) {
+    free (fs->nodes[i].name);
+    free (fs->nodes[i].host_path);
+  }
+  free (fs->nodes);
+  free (fs->runs);
+  free (fs->bitmaps);
+}
+
+int
+create_ext2 (struct virtual_disk *disk)
+{
+  struct ext2 fs = { .disk = disk };
+  int64_t nr_data_blocks;
+  size_t i;
+  int ret = -1;
+
+  if (scan_tree (&fs) == -1 ||
+      find_hard_links (&fs) == -1)
+    goto out;
+
+  nr_data_blocks = assign_inodes (&fs);
+  if (nr_data_blocks == -1 ||
+      compute_geometry (&fs, nr_data_blocks) == -1)
+    goto out;
+
+  fs.inodes = alloc_buffer (disk, fs.nr_inodes, INODE_SIZE);
+  fs.gdt = alloc_buffer (disk, fs.gdt_blocks, BLOCK_SIZE);
+  if (fs.inodes == NULL || fs.gdt == NULL)
+    goto out;
+
+  /* Allocate blocks in inode order, starting with the root directory. */
+  if (create_inode (&fs, 0) == -1 ||
+      create_lost_and_found (&fs) == -1)
+    goto out;
+  for (i = 1; i < fs.nr_nodes; ++i) {
+    if (fs.nodes[i].owner == i && create_inode (&fs, i) == -1)
+      goto out;
+  }
+
+  if (create_regions (&fs) == -1)
+    goto out;
+
+  disk->filesystem_size = fs.nr_blocks * BLOCK_SIZE;
+  ret = 0;
+
+ out:
+  free_ext2 (&fs);
+  return ret;
+}
@@ -61,6 +61,10 @@ create_filesystem (struct virtual_disk *disk)
   CLEANUP_FREE char *filename = NULL;
   int fd = -1;
 
+  /* In lazy mode we construct the filesystem ourselves. */
+  if (lazy)
+    return create_ext2 (disk);
+
   /* Estimate the filesystem size and compute the final virtual size
    * of the disk.  We only need to do this if the user didn't specify
    * the exact size on the command line.
@@ -39,11 +39,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <assert.h>
 
 #define NBDKIT_API_VERSION 2
 
 #include <nbdkit-plugin.h>
 
+#include "fdcache.h"
 #include "random.h"
 #include "regions.h"
 
@@ -55,10 +57,14 @@ const char *label;
 const char *type = "ext2";
 int64_t size;
 bool size_add_estimate;  /* if size=+SIZE was used */
+bool lazy;
 
 /* Virtual disk. */
 static struct virtual_disk disk;
 
+/* In lazy mode, cache of open host files. */
+static struct fdcache fdcache = FDCACHE_INIT;
+
 /* Used to create a random GUID for the partition. */
 struct random_state random_state;
 
@@ -72,6 +78,7 @@ linuxdisk_load (void)
 static void
 linuxdisk_unload (void)
 {
+  fdcache_close (&fdcache);
   free_virtual_disk (&disk);
   free (dir);
 }
@@ -111,6 +118,12 @@ linuxdisk_config (const char *key, const char *value)
     if (size == -1)
       return -1;
   }
+  else if (strcmp (key, "lazy") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    lazy = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -127,6 +140,10 @@ linuxdisk_config_complete (void)
                   "after the plugin name on the command line");
     return -1;
   }
+  if (lazy && strcmp (type, "ext2") != 0) {
+    nbdkit_error ("lazy=true can only be used with type=ext2");
+    return -1;
+  }
 
   return create_virtual_disk (&disk);
 }
@@ -135,7 +152,8 @@ linuxdisk_config_complete (void)
   "dir=<DIRECTORY>  (required) The directory to serve.\n" \
   "label=<LABEL>               The filesystem label.\n" \
   "type=ext2|ext3|ext4         The filesystem type.\n" \
-  "size=[+]<SIZE>              The virtual filesystem size."
+  "size=[+]<SIZE>              The virtual filesystem size.\n" \
+  "lazy=true                   Map file data instead of copying it."
 
 static void *
 linuxdisk_open (int readonly)
@@ -167,16 +185,43 @@ linuxdisk_can_cache (void *handle)
   return NBDKIT_CACHE_EMULATE;
 }
 
+/* In lazy mode, read from the host file backing extent i. */
+static ssize_t
+pread_extent (size_t i, void *buf, size_t len, uint64_t offset)
+{
+  const struct extent *extent = &disk.extents[i];
+  const char *host_path = disk.files[extent->file];
+  int fd, slot;
+  ssize_t r;
+
+  offset += extent->offset;
+  slot = fdcache_get (&fdcache, extent->file, host_path, offset, len, &fd);
+  if (slot == -2)
+    return -1;
+  r = pread (fd, buf, len, offset);
+  if (r == -1)
+    nbdkit_error ("pread: %s: %m", host_path);
+  else if (r == 0) {
+    nbdkit_error ("pread: %s: unexpected end of file", host_path);
+    r = -1;
+  }
+  fdcache_put (&fdcache, slot, fd);
+  return r;
+}
+
 /* Read data from the virtual disk. */
 static int
 linuxdisk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                  uint32_t flags)
 {
+  const struct region *region = find_region (&disk.regions, offset);
+
   while (count > 0) {
-    const struct region *region = find_region (&disk.regions, offset);
     size_t len;
     ssize_t r;
 
+    region = next_region (&disk.regions, region, offset);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -184,8 +229,17 @@ linuxdisk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
 
     switch (region->type) {
     case region_file:
-      /* We don't use region->u.i since there is only one backing
-       * file, and we have that open already (in ‘disk.fd’).
+      if (disk.fd == -1) {
+        /* Lazy mode: region->u.i is the extent of a host file. */
+        assert (region->u.i < disk.nr_extents);
+        r = pread_extent (region->u.i, buf, len, offset - region->start);
+        if (r == -1)
+          return -1;
+        len = r;
+        break;
+      }
+      /* Otherwise we don't use region->u.i since there is only one
+       * backing file, and we have that open already (in ‘disk.fd’).
        */
       r = pread (disk.fd, buf, len, offset - region->start);
       if (r == -1) {
@@ -194,18 +194,17 @@ create_gpt_partition_table_entry (const struct region *region,
 static void
 create_gpt_partition_table (struct virtual_disk *disk, unsigned char *out)
 {
-  size_t j;
-
-  for (j = 0; j < nr_regions (&disk->regions); ++j) {
-    const struct region *region = get_region (&disk->regions, j);
-
-    /* Find the (only) partition region, which has type region_file. */
-    if (region->type == region_file) {
-      create_gpt_partition_table_entry (region, true,
-                                        PARTITION_TYPE_GUID,
-                                        disk->guid,
-                                        out);
-      out += GPT_PT_ENTRY_SIZE;
-    }
-  }
+  struct region region;
+
+  /* The (only) partition contains the filesystem.  In lazy mode this
+   * is made of many regions so we cannot use a single region here.
+   */
+  region.start = disk->filesystem_start;
+  region.len = disk->filesystem_size;
+  region.end = region.start + region.len - 1;
+
+  create_gpt_partition_table_entry (&region, true,
+                                    PARTITION_TYPE_GUID,
+                                    disk->guid,
+                                    out);
 }
@@ -56,6 +56,7 @@ init_virtual_disk (struct virtual_disk *disk)
   disk->fd = -1;
 
   init_regions (&disk->regions);
+  init_regions (&disk->fs_regions);
 }
 
 int
@@ -107,7 +108,17 @@ create_virtual_disk (struct virtual_disk *disk)
 void
 free_virtual_disk (struct virtual_disk *disk)
 {
+  size_t i;
+
   free_regions (&disk->regions);
+  free_regions (&disk->fs_regions);
+  for (i = 0; i < disk->nr_files; ++i)
+    free (disk->files[i]);
+  free (disk->files);
+  free (disk->extents);
+  for (i = 0; i < disk->nr_buffers; ++i)
+    free (disk->buffers[i]);
+  free (disk->buffers);
   free (disk->protective_mbr);
   free (disk->primary_header);
   free (disk->pt);
@@ -120,6 +131,8 @@ free_virtual_disk (struct virtual_disk *disk)
 static int
 create_regions (struct virtual_disk *disk)
 {
+  size_t i;
+
   /* Protective MBR. */
   if (append_region_len (&disk->regions, "Protective MBR",
                          SECTOR_SIZE, 0, 0,
@@ -139,10 +152,43 @@ create_regions (struct virtual_disk *disk)
     return -1;
 
   /* Partition containing the filesystem.  Align it to 2048 sectors. */
-  if (append_region_len (&disk->regions, "Filesystem",
-                         disk->filesystem_size, 2048*SECTOR_SIZE, 0,
-                         region_file, 0 /* unused */) == -1)
-    return -1;
+  if (disk->fd >= 0) {
+    if (append_region_len (&disk->regions, "Filesystem",
+                           disk->filesystem_size, 2048*SECTOR_SIZE, 0,
+                           region_file, 0 /* unused */) == -1)
+      return -1;
+  }
+  else {
+    /* In lazy mode copy the regions making up the filesystem. */
+    for (i = 0; i < nr_regions (&disk->fs_regions); ++i) {
+      const struct region *region = get_region (&disk->fs_regions, i);
+      uint64_t align = i == 0 ? 2048*SECTOR_SIZE : 0;
+      int r;
+
+      switch (region->type) {
+      case region_file:
+        r = append_region_len (&disk->regions, region->description,
+                               region->len, align, 0,
+                               region_file, region->u.i);
+        break;
+      case region_data:
+        r = append_region_len (&disk->regions, region->description,
+                               region->len, align, 0,
+                               region_data, region->u.data);
+        break;
+      case region_zero:
+      default:
+        r = append_region_len (&disk->regions, region->description,
+                               region->len, align, 0,
+                               region_zero);
+        break;
+      }
+      if (r == -1)
+        return -1;
+    }
+  }
+  disk->filesystem_start =
+    virtual_size (&disk->regions) - disk->filesystem_size;
 
   /* GPT secondary PT (LBA -33..-2). */
   if (append_region_len (&disk->regions, "GPT secondary PT",
@@ -43,11 +43,20 @@ extern const char *label;
 extern const char *type;
 extern int64_t size;
 extern bool size_add_estimate;
+extern bool lazy;
 
 extern struct random_state random_state;
 
 #define SECTOR_SIZE 512
 
+/* In lazy mode a region_file region of the filesystem refers to part
+ * of one of the host files.  region->u.i is the index of the extent.
+ */
+struct extent {
+  size_t file;                  /* index into virtual_disk.files */
+  uint64_t offset;              /* offset within the host file */
+};
+
 struct virtual_disk {
   /* Virtual disk layout. */
   struct regions regions;
@@ -64,14 +73,30 @@ struct virtual_disk {
   /* GPT secondary (backup) PT header. */
   uint8_t *secondary_header;
 
-  /* Size of the filesystem in bytes. */
+  /* Offset and size of the filesystem in bytes. */
+  uint64_t filesystem_start;
   uint64_t filesystem_size;
 
   /* Unique partition GUID. */
   char guid[16];
 
-  /* File descriptor of the temporary file containing the filesystem. */
+  /* File descriptor of the temporary file containing the filesystem.
+   * This is -1 in lazy mode.
+   */
   int fd;
+
+  /* In lazy mode, the layout of the filesystem (with offsets relative
+   * to the start of the filesystem), the host files and extents
+   * referred to by its region_file regions, and the buffers holding
+   * the metadata referred to by its region_data regions.
+   */
+  struct regions fs_regions;
+  char **files;
+  size_t nr_files;
+  struct extent *extents;
+  size_t nr_extents;
+  void **buffers;
+  size_t nr_buffers;
 };
 
 /* virtual-disk.c */
@@ -88,4 +113,7 @@ extern int create_partition_table (struct virtual_disk *disk);
 /* filesystem.c */
 extern int create_filesystem (struct virtual_disk *disk);
 
+/* ext2.c */
+extern int create_ext2 (struct virtual_disk *disk);
+
 #endif /* NBDKIT_VIRTUAL_DISK_H */
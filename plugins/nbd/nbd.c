@@ -43,10 +43,20 @@
 #include <sys/un.h>
 #include <assert.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <poll.h>
 #include <fcntl.h>
 
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <semaphore.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include <libnbd.h>
 
 #define NBDKIT_API_VERSION 2
@@ -56,23 +66,47 @@
 #include "cleanup.h"
 #include "utils.h"
 
+/* States of transaction.state */
+enum {
+  TRANS_PENDING = 0,
+  TRANS_DONE,
+  TRANS_WAITING, /* Worker is (about to be) asleep waiting for the reply */
+};
+
 /* The per-transaction details */
 struct transaction {
   int64_t cookie;
+  uint32_t state; /* Updated atomically, also the futex word */
+#ifndef HAVE_LINUX_FUTEX_H
   sem_t sem;
+#endif
   uint32_t early_err;
   uint32_t err;
   nbd_completion_callback cb;
 };
 
-/* The per-connection handle */
-struct handle {
+/* One connection to the server */
+struct conn {
   /* These fields are read-only once initialized */
   struct nbd_handle *nbd;
   int fd; /* Cache of nbd_aio_get_fd */
-  int fds[2]; /* Pipe for kicking the reader thread */
-  bool readonly;
+  int fds[2]; /* Eventfd (both fds the same) or pipe for kicking the reader */
   pthread_t reader;
+
+  bool kick_pending; /* Updated atomically, true if reader is being kicked */
+};
+
+/* Upper limit on connections=N */
+#define MAX_CONNECTIONS 16
+
+/* The per-connection handle */
+struct handle {
+  /* These fields are read-only once initialized */
+  struct conn conns[MAX_CONNECTIONS];
+  unsigned nr_conns; /* Connections actually opened */
+  bool readonly;
+
+  unsigned next; /* Round-robin counter, updated atomically */
 };
 
 /* Connect to server via absolute name of Unix socket */
@@ -95,6 +129,9 @@ static unsigned retry;
 static bool shared;
 static struct handle *shared_handle;
 
+/* Number of connections to open to a multi-conn server */
+static unsigned connections = 1;
+
 /* Control TLS settings */
 static int tls = -1;
 static char *tls_certificates;
@@ -118,8 +155,8 @@ nbdplug_unload (void)
 /* Called for each key=value passed on the command line.  This plugin
  * accepts socket=<sockname>, hostname=<hostname>/port=<port>, or
  * [uri=]<uri> (exactly one connection required), and optional
- * parameters export=<name>, retry=<n>, shared=<bool> and various
- * tls settings.
+ * parameters export=<name>, retry=<n>, shared=<bool>, connections=<n>
+ * and various tls settings.
  */
 static int
 nbdplug_config (const char *key, const char *value)
@@ -145,6 +182,14 @@ nbdplug_config (const char *key, const char *value)
     if (nbdkit_parse_unsigned ("retry", value, &retry) == -1)
       return -1;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections < 1 || connections > MAX_CONNECTIONS) {
+      nbdkit_error ("connections must be between 1 and %d", MAX_CONNECTIONS);
+      return -1;
+    }
+  }
   else if (strcmp (key, "shared") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -272,6 +317,7 @@ nbdplug_config_complete (void)
   "retry=<N>              Retry connection up to N seconds (default 0).\n" \
   "shared=<BOOL>          True to share one server connection among all clients,\n" \
   "                       rather than a connection per client (default false).\n" \
+  "connections=<N>        Open N connections to a multi-conn server (default 1).\n" \
   "tls=<MODE>             How to use TLS; one of 'off', 'on', or 'require'.\n" \
   "tls-certificates=<DIR> Directory containing files for X.509 certificates.\n" \
   "tls-verify=<BOOL>      True (default for X.509) to validate server.\n" \
@@ -297,9 +343,9 @@ nbdplug_dump_plugin (void)
 
 /* Reader loop. */
 void *
-nbdplug_reader (void *handle)
+nbdplug_reader (void *conn)
 {
-  struct handle *h = handle;
+  struct conn *h = conn;
 
   while (!nbd_aio_is_dead (h->nbd) && !nbd_aio_is_closed (h->nbd)) {
     struct pollfd fds[2] = {
@@ -308,7 +354,7 @@ nbdplug_reader (void *handle)
       [1].events = POLLIN,
     };
     unsigned dir;
-    char c;
+    char buf[8];
 
     dir = nbd_aio_get_direction (h->nbd);
     nbdkit_debug ("polling, dir=%d", dir);
@@ -326,14 +372,21 @@ nbdplug_reader (void *handle)
     else if (dir & LIBNBD_AIO_DIRECTION_WRITE && fds[0].revents & POLLOUT)
       nbd_aio_notify_write (h->nbd);
 
-    /* Check if we were kicked because a command was started */
+    /* Check if we were kicked because a command was started.  Drain
+     * the fd before clearing the pending flag.  A kick which arrives
+     * before the flag is cleared does not write, but its command was
+     * already started so nbd_aio_get_direction sees it on the next
+     * iteration.  A kick after the flag is cleared writes a byte which
+     * is left in the fd and wakes the next poll.
+     */
     if (fds[1].revents & POLLIN) {
-      while (read (h->fds[0], &c, 1) == 1)
+      while (read (h->fds[0], buf, sizeof buf) > 0)
         /* Drain any backlog */;
       if (errno != EAGAIN) {
-        nbdkit_error ("failed to read pipe: %m");
+        nbdkit_error ("failed to read kick fd: %m");
         break;
       }
+      __atomic_store_n (&h->kick_pending, false, __ATOMIC_SEQ_CST);
     }
   }
 
@@ -355,9 +408,18 @@ nbdplug_notify (void *opaque, int *error)
   nbdkit_debug ("cookie %" PRId64 " completed state machine, status %d",
                 trans->cookie, *error);
   trans->err = *error;
-  if (sem_post (&trans->sem)) {
-    nbdkit_error ("failed to post semaphore: %m");
-    abort ();
+
+  /* Only pay for a wakeup if the worker has gone to sleep. */
+  if (__atomic_exchange_n (&trans->state, TRANS_DONE,
+                           __ATOMIC_ACQ_REL) == TRANS_WAITING) {
+#ifdef HAVE_LINUX_FUTEX_H
+    syscall (SYS_futex, &trans->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    if (sem_post (&trans->sem)) {
+      nbdkit_error ("failed to post semaphore: %m");
+      abort ();
+    }
+#endif
   }
   return 1;
 }
@@ -367,18 +429,51 @@ static void
 nbdplug_prepare (struct transaction *trans)
 {
   memset (trans, 0, sizeof *trans);
+#ifndef HAVE_LINUX_FUTEX_H
   if (sem_init (&trans->sem, 0, 0))
     assert (false);
+#endif
   trans->cb.callback = nbdplug_notify;
   trans->cb.user_data = trans;
 }
 
-/* Register a cookie and kick the I/O thread. */
+/* Choose the connection for the next command.  Requests are spread
+ * round-robin over all the connections, which is safe because they
+ * are only opened when the server advertises multi-conn.
+ */
+static struct conn *
+nbdplug_pick (struct handle *h)
+{
+  unsigned i = 0;
+
+  if (h->nr_conns > 1)
+    i = __atomic_fetch_add (&h->next, 1, __ATOMIC_RELAXED) % h->nr_conns;
+  return &h->conns[i];
+}
+
+/* Kick the reader thread so that it polls for the new command.
+ * Concurrent kicks are coalesced into one write until the reader
+ * thread has drained the fd.
+ */
 static void
-nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
+nbdplug_kick (struct conn *h)
 {
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t c = 1;
+#else
   char c = 0;
+#endif
+
+  if (__atomic_exchange_n (&h->kick_pending, true, __ATOMIC_SEQ_CST))
+    return;
+  if (write (h->fds[1], &c, sizeof c) != sizeof c && errno != EAGAIN)
+    nbdkit_debug ("failed to kick reader thread: %m");
+}
 
+/* Register a cookie and kick the I/O thread. */
+static void
+nbdplug_register (struct conn *h, struct transaction *trans, int64_t cookie)
+{
   if (cookie == -1) {
     nbdkit_error ("command failed: %s", nbd_get_error ());
     trans->early_err = nbd_get_errno ();
@@ -388,52 +483,75 @@ nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
   nbdkit_debug ("cookie %" PRId64 " started by state machine", cookie);
   trans->cookie = cookie;
 
-  if (write (h->fds[1], &c, 1) != 1 && errno != EAGAIN)
-    nbdkit_debug ("failed to kick reader thread: %m");
+  nbdplug_kick (h);
 }
 
 /* Perform the reply half of a transaction. */
 static int
-nbdplug_reply (struct handle *h, struct transaction *trans)
+nbdplug_reply (struct conn *h, struct transaction *trans)
 {
   int err;
+  uint32_t state = TRANS_PENDING;
 
   if (trans->early_err)
     err = trans->early_err;
   else {
-    while ((err = sem_wait (&trans->sem)) == -1 && errno == EINTR)
-      /* try again */;
-    if (err) {
-      nbdkit_debug ("failed to wait on semaphore: %m");
-      err = EIO;
+    /* If the reply has already arrived there is no need to sleep,
+     * otherwise tell nbdplug_notify that it must wake us.
+     */
+    if (__atomic_compare_exchange_n (&trans->state, &state, TRANS_WAITING,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+#ifdef HAVE_LINUX_FUTEX_H
+      while (__atomic_load_n (&trans->state, __ATOMIC_ACQUIRE) ==
+             TRANS_WAITING)
+        /* EINTR and EAGAIN (already woken) are handled by the loop. */
+        syscall (SYS_futex, &trans->state, FUTEX_WAIT_PRIVATE,
+                 TRANS_WAITING, NULL, NULL, 0);
+#else
+      while (sem_wait (&trans->sem) == -1) {
+        if (errno != EINTR) {
+          nbdkit_debug ("failed to wait on semaphore: %m");
+          abort ();
+        }
+      }
+#endif
     }
-    else
-      err = trans->err;
+    err = trans->err;
   }
+#ifndef HAVE_LINUX_FUTEX_H
   if (sem_destroy (&trans->sem))
     abort ();
+#endif
   errno = err;
   return err ? -1 : 0;
 }
 
-/* Create the shared or per-connection handle. */
-static struct handle *
-nbdplug_open_handle (int readonly)
+static void
+nbdplug_close_kick_fds (struct conn *h)
+{
+  close (h->fds[0]);
+  if (h->fds[1] != h->fds[0])
+    close (h->fds[1]);
+}
+
+/* Open one connection to the server. */
+static int
+nbdplug_open_conn (struct conn *h)
 {
-  struct handle *h;
   int r;
   unsigned long retries = retry;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
+#if defined HAVE_SYS_EVENTFD_H
+  h->fds[0] = h->fds[1] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (h->fds[0] == -1) {
+    nbdkit_error ("eventfd: %m");
+    return -1;
   }
-#ifdef HAVE_PIPE2
+#elif defined HAVE_PIPE2
   if (pipe2 (h->fds, O_NONBLOCK)) {
     nbdkit_error ("pipe2: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
 #else
   /* This plugin doesn't fork, so we don't care about CLOEXEC. Our use
@@ -441,18 +559,15 @@ nbdplug_open_handle (int readonly)
    */
   if (pipe (h->fds)) {
     nbdkit_error ("pipe: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
   if (set_nonblock (h->fds[0]) == -1) {
     close (h->fds[1]);
-    free (h);
-    return NULL;
+    return -1;
   }
   if (set_nonblock (h->fds[1]) == -1) {
     close (h->fds[0]);
-    free (h);
-    return NULL;
+    return -1;
   }
 #endif
 
@@ -495,23 +610,84 @@ nbdplug_open_handle (int readonly)
   if (h->fd == -1)
     goto err;
 
-  if (readonly)
-    h->readonly = true;
-
   /* Spawn a dedicated reader thread */
   if ((errno = pthread_create (&h->reader, NULL, nbdplug_reader, h))) {
     nbdkit_error ("failed to initialize reader thread: %m");
     goto err;
   }
 
-  return h;
+  return 0;
 
  err:
-  close (h->fds[0]);
-  close (h->fds[1]);
+  nbdplug_close_kick_fds (h);
   nbdkit_error ("failure while creating nbd handle: %s", nbd_get_error ());
   if (h->nbd)
     nbd_close (h->nbd);
+  h->nbd = NULL;
+  return -1;
+}
+
+/* Close one connection to the server. */
+static void
+nbdplug_close_conn (struct conn *h)
+{
+  if (nbd_shutdown (h->nbd, 0) == -1)
+    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
+  if ((errno = pthread_join (h->reader, NULL)))
+    nbdkit_debug ("failed to join reader thread: %m");
+  nbdplug_close_kick_fds (h);
+  nbd_close (h->nbd);
+}
+
+/* Create the shared or per-connection handle.  With connections=N
+ * and a server which advertises multi-conn, N connections are opened
+ * and requests are spread across them.
+ */
+static struct handle *
+nbdplug_open_handle (int readonly)
+{
+  struct handle *h;
+  int mc;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  if (readonly)
+    h->readonly = true;
+
+  if (nbdplug_open_conn (&h->conns[0]) == -1) {
+    free (h);
+    return NULL;
+  }
+  h->nr_conns = 1;
+
+  if (connections > 1) {
+    mc = nbd_can_multi_conn (h->conns[0].nbd);
+    if (mc == -1) {
+      nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
+      goto err;
+    }
+    if (!mc)
+      nbdkit_debug ("server does not support multi-conn, "
+                    "using a single connection");
+    else {
+      while (h->nr_conns < connections) {
+        if (nbdplug_open_conn (&h->conns[h->nr_conns]) == -1)
+          goto err;
+        h->nr_conns++;
+      }
+      nbdkit_debug ("opened %u connections to the server", h->nr_conns);
+    }
+  }
+
+  return h;
+
+ err:
+  while (h->nr_conns > 0)
+    nbdplug_close_conn (&h->conns[--h->nr_conns]);
   free (h);
   return NULL;
 }
@@ -529,13 +705,10 @@ nbdplug_open (int readonly)
 static void
 nbdplug_close_handle (struct handle *h)
 {
-  if (nbd_shutdown (h->nbd, 0) == -1)
-    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
-  if ((errno = pthread_join (h->reader, NULL)))
-    nbdkit_debug ("failed to join reader thread: %m");
-  close (h->fds[0]);
-  close (h->fds[1]);
-  nbd_close (h->nbd);
+  unsigned i;
+
+  for (i = 0; i < h->nr_conns; ++i)
+    nbdplug_close_conn (&h->conns[i]);
   free (h);
 }
 
@@ -554,7 +727,7 @@ static int64_t
 nbdplug_get_size (void *handle)
 {
   struct handle *h = handle;
-  int64_t size = nbd_get_size (h->nbd);
+  int64_t size = nbd_get_size (h->conns[0].nbd);
 
   if (size == -1) {
     nbdkit_error ("failure to get size: %s", nbd_get_error ());
@@ -567,7 +740,7 @@ static int
 nbdplug_can_write (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_read_only (h->nbd);
+  int i = nbd_is_read_only (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check readonly flag: %s", nbd_get_error ());
@@ -580,7 +753,7 @@ static int
 nbdplug_can_flush (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_flush (h->nbd);
+  int i = nbd_can_flush (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check flush flag: %s", nbd_get_error ());
@@ -593,7 +766,7 @@ static int
 nbdplug_is_rotational (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_rotational (h->nbd);
+  int i = nbd_is_rotational (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check rotational flag: %s", nbd_get_error ());
@@ -606,7 +779,7 @@ static int
 nbdplug_can_trim (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_trim (h->nbd);
+  int i = nbd_can_trim (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check trim flag: %s", nbd_get_error ());
@@ -619,7 +792,7 @@ static int
 nbdplug_can_zero (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_zero (h->nbd);
+  int i = nbd_can_zero (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check zero flag: %s", nbd_get_error ());
@@ -633,7 +806,7 @@ nbdplug_can_fast_zero (void *handle)
 {
 #if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
   struct handle *h = handle;
-  int i = nbd_can_fast_zero (h->nbd);
+  int i = nbd_can_fast_zero (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fast zero flag: %s", nbd_get_error ());
@@ -650,7 +823,7 @@ static int
 nbdplug_can_fua (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_fua (h->nbd);
+  int i = nbd_can_fua (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fua flag: %s", nbd_get_error ());
@@ -663,7 +836,7 @@ static int
 nbdplug_can_multi_conn (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_multi_conn (h->nbd);
+  int i = nbd_can_multi_conn (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
@@ -676,7 +849,7 @@ static int
 nbdplug_can_cache (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_cache (h->nbd);
+  int i = nbd_can_cache (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check cache flag: %s", nbd_get_error ());
@@ -689,7 +862,7 @@ static int
 nbdplug_can_extents (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
+  int i = nbd_can_meta_context (h->conns[0].nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
 
   if (i == -1) {
     nbdkit_error ("failure to check extents ability: %s", nbd_get_error ());
@@ -704,13 +877,14 @@ nbdplug_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pread (h->nbd, buf, count, offset,
+  nbdplug_register (c, &s, nbd_aio_pread (c->nbd, buf, count, offset,
                                           s.cb, 0));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Write data to the file. */
@@ -719,14 +893,15 @@ nbdplug_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
                 uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pwrite (h->nbd, buf, count, offset,
+  nbdplug_register (c, &s, nbd_aio_pwrite (c->nbd, buf, count, offset,
                                            s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Write zeroes to the file. */
@@ -734,6 +909,7 @@ static int
 nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = 0;
 
@@ -751,8 +927,8 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
 #endif
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_zero (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_zero (c->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (c, &s);
 }
 
 /* Trim a portion of the file. */
@@ -760,26 +936,42 @@ static int
 nbdplug_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_trim (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_trim (c->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (c, &s);
 }
 
-/* Flush the file to disk. */
+/* Flush the file to disk.  The flush is sent on every connection at
+ * once, so that it covers writes which have completed on any of them
+ * even if the server's multi-conn guarantee is weaker than the spec.
+ */
 static int
 nbdplug_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
-  struct transaction s;
+  struct transaction s[MAX_CONNECTIONS];
+  unsigned i;
+  int r = 0, err = 0;
 
   assert (!flags);
-  nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_flush (h->nbd, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  for (i = 0; i < h->nr_conns; ++i) {
+    nbdplug_prepare (&s[i]);
+    nbdplug_register (&h->conns[i], &s[i],
+                      nbd_aio_flush (h->conns[i].nbd, s[i].cb, 0));
+  }
+  for (i = 0; i < h->nr_conns; ++i) {
+    if (nbdplug_reply (&h->conns[i], &s[i]) == -1 && r == 0) {
+      r = -1;
+      err = errno;
+    }
+  }
+  errno = err;
+  return r;
 }
 
 static int
@@ -809,15 +1001,16 @@ nbdplug_extents (void *handle, uint32_t count, uint64_t offset,
                  uint32_t flags, struct nbdkit_extents *extents)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_REQ_ONE ? LIBNBD_CMD_FLAG_REQ_ONE : 0;
   nbd_extent_callback extcb = { nbdplug_extent, extents };
 
   assert (!(flags & ~NBDKIT_FLAG_REQ_ONE));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_block_status (h->nbd, count, offset,
+  nbdplug_register (c, &s, nbd_aio_block_status (c->nbd, count, offset,
                                                  extcb, s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Cache a portion of the file. */
@@ -825,12 +1018,13 @@ static int
 nbdplug_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_cache (h->nbd, count, offset, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_cache (c->nbd, count, offset, s.cb, 0));
+  return nbdplug_reply (c, &s);
 }
 
 static struct nbdkit_plugin plugin = {
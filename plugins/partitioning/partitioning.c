@@ -134,6 +134,7 @@ partitioning_config (const char *key, const char *value)
     file.alignment = alignment;
     file.mbr_id = mbr_id;
     memcpy (file.type_guid, type_guid, sizeof type_guid);
+    file.next_offset = file.readahead_end = 0;
 
     file.fd = open (file.filename, O_RDWR);
     if (file.fd == -1) {
@@ -307,15 +308,47 @@ partitioning_can_cache (void *handle)
   return NBDKIT_CACHE_EMULATE;
 }
 
+/* When a file is read sequentially, ask the kernel to read ahead this
+ * much.
+ */
+#define READAHEAD_SIZE (2 * 1024 * 1024)
+
+/* Called before reading len bytes at offset in files[i].  The offsets
+ * are updated without a lock because they are only hints.
+ */
+static void
+readahead_hint (size_t i, uint64_t offset, size_t len)
+{
+#if HAVE_POSIX_FADVISE
+  uint64_t next = __atomic_load_n (&files[i].next_offset, __ATOMIC_RELAXED);
+  uint64_t end = __atomic_load_n (&files[i].readahead_end, __ATOMIC_RELAXED);
+
+  /* If this read follows on from the previous one, read ahead.  The
+   * hint is only repeated once the reader is halfway through the
+   * previous window.
+   */
+  if (offset == next && offset + len + READAHEAD_SIZE/2 > end) {
+    __atomic_store_n (&files[i].readahead_end, offset + len + READAHEAD_SIZE,
+                      __ATOMIC_RELAXED);
+    posix_fadvise (files[i].fd, offset + len, READAHEAD_SIZE,
+                   POSIX_FADV_WILLNEED);
+  }
+  __atomic_store_n (&files[i].next_offset, offset + len, __ATOMIC_RELAXED);
+#endif
+}
+
 /* Read data. */
 static int
 partitioning_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  const struct region *region = find_region (&regions, offset);
+
   while (count > 0) {
-    const struct region *region = find_region (&regions, offset);
     size_t i, len;
     ssize_t r;
 
+    region = next_region (&regions, region, offset);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -325,6 +358,7 @@ partitioning_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     case region_file:
       i = region->u.i;
       assert (i < nr_files);
+      readahead_hint (i, offset - region->start, len);
       r = pread (files[i].fd, buf, len, offset - region->start);
       if (r == -1) {
         nbdkit_error ("pread: %s: %m", files[i].filename);
@@ -359,11 +393,14 @@ static int
 partitioning_pwrite (void *handle,
                      const void *buf, uint32_t count, uint64_t offset)
 {
+  const struct region *region = find_region (&regions, offset);
+
   while (count > 0) {
-    const struct region *region = find_region (&regions, offset);
     size_t i, len;
     ssize_t r;
 
+    region = next_region (&regions, region, offset);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
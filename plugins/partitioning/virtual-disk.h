@@ -86,6 +86,8 @@ struct file {
   unsigned long alignment;      /* alignment of this partition */
   uint8_t mbr_id;               /* MBR ID of this partition */
   char type_guid[16];           /* partition type GUID of this partition */
+  uint64_t next_offset;         /* offset following the last read */
+  uint64_t readahead_end;       /* end of the last readahead hint */
 };
 
 extern struct file *files;
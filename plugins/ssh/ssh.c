@@ -42,6 +42,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
@@ -62,6 +63,7 @@ static const char **identity = NULL;
 static size_t nr_identities = 0;
 static uint32_t timeout = 0;
 static bool compression = false;
+static unsigned sessions = 1;
 
 /* config can be:
  * NULL => parse options from default file
@@ -172,6 +174,15 @@ ssh_config (const char *key, const char *value)
     compression = r;
   }
 
+  else if (strcmp (key, "sessions") == 0) {
+    if (nbdkit_parse_unsigned ("sessions", value, &sessions) == -1)
+      return -1;
+    if (sessions < 1 || sessions > 64) {
+      nbdkit_error ("sessions must be between 1 and 64");
+      return -1;
+    }
+  }
+
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -204,20 +215,33 @@ ssh_config_complete (void)
   "identity=<FILENAME>        Prepend private key (identity) file.\n" \
   "timeout=SECS               Set SSH connection timeout.\n" \
   "verify-remote-host=false   Ignore known_hosts.\n" \
-  "compression=true           Enable compression."
+  "compression=true           Enable compression.\n" \
+  "sessions=<N>               Number of SSH sessions per connection."
 
-/* The per-connection handle. */
-struct ssh_handle {
+/* One SSH session with the remote file open. */
+struct session {
   ssh_session session;
   sftp_session sftp;
   sftp_file file;
+  bool in_use;                  /* Protected by ssh_handle.lock. */
+};
+
+/* The per-connection handle.  Each request takes a free session for
+ * its duration, so with sessions=N up to N requests from the same
+ * client run in parallel.
+ */
+struct ssh_handle {
+  pthread_mutex_t lock;
+  pthread_cond_t session_freed;
+  size_t nr_sessions;
+  struct session sessions[];
 };
 
 /* Verify the remote host.
  * See: http://api.libssh.org/master/libssh_tutor_guided_tour.html
  */
 static int
-do_verify_remote_host (struct ssh_handle *h)
+do_verify_remote_host (struct session *h)
 {
   enum ssh_known_hosts_e state;
   unsigned char *hash = NULL;
@@ -309,7 +333,7 @@ authenticate_password (ssh_session session, const char *pass)
 }
 
 static int
-authenticate (struct ssh_handle *h)
+authenticate (struct session *h)
 {
   int method, rc;
 
@@ -339,22 +363,15 @@ authenticate (struct ssh_handle *h)
   return -1;
 }
 
-/* Create the per-connection handle. */
-static void *
-ssh_open (int readonly)
+/* Connect, authenticate and open the remote file. */
+static int
+open_session (struct session *h, int readonly)
 {
-  struct ssh_handle *h;
   const int set = 1;
   size_t i;
   int r;
   int access_type;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("calloc: %m");
-    return NULL;
-  }
-
   /* Set up the SSH session. */
   h->session = ssh_new ();
   if (!h->session) {
@@ -504,7 +521,7 @@ ssh_open (int readonly)
 
   nbdkit_debug ("opened libssh handle");
 
-  return h;
+  return 0;
 
  err:
   if (h->file)
@@ -515,15 +532,13 @@ ssh_open (int readonly)
     ssh_disconnect (h->session);
     ssh_free (h->session);
   }
-  free (h);
-  return NULL;
+  memset (h, 0, sizeof *h);
+  return -1;
 }
 
-/* Free up the per-connection handle. */
 static void
-ssh_close (void *handle)
+close_session (struct session *h)
 {
-  struct ssh_handle *h = handle;
   int r;
 
   r = sftp_close (h->file);
@@ -533,64 +548,241 @@ ssh_close (void *handle)
   sftp_free (h->sftp);
   ssh_disconnect (h->session);
   ssh_free (h->session);
+}
+
+/* Create the per-connection handle. */
+static void *
+ssh_open (int readonly)
+{
+  struct ssh_handle *h;
+
+  h = calloc (1, sizeof *h + sessions * sizeof (struct session));
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->session_freed, NULL);
+
+  for (h->nr_sessions = 0; h->nr_sessions < sessions; h->nr_sessions++) {
+    if (open_session (&h->sessions[h->nr_sessions], readonly) == -1)
+      goto err;
+  }
+
+  return h;
+
+ err:
+  while (h->nr_sessions > 0)
+    close_session (&h->sessions[--h->nr_sessions]);
+  pthread_cond_destroy (&h->session_freed);
+  pthread_mutex_destroy (&h->lock);
+  free (h);
+  return NULL;
+}
+
+/* Free up the per-connection handle. */
+static void
+ssh_close (void *handle)
+{
+  struct ssh_handle *h = handle;
+  size_t i;
+
+  for (i = 0; i < h->nr_sessions; ++i)
+    close_session (&h->sessions[i]);
+  pthread_cond_destroy (&h->session_freed);
+  pthread_mutex_destroy (&h->lock);
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+/* Requests are serialized per session (see get_session below), and
+ * separate sessions may be used from different threads.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+/* Take a free session, waiting for one if they are all busy. */
+static struct session *
+get_session (struct ssh_handle *h)
+{
+  struct session *s = NULL;
+  size_t i;
+
+  pthread_mutex_lock (&h->lock);
+  for (;;) {
+    for (i = 0; i < h->nr_sessions; ++i) {
+      if (!h->sessions[i].in_use) {
+        s = &h->sessions[i];
+        s->in_use = true;
+        pthread_mutex_unlock (&h->lock);
+        return s;
+      }
+    }
+    pthread_cond_wait (&h->session_freed, &h->lock);
+  }
+}
+
+static void
+put_session (struct ssh_handle *h, struct session *s)
+{
+  pthread_mutex_lock (&h->lock);
+  s->in_use = false;
+  pthread_cond_signal (&h->session_freed);
+  pthread_mutex_unlock (&h->lock);
+}
 
 /* Get the file size. */
 static int64_t
 ssh_get_size (void *handle)
 {
   struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
   sftp_attributes attrs;
   int64_t r;
 
-  attrs = sftp_fstat (h->file);
+  attrs = sftp_fstat (s->file);
+  if (attrs == NULL) {
+    nbdkit_error ("fstat failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
+    return -1;
+  }
   r = attrs->size;
   sftp_attributes_free (attrs);
 
+  put_session (h, s);
   return r;
 }
 
-/* Read data from the remote server. */
+/* Reads are split into chunks of this size and up to
+ * MAX_READS_IN_FLIGHT chunks are requested from the server before
+ * waiting for the first reply, so that a single large read is not
+ * limited to one round trip per chunk.
+ */
+#define READ_CHUNK (64*1024)
+#define MAX_READS_IN_FLIGHT 32
+
+/* Synchronously read the remainder of a chunk after a short read. */
 static int
-ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+read_rest (struct session *s, char *buf, uint32_t count, uint64_t offset)
 {
-  struct ssh_handle *h = handle;
-  int r;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
-  if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+  if (sftp_seek64 (s->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
     return -1;
   }
-
   while (count > 0) {
-    rs = sftp_read (h->file, buf, count);
+    rs = sftp_read (s->file, buf, count);
     if (rs < 0) {
-      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (h->session), rs);
+      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (s->session), rs);
+      return -1;
+    }
+    if (rs == 0) {
+      nbdkit_error ("read failed: unexpected end of file");
       return -1;
     }
     buf += rs;
     count -= rs;
   }
-
   return 0;
 }
 
+/* Read data from the remote server. */
+static int
+ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
+  struct {
+    uint32_t id;
+    uint32_t len;
+    uint32_t pos;               /* Offset of the chunk within buf. */
+  } reads[MAX_READS_IN_FLIGHT];
+  unsigned head = 0, nr_reads = 0;
+  uint32_t issued = 0;
+  int r, ret = -1;
+  ssize_t rs;
+
+  r = sftp_seek64 (s->file, offset);
+  if (r != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+    goto out;
+  }
+
+  while (issued < count || nr_reads > 0) {
+    unsigned i;
+
+    /* Keep the pipeline full.  Each request is for the current file
+     * position, which sftp_async_read_begin advances.
+     */
+    while (nr_reads < MAX_READS_IN_FLIGHT && issued < count) {
+      uint32_t len = MIN (count - issued, READ_CHUNK);
+      int id = sftp_async_read_begin (s->file, len);
+
+      if (id < 0) {
+        nbdkit_error ("read failed: %s", ssh_get_error (s->session));
+        goto drain;
+      }
+      i = (head + nr_reads) % MAX_READS_IN_FLIGHT;
+      reads[i].id = id;
+      reads[i].len = len;
+      reads[i].pos = issued;
+      nr_reads++;
+      issued += len;
+    }
+
+    /* Collect the oldest reply. */
+    i = head;
+    head = (head + 1) % MAX_READS_IN_FLIGHT;
+    nr_reads--;
+    rs = sftp_async_read (s->file, (char *) buf + reads[i].pos, reads[i].len,
+                          reads[i].id);
+    if (rs < 0) {
+      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (s->session), rs);
+      goto drain;
+    }
+    if (rs < reads[i].len) {
+      /* The server may return less than requested.  Fill in the
+       * rest, then restore the file position for the next request.
+       */
+      if (read_rest (s, (char *) buf + reads[i].pos + rs,
+                     reads[i].len - rs, offset + reads[i].pos + rs) == -1)
+        goto drain;
+      if (sftp_seek64 (s->file, offset + issued) != SSH_OK) {
+        nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+        goto drain;
+      }
+    }
+  }
+  ret = 0;
+  goto out;
+
+ drain:
+  /* Consume the replies to any requests still in flight so that they
+   * are not mistaken for replies to later requests.
+   */
+  while (nr_reads > 0) {
+    sftp_async_read (s->file, (char *) buf + reads[head].pos,
+                     reads[head].len, reads[head].id);
+    head = (head + 1) % MAX_READS_IN_FLIGHT;
+    nr_reads--;
+  }
+ out:
+  put_session (h, s);
+  return ret;
+}
+
 /* Write data to the remote server. */
 static int
 ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
   struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
   int r;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
+  r = sftp_seek64 (s->file, offset);
   if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
     return -1;
   }
 
@@ -602,15 +794,17 @@ ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
      * the request.  I don't know whether 256K is a limit that applies
      * to all servers.
      */
-    rs = sftp_write (h->file, buf, MIN (count, 128*1024));
+    rs = sftp_write (s->file, buf, MIN (count, 128*1024));
     if (rs < 0) {
-      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (h->session), rs);
+      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (s->session), rs);
+      put_session (h, s);
       return -1;
     }
     buf += rs;
     count -= rs;
   }
 
+  put_session (h, s);
   return 0;
 }
 
@@ -622,24 +816,31 @@ ssh_can_flush (void *handle)
   /* I added this extension to openssh 6.5 (April 2013).  It may not
    * be available in other SSH servers.
    */
-  return sftp_extension_supported (h->sftp, "fsync@openssh.com", "1");
+  return sftp_extension_supported (h->sessions[0].sftp,
+                                   "fsync@openssh.com", "1");
 }
 
+/* fsync on the server flushes the file no matter which handle is
+ * used, so this also covers writes completed through other sessions.
+ */
 static int
 ssh_flush (void *handle)
 {
   struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
   int r;
 
  again:
-  r = sftp_fsync (h->file);
+  r = sftp_fsync (s->file);
   if (r == SSH_AGAIN)
     goto again;
   else if (r != SSH_OK) {
-    nbdkit_error ("fsync failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("fsync failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
     return -1;
   }
 
+  put_session (h, s);
   return 0;
 }
 
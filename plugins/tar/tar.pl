@@ -53,6 +53,10 @@ another tool afterwards.
 
 The disk image cannot be resized.
 
+L<nbdkit-tar-filter(1)> does the same thing without requiring Perl or
+L<tar(1)>, supports sparse files, and can be used on top of any
+plugin.  New users should use the filter instead.
+
 =head1 VERSION
 
 C<nbdkit-tar-plugin> first appeared in nbdkit 1.2.
@@ -61,6 +65,7 @@ C<nbdkit-tar-plugin> first appeared in nbdkit 1.2.
 
 L<https://github.com/libguestfs/nbdkit/blob/master/plugins/tar/tar.pl>,
 L<nbdkit(1)>,
+L<nbdkit-tar-filter(1)>,
 L<nbdkit-plugin(3)>,
 L<nbdkit-perl-plugin(3)>.
 
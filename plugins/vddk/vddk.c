@@ -40,6 +40,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #define NBDKIT_API_VERSION 2
 
@@ -376,11 +377,19 @@ vddk_dump_plugin (void)
 #endif
 }
 
-/* XXX To really do threading correctly in accordance with the VDDK
- * documentation, we must do all open/close calls from a single
- * thread.  This is a huge pain.
+/* VDDK allows different disk handles to be used from different
+ * threads at the same time, but connecting, opening and closing
+ * handles must not happen concurrently.  So requests are only
+ * serialized per connection, and open_close_lock serializes the
+ * open and close calls.
+ *
+ * XXX The VDDK documentation goes further and says that all
+ * open/close calls should be made from a single thread.  This is a
+ * huge pain and has not been found necessary in practice.
  */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+
+static pthread_mutex_t open_close_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* The per-connection handle. */
 struct vddk_handle {
@@ -457,6 +466,8 @@ vddk_open (int readonly)
     h->params->nfcHostPort = nfc_host_port;
   }
 
+  pthread_mutex_lock (&open_close_lock);
+
   /* XXX Some documentation suggests we should call
    * VixDiskLib_PrepareForAccess here.  It may be required for
    * Advanced Transport modes, but I could not make it work with
@@ -497,12 +508,14 @@ vddk_open (int readonly)
   nbdkit_debug ("transport mode: %s",
                 VixDiskLib_GetTransportMode (h->handle));
 
+  pthread_mutex_unlock (&open_close_lock);
   return h;
 
  err2:
   DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
   VixDiskLib_Disconnect (h->connection);
  err1:
+  pthread_mutex_unlock (&open_close_lock);
   free_connect_params (h->params);
  err0:
   free (h);
@@ -515,10 +528,12 @@ vddk_close (void *handle)
 {
   struct vddk_handle *h = handle;
 
+  pthread_mutex_lock (&open_close_lock);
   DEBUG_CALL ("VixDiskLib_Close", "handle");
   VixDiskLib_Close (h->handle);
   DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
   VixDiskLib_Disconnect (h->connection);
+  pthread_mutex_unlock (&open_close_lock);
   free_connect_params (h->params);
   free (h);
 }
@@ -567,6 +582,85 @@ vddk_get_size (void *handle)
   return (int64_t) size;
 }
 
+/* Large reads and writes are split into chunks of this many sectors
+ * which are submitted together with VixDiskLib_ReadAsync or
+ * VixDiskLib_WriteAsync, so that the transport (especially NBD/NFC
+ * over the network) has several requests in flight.
+ */
+#define ASYNC_CHUNK_SECTORS (256*1024 / VIXDISKLIB_SECTOR_SIZE)
+
+static inline bool
+have_async (void)
+{
+  return VixDiskLib_ReadAsync != NULL && VixDiskLib_WriteAsync != NULL &&
+    VixDiskLib_Wait != NULL;
+}
+
+/* Completion callback for async calls.  This may be called from a
+ * VDDK thread, and records the first error seen.
+ */
+static void
+async_done (void *data, VixError result)
+{
+  VixError *errp = data;
+  VixError ok = VIX_OK;
+
+  if (result != VIX_OK)
+    __atomic_compare_exchange_n (errp, &ok, result, false,
+                                 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Submit a read or write as several async chunks and wait for them
+ * all to complete.
+ */
+static int
+do_async (struct vddk_handle *h, bool is_write, unsigned char *buf,
+          uint64_t sector, uint64_t nr_sectors)
+{
+  const char *fn = is_write ? "VixDiskLib_WriteAsync" : "VixDiskLib_ReadAsync";
+  VixError result = VIX_OK;
+  VixError err;
+  int r = 0;
+
+  while (nr_sectors > 0) {
+    uint64_t n = MIN (nr_sectors, ASYNC_CHUNK_SECTORS);
+
+    DEBUG_CALL (fn,
+                "handle, %" PRIu64 " sectors, %" PRIu64 " sectors, "
+                "buffer, async_done, &result", sector, n);
+    if (is_write)
+      err = VixDiskLib_WriteAsync (h->handle, sector, n, buf,
+                                   async_done, &result);
+    else
+      err = VixDiskLib_ReadAsync (h->handle, sector, n, buf,
+                                  async_done, &result);
+    if (err != VIX_ASYNC && err != VIX_OK) {
+      VDDK_ERROR (err, "%s", fn);
+      r = -1;
+      break;
+    }
+    buf += n * VIXDISKLIB_SECTOR_SIZE;
+    sector += n;
+    nr_sectors -= n;
+  }
+
+  /* Always wait, even after an error, as earlier chunks may still be
+   * using the buffer.
+   */
+  DEBUG_CALL ("VixDiskLib_Wait", "handle");
+  err = VixDiskLib_Wait (h->handle);
+  if (err != VIX_OK && r == 0) {
+    VDDK_ERROR (err, "VixDiskLib_Wait");
+    r = -1;
+  }
+  err = __atomic_load_n (&result, __ATOMIC_SEQ_CST);
+  if (err != VIX_OK && r == 0) {
+    VDDK_ERROR (err, "%s", fn);
+    r = -1;
+  }
+  return r;
+}
+
 /* Read data from the file.
  *
  * Note that reads have to be aligned to sectors (XXX).
@@ -590,6 +684,9 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   offset /= VIXDISKLIB_SECTOR_SIZE;
   count /= VIXDISKLIB_SECTOR_SIZE;
 
+  if (count > ASYNC_CHUNK_SECTORS && have_async ())
+    return do_async (h, false, buf, offset, count);
+
   DEBUG_CALL ("VixDiskLib_Read",
               "handle, %" PRIu64 " sectors, %" PRIu32 " sectors, buffer",
               offset, count);
@@ -628,6 +725,14 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   offset /= VIXDISKLIB_SECTOR_SIZE;
   count /= VIXDISKLIB_SECTOR_SIZE;
 
+  if (count > ASYNC_CHUNK_SECTORS && have_async ()) {
+    if (do_async (h, true, (unsigned char *) buf, offset, count) == -1)
+      return -1;
+    if (fua && vddk_flush (handle, 0) == -1)
+      return -1;
+    return 0;
+  }
+
   DEBUG_CALL ("VixDiskLib_Write",
               "handle, %" PRIu64 " sectors, %" PRIu32 " sectors, buffer",
               offset, count);
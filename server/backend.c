@@ -42,6 +42,34 @@
 #include "internal.h"
 #include "minmax.h"
 
+/* Time and trace calls into each layer, if --metrics or --trace is
+ * used.
+ */
+static inline void
+layer_call_begin (struct timespec *start)
+{
+  if (metrics_addr || trace_file)
+    clock_gettime (CLOCK_MONOTONIC, start);
+}
+
+static void
+layer_call_end (struct backend *b, int op, const struct timespec *start,
+                uint32_t count, uint64_t offset, int r)
+{
+  struct timespec end;
+
+  if (!metrics_addr && !trace_file)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if (metrics_addr)
+    metrics_layer_end (b, op,
+                       (end.tv_sec - start->tv_sec) * UINT64_C (1000000000) +
+                       end.tv_nsec - start->tv_nsec, r);
+  if (trace_file)
+    trace_layer (b, op, count, offset, start, &end, r);
+}
+
 /* Helpers for registering a new backend. */
 
 /* Set all debug flags which apply to this backend. */
@@ -236,8 +264,10 @@ backend_finalize (struct backend *b, struct connection *conn)
   if (h->state & HANDLE_FAILED)
     return -1;
 
-  if (h->handle) {
-    assert (h->state & HANDLE_CONNECTED);
+  /* If .prepare failed in this or an inner layer then this layer was
+   * never connected and there is nothing to finalize.
+   */
+  if (h->handle && (h->state & HANDLE_CONNECTED)) {
     if (b->finalize (b, conn, h->handle) == -1) {
       h->state |= HANDLE_FAILED;
       return -1;
@@ -480,6 +510,7 @@ backend_pread (struct backend *b, struct connection *conn,
                uint32_t flags, int *err)
 {
   struct b_conn_handle *h = &conn->handles[b->i];
+  struct timespec start;
   int r;
 
   assert (h->handle && (h->state & HANDLE_CONNECTED));
@@ -488,7 +519,9 @@ backend_pread (struct backend *b, struct connection *conn,
   debug ("%s: pread count=%" PRIu32 " offset=%" PRIu64,
          b->name, count, offset);
 
+  layer_call_begin (&start);
   r = b->pread (b, conn, h->handle, buf, count, offset, flags, err);
+  layer_call_end (b, LAYER_PREAD, &start, count, offset, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -501,6 +534,7 @@ backend_pwrite (struct backend *b, struct connection *conn,
 {
   struct b_conn_handle *h = &conn->handles[b->i];
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  struct timespec start;
   int r;
 
   assert (h->handle && (h->state & HANDLE_CONNECTED));
@@ -512,7 +546,9 @@ backend_pwrite (struct backend *b, struct connection *conn,
   debug ("%s: pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
          b->name, count, offset, fua);
 
+  layer_call_begin (&start);
   r = b->pwrite (b, conn, h->handle, buf, count, offset, flags, err);
+  layer_call_end (b, LAYER_PWRITE, &start, count, offset, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -523,6 +559,7 @@ backend_flush (struct backend *b, struct connection *conn,
                uint32_t flags, int *err)
 {
   struct b_conn_handle *h = &conn->handles[b->i];
+  struct timespec start;
   int r;
 
   assert (h->handle && (h->state & HANDLE_CONNECTED));
@@ -530,7 +567,9 @@ backend_flush (struct backend *b, struct connection *conn,
   assert (flags == 0);
   debug ("%s: flush", b->name);
 
+  layer_call_begin (&start);
   r = b->flush (b, conn, h->handle, flags, err);
+  layer_call_end (b, LAYER_FLUSH, &start, 0, 0, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -543,6 +582,7 @@ backend_trim (struct backend *b, struct connection *conn,
 {
   struct b_conn_handle *h = &conn->handles[b->i];
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  struct timespec start;
   int r;
 
   assert (h->handle && (h->state & HANDLE_CONNECTED));
@@ -555,7 +595,9 @@ backend_trim (struct backend *b, struct connection *conn,
   debug ("%s: trim count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
          b->name, count, offset, fua);
 
+  layer_call_begin (&start);
   r = b->trim (b, conn, h->handle, count, offset, flags, err);
+  layer_call_end (b, LAYER_TRIM, &start, count, offset, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -569,6 +611,7 @@ backend_zero (struct backend *b, struct connection *conn,
   struct b_conn_handle *h = &conn->handles[b->i];
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
   bool fast = !!(flags & NBDKIT_FLAG_FAST_ZERO);
+  struct timespec start;
   int r;
 
   assert (h->handle && (h->state & HANDLE_CONNECTED));
@@ -585,7 +628,9 @@ backend_zero (struct backend *b, struct connection *conn,
          " may_trim=%d fua=%d fast=%d",
          b->name, count, offset, !!(flags & NBDKIT_FLAG_MAY_TRIM), fua, fast);
 
+  layer_call_begin (&start);
   r = b->zero (b, conn, h->handle, count, offset, flags, err);
+  layer_call_end (b, LAYER_ZERO, &start, count, offset, r);
   if (r == -1) {
     assert (*err);
     if (!fast)
@@ -600,6 +645,7 @@ backend_extents (struct backend *b, struct connection *conn,
                  struct nbdkit_extents *extents, int *err)
 {
   struct b_conn_handle *h = &conn->handles[b->i];
+  struct timespec start;
   int r;
 
   assert (h->handle && (h->state & HANDLE_CONNECTED));
@@ -618,7 +664,9 @@ backend_extents (struct backend *b, struct connection *conn,
       *err = errno;
     return r;
   }
+  layer_call_begin (&start);
   r = b->extents (b, conn, h->handle, count, offset, flags, extents, err);
+  layer_call_end (b, LAYER_EXTENTS, &start, count, offset, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -630,6 +678,7 @@ backend_cache (struct backend *b, struct connection *conn,
                uint32_t flags, int *err)
 {
   struct b_conn_handle *h = &conn->handles[b->i];
+  struct timespec start;
   int r;
 
   assert (h->handle && (h->state & HANDLE_CONNECTED));
@@ -651,7 +700,9 @@ backend_cache (struct backend *b, struct connection *conn,
     }
     return 0;
   }
+  layer_call_begin (&start);
   r = b->cache (b, conn, h->handle, count, offset, flags, err);
+  layer_call_end (b, LAYER_CACHE, &start, count, offset, r);
   if (r == -1)
     assert (*err);
   return r;
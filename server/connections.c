@@ -166,6 +166,7 @@ handle_single_connection (int sockin, int sockout)
    */
   if (protocol_handshake (conn) == -1)
     goto done;
+  metrics_register_connection (conn);
 
   if (!nworkers) {
     /* No need for a separate thread. */
@@ -328,6 +329,7 @@ free_connection (struct connection *conn)
   if (!conn)
     return;
 
+  metrics_unregister_connection (conn);
   threadlocal_set_conn (NULL);
   conn->close (conn);
   if (listen_stdin) {
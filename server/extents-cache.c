@@ -0,0 +1,137 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Server-side cache of block status results (--cache-extents).
+ *
+ * There is one cache for the export, shared by all connections.  It
+ * stores the extents returned by the outermost backend for
+ * NBD_CMD_BLOCK_STATUS, so repeated block status requests for the
+ * same part of the disk can be answered without calling the plugin.
+ * Client writes, trims and zeroes invalidate the affected range.
+ *
+ * A block status request which races with a write must not put stale
+ * results into the cache.  Every invalidation increments a generation
+ * number, and results are only added if no invalidation happened
+ * while the backend was being called.  Since the invalidation happens
+ * after the write has completed, either the backend saw the new data
+ * or the generation number has changed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "extentmap.h"
+
+/* Maximum number of entries in the cache (about 8 MB). */
+#define MAX_CACHE_ENTRIES (256 * 1024)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct extentmap map = { .max_entries = MAX_CACHE_ENTRIES };
+static uint64_t generation;
+
+void
+extents_cache_free (void)
+{
+  extentmap_free (&map);
+}
+
+/* Try to answer a block status request from the cache.  Returns true
+ * if the extents list was filled in from the cache.  Otherwise
+ * returns false and sets *gen, which must be passed to
+ * extents_cache_add after calling the backend.
+ */
+bool
+extents_cache_lookup (uint32_t count, uint64_t offset, uint32_t flags,
+                      struct nbdkit_extents *extents, uint64_t *gen)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  const uint64_t end = offset + count;
+  struct extentmap_entry e;
+  uint64_t pos = offset;
+
+  /* We must know at least the extent containing offset.  After that,
+   * return as much as is known, stopping at the first gap (block
+   * status replies may be shorter than the request).
+   */
+  while (pos < end && extentmap_lookup (&map, pos, &e)) {
+    if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1)
+      break;
+    pos = e.offset + e.length;
+    if (flags & NBDKIT_FLAG_REQ_ONE)
+      break;
+  }
+  if (pos > offset && nbdkit_extents_count (extents) > 0) {
+    debug ("extents cache hit: count=%" PRIu32 " offset=%" PRIu64,
+           count, offset);
+    return true;
+  }
+
+  *gen = generation;
+  return false;
+}
+
+/* Add the extents returned by the backend to the cache. */
+void
+extents_cache_add (uint64_t gen, const struct nbdkit_extents *extents)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  size_t i;
+
+  if (gen != generation)
+    return;
+
+  for (i = 0; i < nbdkit_extents_count (extents); ++i) {
+    const struct nbdkit_extent e = nbdkit_get_extent (extents, i);
+
+    /* Not fatal, it just means the extent isn't cached. */
+    if (extentmap_insert (&map, e.offset, e.length, e.type) == -1)
+      return;
+  }
+}
+
+/* Forget the cached extents for a range which has been modified. */
+void
+extents_cache_invalidate (uint32_t count, uint64_t offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  generation++;
+  extentmap_invalidate (&map, offset, count);
+}
@@ -36,6 +36,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <pthread.h>
 
@@ -86,6 +87,12 @@
 /* Maximum read or write request that we will handle. */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* Maximum size of a single NBD_REPLY_TYPE_OFFSET_DATA chunk.  Larger
+ * structured reads (without NBD_CMD_FLAG_DF) are split into chunks of
+ * this size so that other replies can be interleaved between them.
+ */
+#define MAX_READ_CHUNK (2 * 1024 * 1024)
+
 /* main.c */
 struct debug_flag {
   struct debug_flag *next;
@@ -104,12 +111,20 @@ enum log_to {
   LOG_TO_NULL,           /* --log=null forced on the command line */
 };
 
+enum trace_format {
+  TRACE_FORMAT_CHROME,   /* --trace-format=chrome (default) */
+  TRACE_FORMAT_PERF,     /* --trace-format=perf */
+};
+
+extern bool cache_extents;
 extern struct debug_flag *debug_flags;
+extern bool error_messages;
 extern const char *exportname;
 extern bool foreground;
 extern const char *ipaddr;
 extern enum log_to log_to;
 extern unsigned mask_handshake;
+extern char *metrics_addr;
 extern bool newstyle;
 extern bool no_sr;
 extern const char *port;
@@ -118,6 +133,9 @@ extern const char *run;
 extern bool listen_stdin;
 extern const char *selinux_label;
 extern unsigned threads;
+extern char *trace_file;
+extern enum trace_format trace_format;
+extern unsigned trace_sample;
 extern int tls;
 extern const char *tls_certificates_dir;
 extern const char *tls_psk;
@@ -214,6 +232,28 @@ reset_b_conn_handle (struct b_conn_handle *h)
   h->can_cache = -1;
 }
 
+/* Per-connection request counters, see metrics.c.  Indexed by
+ * NBD_CMD_* and by metrics_error_index (NBD_E*).
+ */
+#define NR_NBD_CMDS (NBD_CMD_BLOCK_STATUS + 1)
+#define NR_NBD_ERRORS 8
+
+struct conn_counters {
+  uint64_t requests[NR_NBD_CMDS];
+  uint64_t bytes[NR_NBD_CMDS];
+  uint64_t nsecs[NR_NBD_CMDS];
+  uint64_t errors[NR_NBD_ERRORS];
+  uint64_t queue_nsecs;
+  uint64_t in_flight;
+};
+
+struct conn_metrics {
+  struct conn_metrics *next;    /* list of connections, see metrics.c */
+  bool registered;
+  size_t instance_num;
+  struct conn_counters c;
+};
+
 struct connection {
   pthread_mutex_t request_lock;
   pthread_mutex_t read_lock;
@@ -239,6 +279,8 @@ struct connection {
   connection_recv_function recv;
   connection_send_function send;
   connection_close_function close;
+
+  struct conn_metrics metrics;
 };
 
 extern void handle_single_connection (int sockin, int sockout);
@@ -280,6 +322,87 @@ extern int crypto_negotiate_tls (struct connection *conn,
                                  int sockin, int sockout)
   __attribute__((__nonnull__ (1)));
 
+/* extents-cache.c */
+extern void extents_cache_free (void);
+extern bool extents_cache_lookup (uint32_t count, uint64_t offset,
+                                  uint32_t flags,
+                                  struct nbdkit_extents *extents,
+                                  uint64_t *gen)
+  __attribute__((__nonnull__ (4, 5)));
+extern void extents_cache_add (uint64_t gen,
+                               const struct nbdkit_extents *extents)
+  __attribute__((__nonnull__ (2)));
+extern void extents_cache_invalidate (uint32_t count, uint64_t offset);
+
+/* metrics.c */
+struct backend;
+
+enum {
+  LAYER_PREAD, LAYER_PWRITE, LAYER_FLUSH, LAYER_TRIM, LAYER_ZERO,
+  LAYER_EXTENTS, LAYER_CACHE,
+  NR_LAYER_OPS
+};
+
+struct layer_metrics {
+  uint64_t calls[NR_LAYER_OPS];
+  uint64_t errors[NR_LAYER_OPS];
+  uint64_t nsecs[NR_LAYER_OPS];
+};
+
+/* Tracks a single NBD request from when its header is read until the
+ * reply has been sent, for both --metrics and --trace.  Declare it
+ * with CLEANUP_REQUEST_METRICS so that every return path is counted.
+ */
+struct request_metrics {
+  struct connection *conn;      /* NULL if not counted in metrics */
+  bool traced;                  /* true if sampled by --trace */
+  uint16_t cmd;
+  uint32_t count;
+  uint64_t offset;
+  bool dispatched;
+  struct timespec start;
+};
+
+extern void metrics_bind (void);
+extern void metrics_start (void);
+extern void metrics_free (void);
+extern void metrics_register_connection (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void metrics_unregister_connection (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void metrics_request_begin (struct request_metrics *rm,
+                                   struct connection *conn,
+                                   uint16_t cmd, uint32_t count,
+                                   uint64_t offset)
+  __attribute__((__nonnull__ (1, 2)));
+extern void metrics_request_dispatched (struct request_metrics *rm)
+  __attribute__((__nonnull__ (1)));
+extern void metrics_request_end (struct request_metrics *rm)
+  __attribute__((__nonnull__ (1)));
+extern void metrics_reply_error (struct connection *conn, uint32_t nbd_error)
+  __attribute__((__nonnull__ (1)));
+extern void metrics_layer_end (struct backend *b, int op, uint64_t nsecs,
+                               int r)
+  __attribute__((__nonnull__ (1)));
+extern const char *name_of_layer_op (int op);
+
+/* trace.c */
+extern void trace_open (void);
+extern void trace_start (void);
+extern void trace_close (void);
+extern bool trace_request_begin (void);
+extern void trace_request_end (uint16_t cmd, uint32_t count, uint64_t offset,
+                               const struct timespec *start,
+                               const struct timespec *end)
+  __attribute__((__nonnull__ (4, 5)));
+extern void trace_layer (struct backend *b, int op,
+                         uint32_t count, uint64_t offset,
+                         const struct timespec *start,
+                         const struct timespec *end, int r)
+  __attribute__((__nonnull__ (1, 5, 6)));
+#define CLEANUP_REQUEST_METRICS \
+  __attribute__((cleanup (metrics_request_end)))
+
 /* debug.c */
 #define debug(fs, ...)                                   \
   do {                                                   \
@@ -373,6 +496,9 @@ struct backend {
                   struct nbdkit_extents *extents, int *err);
   int (*cache) (struct backend *, struct connection *conn, void *handle,
                 uint32_t count, uint64_t offset, uint32_t flags, int *err);
+
+  /* Call counters and latencies, only updated if --metrics is used. */
+  struct layer_metrics metrics;
 };
 
 extern void backend_init (struct backend *b, struct backend *next, size_t index,
@@ -492,6 +618,10 @@ extern void threadlocal_set_instance_num (size_t instance_num);
 extern size_t threadlocal_get_instance_num (void);
 extern void threadlocal_set_error (int err);
 extern int threadlocal_get_error (void);
+extern void threadlocal_set_last_error (const char *fs, va_list args)
+  __attribute__((__format__ (printf, 1, 0)));
+extern void threadlocal_clear_last_error (void);
+extern const char *threadlocal_get_last_error (void);
 extern void *threadlocal_buffer (size_t size);
 extern void threadlocal_set_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
@@ -46,6 +46,24 @@
 void
 nbdkit_verror (const char *fs, va_list args)
 {
+  struct connection *conn;
+  va_list args_copy;
+
+  /* With --error-messages, save the message so it can be sent back
+   * to the client in a structured error reply.  Skip this unless it
+   * could be used: structured replies are only negotiated after any
+   * TLS upgrade, but when TLS is optional don't send messages over an
+   * unencrypted connection.
+   */
+  if (error_messages) {
+    conn = threadlocal_get_conn ();
+    if (conn && conn->structured_replies && (!tls || conn->using_tls)) {
+      va_copy (args_copy, args);
+      threadlocal_set_last_error (fs, args_copy);
+      va_end (args_copy);
+    }
+  }
+
   switch (log_to) {
   case LOG_TO_DEFAULT:
     if (forked_into_background)
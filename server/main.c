@@ -71,13 +71,16 @@ static void start_serving (void);
 static void write_pidfile (void);
 static bool is_config_key (const char *key, size_t len);
 
+bool cache_extents;             /* --cache-extents */
 struct debug_flag *debug_flags; /* -D */
+bool error_messages;            /* --error-messages */
 bool exit_with_parent;          /* --exit-with-parent */
 const char *exportname;         /* -e */
 bool foreground;                /* -f */
 const char *ipaddr;             /* -i */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
 unsigned mask_handshake = ~0U;  /* --mask-handshake */
+char *metrics_addr;             /* --metrics */
 bool newstyle = true;           /* false = -o, true = -n */
 bool no_sr;                     /* --no-sr */
 char *pidfile;                  /* -P */
@@ -91,6 +94,9 @@ int tls;                        /* --tls : 0=off 1=on 2=require */
 const char *tls_certificates_dir; /* --tls-certificates */
 const char *tls_psk;            /* --tls-psk */
 bool tls_verify_peer;           /* --tls-verify-peer */
+char *trace_file;               /* --trace */
+enum trace_format trace_format = TRACE_FORMAT_CHROME; /* --trace-format */
+unsigned trace_sample = 1;      /* --trace-sample */
 char *unixsocket;               /* -U */
 const char *user, *group;       /* -u & -g */
 bool verbose;                   /* -v */
@@ -253,6 +259,10 @@ main (int argc, char *argv[])
       dump_plugin = true;
       break;
 
+    case ERROR_MESSAGES_OPTION:
+      error_messages = true;
+      break;
+
     case EXIT_WITH_PARENT_OPTION:
 #ifdef HAVE_EXIT_WITH_PARENT
       exit_with_parent = true;
@@ -304,6 +314,21 @@ main (int argc, char *argv[])
       }
       exit (EXIT_SUCCESS);
 
+    case METRICS_OPTION:
+      /* Anything containing a '/' is a Unix domain socket, otherwise
+       * it is a TCP port on the loopback interface.
+       */
+      free (metrics_addr);
+      if (strchr (optarg, '/') != NULL)
+        metrics_addr = nbdkit_absolute_path (optarg);
+      else
+        metrics_addr = strdup (optarg);
+      if (metrics_addr == NULL) {
+        perror ("strdup");
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case RUN_OPTION:
       if (socket_activation) {
         fprintf (stderr, "%s: cannot use socket activation with --run flag\n",
@@ -350,6 +375,35 @@ main (int argc, char *argv[])
       tls_verify_peer = true;
       break;
 
+    case TRACE_OPTION:
+      free (trace_file);
+      trace_file = nbdkit_absolute_path (optarg);
+      if (trace_file == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
+    case TRACE_FORMAT_OPTION:
+      if (strcmp (optarg, "chrome") == 0)
+        trace_format = TRACE_FORMAT_CHROME;
+      else if (strcmp (optarg, "perf") == 0)
+        trace_format = TRACE_FORMAT_PERF;
+      else {
+        fprintf (stderr, "%s: "
+                 "--trace-format must be \"chrome\" or \"perf\"\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case TRACE_SAMPLE_OPTION:
+      if (nbdkit_parse_unsigned ("trace-sample", optarg, &trace_sample) == -1)
+        exit (EXIT_FAILURE);
+      if (trace_sample == 0) {
+        fprintf (stderr, "%s: --trace-sample cannot be 0\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case VSOCK_OPTION:
 #ifdef AF_VSOCK
       vsock = true;
@@ -378,6 +432,10 @@ main (int argc, char *argv[])
       group = optarg;
       break;
 
+    case CACHE_EXTENTS_OPTION:
+      cache_extents = true;
+      break;
+
     case 'i':
       if (socket_activation) {
         fprintf (stderr, "%s: cannot use socket activation with -i flag\n",
@@ -701,11 +759,14 @@ main (int argc, char *argv[])
 
   start_serving ();
 
+  metrics_free ();
+  trace_close ();
   backend->free (backend);
   backend = NULL;
 
   free (unixsocket);
   free (pidfile);
+  free (metrics_addr);
 
   if (random_fifo) {
     unlink (random_fifo);
@@ -718,6 +779,7 @@ main (int argc, char *argv[])
   }
 
   crypto_free ();
+  extents_cache_free ();
   close_quit_pipe ();
 
   /* Note: Don't exit here, otherwise this won't work when compiled
@@ -886,6 +948,13 @@ start_serving (void)
     exit (EXIT_FAILURE);
   }
 
+  /* Bind the metrics socket and open the trace file now so errors
+   * are reported before we fork.  The threads serving metrics and
+   * writing the trace are started later.
+   */
+  metrics_bind ();
+  trace_open ();
+
   /* Socket activation -- we are handling connections on pre-opened
    * file descriptors [FIRST_SOCKET_ACTIVATION_FD ..
    * FIRST_SOCKET_ACTIVATION_FD+nr_socks-1].
@@ -902,6 +971,8 @@ start_serving (void)
       socks[i] = FIRST_SOCKET_ACTIVATION_FD + i;
     change_user ();
     write_pidfile ();
+    metrics_start ();
+    trace_start ();
     accept_incoming_connections (socks, nr_socks);
     return;
   }
@@ -910,6 +981,8 @@ start_serving (void)
   if (listen_stdin) {
     change_user ();
     write_pidfile ();
+    metrics_start ();
+    trace_start ();
     threadlocal_new_server_thread ();
     handle_single_connection (0, 1);
     return;
@@ -929,6 +1002,8 @@ start_serving (void)
   change_user ();
   fork_into_background ();
   write_pidfile ();
+  metrics_start ();
+  trace_start ();
   accept_incoming_connections (socks, nr_socks);
 }
 
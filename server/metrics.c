@@ -0,0 +1,979 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Live metrics (--metrics).
+ *
+ * Counters are kept per connection (struct conn_metrics embedded in
+ * struct connection) and per backend layer (struct layer_metrics
+ * embedded in struct backend).  Both are updated with relaxed atomic
+ * adds so the request path takes no extra locks.  When a connection
+ * closes its counters are folded into per-export totals.
+ *
+ * A background thread serves the current values in the Prometheus
+ * text exposition format on a Unix domain socket or a TCP port bound
+ * to the loopback interface.  Any request read from the socket gets
+ * the same reply, so this works with HTTP clients such as curl and
+ * Prometheus itself, and with plain socket tools.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "protostrings.h"
+#include "utils.h"
+
+#define add_counter(p, n) __atomic_add_fetch ((p), (n), __ATOMIC_RELAXED)
+#define sub_counter(p, n) __atomic_sub_fetch ((p), (n), __ATOMIC_RELAXED)
+#define get_counter(p) __atomic_load_n ((p), __ATOMIC_RELAXED)
+
+static int *socks;
+static size_t nr_socks;
+static bool thread_started;
+static pthread_t thread;
+static int stop_pipe[2] = { -1, -1 };
+
+/* This lock protects the list of open connections, the per-export
+ * totals and the gauges.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn_metrics *connections;
+
+struct export_totals {
+  struct export_totals *next;
+  char *name;
+  struct conn_counters c;
+};
+static struct export_totals *exports;
+
+struct gauge {
+  struct gauge *next;
+  char *name;
+  char *help;
+  double value;
+  const uint64_t *source;       /* If set, read the value from here. */
+};
+static struct gauge *gauges;
+
+static const char *cmd_names[NR_NBD_CMDS] = {
+  [NBD_CMD_READ] = "read", [NBD_CMD_WRITE] = "write",
+  [NBD_CMD_DISC] = "disc", [NBD_CMD_FLUSH] = "flush",
+  [NBD_CMD_TRIM] = "trim", [NBD_CMD_CACHE] = "cache",
+  [NBD_CMD_WRITE_ZEROES] = "write_zeroes",
+  [NBD_CMD_BLOCK_STATUS] = "block_status",
+};
+
+static const uint32_t nbd_errors[NR_NBD_ERRORS] = {
+  NBD_EPERM, NBD_EIO, NBD_ENOMEM, NBD_EINVAL,
+  NBD_ENOSPC, NBD_EOVERFLOW, NBD_ENOTSUP, NBD_ESHUTDOWN,
+};
+
+static const char *layer_op_names[NR_LAYER_OPS] = {
+  [LAYER_PREAD] = "pread", [LAYER_PWRITE] = "pwrite",
+  [LAYER_FLUSH] = "flush", [LAYER_TRIM] = "trim",
+  [LAYER_ZERO] = "zero", [LAYER_EXTENTS] = "extents",
+  [LAYER_CACHE] = "cache",
+};
+
+const char *
+name_of_layer_op (int op)
+{
+  return layer_op_names[op];
+}
+
+static uint64_t
+nsecs_between (const struct timespec *start, const struct timespec *end)
+{
+  int64_t ns;
+
+  ns = (end->tv_sec - start->tv_sec) * INT64_C (1000000000) +
+    (end->tv_nsec - start->tv_nsec);
+  return ns > 0 ? ns : 0;
+}
+
+static uint64_t
+nsecs_since (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return nsecs_between (start, &now);
+}
+
+void
+metrics_register_connection (struct connection *conn)
+{
+  if (!metrics_addr)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  conn->metrics.instance_num = threadlocal_get_instance_num ();
+  conn->metrics.next = connections;
+  conn->metrics.registered = true;
+  connections = &conn->metrics;
+}
+
+static void
+add_conn_counters (struct conn_counters *to, const struct conn_counters *from)
+{
+  size_t i;
+
+  for (i = 0; i < NR_NBD_CMDS; ++i) {
+    to->requests[i] += get_counter (&from->requests[i]);
+    to->bytes[i] += get_counter (&from->bytes[i]);
+    to->nsecs[i] += get_counter (&from->nsecs[i]);
+  }
+  for (i = 0; i < NR_NBD_ERRORS; ++i)
+    to->errors[i] += get_counter (&from->errors[i]);
+  to->queue_nsecs += get_counter (&from->queue_nsecs);
+  to->in_flight += get_counter (&from->in_flight);
+}
+
+/* Find or create the totals for an export.  Call with lock held. */
+static struct export_totals *
+find_export (struct export_totals **list, const char *name)
+{
+  struct export_totals *e;
+
+  for (e = *list; e; e = e->next)
+    if (strcmp (e->name, name) == 0)
+      return e;
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL)
+    return NULL;
+  e->name = strdup (name);
+  if (e->name == NULL) {
+    free (e);
+    return NULL;
+  }
+  e->next = *list;
+  *list = e;
+  return e;
+}
+
+static void
+free_exports (struct export_totals *list)
+{
+  struct export_totals *next;
+
+  for (; list; list = next) {
+    next = list->next;
+    free (list->name);
+    free (list);
+  }
+}
+
+void
+metrics_unregister_connection (struct connection *conn)
+{
+  struct conn_metrics **pp;
+  struct export_totals *e;
+
+  if (!conn->metrics.registered)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (pp = &connections; *pp; pp = &(*pp)->next) {
+    if (*pp == &conn->metrics) {
+      *pp = conn->metrics.next;
+      break;
+    }
+  }
+  conn->metrics.registered = false;
+
+  e = find_export (&exports, conn->exportname);
+  if (e)
+    add_conn_counters (&e->c, &conn->metrics.c);
+}
+
+void
+metrics_request_begin (struct request_metrics *rm, struct connection *conn,
+                       uint16_t cmd, uint32_t count, uint64_t offset)
+{
+  rm->conn = NULL;
+  rm->traced = false;
+  if (cmd >= NR_NBD_CMDS)
+    return;
+
+  if (trace_file)
+    rm->traced = trace_request_begin ();
+  if (!metrics_addr && !rm->traced)
+    return;
+
+  rm->cmd = cmd;
+  rm->count = count;
+  rm->offset = offset;
+  rm->dispatched = false;
+  clock_gettime (CLOCK_MONOTONIC, &rm->start);
+  if (metrics_addr) {
+    rm->conn = conn;
+    add_counter (&conn->metrics.c.in_flight, 1);
+  }
+}
+
+/* Called when the request has acquired the request lock and is about
+ * to be passed to the backend.
+ */
+void
+metrics_request_dispatched (struct request_metrics *rm)
+{
+  if (!rm->conn || rm->dispatched)
+    return;
+
+  rm->dispatched = true;
+  add_counter (&rm->conn->metrics.c.queue_nsecs, nsecs_since (&rm->start));
+}
+
+void
+metrics_request_end (struct request_metrics *rm)
+{
+  struct timespec end;
+  struct conn_counters *c;
+
+  if (!rm->conn && !rm->traced)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if (rm->traced)
+    trace_request_end (rm->cmd, rm->count, rm->offset, &rm->start, &end);
+  if (!rm->conn)
+    return;
+
+  c = &rm->conn->metrics.c;
+  add_counter (&c->requests[rm->cmd], 1);
+  add_counter (&c->bytes[rm->cmd], rm->count);
+  add_counter (&c->nsecs[rm->cmd], nsecs_between (&rm->start, &end));
+  sub_counter (&c->in_flight, 1);
+}
+
+void
+metrics_reply_error (struct connection *conn, uint32_t nbd_error)
+{
+  size_t i;
+
+  if (!metrics_addr)
+    return;
+
+  for (i = 0; i < NR_NBD_ERRORS; ++i) {
+    if (nbd_errors[i] == nbd_error) {
+      add_counter (&conn->metrics.c.errors[i], 1);
+      return;
+    }
+  }
+}
+
+void
+metrics_layer_end (struct backend *b, int op, uint64_t nsecs, int r)
+{
+  add_counter (&b->metrics.calls[op], 1);
+  add_counter (&b->metrics.nsecs[op], nsecs);
+  if (r == -1)
+    add_counter (&b->metrics.errors[op], 1);
+}
+
+/* Filters publish gauges through nbdkit_set_gauge and
+ * nbdkit_register_gauge below.  The metric is exported as
+ * nbdkit_NAME.
+ *
+ * Find or add the named gauge.  Call with lock held.  Returns NULL
+ * if the name is invalid or we are out of memory.
+ */
+static struct gauge *
+get_gauge (const char *name, const char *help)
+{
+  struct gauge *g;
+  size_t i;
+
+  for (i = 0; name[i]; ++i) {
+    if (!((name[i] >= 'a' && name[i] <= 'z') ||
+          (name[i] >= 'A' && name[i] <= 'Z') || name[i] == '_' ||
+          (i > 0 && name[i] >= '0' && name[i] <= '9'))) {
+      nbdkit_debug ("metrics: invalid gauge name: %s", name);
+      return NULL;
+    }
+  }
+  if (i == 0)
+    return NULL;
+
+  for (g = gauges; g; g = g->next) {
+    if (strcmp (g->name, name) == 0)
+      return g;
+  }
+
+  g = calloc (1, sizeof *g);
+  if (g == NULL)
+    return NULL;
+  g->name = strdup (name);
+  g->help = strdup (help ? help : "");
+  if (g->name == NULL || g->help == NULL) {
+    free (g->name);
+    free (g->help);
+    free (g);
+    return NULL;
+  }
+  g->next = gauges;
+  gauges = g;
+  return g;
+}
+
+void
+nbdkit_set_gauge (const char *name, const char *help, double value)
+{
+  struct gauge *g;
+
+  if (!metrics_addr)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  g = get_gauge (name, help);
+  if (g) {
+    g->value = value;
+    g->source = NULL;
+  }
+}
+
+void
+nbdkit_register_gauge (const char *name, const char *help,
+                       const uint64_t *value)
+{
+  struct gauge *g;
+
+  if (!metrics_addr)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  g = get_gauge (name, help);
+  if (g)
+    g->source = value;
+}
+
+/* Print a label value, escaped as required by the exposition format. */
+static void
+print_label (FILE *fp, const char *str)
+{
+  for (; *str; ++str) {
+    switch (*str) {
+    case '\\': fputs ("\\\\", fp); break;
+    case '"': fputs ("\\\"", fp); break;
+    case '\n': fputs ("\\n", fp); break;
+    default: fputc (*str, fp);
+    }
+  }
+}
+
+static void
+print_header (FILE *fp, const char *name, const char *type, const char *help)
+{
+  fprintf (fp, "# HELP nbdkit_%s %s\n", name, help);
+  fprintf (fp, "# TYPE nbdkit_%s %s\n", name, type);
+}
+
+/* Print one metric family over all connections ('conns' true) or all
+ * exports.  'field' selects which counter.
+ */
+enum field { REQUESTS, BYTES, SECONDS, ERRORS, QUEUE_SECONDS, IN_FLIGHT };
+
+static void
+print_counters (FILE *fp, const char *name, const char *labels,
+                const struct conn_counters *c, enum field field)
+{
+  size_t i;
+
+  switch (field) {
+  case REQUESTS:
+  case BYTES:
+  case SECONDS:
+    for (i = 0; i < NR_NBD_CMDS; ++i) {
+      if (c->requests[i] == 0)
+        continue;
+      fprintf (fp, "nbdkit_%s{%s,command=\"%s\"} ", name, labels,
+               cmd_names[i]);
+      if (field == REQUESTS)
+        fprintf (fp, "%" PRIu64 "\n", c->requests[i]);
+      else if (field == BYTES)
+        fprintf (fp, "%" PRIu64 "\n", c->bytes[i]);
+      else
+        fprintf (fp, "%.9f\n", c->nsecs[i] / 1e9);
+    }
+    break;
+  case ERRORS:
+    for (i = 0; i < NR_NBD_ERRORS; ++i) {
+      if (c->errors[i] == 0)
+        continue;
+      fprintf (fp, "nbdkit_%s{%s,error=\"%s\"} %" PRIu64 "\n",
+               name, labels, name_of_nbd_error (nbd_errors[i]),
+               c->errors[i]);
+    }
+    break;
+  case QUEUE_SECONDS:
+    fprintf (fp, "nbdkit_%s{%s} %.9f\n", name, labels, c->queue_nsecs / 1e9);
+    break;
+  case IN_FLIGHT:
+    fprintf (fp, "nbdkit_%s{%s} %" PRIu64 "\n", name, labels, c->in_flight);
+    break;
+  }
+}
+
+static const struct {
+  const char *name, *type, *help;
+  enum field field;
+} families[] = {
+  { "requests_total", "counter",
+    "Requests completed, by command.", REQUESTS },
+  { "request_bytes_total", "counter",
+    "Bytes requested, by command.", BYTES },
+  { "request_seconds_total", "counter",
+    "Total time from receiving a request to sending its reply.", SECONDS },
+  { "request_queue_seconds_total", "counter",
+    "Total time requests waited before being passed to the plugin.",
+    QUEUE_SECONDS },
+  { "requests_in_flight", "gauge",
+    "Requests received but not yet replied to.", IN_FLIGHT },
+  { "errors_total", "counter",
+    "Error replies sent, by NBD error.", ERRORS },
+};
+
+struct conn_snapshot {
+  size_t instance_num;
+  char *labels;
+  struct conn_counters c;
+};
+
+/* Build the whole response body.  Returns a malloc'd string or NULL. */
+static char *
+generate (size_t *len)
+{
+  FILE *fp;
+  char *body = NULL;
+  struct conn_snapshot *snap = NULL;
+  size_t nr_snap = 0, i, j;
+  struct export_totals *totals = NULL, *e, *t;
+  const struct conn_metrics *cm;
+  struct backend *b;
+  struct gauge *g;
+  char *labels;
+  size_t labels_len;
+
+  fp = open_memstream (&body, len);
+  if (fp == NULL)
+    return NULL;
+
+  /* Take a snapshot of the connections and exports under the lock so
+   * that connections can come and go while we are formatting.
+   */
+  pthread_mutex_lock (&lock);
+  for (cm = connections; cm; cm = cm->next)
+    nr_snap++;
+  snap = calloc (nr_snap, sizeof *snap);
+  for (i = 0, cm = connections; snap && cm; ++i, cm = cm->next) {
+    const struct connection *conn =
+      container_of (cm, struct connection, metrics);
+    FILE *lfp = open_memstream (&labels, &labels_len);
+
+    if (lfp) {
+      fprintf (lfp, "connection=\"%zu\",export=\"", cm->instance_num);
+      print_label (lfp, conn->exportname);
+      fputc ('"', lfp);
+      fclose (lfp);
+      snap[i].labels = labels;
+    }
+    snap[i].instance_num = cm->instance_num;
+    add_conn_counters (&snap[i].c, &cm->c);
+
+    t = find_export (&totals, conn->exportname);
+    if (t)
+      add_conn_counters (&t->c, &snap[i].c);
+  }
+  for (e = exports; e; e = e->next) {
+    t = find_export (&totals, e->name);
+    if (t)
+      add_conn_counters (&t->c, &e->c);
+  }
+  pthread_mutex_unlock (&lock);
+
+  print_header (fp, "connections", "gauge", "Open client connections.");
+  fprintf (fp, "nbdkit_connections %zu\n", nr_snap);
+
+  /* Per-connection counters. */
+  for (j = 0; j < sizeof families / sizeof families[0]; ++j) {
+    print_header (fp, families[j].name, families[j].type, families[j].help);
+    for (i = 0; snap && i < nr_snap; ++i)
+      if (snap[i].labels)
+        print_counters (fp, families[j].name, snap[i].labels, &snap[i].c,
+                        families[j].field);
+  }
+
+  /* Per-export counters, including connections which have closed. */
+  for (j = 0; j < sizeof families / sizeof families[0]; ++j) {
+    CLEANUP_FREE char *name = NULL;
+
+    if (families[j].field == IN_FLIGHT)
+      continue;
+    if (asprintf (&name, "export_%s", families[j].name) == -1)
+      continue;
+    print_header (fp, name, families[j].type, families[j].help);
+    for (t = totals; t; t = t->next) {
+      FILE *lfp = open_memstream (&labels, &labels_len);
+
+      if (lfp == NULL)
+        continue;
+      fputs ("export=\"", lfp);
+      print_label (lfp, t->name);
+      fputc ('"', lfp);
+      fclose (lfp);
+      print_counters (fp, name, labels, &t->c, families[j].field);
+      free (labels);
+    }
+  }
+
+  /* Per-layer calls and latencies.  Latencies include the time spent
+   * in the layers below.
+   */
+  print_header (fp, "layer_calls_total", "counter",
+                "Calls into each filter or plugin, by operation.");
+  for_each_backend (b)
+    for (i = 0; i < NR_LAYER_OPS; ++i)
+      fprintf (fp, "nbdkit_layer_calls_total{layer=\"%s\",type=\"%s\","
+               "op=\"%s\"} %" PRIu64 "\n",
+               b->name, b->type, layer_op_names[i],
+               get_counter (&b->metrics.calls[i]));
+  print_header (fp, "layer_errors_total", "counter",
+                "Calls into each filter or plugin which failed.");
+  for_each_backend (b)
+    for (i = 0; i < NR_LAYER_OPS; ++i)
+      fprintf (fp, "nbdkit_layer_errors_total{layer=\"%s\",type=\"%s\","
+               "op=\"%s\"} %" PRIu64 "\n",
+               b->name, b->type, layer_op_names[i],
+               get_counter (&b->metrics.errors[i]));
+  print_header (fp, "layer_seconds_total", "counter",
+                "Time spent in each filter or plugin and the layers "
+                "below it.");
+  for_each_backend (b)
+    for (i = 0; i < NR_LAYER_OPS; ++i)
+      fprintf (fp, "nbdkit_layer_seconds_total{layer=\"%s\",type=\"%s\","
+               "op=\"%s\"} %.9f\n",
+               b->name, b->type, layer_op_names[i],
+               get_counter (&b->metrics.nsecs[i]) / 1e9);
+
+  /* Gauges published by filters. */
+  pthread_mutex_lock (&lock);
+  for (g = gauges; g; g = g->next) {
+    print_header (fp, g->name, "gauge", g->help);
+    if (g->source)
+      fprintf (fp, "nbdkit_%s %" PRIu64 "\n",
+               g->name, get_counter (g->source));
+    else
+      fprintf (fp, "nbdkit_%s %.17g\n", g->name, g->value);
+  }
+  pthread_mutex_unlock (&lock);
+
+  for (i = 0; snap && i < nr_snap; ++i)
+    free (snap[i].labels);
+  free (snap);
+  free_exports (totals);
+
+  if (fclose (fp) == EOF) {
+    free (body);
+    return NULL;
+  }
+  return body;
+}
+
+/* A client of the metrics socket gets this many milliseconds in
+ * total to send its request and read the reply.  The socket is
+ * non-blocking, so a client which stops reading cannot hold up the
+ * metrics thread (or metrics_stop) for longer than this.
+ */
+#define CLIENT_TIMEOUT 5000
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Wait until sock is ready for events, the deadline passes, or the
+ * server is shutting down.  Returns 0 if sock is ready, -1 otherwise.
+ */
+static int
+wait_client (int sock, short events, int64_t deadline)
+{
+  struct pollfd fds[2] = {
+    { .fd = sock, .events = events },
+    { .fd = stop_pipe[0], .events = POLLIN },
+  };
+  int64_t timeout;
+  int r;
+
+  for (;;) {
+    timeout = deadline - now_ms ();
+    if (timeout <= 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    r = poll (fds, 2, timeout);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (fds[1].revents) {
+      errno = ESHUTDOWN;
+      return -1;
+    }
+    return 0;
+  }
+}
+
+static int
+write_full (int sock, const char *buf, size_t len, int64_t deadline)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (sock, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (wait_client (sock, POLLOUT, deadline) == -1)
+          return -1;
+        continue;
+      }
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* Serve a single client of the metrics socket. */
+static void
+serve_client (int sock)
+{
+  static const char header[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+  char request[4096];
+  size_t n = 0;
+  ssize_t r;
+  int64_t deadline = now_ms () + CLIENT_TIMEOUT;
+  CLEANUP_FREE char *body = NULL;
+  size_t len;
+
+  /* Read (and ignore) the request until the blank line which ends
+   * HTTP headers, but don't wait more than a second for it.
+   */
+  while (n < sizeof request - 1 &&
+         wait_client (sock, POLLIN, now_ms () + 1000) == 0) {
+    r = read (sock, request + n, sizeof request - 1 - n);
+    if (r == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+      continue;
+    if (r <= 0)
+      break;
+    n += r;
+    request[n] = '\0';
+    if (strstr (request, "\r\n\r\n") || strstr (request, "\n\n"))
+      break;
+  }
+
+  body = generate (&len);
+  if (body == NULL) {
+    nbdkit_debug ("metrics: could not generate metrics: %m");
+    return;
+  }
+  if (write_full (sock, header, sizeof header - 1, deadline) == -1 ||
+      write_full (sock, body, len, deadline) == -1)
+    nbdkit_debug ("metrics: write: %m");
+}
+
+static void *
+metrics_thread (void *vp)
+{
+  struct pollfd *fds = vp;
+  size_t i;
+  int sock;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("metrics");
+
+  for (;;) {
+    for (i = 0; i <= nr_socks; ++i)
+      fds[i].revents = 0;
+    if (poll (fds, nr_socks + 1, -1) == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      nbdkit_error ("metrics: poll: %m");
+      break;
+    }
+    if (fds[nr_socks].revents)
+      break;
+
+    for (i = 0; i < nr_socks; ++i) {
+      if (!(fds[i].revents & POLLIN))
+        continue;
+#ifdef HAVE_ACCEPT4
+      sock = accept4 (fds[i].fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK);
+#else
+      sock = set_nonblock (set_cloexec (accept (fds[i].fd, NULL, NULL)));
+#endif
+      if (sock == -1)
+        continue;
+      serve_client (sock);
+      close (sock);
+    }
+  }
+
+  free (fds);
+  return NULL;
+}
+
+static void
+bind_metrics_unix_socket (void)
+{
+  struct sockaddr_un addr;
+  size_t len = strlen (metrics_addr);
+  int sock;
+
+  if (len >= UNIX_PATH_MAX) {
+    fprintf (stderr, "%s: --metrics: path too long: length %zu > max %d bytes\n",
+             program_name, len, UNIX_PATH_MAX-1);
+    exit (EXIT_FAILURE);
+  }
+
+#ifdef SOCK_CLOEXEC
+  sock = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+#else
+  sock = set_cloexec (socket (AF_UNIX, SOCK_STREAM, 0));
+#endif
+  if (sock == -1) {
+    perror ("metrics: socket");
+    exit (EXIT_FAILURE);
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path, metrics_addr, len+1 /* trailing \0 */);
+  if (bind (sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror (metrics_addr);
+    exit (EXIT_FAILURE);
+  }
+  if (listen (sock, SOMAXCONN) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+
+  socks = malloc (sizeof (int));
+  if (socks == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  socks[0] = sock;
+  nr_socks = 1;
+}
+
+/* Bind to the loopback interface only.  The metrics expose details
+ * of the clients, and there is no authentication.
+ */
+static void
+bind_metrics_tcpip_socket (void)
+{
+  struct addrinfo hints, *ai, *a;
+  int err, sock, opt = 1;
+
+  memset (&hints, 0, sizeof hints);
+  hints.ai_socktype = SOCK_STREAM;
+  err = getaddrinfo (NULL, metrics_addr, &hints, &ai);
+  if (err != 0) {
+    fprintf (stderr, "%s: --metrics: getaddrinfo: %s: %s\n",
+             program_name, metrics_addr, gai_strerror (err));
+    exit (EXIT_FAILURE);
+  }
+
+  for (a = ai; a != NULL; a = a->ai_next) {
+#ifdef SOCK_CLOEXEC
+    sock = socket (a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                   a->ai_protocol);
+#else
+    sock = set_cloexec (socket (a->ai_family, a->ai_socktype,
+                                a->ai_protocol));
+#endif
+    if (sock == -1)
+      continue;
+    setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+#ifdef IPV6_V6ONLY
+    if (a->ai_family == PF_INET6)
+      setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt);
+#endif
+    if (bind (sock, a->ai_addr, a->ai_addrlen) == -1 ||
+        listen (sock, SOMAXCONN) == -1) {
+      close (sock);
+      continue;
+    }
+    socks = realloc (socks, sizeof (int) * (nr_socks+1));
+    if (socks == NULL) {
+      perror ("realloc");
+      exit (EXIT_FAILURE);
+    }
+    socks[nr_socks++] = sock;
+  }
+  freeaddrinfo (ai);
+
+  if (nr_socks == 0) {
+    fprintf (stderr, "%s: --metrics: unable to bind to port %s\n",
+             program_name, metrics_addr);
+    exit (EXIT_FAILURE);
+  }
+}
+
+void
+metrics_bind (void)
+{
+  if (!metrics_addr)
+    return;
+
+  if (metrics_addr[0] == '/')
+    bind_metrics_unix_socket ();
+  else
+    bind_metrics_tcpip_socket ();
+
+  debug ("metrics served on %s", metrics_addr);
+}
+
+void
+metrics_start (void)
+{
+  struct pollfd *fds;
+  size_t i;
+  int err;
+
+  if (!metrics_addr)
+    return;
+
+#ifdef HAVE_PIPE2
+  if (pipe2 (stop_pipe, O_CLOEXEC) == -1) {
+    perror ("pipe2");
+    exit (EXIT_FAILURE);
+  }
+#else
+  if (pipe (stop_pipe) == -1 ||
+      set_cloexec (stop_pipe[0]) == -1 || set_cloexec (stop_pipe[1]) == -1) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+#endif
+  fds = calloc (nr_socks + 1, sizeof *fds);
+  if (fds == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_socks; ++i) {
+    fds[i].fd = socks[i];
+    fds[i].events = POLLIN;
+  }
+  fds[nr_socks].fd = stop_pipe[0];
+  fds[nr_socks].events = POLLIN;
+
+  err = pthread_create (&thread, NULL, metrics_thread, fds);
+  if (err) {
+    errno = err;
+    perror ("metrics: pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  thread_started = true;
+}
+
+void
+metrics_free (void)
+{
+  struct gauge *g;
+  size_t i;
+
+  if (thread_started) {
+    char c = 0;
+
+    if (write (stop_pipe[1], &c, 1) != 1)
+      perror ("metrics: write");
+    pthread_join (thread, NULL);
+    thread_started = false;
+  }
+  if (stop_pipe[0] >= 0) {
+    close (stop_pipe[0]);
+    close (stop_pipe[1]);
+    stop_pipe[0] = stop_pipe[1] = -1;
+  }
+
+  for (i = 0; i < nr_socks; ++i)
+    close (socks[i]);
+  free (socks);
+  socks = NULL;
+  if (nr_socks > 0 && metrics_addr[0] == '/')
+    unlink (metrics_addr);
+  nr_socks = 0;
+
+  free_exports (exports);
+  exports = NULL;
+  while ((g = gauges) != NULL) {
+    gauges = g->next;
+    free (g->name);
+    free (g->help);
+    free (g);
+  }
+}
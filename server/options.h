@@ -40,13 +40,16 @@
 
 enum {
   HELP_OPTION = CHAR_MAX + 1,
+  CACHE_EXTENTS_OPTION,
   DUMP_CONFIG_OPTION,
   DUMP_PLUGIN_OPTION,
+  ERROR_MESSAGES_OPTION,
   EXIT_WITH_PARENT_OPTION,
   FILTER_OPTION,
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
   MASK_HANDSHAKE_OPTION,
+  METRICS_OPTION,
   NO_SR_OPTION,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
@@ -55,14 +58,19 @@ enum {
   TLS_CERTIFICATES_OPTION,
   TLS_PSK_OPTION,
   TLS_VERIFY_PEER_OPTION,
+  TRACE_OPTION,
+  TRACE_FORMAT_OPTION,
+  TRACE_SAMPLE_OPTION,
   VSOCK_OPTION,
 };
 
 static const char *short_options = "D:e:fg:i:nop:P:rst:u:U:vV";
 static const struct option long_options[] = {
+  { "cache-extents",    no_argument,       NULL, CACHE_EXTENTS_OPTION },
   { "debug",            required_argument, NULL, 'D' },
   { "dump-config",      no_argument,       NULL, DUMP_CONFIG_OPTION },
   { "dump-plugin",      no_argument,       NULL, DUMP_PLUGIN_OPTION },
+  { "error-messages",   no_argument,       NULL, ERROR_MESSAGES_OPTION },
   { "exit-with-parent", no_argument,       NULL, EXIT_WITH_PARENT_OPTION },
   { "export",           required_argument, NULL, 'e' },
   { "export-name",      required_argument, NULL, 'e' },
@@ -77,6 +85,7 @@ static const struct option long_options[] = {
   { "log",              required_argument, NULL, LOG_OPTION },
   { "long-options",     no_argument,       NULL, LONG_OPTIONS_OPTION },
   { "mask-handshake",   required_argument, NULL, MASK_HANDSHAKE_OPTION },
+  { "metrics",          required_argument, NULL, METRICS_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
   { "no-sr",            no_argument,       NULL, NO_SR_OPTION },
@@ -97,6 +106,9 @@ static const struct option long_options[] = {
   { "tls-certificates", required_argument, NULL, TLS_CERTIFICATES_OPTION },
   { "tls-psk",          required_argument, NULL, TLS_PSK_OPTION },
   { "tls-verify-peer",  no_argument,       NULL, TLS_VERIFY_PEER_OPTION },
+  { "trace",            required_argument, NULL, TRACE_OPTION },
+  { "trace-format",     required_argument, NULL, TRACE_FORMAT_OPTION },
+  { "trace-sample",     required_argument, NULL, TRACE_SAMPLE_OPTION },
   { "unix",             required_argument, NULL, 'U' },
   { "user",             required_argument, NULL, 'u' },
   { "verbose",          no_argument,       NULL, 'v' },
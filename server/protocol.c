@@ -48,6 +48,27 @@
 #include "nbd-protocol.h"
 #include "protostrings.h"
 
+/* If structured replies are in effect, a read or block status request
+ * which starts inside the export but runs past the end is answered for
+ * the part in range.  For reads the tail gets an
+ * NBD_REPLY_TYPE_ERROR_OFFSET chunk, which is not possible if the
+ * client asked for an unfragmented reply.  Block status replies are
+ * allowed to cover less than the request, so those are truncated.
+ */
+static bool
+valid_partial_range (struct connection *conn,
+                     uint16_t cmd, uint16_t flags,
+                     uint64_t offset, uint32_t count)
+{
+  if (!conn->structured_replies || count == 0)
+    return false;
+  if (cmd == NBD_CMD_READ && (flags & NBD_CMD_FLAG_DF))
+    return false;
+  if (cmd != NBD_CMD_READ && cmd != NBD_CMD_BLOCK_STATUS)
+    return false;
+  return offset < backend_get_size (backend, conn);
+}
+
 static bool
 validate_request (struct connection *conn,
                   uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
@@ -71,7 +92,8 @@ validate_request (struct connection *conn,
   case NBD_CMD_TRIM:
   case NBD_CMD_WRITE_ZEROES:
   case NBD_CMD_BLOCK_STATUS:
-    if (!backend_valid_range (backend, conn, offset, count)) {
+    if (!backend_valid_range (backend, conn, offset, count) &&
+        !valid_partial_range (conn, cmd, flags, offset, count)) {
       /* XXX Allow writes to extend the disk? */
       nbdkit_error ("invalid request: %s: offset and count are out of range: "
                     "offset=%" PRIu64 " count=%" PRIu32,
@@ -231,6 +253,7 @@ handle_request (struct connection *conn,
 {
   uint32_t f = 0;
   int err = 0;
+  uint64_t gen;
 
   /* Clear the error, so that we know if the plugin calls
    * nbdkit_set_error() or relied on errno.  */
@@ -280,6 +303,18 @@ handle_request (struct connection *conn,
   case NBD_CMD_BLOCK_STATUS:
     if (flags & NBD_CMD_FLAG_REQ_ONE)
       f |= NBDKIT_FLAG_REQ_ONE;
+    if (cache_extents) {
+      if (extents_cache_lookup (count, offset, f, extents, &gen))
+        break;
+      /* On a cache miss, ask for as much information as the plugin is
+       * willing to return.  The reply still honours REQ_ONE.
+       */
+      if (backend_extents (backend, conn, count, offset,
+                           f & ~NBDKIT_FLAG_REQ_ONE, extents, &err) == -1)
+        return err;
+      extents_cache_add (gen, extents);
+      break;
+    }
     if (backend_extents (backend, conn, count, offset, f,
                          extents, &err) == -1)
       return err;
@@ -371,6 +406,9 @@ send_simple_reply (struct connection *conn,
   int r;
   int f = (cmd == NBD_CMD_READ && !error) ? SEND_MORE : 0;
 
+  if (error)
+    metrics_reply_error (conn, nbd_errno (error, flags));
+
   reply.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
   reply.handle = handle;
   reply.error = htobe32 (nbd_errno (error, flags));
@@ -393,16 +431,17 @@ send_simple_reply (struct connection *conn,
   return 1;                     /* command processed ok */
 }
 
+/* Send a single NBD_REPLY_TYPE_OFFSET_DATA chunk.  The write lock is
+ * only held while this chunk is sent, so when a read is split into
+ * several chunks other threads can interleave their replies between
+ * them.  'last' sets NBD_REPLY_FLAG_DONE on the chunk.
+ */
 static int
 send_structured_reply_read (struct connection *conn,
                             uint64_t handle, uint16_t cmd,
-                            const char *buf, uint32_t count, uint64_t offset)
+                            const char *buf, uint32_t count, uint64_t offset,
+                            bool last)
 {
-  /* Once we are really using structured replies and sending data back
-   * in chunks, we'll be able to grab the write lock for each chunk,
-   * allowing other threads to interleave replies.  As we're not doing
-   * that yet we acquire the lock for the whole function.
-   */
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
   struct nbd_structured_reply reply;
   struct nbd_structured_reply_offset_data offset_data;
@@ -412,7 +451,7 @@ send_structured_reply_read (struct connection *conn,
 
   reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
   reply.handle = handle;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
+  reply.flags = htobe16 (last ? NBD_REPLY_FLAG_DONE : 0);
   reply.type = htobe16 (NBD_REPLY_TYPE_OFFSET_DATA);
   reply.length = htobe32 (count + sizeof offset_data);
 
@@ -578,21 +617,42 @@ send_structured_reply_block_status (struct connection *conn,
   return 1;                     /* command processed ok */
 }
 
+/* Send an NBD_REPLY_TYPE_ERROR chunk, or if 'error_offset' is not
+ * NULL an NBD_REPLY_TYPE_ERROR_OFFSET chunk, which ends the reply.
+ *
+ * The chunk carries a human-readable message.  If 'msg' is NULL we
+ * use the last message passed to nbdkit_error while handling this
+ * request (only saved if --error-messages was used), falling back to
+ * the description of the errno.
+ */
 static int
 send_structured_reply_error (struct connection *conn,
                              uint64_t handle, uint16_t cmd, uint16_t flags,
-                             uint32_t error)
+                             uint32_t error, const char *msg,
+                             const uint64_t *error_offset)
 {
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
   struct nbd_structured_reply reply;
   struct nbd_structured_reply_error error_data;
+  uint64_t offset_data;
+  size_t len;
   int r;
 
+  if (msg == NULL)
+    msg = threadlocal_get_last_error ();
+  if (msg == NULL)
+    msg = strerror (error);
+  len = MIN (strlen (msg), NBD_MAX_STRING);
+
+  metrics_reply_error (conn, nbd_errno (error, flags));
+
   reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
   reply.handle = handle;
   reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_ERROR);
-  reply.length = htobe32 (0 /* no human readable error */ + sizeof error_data);
+  reply.type = htobe16 (error_offset ? NBD_REPLY_TYPE_ERROR_OFFSET
+                                     : NBD_REPLY_TYPE_ERROR);
+  reply.length = htobe32 (sizeof error_data + len +
+                          (error_offset ? sizeof offset_data : 0));
 
   r = conn->send (conn, &reply, sizeof reply, SEND_MORE);
   if (r == -1) {
@@ -602,13 +662,106 @@ send_structured_reply_error (struct connection *conn,
 
   /* Send the error. */
   error_data.error = htobe32 (nbd_errno (error, flags));
-  error_data.len = htobe16 (0);
-  r = conn->send (conn, &error_data, sizeof error_data, 0);
+  error_data.len = htobe16 (len);
+  r = conn->send (conn, &error_data, sizeof error_data, SEND_MORE);
+  if (r == -1) {
+    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+    return connection_set_status (conn, -1);
+  }
+
+  /* Send the human readable error message. */
+  r = conn->send (conn, msg, len, error_offset ? SEND_MORE : 0);
   if (r == -1) {
     nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (conn, -1);
   }
-  /* No human readable error message at the moment. */
+
+  /* Send the offset of the error. */
+  if (error_offset) {
+    offset_data = htobe64 (*error_offset);
+    r = conn->send (conn, &offset_data, sizeof offset_data, 0);
+    if (r == -1) {
+      nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+      return connection_set_status (conn, -1);
+    }
+  }
+
+  return 1;                     /* command processed ok */
+}
+
+/* Handle NBD_CMD_READ when structured replies are in effect and the
+ * client did not set NBD_CMD_FLAG_DF, so we are allowed to fragment
+ * the reply.  The read is split into chunks of at most MAX_READ_CHUNK
+ * bytes.  Each chunk is read from the backend (under the request
+ * lock) and then sent (under the write lock) before the next chunk is
+ * read, so a single large read no longer holds conn->write_lock for
+ * the whole transmission.  'buf' need only be large enough for one
+ * chunk.
+ *
+ * Because the request lock is dropped between chunks, other requests
+ * on the same connection may run in between.  This is allowed by the
+ * protocol, which makes no promises about the ordering of concurrent
+ * overlapping requests.
+ *
+ * If a chunk fails after earlier chunks were sent, the data already
+ * sent is valid and the rest of the request is failed with
+ * NBD_REPLY_TYPE_ERROR_OFFSET.  'tail' is the number of bytes of the
+ * request which lie beyond the end of the export (after the 'count'
+ * bytes which are in range), and are failed in the same way.
+ */
+static int
+handle_fragmented_read (struct connection *conn, uint64_t handle,
+                        uint16_t flags, char *buf,
+                        uint32_t count, uint64_t offset, uint32_t tail,
+                        struct request_metrics *rm)
+{
+  const uint16_t cmd = NBD_CMD_READ;
+  uint32_t pos = 0, n, error;
+  uint64_t error_offset;
+  int r;
+
+  do {
+    n = MIN (count - pos, MAX_READ_CHUNK);
+
+    if (quit || !connection_get_status (conn)) {
+      error = ESHUTDOWN;
+    }
+    else {
+      lock_request (conn);
+      metrics_request_dispatched (rm);
+      error = handle_request (conn, cmd, flags, offset + pos, n, buf, NULL);
+      assert ((int) error >= 0);
+      unlock_request (conn);
+    }
+
+    if (connection_get_status (conn) < 0)
+      return -1;
+
+    if (error != 0) {
+      debug ("sending error reply: %s", strerror (error));
+      if (pos == 0)
+        return send_structured_reply_error (conn, handle, cmd, flags, error,
+                                            NULL, NULL);
+      error_offset = offset + pos;
+      return send_structured_reply_error (conn, handle, cmd, flags, error,
+                                          NULL, &error_offset);
+    }
+
+    r = send_structured_reply_read (conn, handle, cmd, buf, n, offset + pos,
+                                    pos + n == count && tail == 0);
+    if (r <= 0)
+      return r;
+    pos += n;
+  } while (pos < count);
+
+  if (tail > 0) {
+    debug ("%s: %" PRIu32 " bytes requested beyond end of export",
+           name_of_nbd_cmd (cmd), tail);
+    error_offset = offset + count;
+    return send_structured_reply_error (conn, handle, cmd, flags, EINVAL,
+                                        "read beyond the end of the export",
+                                        &error_offset);
+  }
 
   return 1;                     /* command processed ok */
 }
@@ -620,9 +773,12 @@ protocol_recv_request_send_reply (struct connection *conn)
   struct nbd_request request;
   uint16_t cmd, flags;
   uint32_t magic, count, error = 0;
+  uint32_t tail = 0;
   uint64_t offset;
+  bool fragmented_read;
   char *buf = NULL;
   CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
+  CLEANUP_REQUEST_METRICS struct request_metrics rm = { .conn = NULL };
 
   /* Read the request packet. */
   {
@@ -653,12 +809,18 @@ protocol_recv_request_send_reply (struct connection *conn)
     offset = be64toh (request.offset);
     count = be32toh (request.count);
 
+    fragmented_read = conn->structured_replies && cmd == NBD_CMD_READ &&
+      !(flags & NBD_CMD_FLAG_DF);
+
     if (cmd == NBD_CMD_DISC) {
       debug ("client sent %s, closing connection", name_of_nbd_cmd (cmd));
       return connection_set_status (conn, 0); /* disconnect */
     }
 
+    metrics_request_begin (&rm, conn, cmd, count, offset);
+
     /* Validate the request. */
+    threadlocal_clear_last_error ();
     if (!validate_request (conn, cmd, flags, offset, count, &error)) {
       if (cmd == NBD_CMD_WRITE &&
           skip_over_write_buffer (conn->sockin, count) < 0)
@@ -666,11 +828,25 @@ protocol_recv_request_send_reply (struct connection *conn)
       goto send_reply;
     }
 
+    /* Trim requests which run past the end of the export, see
+     * valid_partial_range above.
+     */
+    if ((cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS) &&
+        !backend_valid_range (backend, conn, offset, count)) {
+      uint32_t n = backend_get_size (backend, conn) - offset;
+
+      tail = count - n;
+      count = n;
+    }
+
     /* Get the data buffer used for either read or write requests.
      * This is a common per-thread data buffer, it must not be freed.
+     * Fragmented reads only need room for a single chunk.
      */
     if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
-      buf = threadlocal_buffer ((size_t) count);
+      buf = threadlocal_buffer (fragmented_read
+                                ? (size_t) MIN (count, MAX_READ_CHUNK)
+                                : (size_t) count);
       if (buf == NULL) {
         error = ENOMEM;
         if (cmd == NBD_CMD_WRITE &&
@@ -703,15 +879,28 @@ protocol_recv_request_send_reply (struct connection *conn)
     }
   }
 
+  if (fragmented_read)
+    return handle_fragmented_read (conn, request.handle, flags, buf,
+                                   count, offset, tail, &rm);
+
   /* Perform the request.  Only this part happens inside the request lock. */
   if (quit || !connection_get_status (conn)) {
     error = ESHUTDOWN;
   }
   else {
     lock_request (conn);
+    metrics_request_dispatched (&rm);
     error = handle_request (conn, cmd, flags, offset, count, buf, extents);
     assert ((int) error >= 0);
     unlock_request (conn);
+
+    /* Even if the request failed, part of the range may have been
+     * modified.
+     */
+    if (cache_extents &&
+        (cmd == NBD_CMD_WRITE || cmd == NBD_CMD_TRIM ||
+         cmd == NBD_CMD_WRITE_ZEROES))
+      extents_cache_invalidate (count, offset);
   }
 
   /* Send the reply packet. */
@@ -730,16 +919,15 @@ protocol_recv_request_send_reply (struct connection *conn)
 
   /* Currently we prefer to send simple replies for everything except
    * where we have to (ie. NBD_CMD_READ and NBD_CMD_BLOCK_STATUS when
-   * structured_replies have been negotiated).  However this prevents
-   * us from sending human-readable error messages to the client, so
-   * we should reconsider this in future.
+   * structured_replies have been negotiated).  Human-readable error
+   * messages are therefore only sent to the client for those commands.
    */
   if (conn->structured_replies &&
       (cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS)) {
     if (!error) {
       if (cmd == NBD_CMD_READ)
         return send_structured_reply_read (conn, request.handle, cmd,
-                                           buf, count, offset);
+                                           buf, count, offset, true);
       else /* NBD_CMD_BLOCK_STATUS */
         return send_structured_reply_block_status (conn, request.handle,
                                                    cmd, flags,
@@ -748,7 +936,7 @@ protocol_recv_request_send_reply (struct connection *conn)
     }
     else
       return send_structured_reply_error (conn, request.handle, cmd, flags,
-                                          error);
+                                          error, NULL, NULL);
   }
   else
     return send_simple_reply (conn, request.handle, cmd, flags, buf, count,
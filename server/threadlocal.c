@@ -56,6 +56,7 @@ struct threadlocal {
   char *name;                   /* Can be NULL. */
   size_t instance_num;          /* Can be 0. */
   int err;
+  char *last_error;             /* Last nbdkit_error message, or NULL. */
   void *buffer;
   size_t buffer_size;
   struct connection *conn;
@@ -69,6 +70,7 @@ free_threadlocal (void *threadlocalv)
   struct threadlocal *threadlocal = threadlocalv;
 
   free (threadlocal->name);
+  free (threadlocal->last_error);
   free (threadlocal->buffer);
   free (threadlocal);
 }
@@ -175,6 +177,75 @@ threadlocal_get_error (void)
   return threadlocal ? threadlocal->err : 0;
 }
 
+/* Remember the formatted error message so that it can be sent back
+ * to the client in a structured error reply.  Only called if
+ * --error-messages was used.  This preserves errno.
+ */
+void
+threadlocal_set_last_error (const char *fs, va_list args)
+{
+  int err = errno;
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  FILE *fp;
+  char *msg = NULL;
+  size_t len = 0, i;
+
+  if (!threadlocal)
+    goto out;
+
+  free (threadlocal->last_error);
+  threadlocal->last_error = NULL;
+
+  /* Best effort: failure to save the message is not an error. */
+  fp = open_memstream (&msg, &len);
+  if (fp == NULL)
+    goto out;
+  errno = err;                  /* must restore in case fs contains %m */
+  vfprintf (fp, fs, args);
+  if (fclose (fp) == EOF) {
+    free (msg);
+    goto out;
+  }
+
+  /* Some callers include a trailing newline in the message.  Any
+   * other control characters are replaced so that the message is
+   * safe to display on the client.
+   */
+  while (len > 0 && msg[len-1] == '\n')
+    msg[--len] = '\0';
+  for (i = 0; i < len; ++i) {
+    if ((unsigned char) msg[i] < 0x20 || msg[i] == 0x7f)
+      msg[i] = ' ';
+  }
+  threadlocal->last_error = msg;
+
+ out:
+  errno = err;
+}
+
+void
+threadlocal_clear_last_error (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal) {
+    free (threadlocal->last_error);
+    threadlocal->last_error = NULL;
+  }
+}
+
+/* Return the last error message saved by threadlocal_set_last_error,
+ * or NULL if there is none.  The string is owned by thread-local
+ * storage and is valid until the next call to nbdkit_error.
+ */
+const char *
+threadlocal_get_last_error (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  return threadlocal ? threadlocal->last_error : NULL;
+}
+
 /* Return the single pread/pwrite buffer for this thread.  The buffer
  * size is increased to ‘size’ bytes if required.
  *
@@ -0,0 +1,540 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Per-layer latency tracing (--trace).
+ *
+ * Each thread which serves requests records events into its own
+ * chunk without taking any locks: one event for every call into a
+ * filter or the plugin (see backend.c) and one for the whole NBD
+ * request.  When a chunk fills up, or its thread exits, it is queued
+ * for a background writer thread which formats it into the trace
+ * file, so the request path never does any file I/O.  Anything left
+ * is written out when nbdkit shuts down.
+ *
+ * --trace-sample=N traces only one request in N.  The decision is
+ * made when the request is read, and applies to all layer calls made
+ * while handling it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "protostrings.h"
+
+#define EVENTS_PER_CHUNK 4096
+
+/* Number of empty chunks kept for reuse by the request threads. */
+#define MAX_SPARE_CHUNKS 8
+
+struct trace_event {
+  const char *layer;            /* backend name, NULL for a request */
+  const char *type;             /* "filter" or "plugin" */
+  int op;                       /* LAYER_* or NBD_CMD_* */
+  int r;                        /* layer return value */
+  uint32_t count;
+  uint64_t offset;
+  uint64_t start;               /* nanoseconds since trace_open */
+  uint64_t duration;            /* nanoseconds */
+};
+
+/* One of these per thread which has recorded events.  It is freed by
+ * the writer thread once the last chunk of an exited thread has been
+ * written.
+ */
+struct trace_thread {
+  struct trace_thread *next;    /* list of running threads */
+  unsigned tid;                 /* small thread number for the trace */
+  char *name;                   /* thread name, or NULL */
+  bool named;                   /* thread name written to the file */
+  bool sampled;                 /* current request is being traced */
+  struct trace_chunk *chunk;    /* chunk being filled by this thread */
+};
+
+struct trace_chunk {
+  struct trace_chunk *next;     /* write queue or spare list */
+  struct trace_thread *thread;
+  bool last;                    /* last chunk of an exited thread */
+  size_t nr_events;
+  struct trace_event events[EVENTS_PER_CHUNK];
+};
+
+static pthread_key_t thread_key;
+static struct timespec t0;
+static uint64_t nr_requests;
+static unsigned nr_threads;
+
+/* This lock protects the list of running threads, the write queue,
+ * the spare chunks and the writer thread state.  The file is only touched by
+ * the writer thread, or by trace_close after the writer has stopped.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct trace_thread *running;
+static struct trace_chunk *queue_head, *queue_tail;
+static struct trace_chunk *spare;
+static size_t nr_spare;
+static pthread_t writer;
+static bool writer_running, writer_stop;
+static FILE *fp;
+static bool first_event = true;
+
+static uint64_t
+nsecs_since_t0 (const struct timespec *ts)
+{
+  return (ts->tv_sec - t0.tv_sec) * UINT64_C (1000000000) +
+    ts->tv_nsec - t0.tv_nsec;
+}
+
+/* Print a string as a JSON string. */
+static void
+print_json_string (const char *str)
+{
+  fputc ('"', fp);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      fprintf (fp, "\\%c", *str);
+    else if ((unsigned char) *str < 0x20)
+      fprintf (fp, "\\u%04x", *str);
+    else
+      fputc (*str, fp);
+  }
+  fputc ('"', fp);
+}
+
+static void
+print_chrome_event (const struct trace_thread *t,
+                    const struct trace_event *ev)
+{
+  fputs (first_event ? "" : ",\n", fp);
+  first_event = false;
+
+  fputs ("{\"name\":", fp);
+  if (ev->layer) {
+    CLEANUP_FREE char *name = NULL;
+
+    if (asprintf (&name, "%s.%s", ev->layer, name_of_layer_op (ev->op)) == -1)
+      print_json_string (ev->layer);
+    else
+      print_json_string (name);
+    fprintf (fp, ",\"cat\":\"%s\"", ev->type);
+  }
+  else {
+    print_json_string (name_of_nbd_cmd (ev->op));
+    fputs (",\"cat\":\"request\"", fp);
+  }
+  fprintf (fp, ",\"ph\":\"X\",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64
+           ".%03u,\"pid\":%ld,\"tid\":%u,"
+           "\"args\":{\"count\":%" PRIu32 ",\"offset\":%" PRIu64,
+           ev->start / 1000, (unsigned) (ev->start % 1000),
+           ev->duration / 1000, (unsigned) (ev->duration % 1000),
+           (long) getpid (), t->tid, ev->count, ev->offset);
+  if (ev->layer)
+    fprintf (fp, ",\"result\":%d", ev->r);
+  fputs ("}}", fp);
+}
+
+static void
+print_perf_event (const struct trace_thread *t,
+                  const struct trace_event *ev)
+{
+  fprintf (fp, "%s %ld/%u [000] %" PRIu64 ".%09" PRIu64 ": ",
+           t->name ? t->name : "nbdkit", (long) getpid (), t->tid,
+           ev->start / 1000000000, ev->start % 1000000000);
+  if (ev->layer)
+    fprintf (fp, "nbdkit:layer: layer=%s type=%s op=%s",
+             ev->layer, ev->type, name_of_layer_op (ev->op));
+  else
+    fprintf (fp, "nbdkit:request: cmd=%s", name_of_nbd_cmd (ev->op));
+  fprintf (fp, " count=%" PRIu32 " offset=%" PRIu64 " dur_ns=%" PRIu64,
+           ev->count, ev->offset, ev->duration);
+  if (ev->layer)
+    fprintf (fp, " result=%d", ev->r);
+  fputc ('\n', fp);
+}
+
+/* Write out the events in a chunk.  Only called from the writer
+ * thread, or when the writer is not running.
+ */
+static void
+write_chunk (struct trace_chunk *chunk)
+{
+  struct trace_thread *t = chunk->thread;
+  size_t i;
+
+  if (trace_format == TRACE_FORMAT_CHROME && !t->named && t->name) {
+    fputs (first_event ? "" : ",\n", fp);
+    first_event = false;
+    fprintf (fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+             "\"tid\":%u,\"args\":{\"name\":",
+             (long) getpid (), t->tid);
+    print_json_string (t->name);
+    fputs ("}}", fp);
+    t->named = true;
+  }
+
+  for (i = 0; i < chunk->nr_events; ++i) {
+    if (trace_format == TRACE_FORMAT_CHROME)
+      print_chrome_event (t, &chunk->events[i]);
+    else
+      print_perf_event (t, &chunk->events[i]);
+  }
+}
+
+static void
+free_thread (struct trace_thread *t)
+{
+  free (t->name);
+  free (t);
+}
+
+/* Add a chunk to the write queue.  Call with lock held. */
+static void
+enqueue_chunk (struct trace_chunk *chunk)
+{
+  chunk->next = NULL;
+  if (queue_tail)
+    queue_tail->next = chunk;
+  else
+    queue_head = chunk;
+  queue_tail = chunk;
+  pthread_cond_signal (&cond);
+}
+
+/* Write out every queued chunk.  The lock is dropped while writing. */
+static void
+drain_queue (void)
+{
+  struct trace_chunk *chunk, *next;
+
+  while ((chunk = queue_head) != NULL) {
+    queue_head = queue_tail = NULL;
+    pthread_mutex_unlock (&lock);
+
+    for (; chunk; chunk = next) {
+      next = chunk->next;
+      write_chunk (chunk);
+      if (chunk->last)
+        free_thread (chunk->thread);
+      chunk->nr_events = 0;
+      chunk->last = false;
+
+      pthread_mutex_lock (&lock);
+      if (nr_spare < MAX_SPARE_CHUNKS) {
+        chunk->next = spare;
+        spare = chunk;
+        nr_spare++;
+        chunk = NULL;
+      }
+      pthread_mutex_unlock (&lock);
+      free (chunk);
+    }
+
+    pthread_mutex_lock (&lock);
+  }
+}
+
+static void *
+writer_thread (void *vp)
+{
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    drain_queue ();
+    if (writer_stop)
+      break;
+    pthread_cond_wait (&cond, &lock);
+  }
+  pthread_mutex_unlock (&lock);
+  return NULL;
+}
+
+/* Get an empty chunk, reusing one written out by the writer thread if
+ * possible.  Returns NULL if we are out of memory.
+ */
+static struct trace_chunk *
+get_chunk (void)
+{
+  struct trace_chunk *chunk = NULL;
+
+  pthread_mutex_lock (&lock);
+  if (spare) {
+    chunk = spare;
+    spare = chunk->next;
+    nr_spare--;
+  }
+  pthread_mutex_unlock (&lock);
+
+  if (chunk == NULL) {
+    chunk = calloc (1, sizeof *chunk);
+    if (chunk == NULL)
+      debug ("trace: calloc: %m");
+  }
+  return chunk;
+}
+
+/* Called when a thread exits. */
+static void
+release_thread (void *vp)
+{
+  struct trace_thread *t = vp, **pp;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (pp = &running; *pp; pp = &(*pp)->next) {
+    if (*pp == t) {
+      *pp = t->next;
+      break;
+    }
+  }
+  t->chunk->last = true;
+  enqueue_chunk (t->chunk);
+}
+
+static struct trace_thread *
+get_thread (void)
+{
+  struct trace_thread *t;
+  const char *name;
+
+  t = pthread_getspecific (thread_key);
+  if (t)
+    return t;
+
+  t = calloc (1, sizeof *t);
+  if (t == NULL) {
+    debug ("trace: calloc: %m");
+    return NULL;
+  }
+  t->chunk = get_chunk ();
+  if (t->chunk == NULL) {
+    free (t);
+    return NULL;
+  }
+  t->chunk->thread = t;
+  name = threadlocal_get_name ();
+  if (name)
+    t->name = strdup (name);
+  pthread_setspecific (thread_key, t);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  t->tid = ++nr_threads;
+  t->next = running;
+  running = t;
+  return t;
+}
+
+static void
+add_event (struct trace_thread *t, const struct trace_event *ev)
+{
+  struct trace_chunk *chunk;
+
+  /* Hand a full chunk to the writer thread.  If we cannot get an
+   * empty one to replace it, events are dropped instead.
+   */
+  if (t->chunk->nr_events == EVENTS_PER_CHUNK) {
+    chunk = get_chunk ();
+    if (chunk == NULL)
+      t->chunk->nr_events = 0;
+    else {
+      pthread_mutex_lock (&lock);
+      enqueue_chunk (t->chunk);
+      pthread_mutex_unlock (&lock);
+      chunk->thread = t;
+      t->chunk = chunk;
+    }
+  }
+  t->chunk->events[t->chunk->nr_events++] = *ev;
+}
+
+/* Decide if the request being read by this thread is traced. */
+bool
+trace_request_begin (void)
+{
+  struct trace_thread *t;
+  uint64_t n;
+
+  n = __atomic_fetch_add (&nr_requests, 1, __ATOMIC_RELAXED);
+  if (n % trace_sample != 0)
+    return false;
+
+  t = get_thread ();
+  if (t == NULL)
+    return false;
+  t->sampled = true;
+  return true;
+}
+
+void
+trace_request_end (uint16_t cmd, uint32_t count, uint64_t offset,
+                   const struct timespec *start,
+                   const struct timespec *end)
+{
+  struct trace_thread *t = pthread_getspecific (thread_key);
+  struct trace_event ev = {
+    .layer = NULL, .op = cmd, .count = count, .offset = offset,
+  };
+
+  if (t == NULL)
+    return;
+
+  ev.start = nsecs_since_t0 (start);
+  ev.duration = nsecs_since_t0 (end) - ev.start;
+  add_event (t, &ev);
+  t->sampled = false;
+}
+
+void
+trace_layer (struct backend *b, int op, uint32_t count, uint64_t offset,
+             const struct timespec *start, const struct timespec *end, int r)
+{
+  struct trace_thread *t = pthread_getspecific (thread_key);
+  struct trace_event ev = {
+    .layer = b->name, .type = b->type, .op = op, .r = r,
+    .count = count, .offset = offset,
+  };
+
+  if (t == NULL || !t->sampled)
+    return;
+
+  ev.start = nsecs_since_t0 (start);
+  ev.duration = nsecs_since_t0 (end) - ev.start;
+  add_event (t, &ev);
+}
+
+void
+trace_open (void)
+{
+  int fd, err;
+
+  if (!trace_file)
+    return;
+
+  err = pthread_key_create (&thread_key, release_thread);
+  if (err) {
+    errno = err;
+    perror ("trace: pthread_key_create");
+    exit (EXIT_FAILURE);
+  }
+
+  fd = open (trace_file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror (trace_file);
+    exit (EXIT_FAILURE);
+  }
+  fp = fdopen (fd, "w");
+  if (fp == NULL) {
+    perror ("fdopen");
+    exit (EXIT_FAILURE);
+  }
+
+  if (trace_format == TRACE_FORMAT_CHROME)
+    fputs ("[\n", fp);
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  debug ("tracing to %s", trace_file);
+}
+
+/* Start the writer thread.  This is called after forking into the
+ * background.
+ */
+void
+trace_start (void)
+{
+  int err;
+
+  if (!trace_file)
+    return;
+
+  err = pthread_create (&writer, NULL, writer_thread, NULL);
+  if (err) {
+    errno = err;
+    perror ("trace: pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  writer_running = true;
+}
+
+void
+trace_close (void)
+{
+  struct trace_thread *t;
+  struct trace_chunk *chunk;
+
+  if (!trace_file || fp == NULL)
+    return;
+
+  if (writer_running) {
+    pthread_mutex_lock (&lock);
+    writer_stop = true;
+    pthread_cond_signal (&cond);
+    pthread_mutex_unlock (&lock);
+    pthread_join (writer, NULL);
+    writer_running = false;
+  }
+
+  /* No requests are being served by now, so write out anything still
+   * queued and the chunks of threads which are still running (or of
+   * the main thread when using -s).
+   */
+  pthread_mutex_lock (&lock);
+  pthread_key_delete (thread_key);
+  while ((t = running) != NULL) {
+    running = t->next;
+    t->chunk->last = true;
+    enqueue_chunk (t->chunk);
+  }
+  drain_queue ();
+  while ((chunk = spare) != NULL) {
+    spare = chunk->next;
+    free (chunk);
+  }
+  nr_spare = 0;
+
+  if (trace_format == TRACE_FORMAT_CHROME)
+    fputs ("\n]\n", fp);
+  if (fclose (fp) == EOF)
+    perror (trace_file);
+  fp = NULL;
+  pthread_mutex_unlock (&lock);
+}
@@ -32,16 +32,74 @@
 
 /* This file pretends to be libvixDiskLib.so.6.
  *
- * However it only implements --dump-plugin support so our stubs don't
- * need to do anything.
+ * It serves a single in-memory disk (shared by all handles) so that
+ * the plugin can be exercised without VMware.  To help measure the
+ * effect of parallel and asynchronous requests, every read and write
+ * can be made to take some time by setting:
+ *
+ *   DUMMY_VDDK_LATENCY_MS  latency of each Read/Write call (default 0)
+ *   DUMMY_VDDK_MBPS        transfer rate of each call in MB/s (default
+ *                          unlimited), modelling a per-stream limit
+ *   DUMMY_VDDK_SIZE        size of the disk in bytes (default 64M)
+ *
+ * Async calls run on a separate thread each, so overlapping calls
+ * only pay the latency once.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "vddk-structs.h"
 
+#define NO_INITEX_STUB
+#define NO_EXIT_STUB
+#define STUB(fn,ret,args) extern ret fn args
+#define OPTIONAL_STUB(fn,ret,args) extern ret fn args
+#include "vddk-stubs.h"
+#undef STUB
+#undef OPTIONAL_STUB
+
+#define DUMMY_ERROR 1
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *disk;
+static uint64_t disk_size = 64 * 1024 * 1024;
+static long latency_ms;
+static long mbps;
+
+/* The handle counts async calls which have not completed yet. */
+struct dummy_handle {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned in_flight;
+};
+
+static void
+delay (uint64_t nr_sectors)
+{
+  struct timespec ts;
+  uint64_t us = latency_ms * 1000;
+
+  if (mbps > 0)
+    us += nr_sectors * VIXDISKLIB_SECTOR_SIZE / mbps;
+  if (us > 0) {
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep (&ts, NULL);
+  }
+}
+
+static bool
+in_range (uint64_t start_sector, uint64_t nr_sectors)
+{
+  return start_sector + nr_sectors <= disk_size / VIXDISKLIB_SECTOR_SIZE;
+}
+
 VixError
 VixDiskLib_InitEx (uint32_t major, uint32_t minor,
                    VixDiskLibGenericLogFunc *log_function,
@@ -49,20 +107,254 @@ VixDiskLib_InitEx (uint32_t major, uint32_t minor,
                    VixDiskLibGenericLogFunc *panic_function,
                    const char *lib_dir, const char *config_file)
 {
-  /* Do nothing, only exit with no error. */
+  const char *s;
+
+  s = getenv ("DUMMY_VDDK_LATENCY_MS");
+  if (s)
+    latency_ms = atol (s);
+  s = getenv ("DUMMY_VDDK_MBPS");
+  if (s)
+    mbps = atol (s);
+  s = getenv ("DUMMY_VDDK_SIZE");
+  if (s)
+    disk_size = strtoull (s, NULL, 0) &
+      ~(uint64_t) (VIXDISKLIB_SECTOR_SIZE - 1);
   return VIX_OK;
 }
 
 void
 VixDiskLib_Exit (void)
 {
-  /* Do nothing. */
+  free (disk);
+  disk = NULL;
 }
 
-#define NO_INITEX_STUB
-#define NO_EXIT_STUB
-#define STUB(fn,ret,args) void fn (void) { abort (); }
-#define OPTIONAL_STUB(fn,ret,args)
-#include "vddk-stubs.h"
-#undef STUB
-#undef OPTIONAL_STUB
+char *
+VixDiskLib_GetErrorText (VixError err, const char *unused)
+{
+  return strdup ("dummy-vddk error");
+}
+
+void
+VixDiskLib_FreeErrorText (char *text)
+{
+  free (text);
+}
+
+void
+VixDiskLib_FreeConnectParams (VixDiskLibConnectParams *params)
+{
+  free (params);
+}
+
+VixError
+VixDiskLib_ConnectEx (const VixDiskLibConnectParams *params,
+                      char read_only,
+                      const char *snapshot_ref,
+                      const char *transport_modes,
+                      VixDiskLibConnection *connection)
+{
+  *connection = (VixDiskLibConnection) params;
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Open (const VixDiskLibConnection connection,
+                 const char *path,
+                 uint32_t flags,
+                 VixDiskLibHandle *handle)
+{
+  struct dummy_handle *h;
+
+  pthread_mutex_lock (&lock);
+  if (disk == NULL)
+    disk = calloc (1, disk_size);
+  pthread_mutex_unlock (&lock);
+  if (disk == NULL)
+    return DUMMY_ERROR;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL)
+    return DUMMY_ERROR;
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+  *handle = h;
+  return VIX_OK;
+}
+
+const char *
+VixDiskLib_GetTransportMode (VixDiskLibHandle handle)
+{
+  return "file";
+}
+
+VixError
+VixDiskLib_Close (VixDiskLibHandle handle)
+{
+  struct dummy_handle *h = handle;
+
+  VixDiskLib_Wait (handle);
+  pthread_cond_destroy (&h->cond);
+  pthread_mutex_destroy (&h->lock);
+  free (h);
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Disconnect (VixDiskLibConnection connection)
+{
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_GetInfo (VixDiskLibHandle handle, VixDiskLibInfo **info)
+{
+  *info = calloc (1, sizeof **info);
+  if (*info == NULL)
+    return DUMMY_ERROR;
+  (*info)->capacity = disk_size / VIXDISKLIB_SECTOR_SIZE;
+  return VIX_OK;
+}
+
+void
+VixDiskLib_FreeInfo (VixDiskLibInfo *info)
+{
+  free (info);
+}
+
+VixError
+VixDiskLib_Read (VixDiskLibHandle handle,
+                 uint64_t start_sector, uint64_t nr_sectors,
+                 unsigned char *buf)
+{
+  if (!in_range (start_sector, nr_sectors))
+    return DUMMY_ERROR;
+  delay (nr_sectors);
+  memcpy (buf, disk + start_sector * VIXDISKLIB_SECTOR_SIZE,
+          nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Write (VixDiskLibHandle handle,
+                  uint64_t start_sector, uint64_t nr_sectors,
+                  const unsigned char *buf)
+{
+  if (!in_range (start_sector, nr_sectors))
+    return DUMMY_ERROR;
+  delay (nr_sectors);
+  memcpy (disk + start_sector * VIXDISKLIB_SECTOR_SIZE, buf,
+          nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Flush (VixDiskLibHandle handle)
+{
+  return VIX_OK;
+}
+
+struct async_call {
+  struct dummy_handle *h;
+  bool is_write;
+  uint64_t start_sector, nr_sectors;
+  unsigned char *buf;
+  VixDiskLibCompletionCB callback;
+  void *data;
+};
+
+static void *
+async_thread (void *vp)
+{
+  struct async_call *call = vp;
+  struct dummy_handle *h = call->h;
+  VixError err;
+
+  if (call->is_write)
+    err = VixDiskLib_Write (h, call->start_sector, call->nr_sectors,
+                            call->buf);
+  else
+    err = VixDiskLib_Read (h, call->start_sector, call->nr_sectors,
+                           call->buf);
+  call->callback (call->data, err);
+  free (call);
+
+  pthread_mutex_lock (&h->lock);
+  h->in_flight--;
+  pthread_cond_broadcast (&h->cond);
+  pthread_mutex_unlock (&h->lock);
+  return NULL;
+}
+
+static VixError
+start_async (VixDiskLibHandle handle, bool is_write,
+             uint64_t start_sector, uint64_t nr_sectors,
+             unsigned char *buf,
+             VixDiskLibCompletionCB callback, void *data)
+{
+  struct dummy_handle *h = handle;
+  struct async_call *call;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int r;
+
+  call = malloc (sizeof *call);
+  if (call == NULL)
+    return DUMMY_ERROR;
+  call->h = h;
+  call->is_write = is_write;
+  call->start_sector = start_sector;
+  call->nr_sectors = nr_sectors;
+  call->buf = buf;
+  call->callback = callback;
+  call->data = data;
+
+  pthread_mutex_lock (&h->lock);
+  h->in_flight++;
+  pthread_mutex_unlock (&h->lock);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  r = pthread_create (&thread, &attr, async_thread, call);
+  pthread_attr_destroy (&attr);
+  if (r != 0) {
+    pthread_mutex_lock (&h->lock);
+    h->in_flight--;
+    pthread_mutex_unlock (&h->lock);
+    free (call);
+    return DUMMY_ERROR;
+  }
+  return VIX_ASYNC;
+}
+
+VixError
+VixDiskLib_ReadAsync (VixDiskLibHandle handle,
+                      uint64_t start_sector, uint64_t nr_sectors,
+                      unsigned char *buf,
+                      VixDiskLibCompletionCB callback, void *data)
+{
+  return start_async (handle, false, start_sector, nr_sectors, buf,
+                      callback, data);
+}
+
+VixError
+VixDiskLib_WriteAsync (VixDiskLibHandle handle,
+                       uint64_t start_sector, uint64_t nr_sectors,
+                       const unsigned char *buf,
+                       VixDiskLibCompletionCB callback, void *data)
+{
+  return start_async (handle, true, start_sector, nr_sectors,
+                      (unsigned char *) buf, callback, data);
+}
+
+VixError
+VixDiskLib_Wait (VixDiskLibHandle handle)
+{
+  struct dummy_handle *h = handle;
+
+  pthread_mutex_lock (&h->lock);
+  while (h->in_flight > 0)
+    pthread_cond_wait (&h->cond, &h->lock);
+  pthread_mutex_unlock (&h->lock);
+  return VIX_OK;
+}
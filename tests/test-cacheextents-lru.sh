@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that the cacheextents filter caches the results of several
+# non-contiguous extents calls, and that the least recently used
+# extent is evicted when cacheextents-max-size is reached.
+
+source ./functions.sh
+set -x
+set -e
+
+requires grep --version
+requires qemu-io --version
+
+sock="$(mktemp -u)"
+sockurl="nbd+unix:///?socket=$sock"
+pidfile="test-cacheextents-lru.pid"
+accessfile="test-cacheextents-lru-access.log"
+accessfile_full="$PWD/test-cacheextents-lru-access.log"
+files="$pidfile $sock"
+rm -f $files $accessfile
+cleanup_fn rm -f $files $accessfile
+
+# The plugin returns a single 1M extent for each extents call, with a
+# different type for each megabyte so that neighbouring extents are
+# never merged.  cacheextents-max-size=64 leaves room for 2 extents.
+#
+# Intentionally using EOF rather than 'EOF' so that we can pass in the
+# $accessfile_full
+start_nbdkit \
+    -P $pidfile \
+    -U $sock \
+    --filter=cacheextents \
+    sh - cacheextents-max-size=64 <<EOF
+case "\$1" in
+  get_size) echo 8M ;;
+  can_extents) ;;
+  extents)
+    echo "extents request: \$@" >>$accessfile_full
+    i=\$((\$4 / 1048576))
+    echo \${i}M 1M \$((i%4))
+    ;;
+  pread) dd if=/dev/zero count=\$3 iflag=count_bytes ;;
+  *) exit 2 ;;
+esac
+EOF
+
+test_me() {
+    num_accesses=$1
+    shift
+
+    qemu-io -r -f raw "$@" "$sockurl"
+    test "$(grep -c "^extents request: " $accessfile)" -eq "$num_accesses"
+    ret=$?
+    rm -f "$accessfile"
+    return $ret
+}
+
+# Two non-contiguous ranges are both cached.
+test_me 2 -c 'alloc 0 512' -c 'alloc 2M 512' -c 'alloc 0 512' -c 'alloc 2M 512'
+# Both are still cached.  Caching a third range evicts the least
+# recently used one (0), but not the other (2M).
+test_me 2 -c 'alloc 2M 512' -c 'alloc 4M 512' -c 'alloc 2M 512' -c 'alloc 0 512'
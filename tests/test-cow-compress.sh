@@ -0,0 +1,64 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the cow filter with cow-compress and cow-dedup, overwriting
+# blocks many times so that the log has to be compacted.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+for opts in cow-compress=zlib cow-compress=zstd cow-dedup=true \
+            "cow-dedup=true cow-compress=zstd"; do
+    if ! nbdkit --filter=cow null $opts --run true; then
+        echo "$0: $opts not supported, skipping"
+        continue
+    fi
+
+    nbdkit -fv -U - --filter=cow memory 64M $opts \
+           --run '
+        set -e
+        # Compressible and zero data, rewritten several times.
+        for i in 1 2 3 4 5 6 7 8; do
+            qemu-io -f raw -c "write -P $i 0 32M" \
+                           -c "write -z 16M 4M" \
+                           -c "write -P 0x55 60M 4M" "$nbd"
+        done
+        qemu-io -f raw -c "read -P 8 0 16M" \
+                       -c "read -P 0 16M 4M" \
+                       -c "read -P 8 20M 12M" \
+                       -c "read -P 0 32M 28M" \
+                       -c "read -P 0x55 60M 4M" "$nbd"
+    '
+done
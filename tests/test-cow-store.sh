@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test two instances of the cow filter sharing one cow-store file.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+d=cow-store.d
+rm -rf $d
+mkdir -p $d
+cleanup_fn rm -rf $d
+store=$d/store
+
+if ! nbdkit --filter=cow null cow-store=$store --run true; then
+    echo "$0: cow-store not supported"
+    exit 77
+fi
+
+# Print the number of chunks in use in the store.
+chunks ()
+{
+    nbdkit -fv --filter=cow null cow-store=$store --run true 2>&1 |
+        sed -n 's/.*cow-store: .*: \([0-9]*\) chunks in use/\1/p'
+}
+
+start_nbdkit -P $d/a.pid -U $d/a.sock \
+             --filter=cow memory 8M cow-store=$store
+start_nbdkit -P $d/b.pid -U $d/b.sock \
+             --filter=cow memory 8M cow-store=$store
+
+# Write the same 64 distinct blocks to both instances, and one extra
+# block to the second instance only.
+writes=()
+reads=()
+for i in {1..64}; do
+    writes+=(-c "write -P $i $(( i*4 ))K 4K")
+    reads+=(-c "read -P $i $(( i*4 ))K 4K")
+done
+qemu-io -f raw "nbd+unix://?socket=$d/a.sock" "${writes[@]}"
+qemu-io -f raw "nbd+unix://?socket=$d/b.sock" "${writes[@]}" \
+        -c "write -P 0x55 1M 4K"
+
+# The blocks common to both instances are only stored once.
+test "$(chunks)" -eq 65
+
+qemu-io -f raw "nbd+unix://?socket=$d/a.sock" "${reads[@]}" \
+        -c "read -P 0 1M 4K"
+qemu-io -f raw "nbd+unix://?socket=$d/b.sock" "${reads[@]}" \
+        -c "read -P 0x55 1M 4K"
+
+# Overwriting a shared block in one instance must not affect the other.
+qemu-io -f raw "nbd+unix://?socket=$d/a.sock" -c "write -P 0xaa 4K 4K"
+qemu-io -f raw "nbd+unix://?socket=$d/b.sock" -c "read -P 1 4K 4K"
+test "$(chunks)" -eq 66
+
+# When both instances exit their blocks are released.
+kill $(cat $d/a.pid) $(cat $d/b.pid)
+for i in {1..60}; do
+    if ! kill -s 0 $(cat $d/a.pid) $(cat $d/b.pid) 2>/dev/null; then
+        break
+    fi
+    sleep 1
+done
+test "$(chunks)" -eq 0
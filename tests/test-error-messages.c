@@ -0,0 +1,245 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test that the messages which plugins and filters pass to
+ * nbdkit_error are only sent back to clients in structured error
+ * replies if nbdkit was started with --error-messages.  Like
+ * test-layers this needs to speak the NBD protocol directly.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "byte-swapping.h"
+#include "nbd-protocol.h"
+
+/* Declare program_name. */
+#if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME == 1
+#include <errno.h>
+#define program_name program_invocation_short_name
+#else
+#define program_name "nbdkit"
+#endif
+
+static void
+recv_all (int sock, void *buf, size_t len, const char *what)
+{
+  if (recv (sock, buf, len, MSG_WAITALL) != len) {
+    fprintf (stderr, "%s: recv: %s: short read or error\n",
+             program_name, what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+send_all (int sock, const void *buf, size_t len, const char *what)
+{
+  if (send (sock, buf, len, 0) != len) {
+    perror (what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Start nbdkit with the error filter injecting EIO into every read,
+ * negotiate structured replies, issue one read and return the
+ * human-readable message from the error chunk.  The caller must free
+ * the result.
+ */
+static char *
+read_error_message (bool error_messages)
+{
+  pid_t pid;
+  int sfd[2];
+  int sock;
+  struct nbd_new_handshake handshake;
+  uint32_t cflags;
+  struct nbd_new_option option;
+  struct nbd_fixed_new_option_reply option_reply;
+  struct nbd_export_name_option_reply handshake_finish;
+  struct nbd_request request;
+  struct nbd_structured_reply reply;
+  struct nbd_structured_reply_error error;
+  uint32_t length;
+  uint16_t len;
+  char *msg;
+
+  /* The test doesn't care about fd leaks, so we don't bother with
+   * CLOEXEC.
+   */
+  if (socketpair (AF_LOCAL, SOCK_STREAM, 0, sfd) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  sock = sfd[0];
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {               /* Child. */
+    dup2 (sfd[1], 0);
+    dup2 (sfd[1], 1);
+    if (error_messages)
+      execlp ("nbdkit", "nbdkit", "-fs", "--error-messages",
+              "--filter=error", "memory", "size=1M",
+              "error-pread=EIO", "error-pread-rate=1",
+              NULL);
+    else
+      execlp ("nbdkit", "nbdkit", "-fs",
+              "--filter=error", "memory", "size=1M",
+              "error-pread=EIO", "error-pread-rate=1",
+              NULL);
+    perror ("exec: nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Parent (test). */
+  close (sfd[1]);
+
+  /* As in test-layers, we rely on knowing exactly which server we
+   * are talking to, so only the bare minimum is checked.
+   */
+  recv_all (sock, &handshake, sizeof handshake, "handshake");
+  if (be64toh (handshake.nbdmagic) != NBD_MAGIC ||
+      be64toh (handshake.version) != NBD_NEW_VERSION) {
+    fprintf (stderr, "%s: unexpected NBDMAGIC or version\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+  cflags = htobe32 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  send_all (sock, &cflags, sizeof cflags, "send: flags");
+
+  /* Negotiate structured replies. */
+  option.version = htobe64 (NBD_NEW_VERSION);
+  option.option = htobe32 (NBD_OPT_STRUCTURED_REPLY);
+  option.optlen = htobe32 (0);
+  send_all (sock, &option, sizeof option, "send: option");
+  recv_all (sock, &option_reply, sizeof option_reply, "option reply");
+  if (be32toh (option_reply.reply) != NBD_REP_ACK ||
+      be32toh (option_reply.replylen) != 0) {
+    fprintf (stderr, "%s: structured replies were not negotiated\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Enter transmission phase. */
+  option.option = htobe32 (NBD_OPT_EXPORT_NAME);
+  send_all (sock, &option, sizeof option, "send: option");
+  recv_all (sock, &handshake_finish, sizeof handshake_finish - 124,
+            "handshake finish");
+
+  /* Issue a read, which the error filter fails. */
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+  request.handle = htobe64 (1);
+  request.type = htobe16 (NBD_CMD_READ);
+  request.offset = htobe64 (0);
+  request.count = htobe32 (512);
+  request.flags = htobe16 (0);
+  send_all (sock, &request, sizeof request, "send: NBD_CMD_READ");
+
+  recv_all (sock, &reply, sizeof reply, "structured reply");
+  length = be32toh (reply.length);
+  if (be32toh (reply.magic) != NBD_STRUCTURED_REPLY_MAGIC ||
+      be16toh (reply.type) != NBD_REPLY_TYPE_ERROR ||
+      length < sizeof error) {
+    fprintf (stderr, "%s: expected NBD_REPLY_TYPE_ERROR\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  recv_all (sock, &error, sizeof error, "error chunk");
+  if (be32toh (error.error) != NBD_EIO) {
+    fprintf (stderr, "%s: expected NBD_EIO, got %" PRIu32 "\n",
+             program_name, be32toh (error.error));
+    exit (EXIT_FAILURE);
+  }
+  len = be16toh (error.len);
+  if (len != length - sizeof error) {
+    fprintf (stderr, "%s: error message length %u does not match chunk\n",
+             program_name, (unsigned) len);
+    exit (EXIT_FAILURE);
+  }
+  msg = malloc (len + 1);
+  if (msg == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  recv_all (sock, msg, len, "error message");
+  msg[len] = '\0';
+
+  /* Close the connection. */
+  request.type = htobe16 (NBD_CMD_DISC);
+  request.count = htobe32 (0);
+  send_all (sock, &request, sizeof request, "send: NBD_CMD_DISC");
+  close (sock);
+
+  if (waitpid (pid, NULL, 0) == -1)
+    perror ("waitpid");
+
+  return msg;
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *msg;
+
+  /* By default the client only sees the description of the errno. */
+  msg = read_error_message (false);
+  fprintf (stderr, "%s: default message: %s\n", program_name, msg);
+  if (strstr (msg, "injecting") != NULL) {
+    fprintf (stderr, "%s: plugin error message was sent to the client "
+             "without --error-messages\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  free (msg);
+
+  /* With --error-messages the client sees the filter's message. */
+  msg = read_error_message (true);
+  fprintf (stderr, "%s: --error-messages message: %s\n", program_name, msg);
+  if (strcmp (msg, "injecting EIO error into pread") != 0) {
+    fprintf (stderr, "%s: unexpected error message\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  free (msg);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,347 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test that large reads are split into several structured reply
+ * chunks which the client can reassemble, and that an error reading
+ * a chunk in the middle of the request is reported at the right
+ * offset after the chunks which were read successfully.  Like
+ * test-layers this needs to speak the NBD protocol directly.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "byte-swapping.h"
+#include "nbd-protocol.h"
+
+/* Declare program_name. */
+#if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME == 1
+#include <errno.h>
+#define program_name program_invocation_short_name
+#else
+#define program_name "nbdkit"
+#endif
+
+/* Larger than the 2 MB chunks which the server uses, and not a
+ * multiple of them.
+ */
+#define SIZE (5 * 1024 * 1024 + 512)
+
+/* The server splits reads at this offset, see MAX_READ_CHUNK. */
+#define CHUNK (2 * 1024 * 1024)
+
+static const char script_file[] = "test-fragmented-read.script";
+
+/* A plugin which fails reads of the second chunk. */
+static const char script[] =
+  "#!/bin/sh\n"
+  "case \"$1\" in\n"
+  "  get_size) echo 8M ;;\n"
+  "  pread)\n"
+  "    if [ $4 -eq 2097152 ]; then\n"
+  "      echo 'EIO failing the second chunk' >&2\n"
+  "      exit 1\n"
+  "    fi\n"
+  "    head -c $3 /dev/zero ;;\n"
+  "  *) exit 2 ;;\n"
+  "esac\n";
+
+static void
+recv_all (int sock, void *buf, size_t len, const char *what)
+{
+  if (recv (sock, buf, len, MSG_WAITALL) != len) {
+    fprintf (stderr, "%s: recv: %s: short read or error\n",
+             program_name, what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+send_all (int sock, const void *buf, size_t len, const char *what)
+{
+  if (send (sock, buf, len, 0) != len) {
+    perror (what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Start nbdkit with the given plugin and parameters, negotiate
+ * structured replies and enter the transmission phase.  Returns the
+ * socket, and the pid of nbdkit in *pid.
+ */
+static int
+start_nbdkit (pid_t *pid, const char *plugin, const char *param)
+{
+  int sfd[2];
+  int sock;
+  struct nbd_new_handshake handshake;
+  uint32_t cflags;
+  struct nbd_new_option option;
+  struct nbd_fixed_new_option_reply option_reply;
+  struct nbd_export_name_option_reply handshake_finish;
+
+  /* The test doesn't care about fd leaks, so we don't bother with
+   * CLOEXEC.
+   */
+  if (socketpair (AF_LOCAL, SOCK_STREAM, 0, sfd) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  sock = sfd[0];
+
+  *pid = fork ();
+  if (*pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (*pid == 0) {              /* Child. */
+    dup2 (sfd[1], 0);
+    dup2 (sfd[1], 1);
+    execlp ("nbdkit", "nbdkit", "-fs", plugin, param, NULL);
+    perror ("exec: nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Parent (test). */
+  close (sfd[1]);
+
+  /* As in test-layers, we rely on knowing exactly which server we
+   * are talking to, so only the bare minimum is checked.
+   */
+  recv_all (sock, &handshake, sizeof handshake, "handshake");
+  if (be64toh (handshake.nbdmagic) != NBD_MAGIC ||
+      be64toh (handshake.version) != NBD_NEW_VERSION) {
+    fprintf (stderr, "%s: unexpected NBDMAGIC or version\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+  cflags = htobe32 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  send_all (sock, &cflags, sizeof cflags, "send: flags");
+
+  option.version = htobe64 (NBD_NEW_VERSION);
+  option.option = htobe32 (NBD_OPT_STRUCTURED_REPLY);
+  option.optlen = htobe32 (0);
+  send_all (sock, &option, sizeof option, "send: option");
+  recv_all (sock, &option_reply, sizeof option_reply, "option reply");
+  if (be32toh (option_reply.reply) != NBD_REP_ACK ||
+      be32toh (option_reply.replylen) != 0) {
+    fprintf (stderr, "%s: structured replies were not negotiated\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  option.option = htobe32 (NBD_OPT_EXPORT_NAME);
+  send_all (sock, &option, sizeof option, "send: option");
+  recv_all (sock, &handshake_finish, sizeof handshake_finish - 124,
+            "handshake finish");
+
+  return sock;
+}
+
+static void
+stop_nbdkit (pid_t pid, int sock)
+{
+  struct nbd_request request = {
+    .magic = htobe32 (NBD_REQUEST_MAGIC),
+    .type = htobe16 (NBD_CMD_DISC),
+  };
+
+  send_all (sock, &request, sizeof request, "send: NBD_CMD_DISC");
+  close (sock);
+  if (waitpid (pid, NULL, 0) == -1)
+    perror ("waitpid");
+}
+
+static void
+send_request (int sock, uint16_t cmd, uint64_t offset, uint32_t count)
+{
+  struct nbd_request request;
+
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+  request.flags = htobe16 (0);
+  request.type = htobe16 (cmd);
+  request.handle = htobe64 (1);
+  request.offset = htobe64 (offset);
+  request.count = htobe32 (count);
+  send_all (sock, &request, sizeof request, "send: request");
+}
+
+/* Read the structured reply chunks for a read of SIZE bytes at
+ * offset 0 into buf.  Returns the number of data chunks received.
+ * If the reply ends with NBD_REPLY_TYPE_ERROR_OFFSET, the NBD error
+ * and offset are returned in *error and *error_offset, otherwise
+ * *error is set to 0.
+ */
+static unsigned
+recv_read_reply (int sock, char *buf,
+                 uint32_t *error, uint64_t *error_offset)
+{
+  struct nbd_structured_reply reply;
+  struct nbd_structured_reply_offset_data offset_data;
+  struct nbd_structured_reply_error error_data;
+  uint32_t length;
+  uint64_t offset;
+  unsigned nr_chunks = 0;
+  char msg[NBD_MAX_STRING];
+
+  *error = 0;
+  do {
+    recv_all (sock, &reply, sizeof reply, "structured reply");
+    if (be32toh (reply.magic) != NBD_STRUCTURED_REPLY_MAGIC) {
+      fprintf (stderr, "%s: expected a structured reply\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+    length = be32toh (reply.length);
+
+    switch (be16toh (reply.type)) {
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+      recv_all (sock, &offset_data, sizeof offset_data, "offset");
+      offset = be64toh (offset_data.offset);
+      length -= sizeof offset_data;
+      if (length > CHUNK || offset + length > SIZE) {
+        fprintf (stderr, "%s: unexpected chunk: offset %" PRIu64
+                 " length %" PRIu32 "\n", program_name, offset, length);
+        exit (EXIT_FAILURE);
+      }
+      recv_all (sock, buf + offset, length, "data");
+      nr_chunks++;
+      break;
+
+    case NBD_REPLY_TYPE_ERROR_OFFSET:
+      recv_all (sock, &error_data, sizeof error_data, "error");
+      *error = be32toh (error_data.error);
+      length = be16toh (error_data.len);
+      if (length > sizeof msg) {
+        fprintf (stderr, "%s: error message too long\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+      recv_all (sock, msg, length, "error message");
+      recv_all (sock, &offset, sizeof offset, "error offset");
+      *error_offset = be64toh (offset);
+      break;
+
+    default:
+      fprintf (stderr, "%s: unexpected reply type %u\n",
+               program_name, (unsigned) be16toh (reply.type));
+      exit (EXIT_FAILURE);
+    }
+  } while (!(be16toh (reply.flags) & NBD_REPLY_FLAG_DONE));
+
+  return nr_chunks;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pid_t pid;
+  int sock;
+  char *data, *buf;
+  struct nbd_simple_reply reply;
+  uint32_t error;
+  uint64_t error_offset;
+  unsigned nr_chunks;
+  size_t i;
+  FILE *fp;
+
+  data = malloc (SIZE);
+  buf = calloc (1, SIZE);
+  if (data == NULL || buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < SIZE; ++i)
+    data[i] = i * 7 + i / 4096;
+
+  /* Write the data to the memory plugin and read it back. */
+  sock = start_nbdkit (&pid, "memory", "size=8M");
+  send_request (sock, NBD_CMD_WRITE, 0, SIZE);
+  send_all (sock, data, SIZE, "send: data");
+  recv_all (sock, &reply, sizeof reply, "write reply");
+  if (be32toh (reply.magic) != NBD_SIMPLE_REPLY_MAGIC ||
+      be32toh (reply.error) != 0) {
+    fprintf (stderr, "%s: write failed\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  send_request (sock, NBD_CMD_READ, 0, SIZE);
+  nr_chunks = recv_read_reply (sock, buf, &error, &error_offset);
+  fprintf (stderr, "%s: read was sent in %u chunks\n",
+           program_name, nr_chunks);
+  if (error != 0) {
+    fprintf (stderr, "%s: read failed\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  if (nr_chunks != (SIZE + CHUNK - 1) / CHUNK) {
+    fprintf (stderr, "%s: expected the read to be split into %u chunks\n",
+             program_name, (SIZE + CHUNK - 1) / CHUNK);
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (data, buf, SIZE) != 0) {
+    fprintf (stderr, "%s: data read back is different\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  stop_nbdkit (pid, sock);
+
+  /* Use a plugin which fails to read the second chunk. */
+  fp = fopen (script_file, "w");
+  if (fp == NULL || fputs (script, fp) == EOF || fclose (fp) == EOF ||
+      chmod (script_file, 0755) == -1) {
+    perror (script_file);
+    exit (EXIT_FAILURE);
+  }
+  sock = start_nbdkit (&pid, "sh", script_file);
+  send_request (sock, NBD_CMD_READ, 0, SIZE);
+  nr_chunks = recv_read_reply (sock, buf, &error, &error_offset);
+  stop_nbdkit (pid, sock);
+  unlink (script_file);
+
+  if (nr_chunks != 1 || error != NBD_EIO || error_offset != CHUNK) {
+    fprintf (stderr, "%s: expected one chunk followed by NBD_EIO at "
+             "offset %d, got %u chunks, error %" PRIu32 " at %" PRIu64 "\n",
+             program_name, CHUNK, nr_chunks, error, error_offset);
+    exit (EXIT_FAILURE);
+  }
+
+  free (data);
+  free (buf);
+  exit (EXIT_SUCCESS);
+}
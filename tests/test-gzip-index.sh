@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the gzip plugin seek index, including a file made of several
+# gzip members, and that the saved index is reused.  Also check that
+# an index file is only written if asked for, and that a file which is
+# not compressed is served as it is.
+
+source ./functions.sh
+set -e
+set -x
+
+requires gzip --version
+requires qemu-img --version
+
+files="gzip-index.data gzip-index.gz gzip-index.idx gzip-index.out
+       gzip-index.gz.nbdkit-index"
+rm -f $files
+cleanup_fn rm -f $files
+
+{ seq 1 200000; head -c 1M /dev/urandom; seq 1 200000; } > gzip-index.data
+head -c 1000000 gzip-index.data | gzip -9 > gzip-index.gz
+tail -c +1000001 gzip-index.data | gzip -1 >> gzip-index.gz
+
+for i in 1 2; do
+    rm -f gzip-index.out
+    nbdkit -U - gzip gzip-index.gz index=gzip-index.idx index-span=64K \
+           --run 'qemu-img convert -f raw $nbd -O raw gzip-index.out'
+    test -f gzip-index.idx
+    cmp gzip-index.data gzip-index.out
+done
+
+rm -f gzip-index.out
+nbdkit -U - gzip gzip-index.gz \
+       --run 'qemu-img convert -f raw $nbd -O raw gzip-index.out'
+test ! -f gzip-index.gz.nbdkit-index
+cmp gzip-index.data gzip-index.out
+
+rm -f gzip-index.out
+nbdkit -U - gzip gzip-index.data \
+       --run 'qemu-img convert -f raw $nbd -O raw gzip-index.out'
+cmp gzip-index.data gzip-index.out
@@ -0,0 +1,88 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the iso plugin without an external program, reading the ISO
+# back with bsdtar (which understands Rock Ridge).
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-img --version
+requires bsdtar --version
+
+d=iso-native.d
+rm -rf $d
+cleanup_fn rm -rf $d
+
+# Create two directories to be merged, containing files with names
+# which are not valid ISO 9660 names, subdirectories, hard links and
+# symbolic links (including one long enough to need a continuation
+# area).
+mkdir $d
+mkdir $d/in1 $d/in1/sub $d/in1/dir $d/in2 $d/in2/sub
+cp $srcdir/Makefile.am $d/in1/sub/Makefile.am
+ln $d/in1/sub/Makefile.am $d/in1/sub/hardlink
+ln -s Makefile.am $d/in1/sub/symlink
+ln -s ../$(printf '%0100d/' `seq 1 10`)target $d/in1/sub/longsymlink
+: > $d/in1/empty
+long=$(printf 'x%.0s' `seq 1 200`)
+echo long > $d/in1/$long.txt
+echo lower > $d/in1/name.txt
+echo upper > $d/in1/NAME.TXT
+# Three names which all map to the ISO 9660 identifier A_B.
+echo 1 > $d/in1/a-b
+echo 2 > $d/in1/a_b
+echo 3 > $d/in1/A_B
+for i in `seq 1 500`; do echo $i > $d/in1/dir/file-$i; done
+cp $srcdir/Makefile.in $d/in2/sub/Makefile.in
+for i in `seq 1 20`; do cat $srcdir/Makefile.am; done > $d/in2/large
+
+nbdkit -f -v -U - iso $d/in1 $d/in2 \
+       --run "qemu-img convert \$nbd $d/out.iso"
+
+mkdir $d/out
+bsdtar -xf $d/out.iso -C $d/out
+
+# Every ISO 9660 identifier in a directory must be unique.
+bsdtar --options '!rockridge' -tf $d/out.iso | sort > $d/iso-names
+test -z "$(uniq -d $d/iso-names)"
+
+# The output should be the union of the two input directories.
+mkdir $d/expected
+cp -a $d/in1/. $d/in2/. $d/expected/
+diff -r --no-dereference $d/expected $d/out
+test -L $d/out/sub/longsymlink
+test "$(readlink $d/out/sub/longsymlink)" = \
+     "$(readlink $d/in1/sub/longsymlink)"
+test $(stat -c %i $d/out/sub/Makefile.am) = \
+     $(stat -c %i $d/out/sub/hardlink)
@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the linuxdisk plugin in lazy mode, checking the filesystem
+# with e2fsck and reading files back with debugfs.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-img --version
+requires mkfifo --version
+requires e2fsck -V
+requires debugfs -V
+
+d=linuxdisk-lazy.d
+rm -rf $d
+cleanup_fn rm -rf $d
+
+# Create a test directory with regular files (including one large
+# enough to need indirect blocks), subdirectories, hard links and
+# special files.
+mkdir $d
+mkdir $d/in $d/in/sub $d/in/dir
+mkfifo $d/in/fifo
+cp $srcdir/Makefile.am $d/in/sub/Makefile.am
+ln $d/in/sub/Makefile.am $d/in/sub/hardlink
+ln -s Makefile.am $d/in/sub/symlink
+ln -s $(printf '%0100d' 0) $d/in/sub/longsymlink
+: > $d/in/empty
+for i in `seq 1 20`; do cat $srcdir/Makefile.am; done > $d/in/large
+for i in `seq 1 500`; do echo $i > $d/in/dir/file-$i; done
+
+nbdkit -f -v -U - \
+       --filter=partition \
+       linuxdisk $d/in lazy=true partition=1 \
+       --run "qemu-img convert \$nbd $d/fs.img"
+
+e2fsck -fn $d/fs.img
+
+debugfs -R "cat /sub/Makefile.am" $d/fs.img > $d/out
+cmp $d/out $srcdir/Makefile.am
+debugfs -R "cat /sub/hardlink" $d/fs.img > $d/out
+cmp $d/out $srcdir/Makefile.am
+debugfs -R "cat /large" $d/fs.img > $d/out
+cmp $d/out $d/in/large
+debugfs -R "cat /dir/file-500" $d/fs.img > $d/out
+cmp $d/out $d/in/dir/file-500
+debugfs -R "stat /sub/hardlink" $d/fs.img | grep "Links: 2"
+debugfs -R "stat /sub/longsymlink" $d/fs.img | grep "Type: symlink"
+debugfs -R "stat /fifo" $d/fs.img | grep "Type: FIFO"
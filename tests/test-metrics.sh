@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+source ./functions.sh
+set -e
+set -x
+
+requires curl --version
+
+sock=`mktemp -u`
+metrics=`mktemp -u`
+files="metrics.pid metrics.out $sock $metrics"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P metrics.pid -U $sock --metrics $metrics memory 1M
+
+curl -s --unix-socket $metrics http://localhost/metrics > metrics.out
+cat metrics.out
+
+grep '^nbdkit_connections 0$' metrics.out
+grep '^nbdkit_layer_calls_total{layer="memory",type="plugin",op="pread"} 0$' \
+     metrics.out
+
+# If qemu-io is available, check that requests are counted.
+if qemu-io --version >/dev/null 2>&1; then
+    qemu-io -f raw -c 'r 0 64k' -c 'r 64k 64k' "nbd+unix:///?socket=$sock"
+    curl -s --unix-socket $metrics http://localhost/metrics > metrics.out
+    cat metrics.out
+    grep '^nbdkit_export_requests_total{export="",command="read"} 2$' \
+         metrics.out
+    grep '^nbdkit_export_request_bytes_total{export="",command="read"} 131072$' \
+         metrics.out
+    grep '^nbdkit_layer_calls_total{layer="memory",type="plugin",op="pread"} 2$' \
+         metrics.out
+fi
@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the stats filter records the operations and their latencies.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-img --version
+
+files="stats.out stats.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# The pattern plugin doesn't support extents, so qemu-img has to read
+# the whole disk.
+nbdkit -U - --filter=stats pattern size=1M statsfile=stats.log \
+       --run 'qemu-img convert -f raw $nbd -O raw stats.out'
+cat stats.log
+
+grep '^elapsed time: [0-9.e+-]* s$' stats.log
+grep '^read: [1-9][0-9]* ops, 1048576 bytes, [0-9.e+-]* bits/s$' stats.log
+grep '^  latency: p50 [0-9]* us, p99 [0-9]* us, p999 [0-9]* us, max [0-9]* us$' \
+     stats.log
+
+# The percentiles must be in order.
+awk '/^  latency:/ { if (!($3 <= $6 && $6 <= $9 && $9 <= $12)) exit 1 }' \
+    stats.log
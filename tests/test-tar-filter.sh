@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the tar filter with ordinary and sparse members, in GNU and
+# POSIX tar formats.
+
+source ./functions.sh
+set -e
+set -x
+
+requires tar --version
+requires qemu-img --version
+
+files="tar-filter.plain tar-filter.sparse tar-filter-gnu.tar
+       tar-filter-posix.tar tar-filter-ustar.tar tar-filter.out"
+rm -rf $files tar-filter.d
+cleanup_fn rm -rf $files tar-filter.d
+
+seq 1 100000 > tar-filter.plain
+truncate -s 10M tar-filter.sparse
+echo hello | dd of=tar-filter.sparse bs=1 seek=1M conv=notrunc
+echo world | dd of=tar-filter.sparse bs=1 seek=8M conv=notrunc
+
+tar --format=gnu -S -cf tar-filter-gnu.tar \
+    tar-filter.plain tar-filter.sparse
+tar --format=posix -S -cf tar-filter-posix.tar \
+    ./tar-filter.plain ./tar-filter.sparse
+
+for t in tar-filter-gnu.tar tar-filter-posix.tar; do
+    for f in tar-filter.plain tar-filter.sparse; do
+        nbdkit -U - file $t --filter=tar tar-entry=$f \
+               --run 'qemu-img convert -f raw $nbd -O raw tar-filter.out'
+        cmp $f tar-filter.out
+    done
+done
+
+# A ustar member whose name uses the full 155 byte prefix and 100 byte
+# name fields.
+d=tar-filter.d/$(printf 'd%.0s' {1..64})/$(printf 'e%.0s' {1..77})
+f=$d/$(printf 'f%.0s' {1..100})
+mkdir -p $d
+cp tar-filter.plain $f
+tar --format=ustar -cf tar-filter-ustar.tar $f
+nbdkit -U - file tar-filter-ustar.tar --filter=tar tar-entry=$f \
+       --run 'qemu-img convert -f raw $nbd -O raw tar-filter.out'
+cmp $f tar-filter.out
+
+# A missing member is an error.
+if nbdkit -U - file tar-filter-gnu.tar --filter=tar tar-entry=missing \
+          --run 'qemu-img info $nbd'; then
+    echo "$0: expected missing member to fail"
+    exit 1
+fi
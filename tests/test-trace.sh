@@ -0,0 +1,64 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test --trace writes valid traces in both formats.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="trace.json trace.perf"
+rm -f $files
+cleanup_fn rm -f $files
+
+nbdkit -fv -U - --trace=trace.json --filter=cow memory 1M \
+       --run 'qemu-io -f raw -c "w 0 64k" -c "r 0 64k" $nbd'
+cat trace.json
+
+# The trace must be a JSON array containing the request and the call
+# through each layer.
+if python3 --version >/dev/null 2>&1; then
+    python3 -c 'import json, sys; json.load(open("trace.json"))'
+fi
+grep '"name":"NBD_CMD_READ","cat":"request"' trace.json
+grep '"name":"cow.pread","cat":"filter"' trace.json
+grep '"name":"memory.pread","cat":"plugin"' trace.json
+
+nbdkit -fv -U - --trace=trace.perf --trace-format=perf memory 1M \
+       --run 'qemu-io -f raw -c "r 0 64k" $nbd'
+cat trace.perf
+grep 'nbdkit:request: cmd=NBD_CMD_READ count=65536 offset=0' trace.perf
+grep 'nbdkit:layer: layer=memory type=plugin op=pread count=65536 offset=0' \
+     trace.perf
@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Read and write through the vddk plugin using the dummy VDDK
+# library from tests/dummy-vddk.c, with simulated latency.  The large
+# requests are split into several asynchronous calls by the plugin.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+export DUMMY_VDDK_LATENCY_MS=5
+export DUMMY_VDDK_SIZE=$((16 * 1024 * 1024))
+
+LD_LIBRARY_PATH=.libs:$LD_LIBRARY_PATH \
+LIBRARY_PATH=.libs:$LIBRARY_PATH \
+nbdkit -U - vddk file=dummy.vmdk \
+       --run '
+    qemu-io -f raw "$nbd" \
+            -c "write -P 0x55 0 4M" \
+            -c "write -P 0xaa 1M 512" \
+            -c "read -P 0x55 0 1M" \
+            -c "read -P 0xaa 1M 512" \
+            -c "read -P 0x55 $((1024*1024 + 512)) $((3*1024*1024 - 512))" \
+            -c "read -P 0 4M 4M"
+'
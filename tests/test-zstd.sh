@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the zstd filter with a file made of several frames.
+
+source ./functions.sh
+set -e
+set -x
+
+requires zstd --version
+requires qemu-img --version
+
+files="zstd-frames.data zstd-frames.zst zstd-frames.out zstd-frames.chunk.*"
+rm -f $files
+cleanup_fn rm -f $files
+
+{ seq 1 200000; head -c 1M /dev/zero; head -c 1M /dev/urandom; } \
+    > zstd-frames.data
+
+# Compress the file in 256K chunks, each of which becomes a frame.
+split -b 256K zstd-frames.data zstd-frames.chunk.
+for f in zstd-frames.chunk.*; do
+    zstd -q -c $f >> zstd-frames.zst
+done
+
+nbdkit -U - --filter=zstd file zstd-frames.zst \
+       zstd-threads=4 zstd-max-depth=4 \
+       --run 'qemu-img convert -f raw $nbd -O raw zstd-frames.out'
+cmp zstd-frames.data zstd-frames.out